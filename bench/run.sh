@@ -0,0 +1,45 @@
+#!/usr/bin/env bash
+# Compiles every benchmark program with each set of hydro flags and reports
+# compile time (including assembling and linking), runtime (and hardware
+# counters when `perf` is available), and the number of instructions and of
+# memory-operand instructions in the assembly.
+#
+#   bench/run.sh [path/to/hydro] ["-O0" "-O2" ...]
+set -euo pipefail
+
+HYDRO=$(realpath "${1:-./build/hydro}")
+shift || true
+CONFIGS=("$@")
+if [ ${#CONFIGS[@]} -eq 0 ]; then
+    CONFIGS=("-O0" "-O2")
+fi
+
+BENCH_DIR=$(cd "$(dirname "$0")" && pwd)
+WORK_DIR=$(mktemp -d)
+trap 'rm -rf "$WORK_DIR"' EXIT
+
+printf "%-24s %-28s %10s %6s %12s %8s %8s %s\n" "program" "flags" "compile" "exit" "seconds" "insns" "mem-ops" \
+    "counters"
+for program in "$BENCH_DIR"/*.hy; do
+    for config in "${CONFIGS[@]}"; do
+        rm -f "$WORK_DIR/out" "$WORK_DIR/out.asm" "$WORK_DIR/out.o"
+        compile_start=$(date +%s.%N)
+        # shellcheck disable=SC2086
+        (cd "$WORK_DIR" && "$HYDRO" $config "$program" > /dev/null)
+        compile_end=$(date +%s.%N)
+        insns=$(grep -cE '^    [a-z]' "$WORK_DIR/out.asm" || true)
+        mem_ops=$(grep -cE '^    (push|pop|[a-z]+ .*\[)' "$WORK_DIR/out.asm" || true)
+        counters=""
+        start=$(date +%s.%N)
+        if command -v perf > /dev/null; then
+            counters=$(cd "$WORK_DIR" && perf stat -x, -e cycles,instructions,branches,branch-misses ./out 2>&1 > /dev/null \
+                | awk -F, '{printf "%s=%s ", $3, $1}') && status=0 || status=$?
+        else
+            (cd "$WORK_DIR" && ./out) && status=0 || status=$?
+        fi
+        end=$(date +%s.%N)
+        printf "%-24s %-28s %10.4f %6s %12.4f %8s %8s %s\n" "$(basename "$program")" "$config" \
+            "$(awk "BEGIN { print $compile_end - $compile_start }")" "$status" \
+            "$(awk "BEGIN { print $end - $start }")" "$insns" "$mem_ops" "$counters"
+    done
+done
@@ -0,0 +1,739 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+
+#include "./parser.hpp"
+
+using ConstEnv = std::unordered_map<std::string, int64_t>;
+
+// All arithmetic in a .hy program is 64-bit two's complement, so constant
+// folding goes through uint64_t to get defined wraparound.
+inline int64_t wrap_add(const int64_t a, const int64_t b) {
+    return static_cast<int64_t>(static_cast<uint64_t>(a) + static_cast<uint64_t>(b));
+}
+
+inline int64_t wrap_sub(const int64_t a, const int64_t b) {
+    return static_cast<int64_t>(static_cast<uint64_t>(a) - static_cast<uint64_t>(b));
+}
+
+inline int64_t wrap_mul(const int64_t a, const int64_t b) {
+    return static_cast<int64_t>(static_cast<uint64_t>(a) * static_cast<uint64_t>(b));
+}
+
+inline std::optional<int64_t> checked_div(const int64_t a, const int64_t b) {
+    if (b == 0 || (a == INT64_MIN && b == -1)) {
+        return {};
+    }
+    return a / b;
+}
+
+// The remainder has the sign of the dividend, matching idiv and sdiv.
+inline std::optional<int64_t> checked_mod(const int64_t a, const int64_t b) {
+    if (b == 0 || (a == INT64_MIN && b == -1)) {
+        return {};
+    }
+    return a % b;
+}
+
+inline int64_t parse_int_lit(const Token &token) {
+    int64_t value = 0;
+    for (const char c: token.value.value()) {
+        if (c == '-') {
+            continue;
+        }
+        value = wrap_add(wrap_mul(value, 10), c - '0');
+    }
+    if (token.value.value().starts_with('-')) {
+        value = wrap_sub(0, value);
+    }
+    return value;
+}
+
+// The line of the leftmost token of an expression.
+inline int expr_line(const NodeExpr *expr) {
+    if (const auto term = std::get_if<NodeTerm *>(&expr->var)) {
+        if (const auto term_int_lit = std::get_if<NodeTermIntLit *>(&(*term)->var)) {
+            return (*term_int_lit)->int_lit.line;
+        }
+        if (const auto term_ident = std::get_if<NodeTermIdent *>(&(*term)->var)) {
+            return (*term_ident)->ident.line;
+        }
+        return expr_line(std::get<NodeTermParen *>((*term)->var)->expr);
+    }
+    if (const auto bin_expr = std::get_if<NodeBinExpr *>(&expr->var)) {
+        return std::visit([](const auto *bin) { return expr_line(bin->lhs); }, (*bin_expr)->var);
+    }
+    return std::visit([](const auto *cond) { return expr_line(cond->lhs); }, std::get<NodeCondExpr *>(expr->var)->var);
+}
+
+inline NodeTerm *make_int_lit_term(ArenaAllocator &allocator, const int64_t value, const int line = 0) {
+    auto term_int_lit = allocator.emplace<NodeTermIntLit>();
+    term_int_lit->int_lit = {.type = TokenType::int_lit, .line = line, .value = std::to_string(value)};
+    auto term = allocator.emplace<NodeTerm>();
+    term->var = term_int_lit;
+    return term;
+}
+
+inline NodeExpr *make_int_lit_expr(ArenaAllocator &allocator, const int64_t value, const int line = 0) {
+    auto expr = allocator.emplace<NodeExpr>();
+    expr->var = make_int_lit_term(allocator, value, line);
+    return expr;
+}
+
+inline NodeExpr *make_ident_expr(ArenaAllocator &allocator, const Token &ident) {
+    auto term_ident = allocator.emplace<NodeTermIdent>();
+    term_ident->ident = ident;
+    auto term = allocator.emplace<NodeTerm>();
+    term->var = term_ident;
+    auto expr = allocator.emplace<NodeExpr>();
+    expr->var = term;
+    return expr;
+}
+
+inline std::optional<std::string> as_ident(const NodeExpr *expr) {
+    if (const auto term = std::get_if<NodeTerm *>(&expr->var)) {
+        if (const auto ident = std::get_if<NodeTermIdent *>(&(*term)->var)) {
+            return (*ident)->ident.value.value();
+        }
+        if (const auto paren = std::get_if<NodeTermParen *>(&(*term)->var)) {
+            return as_ident((*paren)->expr);
+        }
+    }
+    return {};
+}
+
+inline std::optional<int64_t> eval_const(const NodeExpr *expr, const ConstEnv &env);
+
+inline std::optional<int64_t> eval_const(const NodeTerm *term, const ConstEnv &env) {
+    struct TermVisitor {
+        const ConstEnv &env;
+
+        std::optional<int64_t> operator()(const NodeTermIntLit *term_int_lit) const {
+            return parse_int_lit(term_int_lit->int_lit);
+        }
+
+        std::optional<int64_t> operator()(const NodeTermIdent *term_ident) const {
+            const auto it = env.find(term_ident->ident.value.value());
+            if (it == env.end()) {
+                return {};
+            }
+            return it->second;
+        }
+
+        std::optional<int64_t> operator()(const NodeTermParen *term_paren) const {
+            return eval_const(term_paren->expr, env);
+        }
+    };
+    return std::visit(TermVisitor{.env = env}, term->var);
+}
+
+inline std::optional<int64_t> eval_const(const NodeExpr *expr, const ConstEnv &env) {
+    struct ExprVisitor {
+        const ConstEnv &env;
+
+        std::optional<int64_t> operator()(const NodeTerm *term) const {
+            return eval_const(term, env);
+        }
+
+        std::optional<int64_t> operator()(const NodeBinExpr *bin_expr) const {
+            return std::visit([&]<typename T>(const T *bin) -> std::optional<int64_t> {
+                const auto lhs = eval_const(bin->lhs, env);
+                const auto rhs = eval_const(bin->rhs, env);
+                if (!lhs.has_value() || !rhs.has_value()) {
+                    return {};
+                }
+                if constexpr (std::is_same_v<T, NodeBinExprAdd>) {
+                    return wrap_add(lhs.value(), rhs.value());
+                } else if constexpr (std::is_same_v<T, NodeBinExprSub>) {
+                    return wrap_sub(lhs.value(), rhs.value());
+                } else if constexpr (std::is_same_v<T, NodeBinExprMult>) {
+                    return wrap_mul(lhs.value(), rhs.value());
+                } else if constexpr (std::is_same_v<T, NodeBinExprDiv>) {
+                    return checked_div(lhs.value(), rhs.value());
+                } else {
+                    return checked_mod(lhs.value(), rhs.value());
+                }
+            }, bin_expr->var);
+        }
+
+        std::optional<int64_t> operator()(const NodeCondExpr *cond_expr) const {
+            return std::visit([&]<typename T>(const T *cond) -> std::optional<int64_t> {
+                const auto lhs = eval_const(cond->lhs, env);
+                const auto rhs = eval_const(cond->rhs, env);
+                if (!lhs.has_value() || !rhs.has_value()) {
+                    return {};
+                }
+                if constexpr (std::is_same_v<T, NodeCondExprGreater>) {
+                    return lhs.value() > rhs.value();
+                } else if constexpr (std::is_same_v<T, NodeCondExprGreaterEq>) {
+                    return lhs.value() >= rhs.value();
+                } else if constexpr (std::is_same_v<T, NodeCondExprLess>) {
+                    return lhs.value() < rhs.value();
+                } else if constexpr (std::is_same_v<T, NodeCondExprLessEq>) {
+                    return lhs.value() <= rhs.value();
+                } else if constexpr (std::is_same_v<T, NodeCondExprEq>) {
+                    return lhs.value() == rhs.value();
+                } else {
+                    return lhs.value() != rhs.value();
+                }
+            }, cond_expr->var);
+        }
+    };
+    return std::visit(ExprVisitor{.env = env}, expr->var);
+}
+
+inline const Token &reassign_target(const NodeVarReassign *var_reassign) {
+    struct ReassignVisitor {
+        const Token &operator()(const NodeUnary *unary) const {
+            return std::visit([](const auto *stmt) -> const Token & { return stmt->term_ident->ident; }, unary->var);
+        }
+
+        const Token &operator()(const NodeCompound *compound) const {
+            return std::visit([](const auto *stmt) -> const Token & { return stmt->term_ident->ident; }, compound->var);
+        }
+    };
+    return std::visit(ReassignVisitor{}, var_reassign->var);
+}
+
+inline void collect_used(const NodeExpr *expr, std::unordered_set<std::string> &names);
+
+inline void collect_used(const NodeTerm *term, std::unordered_set<std::string> &names) {
+    if (const auto ident = std::get_if<NodeTermIdent *>(&term->var)) {
+        names.insert((*ident)->ident.value.value());
+    } else if (const auto paren = std::get_if<NodeTermParen *>(&term->var)) {
+        collect_used((*paren)->expr, names);
+    }
+}
+
+inline void collect_used(const NodeExpr *expr, std::unordered_set<std::string> &names) {
+    struct ExprVisitor {
+        std::unordered_set<std::string> &names;
+
+        void operator()(const NodeTerm *term) const {
+            collect_used(term, names);
+        }
+
+        void operator()(const NodeBinExpr *bin_expr) const {
+            std::visit([&](const auto *bin) {
+                collect_used(bin->lhs, names);
+                collect_used(bin->rhs, names);
+            }, bin_expr->var);
+        }
+
+        void operator()(const NodeCondExpr *cond_expr) const {
+            std::visit([&](const auto *cond) {
+                collect_used(cond->lhs, names);
+                collect_used(cond->rhs, names);
+            }, cond_expr->var);
+        }
+    };
+    std::visit(ExprVisitor{.names = names}, expr->var);
+}
+
+// Names written anywhere inside a statement, including `let` declarations in
+// nested scopes.
+inline void collect_assigned(const NodeStmt *stmt, std::unordered_multiset<std::string> &names);
+
+inline void collect_assigned(const NodeScope *scope, std::unordered_multiset<std::string> &names) {
+    for (const NodeStmt *stmt: scope->stmts) {
+        collect_assigned(stmt, names);
+    }
+}
+
+inline void collect_assigned(const NodeIfPred *pred, std::unordered_multiset<std::string> &names) {
+    struct PredVisitor {
+        std::unordered_multiset<std::string> &names;
+
+        void operator()(const NodeIfPredElif *elif) const {
+            collect_assigned(elif->scope, names);
+            if (elif->pred.has_value()) {
+                collect_assigned(elif->pred.value(), names);
+            }
+        }
+
+        void operator()(const NodeIfPredElse *else_) const {
+            collect_assigned(else_->scope, names);
+        }
+    };
+    std::visit(PredVisitor{.names = names}, pred->var);
+}
+
+inline void collect_assigned(const NodeStmt *stmt, std::unordered_multiset<std::string> &names) {
+    struct StmtVisitor {
+        std::unordered_multiset<std::string> &names;
+
+        void operator()(const NodeStmtExit *) const {
+        }
+
+        void operator()(const NodeStmtLet *stmt_let) const {
+            names.insert(stmt_let->ident.value.value());
+        }
+
+        void operator()(const NodeScope *scope) const {
+            collect_assigned(scope, names);
+        }
+
+        void operator()(const NodeStmtIf *stmt_if) const {
+            collect_assigned(stmt_if->scope, names);
+            if (stmt_if->pred.has_value()) {
+                collect_assigned(stmt_if->pred.value(), names);
+            }
+        }
+
+        void operator()(const NodeStmtAssign *stmt_assign) const {
+            names.insert(stmt_assign->ident.value.value());
+        }
+
+        void operator()(const NodeStmtWhile *stmt_while) const {
+            collect_assigned(stmt_while->scope, names);
+        }
+
+        void operator()(const NodeVarReassign *var_reassign) const {
+            names.insert(reassign_target(var_reassign).value.value());
+        }
+    };
+    std::visit(StmtVisitor{.names = names}, stmt->var);
+}
+
+// Tracks which variables hold a known constant across straight-line code.
+// Anything written inside a nested construct is forgotten.
+inline void update_const_env(const NodeStmt *stmt, ConstEnv &env) {
+    if (const auto stmt_let = std::get_if<NodeStmtLet *>(&stmt->var)) {
+        if (const auto value = eval_const((*stmt_let)->expr, env)) {
+            env[(*stmt_let)->ident.value.value()] = value.value();
+        } else {
+            env.erase((*stmt_let)->ident.value.value());
+        }
+        return;
+    }
+    if (const auto stmt_assign = std::get_if<NodeStmtAssign *>(&stmt->var)) {
+        if (const auto value = eval_const((*stmt_assign)->expr, env)) {
+            env[(*stmt_assign)->ident.value.value()] = value.value();
+        } else {
+            env.erase((*stmt_assign)->ident.value.value());
+        }
+        return;
+    }
+    std::unordered_multiset<std::string> assigned;
+    collect_assigned(stmt, assigned);
+    for (const std::string &name: assigned) {
+        env.erase(name);
+    }
+}
+
+// Calls `fn(stmts, env)` for every statement list directly nested in `stmt`,
+// where `env` holds the constants known on entry to that list.
+template <typename Fn>
+void for_each_nested_block(NodeStmt *stmt, const ConstEnv &env, Fn &&fn) {
+    if (const auto scope = std::get_if<NodeScope *>(&stmt->var)) {
+        fn((*scope)->stmts, env);
+    } else if (const auto stmt_if = std::get_if<NodeStmtIf *>(&stmt->var)) {
+        fn((*stmt_if)->scope->stmts, env);
+        std::optional<NodeIfPred *> pred = (*stmt_if)->pred;
+        while (pred.has_value()) {
+            if (const auto elif = std::get_if<NodeIfPredElif *>(&pred.value()->var)) {
+                fn((*elif)->scope->stmts, env);
+                pred = (*elif)->pred;
+            } else {
+                fn(std::get<NodeIfPredElse *>(pred.value()->var)->scope->stmts, env);
+                pred = {};
+            }
+        }
+    } else if (const auto stmt_while = std::get_if<NodeStmtWhile *>(&stmt->var)) {
+        ConstEnv body_env = env;
+        std::unordered_multiset<std::string> assigned;
+        collect_assigned(stmt, assigned);
+        for (const std::string &name: assigned) {
+            body_env.erase(name);
+        }
+        fn((*stmt_while)->scope->stmts, body_env);
+    }
+}
+
+template <typename T>
+NodeExpr *make_bin_expr(ArenaAllocator &allocator, NodeExpr *lhs, NodeExpr *rhs) {
+    auto node = allocator.emplace<T>();
+    node->lhs = lhs;
+    node->rhs = rhs;
+    auto expr = allocator.emplace<NodeExpr>();
+    if constexpr (std::is_constructible_v<decltype(NodeBinExpr::var), T *>) {
+        auto bin_expr = allocator.emplace<NodeBinExpr>();
+        bin_expr->var = node;
+        expr->var = bin_expr;
+    } else {
+        auto cond_expr = allocator.emplace<NodeCondExpr>();
+        cond_expr->var = node;
+        expr->var = cond_expr;
+    }
+    return expr;
+}
+
+inline NodeStmt *make_let_stmt(ArenaAllocator &allocator, const Token &ident, NodeExpr *expr) {
+    auto stmt_let = allocator.emplace<NodeStmtLet>();
+    stmt_let->ident = ident;
+    stmt_let->expr = expr;
+    auto stmt = allocator.emplace<NodeStmt>();
+    stmt->var = stmt_let;
+    return stmt;
+}
+
+inline NodeStmt *make_assign_stmt(ArenaAllocator &allocator, const Token &ident, NodeExpr *expr) {
+    auto stmt_assign = allocator.emplace<NodeStmtAssign>();
+    stmt_assign->ident = ident;
+    stmt_assign->expr = expr;
+    auto stmt = allocator.emplace<NodeStmt>();
+    stmt->var = stmt_assign;
+    return stmt;
+}
+
+// Number of AST nodes, used as the code-size measure by the optimizer.
+inline size_t count_nodes(const NodeExpr *expr);
+
+inline size_t count_nodes(const NodeTerm *term) {
+    if (const auto paren = std::get_if<NodeTermParen *>(&term->var)) {
+        return 1 + count_nodes((*paren)->expr);
+    }
+    return 1;
+}
+
+inline size_t count_nodes(const NodeExpr *expr) {
+    struct ExprVisitor {
+        size_t operator()(const NodeTerm *term) const {
+            return count_nodes(term);
+        }
+
+        size_t operator()(const NodeBinExpr *bin_expr) const {
+            return std::visit([](const auto *bin) { return 1 + count_nodes(bin->lhs) + count_nodes(bin->rhs); },
+                              bin_expr->var);
+        }
+
+        size_t operator()(const NodeCondExpr *cond_expr) const {
+            return std::visit([](const auto *cond) { return 1 + count_nodes(cond->lhs) + count_nodes(cond->rhs); },
+                              cond_expr->var);
+        }
+    };
+    return std::visit(ExprVisitor{}, expr->var);
+}
+
+inline size_t count_nodes(const NodeStmt *stmt);
+
+inline size_t count_nodes(const NodeScope *scope) {
+    size_t count = 1;
+    for (const NodeStmt *stmt: scope->stmts) {
+        count += count_nodes(stmt);
+    }
+    return count;
+}
+
+inline size_t count_nodes(const NodeIfPred *pred) {
+    struct PredVisitor {
+        size_t operator()(const NodeIfPredElif *elif) const {
+            return 1 + count_nodes(elif->expr) + count_nodes(elif->scope)
+                   + (elif->pred.has_value() ? count_nodes(elif->pred.value()) : 0);
+        }
+
+        size_t operator()(const NodeIfPredElse *else_) const {
+            return 1 + count_nodes(else_->scope);
+        }
+    };
+    return std::visit(PredVisitor{}, pred->var);
+}
+
+inline size_t count_nodes(const NodeStmt *stmt) {
+    struct StmtVisitor {
+        size_t operator()(const NodeStmtExit *stmt_exit) const {
+            return 1 + count_nodes(stmt_exit->expr);
+        }
+
+        size_t operator()(const NodeStmtLet *stmt_let) const {
+            return 1 + count_nodes(stmt_let->expr);
+        }
+
+        size_t operator()(const NodeScope *scope) const {
+            return count_nodes(scope);
+        }
+
+        size_t operator()(const NodeStmtIf *stmt_if) const {
+            return 1 + count_nodes(stmt_if->expr) + count_nodes(stmt_if->scope)
+                   + (stmt_if->pred.has_value() ? count_nodes(stmt_if->pred.value()) : 0);
+        }
+
+        size_t operator()(const NodeStmtAssign *stmt_assign) const {
+            return 1 + count_nodes(stmt_assign->expr);
+        }
+
+        size_t operator()(const NodeStmtWhile *stmt_while) const {
+            return 1 + count_nodes(stmt_while->expr) + count_nodes(stmt_while->scope);
+        }
+
+        size_t operator()(const NodeVarReassign *var_reassign) const {
+            if (const auto compound = std::get_if<NodeCompound *>(&var_reassign->var)) {
+                return 1 + std::visit([](const auto *stmt) { return count_nodes(stmt->term); }, (*compound)->var);
+            }
+            return 1;
+        }
+    };
+    return std::visit(StmtVisitor{}, stmt->var);
+}
+
+inline size_t count_nodes(const NodeProgram &prog) {
+    size_t count = 0;
+    for (const NodeStmt *stmt: prog.stmts) {
+        count += count_nodes(stmt);
+    }
+    return count;
+}
+
+// A variable or literal, looking through parentheses.
+inline const NodeTerm *as_leaf(const NodeExpr *expr);
+
+inline const NodeTerm *as_leaf(const NodeTerm *term) {
+    if (const auto paren = std::get_if<NodeTermParen *>(&term->var)) {
+        return as_leaf((*paren)->expr);
+    }
+    return term;
+}
+
+inline const NodeTerm *as_leaf(const NodeExpr *expr) {
+    const auto term = std::get_if<NodeTerm *>(&expr->var);
+    return term != nullptr ? as_leaf(*term) : nullptr;
+}
+
+// The value of a literal, looking through parentheses.
+inline std::optional<int64_t> as_int_lit(const NodeTerm *term) {
+    const auto term_int_lit = std::get_if<NodeTermIntLit *>(&as_leaf(term)->var);
+    if (term_int_lit == nullptr) {
+        return {};
+    }
+    return parse_int_lit((*term_int_lit)->int_lit);
+}
+
+inline std::optional<int64_t> as_int_lit(const NodeExpr *expr) {
+    const NodeTerm *leaf = as_leaf(expr);
+    return leaf != nullptr ? as_int_lit(leaf) : std::nullopt;
+}
+
+// A comparison, looking through parentheses.
+inline const NodeCondExpr *as_cond(const NodeExpr *expr) {
+    if (const auto cond_expr = std::get_if<NodeCondExpr *>(&expr->var)) {
+        return *cond_expr;
+    }
+    if (const auto term = std::get_if<NodeTerm *>(&expr->var)) {
+        if (const auto paren = std::get_if<NodeTermParen *>(&(*term)->var)) {
+            return as_cond((*paren)->expr);
+        }
+    }
+    return nullptr;
+}
+
+// Sethi-Ullman numbers: how many registers an expression needs when the
+// operand that needs more is always evaluated first. A leaf on the right of
+// an operator is used as an operand in place and needs none of its own.
+class RegisterNeed {
+public:
+    size_t operator()(const NodeExpr *expr) {
+        if (const auto it = m_cache.find(expr); it != m_cache.end()) {
+            return it->second;
+        }
+        size_t need = 1;
+        if (const auto term = std::get_if<NodeTerm *>(&expr->var)) {
+            if (const auto paren = std::get_if<NodeTermParen *>(&(*term)->var)) {
+                need = (*this)((*paren)->expr);
+            }
+        } else if (const auto bin_expr = std::get_if<NodeBinExpr *>(&expr->var)) {
+            need = std::visit([&](const auto *bin) { return combine(bin->lhs, bin->rhs); }, (*bin_expr)->var);
+        } else {
+            need = std::visit([&](const auto *cond) { return combine(cond->lhs, cond->rhs); },
+                              std::get<NodeCondExpr *>(expr->var)->var);
+        }
+        m_cache.emplace(expr, need);
+        return need;
+    }
+
+private:
+    size_t combine(const NodeExpr *lhs, const NodeExpr *rhs) {
+        const size_t lhs_need = (*this)(lhs);
+        const size_t rhs_need = as_leaf(rhs) != nullptr ? 0 : (*this)(rhs);
+        return lhs_need == rhs_need ? lhs_need + 1 : std::max(lhs_need, rhs_need);
+    }
+
+    std::unordered_map<const NodeExpr *, size_t> m_cache;
+};
+
+// Deep copy of a subtree into `allocator`. Tokens are copied so the clone
+// keeps the original line numbers for diagnostics.
+class AstCloner {
+public:
+    explicit AstCloner(ArenaAllocator &allocator)
+        : m_allocator(allocator) {
+    }
+
+    NodeTerm *clone(const NodeTerm *term) {
+        auto copy = m_allocator.emplace<NodeTerm>();
+        std::visit([&]<typename T>(const T *node) {
+            auto node_copy = m_allocator.emplace<T>(*node);
+            if constexpr (std::is_same_v<T, NodeTermParen>) {
+                node_copy->expr = clone(node->expr);
+            }
+            copy->var = node_copy;
+        }, term->var);
+        return copy;
+    }
+
+    NodeExpr *clone(const NodeExpr *expr) {
+        struct ExprVisitor {
+            AstCloner &cloner;
+
+            NodeExpr *operator()(const NodeTerm *term) const {
+                auto copy = cloner.m_allocator.emplace<NodeExpr>();
+                copy->var = cloner.clone(term);
+                return copy;
+            }
+
+            NodeExpr *operator()(const NodeBinExpr *bin_expr) const {
+                auto bin_copy = cloner.m_allocator.emplace<NodeBinExpr>();
+                std::visit([&]<typename T>(const T *bin) {
+                    auto node_copy = cloner.m_allocator.emplace<T>();
+                    node_copy->lhs = cloner.clone(bin->lhs);
+                    node_copy->rhs = cloner.clone(bin->rhs);
+                    bin_copy->var = node_copy;
+                }, bin_expr->var);
+                auto copy = cloner.m_allocator.emplace<NodeExpr>();
+                copy->var = bin_copy;
+                return copy;
+            }
+
+            NodeExpr *operator()(const NodeCondExpr *cond_expr) const {
+                auto cond_copy = cloner.m_allocator.emplace<NodeCondExpr>();
+                std::visit([&]<typename T>(const T *cond) {
+                    auto node_copy = cloner.m_allocator.emplace<T>();
+                    node_copy->lhs = cloner.clone(cond->lhs);
+                    node_copy->rhs = cloner.clone(cond->rhs);
+                    cond_copy->var = node_copy;
+                }, cond_expr->var);
+                auto copy = cloner.m_allocator.emplace<NodeExpr>();
+                copy->var = cond_copy;
+                return copy;
+            }
+        };
+        return std::visit(ExprVisitor{.cloner = *this}, expr->var);
+    }
+
+    NodeScope *clone(const NodeScope *scope) {
+        auto copy = m_allocator.emplace<NodeScope>();
+        for (const NodeStmt *stmt: scope->stmts) {
+            copy->stmts.push_back(clone(stmt));
+        }
+        return copy;
+    }
+
+    NodeIfPred *clone(const NodeIfPred *pred) {
+        struct PredVisitor {
+            AstCloner &cloner;
+
+            NodeIfPred *operator()(const NodeIfPredElif *elif) const {
+                auto elif_copy = cloner.m_allocator.emplace<NodeIfPredElif>();
+                elif_copy->expr = cloner.clone(elif->expr);
+                elif_copy->scope = cloner.clone(elif->scope);
+                if (elif->pred.has_value()) {
+                    elif_copy->pred = cloner.clone(elif->pred.value());
+                }
+                return cloner.m_allocator.emplace<NodeIfPred>(elif_copy);
+            }
+
+            NodeIfPred *operator()(const NodeIfPredElse *else_) const {
+                auto else_copy = cloner.m_allocator.emplace<NodeIfPredElse>();
+                else_copy->scope = cloner.clone(else_->scope);
+                return cloner.m_allocator.emplace<NodeIfPred>(else_copy);
+            }
+        };
+        return std::visit(PredVisitor{.cloner = *this}, pred->var);
+    }
+
+    NodeVarReassign *clone(const NodeVarReassign *var_reassign) {
+        auto copy = m_allocator.emplace<NodeVarReassign>();
+        if (const auto unary = std::get_if<NodeUnary *>(&var_reassign->var)) {
+            auto unary_copy = m_allocator.emplace<NodeUnary>();
+            std::visit([&]<typename T>(const T *stmt) {
+                auto node_copy = m_allocator.emplace<T>();
+                node_copy->term_ident = m_allocator.emplace<NodeTermIdent>(*stmt->term_ident);
+                unary_copy->var = node_copy;
+            }, (*unary)->var);
+            copy->var = unary_copy;
+        } else {
+            auto compound_copy = m_allocator.emplace<NodeCompound>();
+            std::visit([&]<typename T>(const T *stmt) {
+                auto node_copy = m_allocator.emplace<T>();
+                node_copy->term_ident = m_allocator.emplace<NodeTermIdent>(*stmt->term_ident);
+                node_copy->term = clone(stmt->term);
+                compound_copy->var = node_copy;
+            }, std::get<NodeCompound *>(var_reassign->var)->var);
+            copy->var = compound_copy;
+        }
+        return copy;
+    }
+
+    NodeStmt *clone(const NodeStmt *stmt) {
+        struct StmtVisitor {
+            AstCloner &cloner;
+
+            NodeStmt *operator()(const NodeStmtExit *stmt_exit) const {
+                auto copy = cloner.m_allocator.emplace<NodeStmtExit>();
+                copy->expr = cloner.clone(stmt_exit->expr);
+                return cloner.wrap_stmt(copy);
+            }
+
+            NodeStmt *operator()(const NodeStmtLet *stmt_let) const {
+                auto copy = cloner.m_allocator.emplace<NodeStmtLet>();
+                copy->ident = stmt_let->ident;
+                copy->expr = cloner.clone(stmt_let->expr);
+                return cloner.wrap_stmt(copy);
+            }
+
+            NodeStmt *operator()(const NodeScope *scope) const {
+                return cloner.wrap_stmt(cloner.clone(scope));
+            }
+
+            NodeStmt *operator()(const NodeStmtIf *stmt_if) const {
+                auto copy = cloner.m_allocator.emplace<NodeStmtIf>();
+                copy->expr = cloner.clone(stmt_if->expr);
+                copy->scope = cloner.clone(stmt_if->scope);
+                if (stmt_if->pred.has_value()) {
+                    copy->pred = cloner.clone(stmt_if->pred.value());
+                }
+                return cloner.wrap_stmt(copy);
+            }
+
+            NodeStmt *operator()(const NodeStmtAssign *stmt_assign) const {
+                auto copy = cloner.m_allocator.emplace<NodeStmtAssign>();
+                copy->ident = stmt_assign->ident;
+                copy->expr = cloner.clone(stmt_assign->expr);
+                return cloner.wrap_stmt(copy);
+            }
+
+            NodeStmt *operator()(const NodeStmtWhile *stmt_while) const {
+                auto copy = cloner.m_allocator.emplace<NodeStmtWhile>();
+                copy->expr = cloner.clone(stmt_while->expr);
+                copy->scope = cloner.clone(stmt_while->scope);
+                return cloner.wrap_stmt(copy);
+            }
+
+            NodeStmt *operator()(const NodeVarReassign *var_reassign) const {
+                return cloner.wrap_stmt(cloner.clone(var_reassign));
+            }
+        };
+        return std::visit(StmtVisitor{.cloner = *this}, stmt->var);
+    }
+
+private:
+    template <typename T>
+    NodeStmt *wrap_stmt(T *node) {
+        auto copy = m_allocator.emplace<NodeStmt>();
+        copy->var = node;
+        return copy;
+    }
+
+    ArenaAllocator &m_allocator;
+};
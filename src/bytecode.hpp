@@ -0,0 +1,585 @@
+#pragma once
+#include <algorithm>
+#include <csignal>
+#include <cstdint>
+#include <iostream>
+#include <optional>
+#include <vector>
+
+#include "./ir.hpp"
+
+// A register bytecode for running a program without compiling it to machine
+// code. Every variable lives in a register of its own for as long as it is in
+// scope and expression temporaries take the registers above it, so an
+// instruction names its operands directly instead of pushing and popping.
+// The compare-and-branch, increment and add-immediate forms fuse what would
+// otherwise be two or three instructions in the most common loop shapes.
+enum class BcOp : uint8_t {
+    // a = imm
+    load_imm,
+    // a = b
+    copy,
+    // a = b <op> c
+    add,
+    sub,
+    mul,
+    div,
+    mod,
+    // a = b + imm
+    add_imm,
+    // a += 1, a -= 1
+    inc,
+    dec,
+    // a = b <cond> c, in IrCond order.
+    greater,
+    greater_eq,
+    less,
+    less_eq,
+    eq,
+    not_eq_,
+    jump,
+    jump_zero,
+    // Jump when `a <cond> b`, in IrCond order.
+    jump_greater,
+    jump_greater_eq,
+    jump_less,
+    jump_less_eq,
+    jump_eq,
+    jump_not_eq,
+    // Jump when `a <cond> imm`, in IrCond order.
+    jump_greater_imm,
+    jump_greater_eq_imm,
+    jump_less_imm,
+    jump_less_eq_imm,
+    jump_eq_imm,
+    jump_not_eq_imm,
+    // Counts a back-edge of loop a, handing control back to whoever runs
+    // the VM once the loop is hot.
+    loop,
+    // Ends the program with the value of a.
+    exit,
+};
+
+struct BcInst {
+    BcOp op;
+    uint16_t a = 0;
+    uint16_t b = 0;
+    uint16_t c = 0;
+    // The instruction jumps go to.
+    uint32_t target = 0;
+    int64_t imm = 0;
+};
+
+struct BcVar {
+    std::string name;
+    uint16_t reg;
+};
+
+// Where a counted loop sits in the program, so the rest of the program from
+// the loop's next iteration on can be rebuilt as an AST of its own.
+struct BcLoopSite {
+    // A scope around the loop, the program itself first.
+    struct Frame {
+        // The statements after the one that leads to the loop.
+        std::vector<NodeStmt *> rest;
+        // The loop this scope is the body of, which runs again once the rest
+        // of the body has; nullptr for any other scope.
+        NodeStmt *repeat = nullptr;
+        // How many of `vars` the scope declares.
+        size_t var_count = 0;
+    };
+
+    NodeStmt *loop = nullptr;
+    std::vector<Frame> frames = {};
+    // Every variable in scope at the loop, outermost scope first.
+    std::vector<BcVar> vars = {};
+};
+
+struct BcProgram {
+    std::vector<BcInst> code;
+    size_t reg_count = 0;
+    // Indexed by the `a` of loop instructions.
+    std::vector<BcLoopSite> loops;
+};
+
+class BytecodeCompiler {
+public:
+    // With `count_loops`, the bottom of every loop gets a `loop` instruction
+    // and a BcLoopSite.
+    explicit BytecodeCompiler(const bool count_loops = false)
+        : m_count_loops(count_loops) {
+    }
+
+    [[nodiscard]] BcProgram compile(const NodeProgram &prog) {
+        gen_stmts(prog.stmts, false);
+        emit({.op = BcOp::load_imm, .a = m_next_reg});
+        emit({.op = BcOp::exit, .a = m_next_reg});
+        use_reg(m_next_reg);
+        return std::move(m_prog);
+    }
+
+private:
+    // A scope being compiled and the statement in it being compiled.
+    struct OpenScope {
+        const std::vector<NodeStmt *> *stmts;
+        size_t index = 0;
+        bool loop_body = false;
+        size_t var_begin = 0;
+    };
+
+    size_t emit(const BcInst &inst) {
+        m_prog.code.push_back(inst);
+        return m_prog.code.size() - 1;
+    }
+
+    void patch(const size_t jump) {
+        m_prog.code[jump].target = static_cast<uint32_t>(m_prog.code.size());
+    }
+
+    void use_reg(const size_t reg) {
+        if (reg > UINT16_MAX) {
+            std::cerr << "Program needs too many registers to interpret" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        m_prog.reg_count = std::max(m_prog.reg_count, reg + 1);
+    }
+
+    uint16_t temp() {
+        use_reg(m_next_reg);
+        return m_next_reg++;
+    }
+
+    [[nodiscard]] uint16_t var_reg(const Token &ident) const {
+        const auto it = std::ranges::find_if(m_vars, [&](const BcVar &var) {
+            return var.name == ident.value.value();
+        });
+        if (it == m_vars.cend()) {
+            std::cerr << "Undeclared Identifier: " << ident.value.value() << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        return it->reg;
+    }
+
+    // Evaluates `expr` and returns the register holding its value: the
+    // variable's own register for an identifier, otherwise `dst` if given or
+    // a fresh temporary.
+    uint16_t gen_expr(const NodeExpr *expr, const std::optional<uint16_t> dst = {}) {
+        if (const NodeTerm *leaf = as_leaf(expr)) {
+            if (const auto term_ident = std::get_if<NodeTermIdent *>(&leaf->var)) {
+                return var_reg((*term_ident)->ident);
+            }
+            const uint16_t reg = dst.has_value() ? dst.value() : temp();
+            emit({.op = BcOp::load_imm, .a = reg, .imm = as_int_lit(leaf).value()});
+            return reg;
+        }
+        if (const NodeCondExpr *cond_expr = as_cond(expr)) {
+            const auto [lhs, rhs, cond] = cond_operands(cond_expr);
+            return gen_binary(static_cast<BcOp>(static_cast<int>(BcOp::greater) + static_cast<int>(cond)), lhs, rhs,
+                              dst);
+        }
+        const auto term = std::get_if<NodeTerm *>(&expr->var);
+        if (term != nullptr) {
+            return gen_expr(std::get<NodeTermParen *>((*term)->var)->expr, dst);
+        }
+        return std::visit([&]<typename T>(const T *bin) {
+            if constexpr (std::is_same_v<T, NodeBinExprAdd> || std::is_same_v<T, NodeBinExprSub>) {
+                if (const auto imm = as_int_lit(bin->rhs)) {
+                    const uint16_t saved = m_next_reg;
+                    const uint16_t lhs = gen_expr(bin->lhs);
+                    m_next_reg = saved;
+                    const uint16_t reg = dst.has_value() ? dst.value() : temp();
+                    const int64_t amount = std::is_same_v<T, NodeBinExprAdd> ? imm.value() : wrap_sub(0, imm.value());
+                    emit({.op = BcOp::add_imm, .a = reg, .b = lhs, .imm = amount});
+                    return reg;
+                }
+            }
+            BcOp op = BcOp::mod;
+            if constexpr (std::is_same_v<T, NodeBinExprAdd>) {
+                op = BcOp::add;
+            } else if constexpr (std::is_same_v<T, NodeBinExprSub>) {
+                op = BcOp::sub;
+            } else if constexpr (std::is_same_v<T, NodeBinExprMult>) {
+                op = BcOp::mul;
+            } else if constexpr (std::is_same_v<T, NodeBinExprDiv>) {
+                op = BcOp::div;
+            }
+            return gen_binary(op, bin->lhs, bin->rhs, dst);
+        }, std::get<NodeBinExpr *>(expr->var)->var);
+    }
+
+    uint16_t gen_binary(const BcOp op, const NodeExpr *lhs_expr, const NodeExpr *rhs_expr,
+                        const std::optional<uint16_t> dst) {
+        const uint16_t saved = m_next_reg;
+        const uint16_t lhs = gen_expr(lhs_expr);
+        const uint16_t rhs = gen_expr(rhs_expr);
+        m_next_reg = saved;
+        const uint16_t reg = dst.has_value() ? dst.value() : temp();
+        emit({.op = op, .a = reg, .b = lhs, .c = rhs});
+        return reg;
+    }
+
+    void gen_expr_into(const NodeExpr *expr, const uint16_t dst) {
+        const uint16_t saved = m_next_reg;
+        if (const uint16_t reg = gen_expr(expr, dst); reg != dst) {
+            emit({.op = BcOp::copy, .a = dst, .b = reg});
+        }
+        m_next_reg = saved;
+    }
+
+    // Emits a jump taken when `expr` is `when_true`, to be patched.
+    size_t gen_branch(const NodeExpr *expr, const bool when_true) {
+        const uint16_t saved = m_next_reg;
+        size_t jump;
+        if (const NodeCondExpr *cond_expr = as_cond(expr)) {
+            auto [lhs_expr, rhs_expr, cond] = cond_operands(cond_expr);
+            if (!as_int_lit(rhs_expr).has_value() && as_int_lit(lhs_expr).has_value()) {
+                std::swap(lhs_expr, rhs_expr);
+                cond = mirror(cond);
+            }
+            if (!when_true) {
+                cond = invert(cond);
+            }
+            const uint16_t lhs = gen_expr(lhs_expr);
+            if (const auto imm = as_int_lit(rhs_expr)) {
+                const auto op = static_cast<BcOp>(static_cast<int>(BcOp::jump_greater_imm) + static_cast<int>(cond));
+                jump = emit({.op = op, .a = lhs, .imm = imm.value()});
+            } else {
+                const uint16_t rhs = gen_expr(rhs_expr);
+                const auto op = static_cast<BcOp>(static_cast<int>(BcOp::jump_greater) + static_cast<int>(cond));
+                jump = emit({.op = op, .a = lhs, .b = rhs});
+            }
+        } else {
+            const uint16_t value = gen_expr(expr);
+            jump = emit({.op = when_true ? BcOp::jump_not_eq_imm : BcOp::jump_zero, .a = value});
+        }
+        m_next_reg = saved;
+        return jump;
+    }
+
+    void gen_stmts(const std::vector<NodeStmt *> &stmts, const bool loop_body) {
+        m_open.push_back({.stmts = &stmts, .loop_body = loop_body, .var_begin = m_vars.size()});
+        for (size_t i = 0; i < stmts.size(); i++) {
+            m_open.back().index = i;
+            gen_stmt(stmts[i]);
+        }
+        m_open.pop_back();
+    }
+
+    void gen_scope(const NodeScope *scope, const bool loop_body = false) {
+        const size_t var_count = m_vars.size();
+        const uint16_t saved = m_next_reg;
+        gen_stmts(scope->stmts, loop_body);
+        m_vars.resize(var_count);
+        m_next_reg = saved;
+    }
+
+    // The site of the loop being compiled, which is the current statement of
+    // the innermost open scope.
+    [[nodiscard]] BcLoopSite loop_site() const {
+        const auto current = [](const OpenScope &open) { return (*open.stmts)[open.index]; };
+        BcLoopSite site{.loop = current(m_open.back()), .vars = m_vars};
+        for (size_t i = 0; i < m_open.size(); i++) {
+            const OpenScope &open = m_open[i];
+            const size_t var_end = i + 1 < m_open.size() ? m_open[i + 1].var_begin : m_vars.size();
+            site.frames.push_back({
+                .rest = {open.stmts->begin() + static_cast<std::ptrdiff_t>(open.index + 1), open.stmts->end()},
+                .repeat = open.loop_body ? current(m_open[i - 1]) : nullptr,
+                .var_count = var_end - open.var_begin,
+            });
+        }
+        return site;
+    }
+
+    // The arms of an if after the first: `end_jumps` collects the jumps from
+    // the end of each arm that ran to past the whole statement.
+    void gen_if_pred(const NodeIfPred *pred, std::vector<size_t> &end_jumps) {
+        if (const auto elif = std::get_if<NodeIfPredElif *>(&pred->var)) {
+            const size_t skip = gen_branch((*elif)->expr, false);
+            gen_scope((*elif)->scope);
+            if ((*elif)->pred.has_value()) {
+                end_jumps.push_back(emit({.op = BcOp::jump}));
+                patch(skip);
+                gen_if_pred((*elif)->pred.value(), end_jumps);
+            } else {
+                patch(skip);
+            }
+            return;
+        }
+        gen_scope(std::get<NodeIfPredElse *>(pred->var)->scope);
+    }
+
+    void gen_stmt(const NodeStmt *stmt) {
+        struct StmtVisitor {
+            BytecodeCompiler &gen;
+
+            void operator()(const NodeStmtExit *stmt_exit) const {
+                const uint16_t saved = gen.m_next_reg;
+                gen.emit({.op = BcOp::exit, .a = gen.gen_expr(stmt_exit->expr)});
+                gen.m_next_reg = saved;
+            }
+
+            void operator()(const NodeStmtLet *stmt_let) const {
+                const std::string &name = stmt_let->ident.value.value();
+                if (std::ranges::any_of(gen.m_vars, [&](const BcVar &var) { return var.name == name; })) {
+                    std::cerr << "Identifier already used: " << name << std::endl;
+                    exit(EXIT_FAILURE);
+                }
+                const uint16_t reg = gen.temp();
+                gen.gen_expr_into(stmt_let->expr, reg);
+                gen.m_vars.push_back({.name = name, .reg = reg});
+            }
+
+            void operator()(const NodeScope *scope) const {
+                gen.gen_scope(scope);
+            }
+
+            void operator()(const NodeStmtIf *stmt_if) const {
+                const size_t skip = gen.gen_branch(stmt_if->expr, false);
+                gen.gen_scope(stmt_if->scope);
+                if (!stmt_if->pred.has_value()) {
+                    gen.patch(skip);
+                    return;
+                }
+                std::vector<size_t> end_jumps = {gen.emit({.op = BcOp::jump})};
+                gen.patch(skip);
+                gen.gen_if_pred(stmt_if->pred.value(), end_jumps);
+                for (const size_t jump: end_jumps) {
+                    gen.patch(jump);
+                }
+            }
+
+            void operator()(const NodeStmtAssign *stmt_assign) const {
+                gen.gen_expr_into(stmt_assign->expr, gen.var_reg(stmt_assign->ident));
+            }
+
+            // Rotated like the native loops: one test before the loop and one
+            // at the bottom of the body, so an iteration takes one dispatch
+            // for its branch.
+            void operator()(const NodeStmtWhile *stmt_while) const {
+                const size_t skip = gen.gen_branch(stmt_while->expr, false);
+                const size_t top = gen.m_prog.code.size();
+                gen.gen_scope(stmt_while->scope, true);
+                if (gen.m_count_loops) {
+                    if (gen.m_prog.loops.size() > UINT16_MAX) {
+                        std::cerr << "Program has too many loops to count" << std::endl;
+                        exit(EXIT_FAILURE);
+                    }
+                    gen.emit({.op = BcOp::loop, .a = static_cast<uint16_t>(gen.m_prog.loops.size())});
+                    gen.m_prog.loops.push_back(gen.loop_site());
+                }
+                gen.m_prog.code[gen.gen_branch(stmt_while->expr, true)].target = static_cast<uint32_t>(top);
+                gen.patch(skip);
+            }
+
+            void operator()(const NodeVarReassign *var_reassign) const {
+                const uint16_t reg = gen.var_reg(reassign_target(var_reassign));
+                if (const auto unary = std::get_if<NodeUnary *>(&var_reassign->var)) {
+                    gen.emit({.op = std::holds_alternative<NodeUnaryAdd *>((*unary)->var) ? BcOp::inc : BcOp::dec,
+                              .a = reg});
+                    return;
+                }
+                std::visit([&]<typename T>(const T *compound) {
+                    const auto imm = as_int_lit(compound->term);
+                    if constexpr (std::is_same_v<T, NodeCompoundPlus> || std::is_same_v<T, NodeCompoundSub>) {
+                        if (imm.has_value()) {
+                            const int64_t amount = std::is_same_v<T, NodeCompoundPlus> ? imm.value()
+                                                                                       : wrap_sub(0, imm.value());
+                            if (amount == 1 || amount == -1) {
+                                gen.emit({.op = amount == 1 ? BcOp::inc : BcOp::dec, .a = reg});
+                            } else {
+                                gen.emit({.op = BcOp::add_imm, .a = reg, .b = reg, .imm = amount});
+                            }
+                            return;
+                        }
+                    }
+                    BcOp op = BcOp::mod;
+                    if constexpr (std::is_same_v<T, NodeCompoundPlus>) {
+                        op = BcOp::add;
+                    } else if constexpr (std::is_same_v<T, NodeCompoundSub>) {
+                        op = BcOp::sub;
+                    } else if constexpr (std::is_same_v<T, NodeCompoundMult>) {
+                        op = BcOp::mul;
+                    } else if constexpr (std::is_same_v<T, NodeCompoundDiv>) {
+                        op = BcOp::div;
+                    }
+                    const uint16_t saved = gen.m_next_reg;
+                    const auto term_expr = NodeExpr{.var = compound->term};
+                    gen.emit({.op = op, .a = reg, .b = reg, .c = gen.gen_expr(&term_expr)});
+                    gen.m_next_reg = saved;
+                }, std::get<NodeCompound *>(var_reassign->var)->var);
+            }
+        };
+        std::visit(StmtVisitor{.gen = *this}, stmt->var);
+    }
+
+    bool m_count_loops;
+    BcProgram m_prog;
+    std::vector<BcVar> m_vars;
+    std::vector<OpenScope> m_open;
+    uint16_t m_next_reg = 0;
+};
+
+enum class BcStatus {
+    exited,
+    // Divided by zero (or INT64_MIN by -1), where native code traps.
+    trapped,
+    // A loop crossed the hot threshold; run() again to carry on.
+    hot_loop,
+};
+
+struct BcOutcome {
+    BcStatus status;
+    // The exit value, or the loop that got hot.
+    int64_t value = 0;
+};
+
+// The status a shell would see from the native program that ended this way.
+inline int exit_status(const BcOutcome &outcome) {
+    return outcome.status == BcStatus::trapped ? 128 + SIGFPE : static_cast<int>(outcome.value & 0xff);
+}
+
+// Runs a BcProgram. With GCC and Clang each handler jumps straight to the
+// next one through a table of label addresses (computed goto), giving every
+// handler its own indirect branch to predict; elsewhere, or when `Threaded`
+// is false, every instruction goes back through one switch.
+class BytecodeVm {
+public:
+    // Once a loop has taken `hot_threshold` back-edges, every further one
+    // stops the VM with BcStatus::hot_loop, until defer_hot() says otherwise.
+    explicit BytecodeVm(const BcProgram &prog, const uint64_t hot_threshold = UINT64_MAX)
+        : m_prog(prog)
+        , m_regs(prog.reg_count)
+        , m_back_edges(prog.loops.size())
+        , m_next_hot(prog.loops.size(), hot_threshold) {
+    }
+
+    // Runs from the start, or from where the last hot_loop stopped.
+    template<bool Threaded = true>
+    BcOutcome run() {
+        const BcInst *const code = m_prog.code.data();
+        const BcInst *pc = code + m_resume;
+        int64_t *const r = m_regs.data();
+#if defined(__GNUC__)
+        static void *const s_labels[] = {
+            &&op_load_imm, &&op_copy, &&op_add, &&op_sub, &&op_mul, &&op_div, &&op_mod, &&op_add_imm, &&op_inc,
+            &&op_dec, &&op_greater, &&op_greater_eq, &&op_less, &&op_less_eq, &&op_eq, &&op_not_eq_, &&op_jump,
+            &&op_jump_zero, &&op_jump_greater, &&op_jump_greater_eq, &&op_jump_less, &&op_jump_less_eq,
+            &&op_jump_eq, &&op_jump_not_eq, &&op_jump_greater_imm, &&op_jump_greater_eq_imm, &&op_jump_less_imm,
+            &&op_jump_less_eq_imm, &&op_jump_eq_imm, &&op_jump_not_eq_imm, &&op_loop, &&op_exit,
+        };
+        static_assert(std::size(s_labels) == static_cast<size_t>(BcOp::exit) + 1);
+#define VM_CASE(name) case BcOp::name: op_##name
+#define VM_NEXT()                                               \
+    do {                                                        \
+        if constexpr (Threaded) {                               \
+            goto *s_labels[static_cast<size_t>(pc->op)];        \
+        } else {                                                \
+            goto dispatch;                                      \
+        }                                                       \
+    } while (false)
+#else
+#define VM_CASE(name) case BcOp::name
+#define VM_NEXT() goto dispatch
+#endif
+#define VM_BINARY(name, expr)                                   \
+    VM_CASE(name) : {                                           \
+        const int64_t lhs = r[pc->b];                           \
+        const int64_t rhs = r[pc->c];                           \
+        r[pc->a] = (expr);                                      \
+        pc++;                                                   \
+        VM_NEXT();                                              \
+    }
+#define VM_BRANCH(name, rhs_value, test)                        \
+    VM_CASE(name) : {                                           \
+        const int64_t lhs = r[pc->a];                           \
+        const int64_t rhs = (rhs_value);                        \
+        pc = (test) ? code + pc->target : pc + 1;               \
+        VM_NEXT();                                              \
+    }
+
+    [[maybe_unused]] dispatch:
+        switch (pc->op) {
+            VM_CASE(load_imm) : r[pc->a] = pc->imm;
+                pc++;
+                VM_NEXT();
+            VM_CASE(copy) : r[pc->a] = r[pc->b];
+                pc++;
+                VM_NEXT();
+            VM_BINARY(add, wrap_add(lhs, rhs))
+            VM_BINARY(sub, wrap_sub(lhs, rhs))
+            VM_BINARY(mul, wrap_mul(lhs, rhs))
+            VM_CASE(div) : VM_CASE(mod) : {
+                const int64_t lhs = r[pc->b];
+                const int64_t rhs = r[pc->c];
+                if (rhs == 0 || (lhs == INT64_MIN && rhs == -1)) {
+                    return {.status = BcStatus::trapped};
+                }
+                r[pc->a] = pc->op == BcOp::div ? lhs / rhs : lhs % rhs;
+                pc++;
+                VM_NEXT();
+            }
+            VM_CASE(add_imm) : r[pc->a] = wrap_add(r[pc->b], pc->imm);
+                pc++;
+                VM_NEXT();
+            VM_CASE(inc) : r[pc->a] = wrap_add(r[pc->a], 1);
+                pc++;
+                VM_NEXT();
+            VM_CASE(dec) : r[pc->a] = wrap_sub(r[pc->a], 1);
+                pc++;
+                VM_NEXT();
+            VM_BINARY(greater, lhs > rhs)
+            VM_BINARY(greater_eq, lhs >= rhs)
+            VM_BINARY(less, lhs < rhs)
+            VM_BINARY(less_eq, lhs <= rhs)
+            VM_BINARY(eq, lhs == rhs)
+            VM_BINARY(not_eq_, lhs != rhs)
+            VM_CASE(jump) : pc = code + pc->target;
+                VM_NEXT();
+            VM_BRANCH(jump_zero, 0, lhs == rhs)
+            VM_BRANCH(jump_greater, r[pc->b], lhs > rhs)
+            VM_BRANCH(jump_greater_eq, r[pc->b], lhs >= rhs)
+            VM_BRANCH(jump_less, r[pc->b], lhs < rhs)
+            VM_BRANCH(jump_less_eq, r[pc->b], lhs <= rhs)
+            VM_BRANCH(jump_eq, r[pc->b], lhs == rhs)
+            VM_BRANCH(jump_not_eq, r[pc->b], lhs != rhs)
+            VM_BRANCH(jump_greater_imm, pc->imm, lhs > rhs)
+            VM_BRANCH(jump_greater_eq_imm, pc->imm, lhs >= rhs)
+            VM_BRANCH(jump_less_imm, pc->imm, lhs < rhs)
+            VM_BRANCH(jump_less_eq_imm, pc->imm, lhs <= rhs)
+            VM_BRANCH(jump_eq_imm, pc->imm, lhs == rhs)
+            VM_BRANCH(jump_not_eq_imm, pc->imm, lhs != rhs)
+            VM_CASE(loop) : if (++m_back_edges[pc->a] >= m_next_hot[pc->a]) {
+                    m_resume = static_cast<size_t>(pc + 1 - code);
+                    return {.status = BcStatus::hot_loop, .value = pc->a};
+                }
+                pc++;
+                VM_NEXT();
+            VM_CASE(exit) : return {.status = BcStatus::exited, .value = r[pc->a]};
+        }
+#undef VM_CASE
+#undef VM_NEXT
+#undef VM_BINARY
+#undef VM_BRANCH
+        return {.status = BcStatus::trapped};
+    }
+
+    [[nodiscard]] int64_t reg(const uint16_t reg) const {
+        return m_regs[reg];
+    }
+
+    [[nodiscard]] uint64_t back_edges(const size_t loop) const {
+        return m_back_edges[loop];
+    }
+
+    // Lets `loop` run `back_edges` more back-edges before it stops the VM.
+    void defer_hot(const size_t loop, const uint64_t back_edges) {
+        m_next_hot[loop] = m_back_edges[loop] + std::min(back_edges, UINT64_MAX - m_back_edges[loop]);
+    }
+
+private:
+    const BcProgram &m_prog;
+    std::vector<int64_t> m_regs;
+    std::vector<uint64_t> m_back_edges;
+    std::vector<uint64_t> m_next_hot;
+    size_t m_resume = 0;
+};
@@ -0,0 +1,25 @@
+#pragma once
+
+#include "./regalloc.hpp"
+
+struct CodegenOptions {
+    RegAllocKind regalloc = RegAllocKind::stack;
+    // How many of the x86-64 allocatable registers the allocators may use.
+    // Fewer than all of them is for exercising spill code.
+    size_t alloc_regs = SIZE_MAX;
+    bool if_convert = false;
+    // Branch profile consulted by if-conversion, if one was given.
+    const BranchProfile *profile = nullptr;
+    // Microarchitecture whose costs pick the sequences for multiplying by a constant.
+    std::string_view tune = "generic";
+    bool peephole = true;
+    // Test a loop's condition at the bottom, after a guard at the top.
+    bool rotate_loops = true;
+    // Boundary a loop's first instruction is padded to with nops, 1 for none.
+    uint64_t loop_align = 16;
+    // Share frame slots between values that are never live at the same time.
+    bool stack_coloring = true;
+    // Core whose latencies order the instructions of each block, "none" to keep
+    // them in source order.
+    std::string_view sched_model = "none";
+};
@@ -0,0 +1,70 @@
+#pragma once
+#include <bit>
+
+#include "./ast_utils.hpp"
+
+// Signed 64-bit division by a constant d as a multiply-high and shift
+// (Hacker's Delight, chapter 10): n / d is the high half of n * multiplier,
+// plus n if d > 0 and the multiplier is negative, minus n if d < 0 and it is
+// positive, arithmetically shifted right by `shift`, plus one if negative.
+struct DivMagic {
+    int64_t multiplier;
+    int shift;
+};
+
+// Valid for |d| >= 2.
+inline DivMagic div_magic(const int64_t d) {
+    constexpr uint64_t two63 = uint64_t{1} << 63;
+    const uint64_t ad = d < 0 ? 0 - static_cast<uint64_t>(d) : static_cast<uint64_t>(d);
+    const uint64_t t = two63 + (static_cast<uint64_t>(d) >> 63);
+    const uint64_t anc = t - 1 - t % ad;
+    int p = 63;
+    uint64_t q1 = two63 / anc;
+    uint64_t r1 = two63 - q1 * anc;
+    uint64_t q2 = two63 / ad;
+    uint64_t r2 = two63 - q2 * ad;
+    uint64_t delta;
+    do {
+        p++;
+        q1 *= 2;
+        r1 *= 2;
+        if (r1 >= anc) {
+            q1++;
+            r1 -= anc;
+        }
+        q2 *= 2;
+        r2 *= 2;
+        if (r2 >= ad) {
+            q2++;
+            r2 -= ad;
+        }
+        delta = ad - r2;
+    } while (q1 < delta || (q1 == delta && r1 == 0));
+    const auto multiplier = static_cast<int64_t>(q2 + 1);
+    return {.multiplier = d < 0 ? static_cast<int64_t>(0 - static_cast<uint64_t>(multiplier)) : multiplier,
+            .shift = p - 64};
+}
+
+// k when |d| is 2^k.
+inline std::optional<int> pow2_shift(const int64_t d) {
+    const uint64_t ad = d < 0 ? 0 - static_cast<uint64_t>(d) : static_cast<uint64_t>(d);
+    if (!std::has_single_bit(ad)) {
+        return {};
+    }
+    return std::countr_zero(ad);
+}
+
+// Constant divisors that are lowered without a divide instruction. 0 is left
+// to trap at runtime, and -1 to trap on INT64_MIN like the hardware does.
+inline bool lowers_to_multiply(const int64_t d) {
+    return d != 0 && d != -1;
+}
+
+// The divisor when `leaf` is a literal that lowers_to_multiply.
+inline std::optional<int64_t> const_divisor(const NodeTerm *leaf) {
+    const auto term_int_lit = leaf != nullptr ? std::get_if<NodeTermIntLit *>(&leaf->var) : nullptr;
+    if (term_int_lit == nullptr || !lowers_to_multiply(parse_int_lit((*term_int_lit)->int_lit))) {
+        return {};
+    }
+    return parse_int_lit((*term_int_lit)->int_lit);
+}
@@ -0,0 +1,66 @@
+#pragma once
+#include <elf.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <span>
+#include <vector>
+
+inline constexpr uint64_t s_elf_base_address = 0x400000;
+// Where the code starts in the file, a page in like ld puts it, so that the
+// loop alignment the encoder computed from offset 0 holds once it is loaded.
+inline constexpr uint64_t s_elf_text_offset = 0x1000;
+
+// A static x86-64 Linux executable whose only contents are `text`. The
+// headers and the code are mapped together by one read-and-execute PT_LOAD
+// segment and execution starts at the first byte of `text`; a PT_GNU_STACK
+// header keeps the stack non-executable. Nothing but the kernel reads the
+// file, so it has no sections.
+inline std::vector<uint8_t> elf_executable(const std::span<const uint8_t> text) {
+    const uint64_t file_size = s_elf_text_offset + text.size();
+
+    Elf64_Ehdr header{};
+    std::memcpy(header.e_ident, ELFMAG, SELFMAG);
+    header.e_ident[EI_CLASS] = ELFCLASS64;
+    header.e_ident[EI_DATA] = ELFDATA2LSB;
+    header.e_ident[EI_VERSION] = EV_CURRENT;
+    header.e_ident[EI_OSABI] = ELFOSABI_SYSV;
+    header.e_type = ET_EXEC;
+    header.e_machine = EM_X86_64;
+    header.e_version = EV_CURRENT;
+    header.e_entry = s_elf_base_address + s_elf_text_offset;
+    header.e_phoff = sizeof(Elf64_Ehdr);
+    header.e_ehsize = sizeof(Elf64_Ehdr);
+    header.e_phentsize = sizeof(Elf64_Phdr);
+    header.e_phnum = 2;
+    header.e_shstrndx = SHN_UNDEF;
+
+    const Elf64_Phdr load = {
+        .p_type = PT_LOAD,
+        .p_flags = PF_R | PF_X,
+        .p_offset = 0,
+        .p_vaddr = s_elf_base_address,
+        .p_paddr = s_elf_base_address,
+        .p_filesz = file_size,
+        .p_memsz = file_size,
+        .p_align = 0x1000,
+    };
+    const Elf64_Phdr stack = {
+        .p_type = PT_GNU_STACK,
+        .p_flags = PF_R | PF_W,
+        .p_offset = 0,
+        .p_vaddr = 0,
+        .p_paddr = 0,
+        .p_filesz = 0,
+        .p_memsz = 0,
+        .p_align = 0x10,
+    };
+
+    std::vector<uint8_t> image(file_size);
+    std::memcpy(image.data(), &header, sizeof(header));
+    std::memcpy(image.data() + sizeof(header), &load, sizeof(load));
+    std::memcpy(image.data() + sizeof(header) + sizeof(load), &stack, sizeof(stack));
+    std::ranges::copy(text, image.begin() + s_elf_text_offset);
+    return image;
+}
@@ -0,0 +1,403 @@
+#pragma once
+#include <iostream>
+#include <vector>
+
+#include "./profile.hpp"
+
+struct EvalOptions {
+    uint64_t max_steps = 10'000'000;
+    size_t max_memory = 1024 * 1024;
+    // Replace the part of the program that did run with its result when the
+    // budget runs out, instead of compiling the original program.
+    bool keep_prefix = false;
+};
+
+enum class EvalOutcome {
+    completed,
+    out_of_steps,
+    out_of_memory,
+    runtime_error,
+    invalid,
+};
+
+// Interprets the program at compile time. Since .hy programs take no input,
+// a run that finishes within budget means the whole program reduces to
+// `exit(<constant>)`.
+class PartialEvaluator {
+public:
+    PartialEvaluator(ArenaAllocator &allocator, const EvalOptions &options)
+        : m_allocator(allocator)
+        , m_options(options) {
+    }
+
+    // Returns true if `prog` was rewritten.
+    bool run(NodeProgram &prog) {
+        m_nodes_before = count_nodes(prog);
+        Snapshot snapshot;
+        for (size_t i = 0; i < prog.stmts.size() && m_outcome == EvalOutcome::completed && !m_exit_code; i++) {
+            snapshot = {.stmt_index = i, .vars = m_vars};
+            const auto stmt_while = std::get_if<NodeStmtWhile *>(&prog.stmts[i]->var);
+            if (stmt_while == nullptr) {
+                exec_stmt(prog.stmts[i]);
+                continue;
+            }
+            // Top-level loops can be resumed at any iteration, so every
+            // iteration boundary is a point the residual program can start from.
+            while (m_outcome == EvalOutcome::completed && !m_exit_code) {
+                snapshot = {.stmt_index = i, .vars = m_vars};
+                const auto cond = eval_expr((*stmt_while)->expr);
+                if (!cond.has_value() || cond.value() == 0) {
+                    break;
+                }
+                m_iterations++;
+                exec_scope((*stmt_while)->scope);
+            }
+        }
+
+        if (m_outcome == EvalOutcome::completed) {
+            auto stmt_exit = m_allocator.emplace<NodeStmtExit>();
+            stmt_exit->expr = make_int_lit_expr(m_allocator, m_exit_code.value_or(0));
+            auto stmt = m_allocator.emplace<NodeStmt>();
+            stmt->var = stmt_exit;
+            prog.stmts = {stmt};
+            m_nodes_after = count_nodes(prog);
+            return true;
+        }
+        if (!m_options.keep_prefix || m_outcome == EvalOutcome::invalid
+            || (snapshot.stmt_index == 0 && m_iterations == 0)) {
+            m_nodes_after = m_nodes_before;
+            return false;
+        }
+        std::vector<NodeStmt *> residual;
+        for (const Var &var: snapshot.vars) {
+            const Token ident{.type = TokenType::ident, .line = 0, .value = var.name};
+            residual.push_back(make_let_stmt(m_allocator, ident, make_int_lit_expr(m_allocator, var.value)));
+        }
+        m_prefix_stmts = snapshot.stmt_index;
+        residual.insert(residual.end(), prog.stmts.begin() + static_cast<std::ptrdiff_t>(snapshot.stmt_index),
+                        prog.stmts.end());
+        prog.stmts = std::move(residual);
+        m_residualized = true;
+        m_nodes_after = count_nodes(prog);
+        return true;
+    }
+
+    // Runs the program without rewriting it, counting how often each if/elif
+    // condition is true. Stops wherever run() would give up.
+    void collect_profile(const NodeProgram &prog, BranchProfile &profile) {
+        m_profile = &profile;
+        for (const NodeStmt *stmt: prog.stmts) {
+            if (!exec_stmt(stmt)) {
+                break;
+            }
+        }
+        m_profile = nullptr;
+    }
+
+    void print_report(std::ostream &out) const {
+        switch (m_outcome) {
+            case EvalOutcome::completed:
+                out << "[eval] program fully evaluated: exit code " << m_exit_code.value_or(0) << "\n";
+                break;
+            case EvalOutcome::out_of_steps:
+                out << "[eval] step budget of " << m_options.max_steps << " exhausted\n";
+                break;
+            case EvalOutcome::out_of_memory:
+                out << "[eval] memory budget of " << m_options.max_memory << " bytes exhausted\n";
+                break;
+            case EvalOutcome::runtime_error:
+                out << "[eval] stopped at a division that traps at runtime\n";
+                break;
+            case EvalOutcome::invalid:
+                out << "[eval] stopped at an invalid program; compiling as written\n";
+                break;
+        }
+        if (m_outcome != EvalOutcome::completed && !m_residualized) {
+            out << "[eval] nothing removed from runtime\n";
+            return;
+        }
+        if (m_residualized) {
+            out << "[eval] kept evaluated prefix: " << m_prefix_stmts << " top-level statements";
+            if (m_iterations > 0) {
+                out << " and " << m_iterations << " loop iterations";
+            }
+            out << " replaced by their results\n";
+        }
+        out << "[eval] removed from runtime: " << m_steps << " evaluation steps, " << m_iterations
+            << " loop iterations; peak " << m_peak_memory << " bytes of variables\n";
+        out << "[eval] program size: " << m_nodes_before << " -> " << m_nodes_after << " AST nodes\n";
+    }
+
+    [[nodiscard]] EvalOutcome outcome() const {
+        return m_outcome;
+    }
+
+    [[nodiscard]] int64_t exit_code() const {
+        return m_exit_code.value_or(0);
+    }
+
+private:
+    struct Var {
+        std::string name;
+        int64_t value;
+    };
+
+    struct Snapshot {
+        size_t stmt_index = 0;
+        std::vector<Var> vars;
+    };
+
+    bool step() {
+        if (m_outcome != EvalOutcome::completed || m_exit_code.has_value()) {
+            return false;
+        }
+        if (++m_steps > m_options.max_steps) {
+            m_outcome = EvalOutcome::out_of_steps;
+            return false;
+        }
+        return true;
+    }
+
+    Var *find_var(const std::string &name) {
+        const auto it = std::ranges::find_if(m_vars, [&](const Var &var) { return var.name == name; });
+        if (it == m_vars.end()) {
+            m_outcome = EvalOutcome::invalid;
+            return nullptr;
+        }
+        return &*it;
+    }
+
+    std::optional<int64_t> eval_term(const NodeTerm *term) {
+        if (!step()) {
+            return {};
+        }
+        if (const auto term_int_lit = std::get_if<NodeTermIntLit *>(&term->var)) {
+            return parse_int_lit((*term_int_lit)->int_lit);
+        }
+        if (const auto term_paren = std::get_if<NodeTermParen *>(&term->var)) {
+            return eval_expr((*term_paren)->expr);
+        }
+        const Var *var = find_var(std::get<NodeTermIdent *>(term->var)->ident.value.value());
+        if (var == nullptr) {
+            return {};
+        }
+        return var->value;
+    }
+
+    std::optional<int64_t> eval_expr(const NodeExpr *expr) {
+        if (const auto term = std::get_if<NodeTerm *>(&expr->var)) {
+            return eval_term(*term);
+        }
+        if (!step()) {
+            return {};
+        }
+        const auto [lhs_expr, rhs_expr] = std::visit([](const auto *expr_var) -> std::pair<NodeExpr *, NodeExpr *> {
+            if constexpr (std::is_same_v<decltype(expr_var), const NodeTerm *>) {
+                return {};
+            } else {
+                return std::visit([](const auto *node) { return std::pair{node->lhs, node->rhs}; }, expr_var->var);
+            }
+        }, expr->var);
+        const auto lhs = eval_expr(lhs_expr);
+        const auto rhs = lhs.has_value() ? eval_expr(rhs_expr) : std::nullopt;
+        if (!rhs.has_value()) {
+            return {};
+        }
+        const auto value = fold(expr, lhs.value(), rhs.value());
+        if (!value.has_value()) {
+            m_outcome = EvalOutcome::runtime_error;
+        }
+        return value;
+    }
+
+    static std::optional<int64_t> fold(const NodeExpr *expr, const int64_t lhs, const int64_t rhs) {
+        if (const auto bin_expr = std::get_if<NodeBinExpr *>(&expr->var)) {
+            return std::visit([&]<typename T>(const T *) -> std::optional<int64_t> {
+                if constexpr (std::is_same_v<T, NodeBinExprAdd>) {
+                    return wrap_add(lhs, rhs);
+                } else if constexpr (std::is_same_v<T, NodeBinExprSub>) {
+                    return wrap_sub(lhs, rhs);
+                } else if constexpr (std::is_same_v<T, NodeBinExprMult>) {
+                    return wrap_mul(lhs, rhs);
+                } else if constexpr (std::is_same_v<T, NodeBinExprDiv>) {
+                    return checked_div(lhs, rhs);
+                } else {
+                    return checked_mod(lhs, rhs);
+                }
+            }, (*bin_expr)->var);
+        }
+        return std::visit([&]<typename T>(const T *) -> std::optional<int64_t> {
+            if constexpr (std::is_same_v<T, NodeCondExprGreater>) {
+                return lhs > rhs;
+            } else if constexpr (std::is_same_v<T, NodeCondExprGreaterEq>) {
+                return lhs >= rhs;
+            } else if constexpr (std::is_same_v<T, NodeCondExprLess>) {
+                return lhs < rhs;
+            } else if constexpr (std::is_same_v<T, NodeCondExprLessEq>) {
+                return lhs <= rhs;
+            } else if constexpr (std::is_same_v<T, NodeCondExprEq>) {
+                return lhs == rhs;
+            } else {
+                return lhs != rhs;
+            }
+        }, std::get<NodeCondExpr *>(expr->var)->var);
+    }
+
+    void record_branch(const NodeExpr *cond_expr, const int64_t cond) {
+        if (m_profile != nullptr) {
+            m_profile->record(expr_line(cond_expr), cond != 0);
+        }
+    }
+
+    void exec_scope(const NodeScope *scope) {
+        const size_t var_count = m_vars.size();
+        for (const NodeStmt *stmt: scope->stmts) {
+            if (!exec_stmt(stmt)) {
+                break;
+            }
+        }
+        m_vars.resize(var_count);
+    }
+
+    bool exec_if_pred(const NodeIfPred *pred) {
+        if (const auto elif = std::get_if<NodeIfPredElif *>(&pred->var)) {
+            const auto cond = eval_expr((*elif)->expr);
+            if (!cond.has_value()) {
+                return false;
+            }
+            record_branch((*elif)->expr, cond.value());
+            if (cond.value() != 0) {
+                exec_scope((*elif)->scope);
+            } else if ((*elif)->pred.has_value()) {
+                return exec_if_pred((*elif)->pred.value());
+            }
+            return true;
+        }
+        exec_scope(std::get<NodeIfPredElse *>(pred->var)->scope);
+        return true;
+    }
+
+    // Returns false once evaluation has to stop, either at an exit or because
+    // it gave up.
+    bool exec_stmt(const NodeStmt *stmt) {
+        if (!step()) {
+            return false;
+        }
+        struct StmtVisitor {
+            PartialEvaluator &eval;
+
+            void operator()(const NodeStmtExit *stmt_exit) const {
+                if (const auto value = eval.eval_expr(stmt_exit->expr)) {
+                    eval.m_exit_code = value.value();
+                }
+            }
+
+            void operator()(const NodeStmtLet *stmt_let) const {
+                const std::string &name = stmt_let->ident.value.value();
+                if (std::ranges::any_of(eval.m_vars, [&](const Var &var) { return var.name == name; })) {
+                    eval.m_outcome = EvalOutcome::invalid;
+                    return;
+                }
+                const auto value = eval.eval_expr(stmt_let->expr);
+                if (!value.has_value()) {
+                    return;
+                }
+                if ((eval.m_vars.size() + 1) * sizeof(int64_t) > eval.m_options.max_memory) {
+                    eval.m_outcome = EvalOutcome::out_of_memory;
+                    return;
+                }
+                eval.m_vars.push_back({.name = name, .value = value.value()});
+                eval.m_peak_memory = std::max(eval.m_peak_memory, eval.m_vars.size() * sizeof(int64_t));
+            }
+
+            void operator()(const NodeScope *scope) const {
+                eval.exec_scope(scope);
+            }
+
+            void operator()(const NodeStmtIf *stmt_if) const {
+                const auto cond = eval.eval_expr(stmt_if->expr);
+                if (!cond.has_value()) {
+                    return;
+                }
+                eval.record_branch(stmt_if->expr, cond.value());
+                if (cond.value() != 0) {
+                    eval.exec_scope(stmt_if->scope);
+                } else if (stmt_if->pred.has_value()) {
+                    eval.exec_if_pred(stmt_if->pred.value());
+                }
+            }
+
+            void operator()(const NodeStmtAssign *stmt_assign) const {
+                const auto value = eval.eval_expr(stmt_assign->expr);
+                if (!value.has_value()) {
+                    return;
+                }
+                if (Var *var = eval.find_var(stmt_assign->ident.value.value())) {
+                    var->value = value.value();
+                }
+            }
+
+            void operator()(const NodeStmtWhile *stmt_while) const {
+                while (true) {
+                    const auto cond = eval.eval_expr(stmt_while->expr);
+                    if (!cond.has_value() || cond.value() == 0) {
+                        return;
+                    }
+                    eval.m_iterations++;
+                    eval.exec_scope(stmt_while->scope);
+                }
+            }
+
+            void operator()(const NodeVarReassign *var_reassign) const {
+                Var *var = eval.find_var(reassign_target(var_reassign).value.value());
+                if (var == nullptr) {
+                    return;
+                }
+                if (const auto unary = std::get_if<NodeUnary *>(&var_reassign->var)) {
+                    const int64_t delta = std::holds_alternative<NodeUnaryAdd *>((*unary)->var) ? 1 : -1;
+                    var->value = wrap_add(var->value, delta);
+                    return;
+                }
+                std::visit([&]<typename T>(const T *compound) {
+                    const auto amount = eval.eval_term(compound->term);
+                    if (!amount.has_value()) {
+                        return;
+                    }
+                    // The term may not move the variable, but re-find it to be safe.
+                    Var *target = eval.find_var(compound->term_ident->ident.value.value());
+                    if constexpr (std::is_same_v<T, NodeCompoundPlus>) {
+                        target->value = wrap_add(target->value, amount.value());
+                    } else if constexpr (std::is_same_v<T, NodeCompoundSub>) {
+                        target->value = wrap_sub(target->value, amount.value());
+                    } else if constexpr (std::is_same_v<T, NodeCompoundMult>) {
+                        target->value = wrap_mul(target->value, amount.value());
+                    } else {
+                        const auto value = std::is_same_v<T, NodeCompoundDiv> ? checked_div(target->value, amount.value())
+                                                                              : checked_mod(target->value, amount.value());
+                        if (!value.has_value()) {
+                            eval.m_outcome = EvalOutcome::runtime_error;
+                            return;
+                        }
+                        target->value = value.value();
+                    }
+                }, std::get<NodeCompound *>(var_reassign->var)->var);
+            }
+        };
+        std::visit(StmtVisitor{.eval = *this}, stmt->var);
+        return m_outcome == EvalOutcome::completed && !m_exit_code.has_value();
+    }
+
+    ArenaAllocator &m_allocator;
+    EvalOptions m_options;
+    EvalOutcome m_outcome = EvalOutcome::completed;
+    std::optional<int64_t> m_exit_code;
+    std::vector<Var> m_vars;
+    uint64_t m_steps = 0;
+    uint64_t m_iterations = 0;
+    size_t m_peak_memory = 0;
+    size_t m_prefix_stmts = 0;
+    size_t m_nodes_before = 0;
+    size_t m_nodes_after = 0;
+    bool m_residualized = false;
+    BranchProfile *m_profile = nullptr;
+};
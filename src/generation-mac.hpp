@@ -1,263 +1,140 @@
 #pragma once
 #include <algorithm>
+#include <array>
 
+#include "./codegen_options.hpp"
+#include "./div_magic.hpp"
+#include "./isel.hpp"
+#include "./machine.hpp"
+#include "./mul_const.hpp"
 #include "./parser.hpp"
+#include "./peephole.hpp"
 #include "cassert"
 
 class Generator {
 public:
-    inline explicit Generator(NodeProgram prog)
-        : m_prog(std::move(prog)) {
+    // Register allocation is only implemented for x86-64; this backend always uses the stack.
+    inline explicit Generator(NodeProgram prog, const CodegenOptions &options = {})
+        : m_prog(std::move(prog))
+        , m_tuning(find_tuning(s_aarch64_tunings, options.tune)) {
+        if (m_tuning == nullptr) {
+            std::cerr << "Unknown --mtune=" << options.tune << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        if (options.if_convert) {
+            m_if_converter.emplace(options.profile);
+        }
+        if (options.peephole) {
+            m_peephole.emplace(s_aarch64_peephole);
+        }
     }
 
-    void gen_term(const NodeTerm *term) {
+    void gen_term(const NodeTerm *term, const size_t reg) {
         struct TermVisitor {
             Generator &gen;
+            size_t reg;
 
             void operator()(const NodeTermIntLit *term_int_lit) const {
-                gen.m_output << "    mov x0, #" << term_int_lit->int_lit.value.value() << "\n";
-                gen.push_expr("x0");
+                gen.emit_mov_imm(expr_reg(reg), parse_int_lit(term_int_lit->int_lit));
             }
 
             void operator()(const NodeTermIdent *term_ident) const {
-                const auto it = std::ranges::find_if(
-                    gen.m_vars.cbegin(),
-                    gen.m_vars.cend(),
-                    [&](const Var &var) { return var.name == term_ident->ident.value.value(); });
-                if (it == gen.m_vars.cend()) {
-                    std::cerr << "Undeclared Identifier: " << term_ident->ident.value.value() << std::endl;
-                    exit(EXIT_FAILURE);
-                }
-                size_t offset = it->stack_loc * 8;
-
-                gen.m_output << "    ;; Loading variable " << term_ident->ident.value.value()
-                        << " (stack_loc=" << it->stack_loc
-                        << ") from offset " << offset << "\n";
-                gen.m_output << "    ldr x0, [sp, #" << offset << "]\n";
-                gen.push_expr("x0");
+                const size_t offset = gen.ident_offset(term_ident->ident);
+                gen.m_code.comment("Loading variable " + term_ident->ident.value.value() + " from offset " +
+                                   std::to_string(offset));
+                gen.m_code.emit(MOp::ldr, {expr_reg(reg), stack_slot(offset)});
             }
 
             void operator()(const NodeTermParen *term_paren) const {
-                gen.gen_expr(term_paren->expr);
+                gen.gen_expr(term_paren->expr, reg);
             }
         };
-        TermVisitor visitor({.gen = *this});
+        TermVisitor visitor({.gen = *this, .reg = reg});
         std::visit(visitor, term->var);
     }
 
-    void gen_bin_expr(const NodeBinExpr *bin_expr) {
+    void gen_bin_expr(const NodeBinExpr *bin_expr, const size_t reg) {
         struct BinExprVisitor {
             Generator &gen;
+            size_t reg;
 
             void operator()(const NodeBinExprSub *sub) const {
-                gen.gen_expr(sub->rhs);
-                gen.gen_expr(sub->lhs);
-                gen.pop_expr("x1"); // rhs
-                gen.pop_expr("x0"); // lhs
-                gen.m_output << "    sub x0, x1, x0\n";
-                gen.push_expr("x0");
+                gen.gen_binary(IrOp::sub, sub->lhs, sub->rhs, reg);
             }
 
             void operator()(const NodeBinExprAdd *add) const {
-                gen.gen_expr(add->rhs);
-                gen.gen_expr(add->lhs);
-                gen.pop_expr("x1"); // rhs
-                gen.pop_expr("x0"); // lhs
-                gen.m_output << "    add x0, x0, x1\n";
-                gen.push_expr("x0");
+                gen.gen_binary(IrOp::add, add->lhs, add->rhs, reg);
             }
 
             void operator()(const NodeBinExprMult *mult) const {
-                gen.gen_expr(mult->rhs);
-                gen.gen_expr(mult->lhs);
-                gen.pop_expr("x1"); // rhs
-                gen.pop_expr("x0"); // lhs
-                gen.m_output << "    mul x0, x0, x1\n";
-                gen.push_expr("x0");
+                gen.gen_binary(IrOp::mul, mult->lhs, mult->rhs, reg);
             }
 
             void operator()(const NodeBinExprDiv *div) const {
-                gen.gen_expr(div->rhs);
-                gen.gen_expr(div->lhs);
-                gen.pop_expr("x1"); // rhs
-                gen.pop_expr("x0"); // lhs
-                gen.m_output << "    sdiv x0, x1, x0\n";
-                gen.push_expr("x0");
+                gen.gen_binary(IrOp::div, div->lhs, div->rhs, reg);
+            }
+
+            void operator()(const NodeBinExprMod *mod) const {
+                gen.gen_binary(IrOp::mod, mod->lhs, mod->rhs, reg);
             }
         };
 
-        BinExprVisitor visitor{.gen = *this};
+        BinExprVisitor visitor{.gen = *this, .reg = reg};
         std::visit(visitor, bin_expr->var);
     }
 
-    void gen_cond_expr(const NodeCondExpr *cond_expr) {
+    void gen_cond_expr(const NodeCondExpr *cond_expr, const size_t reg) {
         struct CondExprVisitor {
             Generator &gen;
+            size_t reg;
 
             void operator()(const NodeCondExprGreater *greater) const {
-                gen.gen_expr(greater->lhs);
-                gen.gen_expr(greater->rhs);
-                gen.pop_expr("x1"); // rhs
-                gen.pop_expr("x0"); // lhs
-
-                const std::string true_label = "greater_" + gen.create_label();
-                const std::string end_label = "end_" + gen.create_label();
-
-                gen.m_output << "    cmp x0, x1\n";
-                gen.m_output << "    b.gt " << true_label << "\n";
-
-                // Not greater
-                gen.m_output << "    mov x0, #0\n";
-                gen.m_output << "    b " << end_label << "\n";
-
-                gen.m_output << true_label << ":\n";
-                // Greater
-                gen.m_output << "    mov x0, #1\n";
-
-                gen.m_output << end_label << ":\n";
-                gen.push_expr("x0");
+                gen.gen_binary(IrOp::cmp, greater->lhs, greater->rhs, reg, IrCond::greater);
             }
 
             void operator()(const NodeCondExprGreaterEq *greater_eq) const {
-                gen.gen_expr(greater_eq->lhs);
-                gen.gen_expr(greater_eq->rhs);
-                gen.pop_expr("x1"); // rhs
-                gen.pop_expr("x0"); // lhs
-
-                const std::string true_label = "greater_eq_" + gen.create_label();
-                const std::string end_label = "end_" + gen.create_label();
-
-                gen.m_output << "    cmp x0, x1\n";
-                gen.m_output << "    b.ge " << true_label << "\n";
-
-                // Not greater equal
-                gen.m_output << "    mov x0, #0\n";
-                gen.m_output << "    b " << end_label << "\n";
-
-                gen.m_output << true_label << ":\n";
-                // Greater equal
-                gen.m_output << "    mov x0, #1\n";
-
-                gen.m_output << end_label << ":\n";
-                gen.push_expr("x0");
+                gen.gen_binary(IrOp::cmp, greater_eq->lhs, greater_eq->rhs, reg, IrCond::greater_eq);
             }
 
             void operator()(const NodeCondExprLess *less) const {
-                gen.gen_expr(less->lhs);
-                gen.gen_expr(less->rhs);
-                gen.pop_expr("x1"); // rhs
-                gen.pop_expr("x0"); // lhs
-
-                const std::string true_label = "less_" + gen.create_label();
-                const std::string end_label = "end_" + gen.create_label();
-
-                gen.m_output << "    cmp x0, x1\n";
-                gen.m_output << "    b.lt " << true_label << "\n";
-
-                // Not less
-                gen.m_output << "    mov x0, #0\n";
-                gen.m_output << "    b " << end_label << "\n";
-
-                gen.m_output << true_label << ":\n";
-                // Less
-                gen.m_output << "    mov x0, #1\n";
-
-                gen.m_output << end_label << ":\n";
-                gen.push_expr("x0");
+                gen.gen_binary(IrOp::cmp, less->lhs, less->rhs, reg, IrCond::less);
             }
 
             void operator()(const NodeCondExprLessEq *less_eq) const {
-                gen.gen_expr(less_eq->lhs);
-                gen.gen_expr(less_eq->rhs);
-                gen.pop_expr("x1"); // rhs
-                gen.pop_expr("x0"); // lhs
-
-                const std::string true_label = "less_eq_" + gen.create_label();
-                const std::string end_label = "end_" + gen.create_label();
-
-                gen.m_output << "    cmp x0, x1\n";
-                gen.m_output << "    b.le " << true_label << "\n";
-
-                // Not less equal
-                gen.m_output << "    mov x0, #0\n";
-                gen.m_output << "    b " << end_label << "\n";
-
-                gen.m_output << true_label << ":\n";
-                // Less equal
-                gen.m_output << "    mov x0, #1\n";
-
-                gen.m_output << end_label << ":\n";
-                gen.push_expr("x0");
+                gen.gen_binary(IrOp::cmp, less_eq->lhs, less_eq->rhs, reg, IrCond::less_eq);
             }
 
             void operator()(const NodeCondExprEq *eq) const {
-                gen.gen_expr(eq->lhs);
-                gen.gen_expr(eq->rhs);
-                gen.pop_expr("x1"); // rhs
-                gen.pop_expr("x0"); // lhs
-
-                const std::string true_label = "eq_" + gen.create_label();
-                const std::string end_label = "end_" + gen.create_label();
-
-                gen.m_output << "    cmp x0, x1\n";
-                gen.m_output << "    b.eq " << true_label << "\n";
-
-                // Not equal
-                gen.m_output << "    mov x0, #0\n";
-                gen.m_output << "    b " << end_label << "\n";
-
-                gen.m_output << true_label << ":\n";
-                // Equal
-                gen.m_output << "    mov x0, #1\n";
-
-                gen.m_output << end_label << ":\n";
-                gen.push_expr("x0");
+                gen.gen_binary(IrOp::cmp, eq->lhs, eq->rhs, reg, IrCond::eq);
             }
 
             void operator()(const NodeCondExprNotEq *not_eq_) const {
-                gen.gen_expr(not_eq_->lhs);
-                gen.gen_expr(not_eq_->rhs);
-                gen.pop_expr("x1"); // rhs
-                gen.pop_expr("x0"); // lhs
-                const std::string true_label = "not_eq_" + gen.create_label();
-                const std::string end_label = "end_" + gen.create_label();
-
-                gen.m_output << "    cmp x0, x1\n";
-                gen.m_output << "    b.ne " << true_label << "\n";
-
-                // Equal
-                gen.m_output << "    mov x0, #0\n";
-                gen.m_output << "    b " << end_label << "\n";
-
-                gen.m_output << true_label << ":\n";
-                // Not equal
-                gen.m_output << "    mov x0, #1\n";
-
-                gen.m_output << end_label << ":\n";
-                gen.push_expr("x0");
+                gen.gen_binary(IrOp::cmp, not_eq_->lhs, not_eq_->rhs, reg, IrCond::not_eq_);
             }
         };
-        CondExprVisitor visitor{.gen = *this};
+        CondExprVisitor visitor{.gen = *this, .reg = reg};
         std::visit(visitor, cond_expr->var);
     }
 
-    void gen_expr(const NodeExpr *expr) {
+    // Evaluates `expr` into s_expr_regs[reg], using only that register and the ones after it.
+    void gen_expr(const NodeExpr *expr, const size_t reg) {
         struct ExprVisitor {
             Generator &gen;
+            size_t reg;
 
             void operator()(const NodeTerm *term) const {
-                gen.gen_term(term);
+                gen.gen_term(term, reg);
             }
 
             void operator()(const NodeBinExpr *bin_expr) const {
-                gen.gen_bin_expr(bin_expr);
+                gen.gen_bin_expr(bin_expr, reg);
             }
 
             void operator()(const NodeCondExpr *cond_expr) const {
-                gen.gen_cond_expr(cond_expr);
+                gen.gen_cond_expr(cond_expr, reg);
             }
         };
-        ExprVisitor visitor{.gen = *this};
+        ExprVisitor visitor{.gen = *this, .reg = reg};
         std::visit(visitor, expr->var);
     }
 
@@ -269,27 +146,25 @@ public:
         end_scope();
     }
 
-    void gen_if_pred(const NodeIfPred *pred, const std::string &end_label) {
+    void gen_if_pred(const NodeIfPred *pred, const int64_t end_label) {
         struct PredVisitor {
             Generator &gen;
-            const std::string &end_label;
+            int64_t end_label;
 
             void operator()(const NodeIfPredElif *elif) const {
-                gen.m_output << "    ;; elif\n";
-                gen.gen_expr(elif->expr);
-                gen.pop_expr("x0");
-                const std::string label = gen.create_label();
-                gen.m_output << "    cbz x0, " << label << "\n";
+                gen.m_code.comment("elif");
+                const int64_t label = gen.create_label();
+                gen.gen_branch_false(elif->expr, label);
                 gen.gen_scope(elif->scope);
-                gen.m_output << "    b " << end_label << "\n";
+                gen.m_code.emit(MOp::b, {mlabel(end_label)});
+                gen.m_code.label(label);
                 if (elif->pred.has_value()) {
-                    gen.m_output << label << ":\n";
                     gen.gen_if_pred(elif->pred.value(), end_label);
                 }
             }
 
             void operator()(const NodeIfPredElse *else_) const {
-                gen.m_output << "    ;; else\n";
+                gen.m_code.comment("else");
                 gen.gen_scope(else_->scope);
             }
         };
@@ -311,14 +186,8 @@ public:
                             std::endl;
                     exit(EXIT_FAILURE);
                 }
-                gen.m_output << "    ;; compound-plus:  \n";
-
-                gen.gen_term(stmt_compound_plus->term);
-                gen.pop_expr("x1");
-                gen.m_output << "    ldr x0, [sp, #" << it->stack_loc * 8 << "]\n";
-                gen.m_output << "    add x0, x0, x1\n";
-
-                gen.m_output << "    str x0, [sp, #" << it->stack_loc * 8 << "]\n";
+                gen.m_code.comment("compound-plus:");
+                gen.gen_update(IrOp::add, it->stack_loc * 8, stmt_compound_plus->term);
             }
 
             void operator()(const NodeCompoundSub *stmt_compound_sub) const {
@@ -330,14 +199,8 @@ public:
                             std::endl;
                     exit(EXIT_FAILURE);
                 }
-                gen.m_output << "    ;; compound-sub:  \n";
-                gen.gen_term(stmt_compound_sub->term);
-                gen.pop_expr("x1");
-                gen.m_output << "    ldr x0, [sp, #" << it->stack_loc * 8 << "]\n";
-
-                gen.m_output << "    mul x0, x0, x1\n";
-
-                gen.m_output << "    str x0, [sp, #" << it->stack_loc * 8 << "]\n";
+                gen.m_code.comment("compound-sub:");
+                gen.gen_update(IrOp::sub, it->stack_loc * 8, stmt_compound_sub->term);
             }
 
             void operator()(const NodeCompoundDiv *stmt_compound_div) const {
@@ -349,13 +212,21 @@ public:
                             std::endl;
                     exit(EXIT_FAILURE);
                 }
-                gen.m_output << "    ;; compound-div:  \n";
-                gen.gen_term(stmt_compound_div->term);
-                gen.pop_expr("x1");
-                gen.m_output << "    ldr x0, [sp, #" << it->stack_loc * 8 << "]\n";
-                gen.m_output << "    sdiv x0, x0, x1\n";
+                gen.m_code.comment("compound-div:");
+                gen.gen_update(IrOp::div, it->stack_loc * 8, stmt_compound_div->term);
+            }
 
-                gen.m_output << "    str x0, [sp, #" << it->stack_loc * 8 << "]\n";
+            void operator()(const NodeCompoundMod *stmt_compound_mod) const {
+                const auto it = std::ranges::find_if(gen.m_vars, [&](const Var &var) {
+                    return var.name == stmt_compound_mod->term_ident->ident.value.value();
+                });
+                if (it == gen.m_vars.end()) {
+                    std::cerr << "Undeclared identifier" << stmt_compound_mod->term_ident->ident.value.value() <<
+                            std::endl;
+                    exit(EXIT_FAILURE);
+                }
+                gen.m_code.comment("compound-mod:");
+                gen.gen_update(IrOp::mod, it->stack_loc * 8, stmt_compound_mod->term);
             }
 
             void operator()(const NodeCompoundMult *stmt_compound_mult) const {
@@ -367,13 +238,8 @@ public:
                             std::endl;
                     exit(EXIT_FAILURE);
                 }
-                gen.m_output << "    ;; compound-mult:  \n";
-                gen.gen_term(stmt_compound_mult->term);
-                gen.pop_expr("x1");
-                gen.m_output << "    ldr x0, [sp, #" << it->stack_loc * 8 << "]\n";
-                gen.m_output << "    mul x0, x0, x1\n";
-
-                gen.m_output << "    str x0, [sp, #" << it->stack_loc * 8 << "]\n";
+                gen.m_code.comment("compound-mult:");
+                gen.gen_update(IrOp::mul, it->stack_loc * 8, stmt_compound_mult->term);
             }
         };
         CompoundVisitor visitor{.gen = *this};
@@ -393,13 +259,13 @@ public:
                             std::endl;
                     exit(EXIT_FAILURE);
                 }
-                gen.m_output << "    ;; incrementing variable '" << stmt_unary_add->term_ident->ident.value.value()
-                        << "' at offset " << it->stack_loc * 8 << "\n";
-                gen.m_output << "    ldr x0, [sp, #" << it->stack_loc * 8 << "]\n";
+                gen.m_code.comment("incrementing variable '" + stmt_unary_add->term_ident->ident.value.value() +
+                                   "' at offset " + std::to_string(it->stack_loc * 8));
+                gen.m_code.emit(MOp::ldr, {s_x0, stack_slot(it->stack_loc * 8)});
 
-                gen.m_output << "    add x0, x0, #1\n";
+                gen.m_code.emit(MOp::add, {s_x0, s_x0, mimm(1)});
 
-                gen.m_output << "    str x0, [sp, #" << it->stack_loc * 8 << "]\n";
+                gen.m_code.emit(MOp::str, {s_x0, stack_slot(it->stack_loc * 8)});
             }
 
             void operator()(const NodeUnarySub *stmt_unary_sub) const {
@@ -411,13 +277,13 @@ public:
                             std::endl;
                     exit(EXIT_FAILURE);
                 }
-                gen.m_output << "    ;; decrementing variable '" << stmt_unary_sub->term_ident->ident.value.value()
-                        << "' at offset " << it->stack_loc * 8 << "\n";
-                gen.m_output << "    ldr x0, [sp, #" << it->stack_loc * 8 << "]\n";
+                gen.m_code.comment("decrementing variable '" + stmt_unary_sub->term_ident->ident.value.value() +
+                                   "' at offset " + std::to_string(it->stack_loc * 8));
+                gen.m_code.emit(MOp::ldr, {s_x0, stack_slot(it->stack_loc * 8)});
 
-                gen.m_output << "    sub x0, x0, #1\n";
+                gen.m_code.emit(MOp::sub, {s_x0, s_x0, mimm(1)});
 
-                gen.m_output << "    str x0, [sp, #" << it->stack_loc * 8 << "]\n";
+                gen.m_code.emit(MOp::str, {s_x0, stack_slot(it->stack_loc * 8)});
             }
         };
         UnaryVisitor visitor{.gen = *this};
@@ -445,16 +311,16 @@ public:
             Generator &gen;
 
             void operator()(const NodeStmtExit *stmt_exit) const {
-                gen.m_output << "    ;; Evaluating exit expression\n";
-                gen.gen_expr(stmt_exit->expr);
-                gen.m_output << "    ;; Exit value on stack\n";
+                gen.m_code.comment("Evaluating exit expression");
+                gen.gen_expr(stmt_exit->expr, 0);
+                gen.m_code.comment("Exit value in x1");
 
-                gen.m_output << "    ;; exit\n";
-                gen.m_output << "    mov x16, #1\n";
-                gen.pop_expr("x0");
-                gen.m_output << "    ;; Exit with value in x0\n";
-                gen.m_output << "    svc #0\n";
-                gen.m_output << "    ;; /exit\n";
+                gen.m_code.comment("exit");
+                gen.m_code.emit(MOp::mov, {s_x16, mimm(1)});
+                gen.m_code.emit(MOp::mov, {s_x0, s_x1});
+                gen.m_code.comment("Exit with value in x0");
+                gen.m_code.emit(MOp::svc, {mimm(0)});
+                gen.m_code.comment("/exit");
             }
 
             void operator()(const NodeStmtLet *stmt_let) const {
@@ -471,15 +337,14 @@ public:
                 size_t var_loc = gen.m_var_count;
                 gen.m_vars.push_back({.name = stmt_let->ident.value.value(), .stack_loc = var_loc});
                 gen.m_var_count++;
-                gen.m_output << "    ;; variable '" << stmt_let->ident.value.value()
-                        << "' allocated at offset " << var_loc * 8 << "\n";
+                gen.m_code.comment("variable '" + stmt_let->ident.value.value() + "' allocated at offset " +
+                                   std::to_string(var_loc * 8));
 
                 // Evaluate the expression
-                gen.gen_expr(stmt_let->expr);
+                gen.gen_expr(stmt_let->expr, 0);
 
                 // Store the result to the variable location
-                gen.pop_expr("x0");
-                gen.m_output << "    str x0, [sp, #" << var_loc * 8 << "]\n";
+                gen.m_code.emit(MOp::str, {s_x1, stack_slot(var_loc * 8)});
             }
 
             void operator()(const NodeStmtAssign *stmt_assign) const {
@@ -491,11 +356,10 @@ public:
                     exit(EXIT_FAILURE);
                 }
 
-                gen.m_output << "    ;; reassigning variable '" << stmt_assign->ident.value.value()
-                        << "' at offset " << it->stack_loc * 8 << "\n";
-                gen.gen_expr(stmt_assign->expr);
-                gen.pop_expr("x0");
-                gen.m_output << "    str x0, [sp, #" << it->stack_loc * 8 << "]\n";
+                gen.m_code.comment("reassigning variable '" + stmt_assign->ident.value.value() + "' at offset " +
+                                   std::to_string(it->stack_loc * 8));
+                gen.gen_expr(stmt_assign->expr, 0);
+                gen.m_code.emit(MOp::str, {s_x1, stack_slot(it->stack_loc * 8)});
             }
 
             void operator()(const NodeScope *scope) const {
@@ -503,39 +367,40 @@ public:
             }
 
             void operator()(const NodeStmtIf *stmt_if) const {
-                gen.m_output << "    ;; if\n";
-                gen.gen_expr(stmt_if->expr);
-                gen.pop_expr("x0");
-                const std::string label = gen.create_label();
-                gen.m_output << "    cbz x0, " << label << "\n";
+                if (gen.m_if_converter.has_value()) {
+                    if (const auto select = gen.m_if_converter->convert(stmt_if)) {
+                        gen.gen_select(select.value());
+                        return;
+                    }
+                }
+                gen.m_code.comment("if");
+                const int64_t label = gen.create_label();
+                gen.gen_branch_false(stmt_if->expr, label);
                 gen.gen_scope(stmt_if->scope);
                 if (stmt_if->pred.has_value()) {
-                    const std::string end_label = gen.create_label();
-                    gen.m_output << "    b " << end_label << "\n";
-                    gen.m_output << label << ":\n";
+                    const int64_t end_label = gen.create_label();
+                    gen.m_code.emit(MOp::b, {mlabel(end_label)});
+                    gen.m_code.label(label);
                     gen.gen_if_pred(stmt_if->pred.value(), end_label);
-                    gen.m_output << end_label << ":\n";
+                    gen.m_code.label(end_label);
                 } else {
-                    gen.m_output << label << ":\n";
+                    gen.m_code.label(label);
                 }
-                gen.m_output << "    ;; /if\n";
+                gen.m_code.comment("/if");
             }
 
             void operator()(const NodeStmtWhile *stmt_while) const {
-                gen.m_output << "    ;; while\n";
-                const std::string loop_start = "loop_start_" + gen.create_label();
-                const std::string loop_end = "loop_end_" + gen.create_label();
-                gen.m_output << loop_start << ":\n";
-                gen.gen_expr(stmt_while->expr);
-                gen.pop_expr("x0");
-
-                gen.m_output << "    cbz x0, " << loop_end << "\n";
+                gen.m_code.comment("while");
+                const int64_t loop_start = gen.create_label();
+                const int64_t loop_end = gen.create_label();
+                gen.m_code.label(loop_start);
+                gen.gen_branch_false(stmt_while->expr, loop_end);
 
                 gen.gen_scope(stmt_while->scope);
-                gen.m_output << "    b " << loop_start << "\n";
+                gen.m_code.emit(MOp::b, {mlabel(loop_start)});
 
-                gen.m_output << loop_end << ":\n";
-                gen.m_output << "    ;;/while\n";
+                gen.m_code.label(loop_end);
+                gen.m_code.comment("/while");
             }
 
             void operator()(const NodeVarReassign *var_reassign) const {
@@ -547,31 +412,423 @@ public:
         std::visit(visitor, stmt->var);
     }
 
-    [[nodiscard]] std::string gen_prog() {
-        m_output << ".global _main\n_main:\n";
 
+    [[nodiscard]] MachineCode gen_prog() {
         for (const NodeStmt *stmt: m_prog.stmts) {
             gen_stmt(stmt);
         }
 
 
-        m_output << "    mov x16, #1\n";
-        m_output << "    mov x0, #0\n";
-        m_output << "    svc #0";
-        return m_output.str();
+        m_code.emit(MOp::mov, {s_x16, mimm(1)});
+        m_code.emit(MOp::mov, {s_x0, mimm(0)});
+        m_code.emit(MOp::svc, {mimm(0)});
+        return finish();
+    }
+
+    static const MachineTarget &target() {
+        return s_aarch64_machine;
+    }
+
+    // The rules that fired, when the peephole pass ran.
+    [[nodiscard]] const Peephole *peephole() const {
+        return m_peephole.has_value() ? &m_peephole.value() : nullptr;
     }
 
 private:
-    void push_expr(const std::string &reg) {
+    [[nodiscard]] MachineCode finish() {
+        if (m_peephole.has_value()) {
+            m_peephole->run(m_code);
+        }
+        return std::move(m_code);
+    }
+    // The register stack expressions are evaluated into. x0 and x16 are left
+    // out for the exit syscall, x17 for leaf operands that can't be used in place.
+    static constexpr std::array<A64Reg, 15> s_expr_regs = {
+        A64Reg::x1, A64Reg::x2,  A64Reg::x3,  A64Reg::x4,  A64Reg::x5,  A64Reg::x6,  A64Reg::x7, A64Reg::x8,
+        A64Reg::x9, A64Reg::x10, A64Reg::x11, A64Reg::x12, A64Reg::x13, A64Reg::x14, A64Reg::x15};
+    static constexpr MOperand s_x0 = mreg(A64Reg::x0);
+    static constexpr MOperand s_x1 = mreg(A64Reg::x1);
+    static constexpr MOperand s_x2 = mreg(A64Reg::x2);
+    static constexpr MOperand s_x16 = mreg(A64Reg::x16);
+    static constexpr MOperand s_x17 = mreg(A64Reg::x17);
+    static constexpr MOperand s_sp = mreg(A64Reg::sp);
+
+    // The second operand of add, sub and cmp: a register or immediate and
+    // the shift applied to it, if any.
+    struct FlexOperand {
+        MOperand value;
+        MOperand shift{};
+
+        [[nodiscard]] bool negative_imm() const {
+            return value.kind == MOperandKind::imm && value.value < 0;
+        }
+
+        [[nodiscard]] FlexOperand negated() const {
+            return {.value = mimm(-value.value), .shift = shift};
+        }
+    };
+
+    static MOperand expr_reg(const size_t reg) {
+        return mreg(s_expr_regs[reg]);
+    }
+
+    static MOperand stack_slot(const size_t offset) {
+        return mmem(s_sp, static_cast<int64_t>(offset));
+    }
+
+    size_t ident_offset(const Token &ident) const {
+        const auto it = std::ranges::find_if(m_vars, [&](const Var &var) {
+            return var.name == ident.value.value();
+        });
+        if (it == m_vars.cend()) {
+            std::cerr << "Undeclared Identifier: " << ident.value.value() << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        return it->stack_loc * 8;
+    }
+
+    // A literal that fits the instruction's immediate field is used in place,
+    // anything else is loaded into x17.
+    FlexOperand leaf_operand(const NodeTerm *leaf, const IrOp op) {
+        if (const auto term_int_lit = std::get_if<NodeTermIntLit *>(&leaf->var)) {
+            const int64_t value = parse_int_lit((*term_int_lit)->int_lit);
+            if (s_aarch64_isel.fits_imm(op, value)) {
+                return imm_operand(value);
+            }
+        }
+        return {.value = leaf_register(leaf)};
+    }
+
+    MOperand leaf_register(const NodeTerm *leaf) {
+        if (const auto term_int_lit = std::get_if<NodeTermIntLit *>(&leaf->var)) {
+            emit_mov_imm(s_x17, parse_int_lit((*term_int_lit)->int_lit));
+            return s_x17;
+        }
+        m_code.emit(MOp::ldr, {s_x17, stack_slot(ident_offset(std::get<NodeTermIdent *>(leaf->var)->ident))});
+        return s_x17;
+    }
+
+    // An add, sub or cmp immediate, shifted when it is a multiple of 4096.
+    static FlexOperand imm_operand(const int64_t value) {
+        if (value % 4096 == 0 && value != 0) {
+            return {.value = mimm(value / 4096), .shift = mshift(MShift::lsl, 12)};
+        }
+        return {.value = mimm(value)};
+    }
+
+    // The rule for `lhs op rhs`, with the operands swapped and `cond` mirrored
+    // when the rule takes them the other way around.
+    const IselRule &select_rule(const IrOp op, const NodeExpr *&lhs, const NodeExpr *&rhs, IrCond &cond) {
+        const IselMatch match = m_isel.select(op, lhs, rhs).value();
+        if (match.swapped) {
+            std::swap(lhs, rhs);
+            cond = mirror(cond);
+        }
+        return *match.rule;
+    }
+
+    // Evaluates the operands in the forms `rule` wants: an immediate, a
+    // shifted register, or a register. Returns the lhs register and the rhs
+    // operand.
+    std::pair<MOperand, FlexOperand> gen_operands(const IselRule &rule, const NodeExpr *lhs, const NodeExpr *rhs,
+                                                  const size_t reg) {
+        if (rule.rhs == IselOperand::scaled) {
+            const auto [index, shift] = m_isel.scaled_operand(rhs).value();
+            const auto [lhs_operand, index_operand] = gen_registers(lhs, index, reg);
+            return {lhs_operand, {.value = index_operand, .shift = mshift(MShift::lsl, shift)}};
+        }
+        if (rule.rhs == IselOperand::imm) {
+            gen_expr(lhs, reg);
+            return {expr_reg(reg), leaf_operand(as_leaf(rhs), rule.op)};
+        }
+        const auto [lhs_operand, rhs_operand] = gen_registers(lhs, rhs, reg);
+        return {lhs_operand, {.value = rhs_operand}};
+    }
+
+    // Both operands in registers. Sethi-Ullman ordering: the operand that
+    // needs more registers is evaluated first so the other one can use what
+    // is left. Only when neither fits in the remaining registers does one go
+    // through memory.
+    std::pair<MOperand, MOperand> gen_registers(const NodeExpr *lhs, const NodeExpr *rhs, const size_t reg) {
+        const MOperand dst = expr_reg(reg);
+        if (const NodeTerm *leaf = as_leaf(rhs)) {
+            gen_expr(lhs, reg);
+            return {dst, leaf_register(leaf)};
+        }
+        const size_t free = s_expr_regs.size() - reg;
+        const size_t lhs_need = m_need(lhs);
+        const size_t rhs_need = m_need(rhs);
+        if (lhs_need >= rhs_need && rhs_need < free) {
+            gen_expr(lhs, reg);
+            gen_expr(rhs, reg + 1);
+            return {dst, expr_reg(reg + 1)};
+        }
+        if (rhs_need > lhs_need && lhs_need < free) {
+            gen_expr(rhs, reg);
+            gen_expr(lhs, reg + 1);
+            return {expr_reg(reg + 1), dst};
+        }
+        gen_expr(rhs, reg);
+        push_expr(dst);
+        gen_expr(lhs, reg);
+        pop_expr(s_x17);
+        return {dst, s_x17};
+    }
+
+    void gen_binary(const IrOp op, const NodeExpr *lhs, const NodeExpr *rhs, const size_t reg,
+                    IrCond cond = IrCond::eq) {
+        const bool divides = op == IrOp::div || op == IrOp::mod;
+        if (const auto divisor = divides ? const_divisor(as_leaf(rhs)) : std::nullopt) {
+            gen_expr(lhs, reg);
+            emit_div_const(op, expr_reg(reg), expr_reg(reg), divisor.value());
+            return;
+        }
+        if (op == IrOp::mul) {
+            if (!as_int_lit(rhs).has_value() && as_int_lit(lhs).has_value()) {
+                std::swap(lhs, rhs);
+            }
+            if (const auto factor = as_int_lit(rhs)) {
+                gen_expr(lhs, reg);
+                emit_mul_const(expr_reg(reg), expr_reg(reg), factor.value());
+                return;
+            }
+        }
+        const IselRule &rule = select_rule(op, lhs, rhs, cond);
+        const auto [lhs_operand, rhs_operand] = gen_operands(rule, lhs, rhs, reg);
+        emit_op(op, cond, expr_reg(reg), lhs_operand, rhs_operand);
+    }
+
+    // Branches to `label` when `expr` is false. A comparison branches on its
+    // flags directly instead of materializing 0 or 1 for cbz.
+    void gen_branch_false(const NodeExpr *expr, const int64_t label) {
+        if (const NodeCondExpr *cond_expr = as_cond(expr)) {
+            auto [lhs, rhs, cond] = cond_operands(cond_expr);
+            const IselRule &rule = select_rule(IrOp::cmp, lhs, rhs, cond);
+            const auto [lhs_operand, rhs_operand] = gen_operands(rule, lhs, rhs, 0);
+            emit_cmp(lhs_operand, rhs_operand);
+            m_code.emit_cond(MOp::bcc, invert(cond), {mlabel(label)});
+            return;
+        }
+        gen_expr(expr, 0);
+        m_code.emit(MOp::cbz, {s_x1, mlabel(label)});
+    }
+
+    // The if as conditional selects into x1, last arm first so the first true
+    // condition wins.
+    void gen_select(const IfSelect &select) {
+        m_code.comment("select");
+        if (select.otherwise != nullptr) {
+            gen_expr(select.otherwise, 0);
+        } else {
+            m_code.emit(MOp::ldr, {s_x1, stack_slot(ident_offset(*select.ident))});
+        }
+        for (auto arm = select.arms.rbegin(); arm != select.arms.rend(); ++arm) {
+            gen_expr(arm->value, 1);
+            auto [lhs, rhs, cond] = cond_operands(arm->cond);
+            const IselRule &rule = select_rule(IrOp::cmp, lhs, rhs, cond);
+            const auto [lhs_operand, rhs_operand] = gen_operands(rule, lhs, rhs, 2);
+            emit_cmp(lhs_operand, rhs_operand);
+            m_code.emit(MOp::csel, {s_x1, s_x2, s_x1, mcond(cond)});
+        }
+        m_code.emit(MOp::str, {s_x1, stack_slot(ident_offset(*select.ident))});
+        m_code.comment("/select");
+    }
+
+    // Any 64-bit constant: a single mov when movz or movn can build it, else
+    // whichever of the two leaves fewer 16-bit chunks for movk to fill in.
+    void emit_mov_imm(const MOperand &reg, const int64_t value) {
+        if (aarch64_mov_imm_count(value) == 1) {
+            m_code.emit(MOp::mov, {reg, mimm(value)});
+            return;
+        }
+        const auto bits = static_cast<uint64_t>(value);
+        int ones_chunks = 0;
+        for (int shift = 0; shift < 64; shift += 16) {
+            ones_chunks += ((bits >> shift) & 0xffff) == 0xffff;
+        }
+        const uint64_t fill = ones_chunks >= 2 ? 0xffff : 0;
+        bool first = true;
+        for (int shift = 0; shift < 64; shift += 16) {
+            const uint64_t chunk = (bits >> shift) & 0xffff;
+            if (chunk == fill) {
+                continue;
+            }
+            const MOp op = !first ? MOp::movk : fill == 0 ? MOp::movz : MOp::movn;
+            const uint64_t field = op == MOp::movn ? ~chunk & 0xffff : chunk;
+            m_code.emit(op, {reg, mimm(static_cast<int64_t>(field)), mshift(MShift::lsl, shift)});
+            first = false;
+        }
+    }
+
+    // `dst = src / divisor` or `src % divisor` through x16 and x17, with
+    // shifts for a power of two and smulh by the magic number otherwise.
+    void emit_div_const(const IrOp op, const MOperand &dst, const MOperand &src, const int64_t divisor) {
+        if (divisor == 1) {
+            if (op == IrOp::div && dst != src) {
+                m_code.emit(MOp::mov, {dst, src});
+            } else if (op == IrOp::mod) {
+                m_code.emit(MOp::mov, {dst, mimm(0)});
+            }
+            return;
+        }
+        if (const auto shift = pow2_shift(divisor)) {
+            const int k = shift.value();
+            // Adding 2^k - 1 to a negative dividend makes the shift round toward zero.
+            m_code.emit(MOp::asr, {s_x16, src, mimm(63)});
+            m_code.emit(MOp::add, {s_x16, src, s_x16, mshift(MShift::lsr, 64 - k)});
+            if (op == IrOp::div) {
+                m_code.emit(MOp::asr, {dst, s_x16, mimm(k)});
+                if (divisor < 0) {
+                    m_code.emit(MOp::neg, {dst, dst});
+                }
+                return;
+            }
+            m_code.emit(MOp::and_, {s_x16, s_x16, mimm(static_cast<int64_t>(~((uint64_t{1} << k) - 1)))});
+            m_code.emit(MOp::sub, {dst, src, s_x16});
+            return;
+        }
+        const auto [multiplier, shift] = div_magic(divisor);
+        emit_mov_imm(s_x16, multiplier);
+        m_code.emit(MOp::smulh, {s_x16, src, s_x16});
+        if (divisor > 0 && multiplier < 0) {
+            m_code.emit(MOp::add, {s_x16, s_x16, src});
+        } else if (divisor < 0 && multiplier > 0) {
+            m_code.emit(MOp::sub, {s_x16, s_x16, src});
+        }
+        if (shift > 0) {
+            m_code.emit(MOp::asr, {s_x16, s_x16, mimm(shift)});
+        }
+        if (op == IrOp::div) {
+            m_code.emit(MOp::add, {dst, s_x16, s_x16, mshift(MShift::lsr, 63)});
+            return;
+        }
+        m_code.emit(MOp::add, {s_x16, s_x16, s_x16, mshift(MShift::lsr, 63)});
+        emit_mov_imm(s_x17, divisor);
+        m_code.emit(MOp::msub, {dst, s_x16, s_x17, src});
+    }
+
+    // `dst = src * factor` as the lsl and shifted-register add and sub
+    // sequence that beats mul on the tuned-for core, if there is one. x16
+    // holds the product when `src` is still needed, x17 the factor for mul.
+    void emit_mul_const(const MOperand &dst, const MOperand &src, const int64_t factor) {
+        if (factor == 0) {
+            m_code.emit(MOp::mov, {dst, mimm(0)});
+            return;
+        }
+        const auto steps = MulSynth(*m_tuning).synthesize(factor);
+        if (!steps.has_value()) {
+            emit_mov_imm(s_x17, factor);
+            m_code.emit(MOp::mul, {dst, src, s_x17});
+            return;
+        }
+        const MOperand t = dst == src && MulSynth::uses_x(steps.value()) ? s_x16 : dst;
+        MOperand cur = src;
+        for (const auto [op, k]: steps.value()) {
+            const MOperand shift = mshift(MShift::lsl, k);
+            switch (op) {
+                case MulOp::shl:
+                    m_code.emit(MOp::lsl, {t, cur, mimm(k)});
+                    break;
+                case MulOp::add_self:
+                    m_code.emit(MOp::add, {t, cur, cur, shift});
+                    break;
+                case MulOp::sub_self:
+                    m_code.emit(MOp::sub, {t, cur, cur, shift});
+                    break;
+                case MulOp::add_x:
+                    m_code.emit(MOp::add, {t, src, cur, shift});
+                    break;
+                case MulOp::sub_x:
+                    m_code.emit(MOp::sub, {t, cur, src});
+                    break;
+                case MulOp::rsub_x:
+                    m_code.emit(MOp::sub, {t, src, cur, shift});
+                    break;
+                case MulOp::neg:
+                    m_code.emit(MOp::neg, {t, cur});
+                    break;
+            }
+            cur = t;
+        }
+        if (cur != dst) {
+            m_code.emit(MOp::mov, {dst, cur});
+        }
+    }
+
+    void emit_op(const IrOp op, const IrCond cond, const MOperand &dst, const MOperand &lhs, const FlexOperand &rhs) {
+        switch (op) {
+            case IrOp::add:
+            case IrOp::sub: {
+                // A negative immediate flips add and sub.
+                const bool negative_imm = rhs.negative_imm();
+                const FlexOperand operand = negative_imm ? rhs.negated() : rhs;
+                m_code.emit((op == IrOp::add) != negative_imm ? MOp::add : MOp::sub,
+                            {dst, lhs, operand.value, operand.shift});
+                break;
+            }
+            case IrOp::mul:
+                m_code.emit(MOp::mul, {dst, lhs, rhs.value});
+                break;
+            case IrOp::div:
+                m_code.emit(MOp::sdiv, {dst, lhs, rhs.value});
+                break;
+            case IrOp::mod:
+                m_code.emit(MOp::sdiv, {s_x16, lhs, rhs.value});
+                m_code.emit(MOp::msub, {dst, s_x16, rhs.value, lhs});
+                break;
+            default:
+                emit_cmp(lhs, rhs);
+                m_code.emit(MOp::cset, {dst, mcond(cond)});
+                break;
+        }
+    }
+
+    // cmp, or cmn for a negative immediate.
+    void emit_cmp(const MOperand &lhs, const FlexOperand &rhs) {
+        if (rhs.negative_imm()) {
+            const FlexOperand operand = rhs.negated();
+            m_code.emit(MOp::cmn, {lhs, operand.value, operand.shift});
+            return;
+        }
+        m_code.emit(MOp::cmp, {lhs, rhs.value, rhs.shift});
+    }
+
+    // `ident op= term` for the variable at `offset`.
+    void gen_update(const IrOp op, const size_t offset, const NodeTerm *term) {
+        const bool divides = op == IrOp::div || op == IrOp::mod;
+        if (const auto divisor = divides ? const_divisor(as_leaf(term)) : std::nullopt) {
+            m_code.emit(MOp::ldr, {s_x0, stack_slot(offset)});
+            emit_div_const(op, s_x0, s_x0, divisor.value());
+            m_code.emit(MOp::str, {s_x0, stack_slot(offset)});
+            return;
+        }
+        if (const auto factor = op == IrOp::mul ? as_int_lit(term) : std::nullopt) {
+            m_code.emit(MOp::ldr, {s_x0, stack_slot(offset)});
+            emit_mul_const(s_x0, s_x0, factor.value());
+            m_code.emit(MOp::str, {s_x0, stack_slot(offset)});
+            return;
+        }
+        FlexOperand operand{.value = expr_reg(0)};
+        if (const NodeTerm *leaf = as_leaf(term)) {
+            operand = leaf_operand(leaf, op);
+        } else {
+            gen_term(term, 0);
+        }
+        m_code.emit(MOp::ldr, {s_x0, stack_slot(offset)});
+        emit_op(op, IrCond::eq, s_x0, s_x0, operand);
+        m_code.emit(MOp::str, {s_x0, stack_slot(offset)});
+    }
+
+    void push_expr(const MOperand &reg) {
         size_t offset = m_var_count * 8 + m_expr_stack_size * 8;
-        m_output << "    str " << reg << ", [sp, #" << offset << "]\n";
+        m_code.emit(MOp::str, {reg, stack_slot(offset)});
         m_expr_stack_size++;
     }
 
-    void pop_expr(const std::string &reg) {
+    void pop_expr(const MOperand &reg) {
         m_expr_stack_size--;
         size_t offset = m_var_count * 8 + m_expr_stack_size * 8;
-        m_output << "    ldr " << reg << ", [sp, #" << offset << "]\n";
+        m_code.emit(MOp::ldr, {reg, stack_slot(offset)});
     }
 
     void begin_scope() {
@@ -589,10 +846,8 @@ private:
         m_scopes.pop_back();
     }
 
-    std::string create_label() {
-        std::stringstream ss;
-        ss << "label" << m_label_count++;
-        return ss.str();
+    int64_t create_label() {
+        return m_label_count++;
     }
 
     struct Var {
@@ -601,10 +856,15 @@ private:
     };
 
     const NodeProgram m_prog;
-    std::stringstream m_output;
+    const MulTuning *m_tuning;
+    InstructionSelector m_isel{s_aarch64_isel};
+    std::optional<IfConverter> m_if_converter;
+    std::optional<Peephole> m_peephole;
+    RegisterNeed m_need;
+    MachineCode m_code;
     size_t m_var_count = 0;
     size_t m_expr_stack_size = 0;
     std::vector<Var> m_vars{};
     std::vector<size_t> m_scopes{};
-    int m_label_count = 0;
+    int64_t m_label_count = 0;
 };
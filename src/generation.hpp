@@ -1,221 +1,153 @@
 #pragma once
 #include <algorithm>
+#include <array>
 #include <iostream>
-#include <sstream>
+#include "./codegen_options.hpp"
+#include "./div_magic.hpp"
+#include "./isel.hpp"
+#include "./machine.hpp"
+#include "./mul_const.hpp"
 #include "./parser.hpp"
+#include "./pass_timings.hpp"
+#include "./peephole.hpp"
+#include "./sched.hpp"
+#include "./stack_coloring.hpp"
 #include "cassert"
 
 class Generator {
 public:
-    inline explicit Generator(NodeProgram prog)
-        : m_prog(std::move(prog)) {
+    inline explicit Generator(NodeProgram prog, const CodegenOptions &options = {})
+        : m_prog(std::move(prog))
+        , m_regalloc(options.regalloc)
+        , m_alloc_reg_count(std::min(options.alloc_regs, s_alloc_regs.size()))
+        , m_tuning(find_tuning(s_x86_tunings, options.tune))
+        , m_rotate_loops(options.rotate_loops)
+        , m_loop_align(options.loop_align) {
+        if (options.sched_model != "none") {
+            m_sched_model = find_sched_model(options.sched_model);
+            if (m_sched_model == nullptr) {
+                std::cerr << "Unknown --sched-model=" << options.sched_model << std::endl;
+                exit(EXIT_FAILURE);
+            }
+        }
+        if (options.stack_coloring) {
+            m_slot_coloring.emplace(m_prog);
+        }
+        if (m_tuning == nullptr) {
+            std::cerr << "Unknown --mtune=" << options.tune << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        if (options.if_convert) {
+            m_if_converter.emplace(options.profile);
+        }
+        if (options.peephole) {
+            m_peephole.emplace(s_x86_peephole);
+        }
     }
 
-    void gen_term(const NodeTerm *term) {
+    void gen_term(const NodeTerm *term, const size_t reg) {
         struct TermVisitor {
             Generator &gen;
+            size_t reg;
 
             void operator()(const NodeTermIntLit *term_int_lit) const {
-                gen.m_output << "    mov rax, " << term_int_lit->int_lit.value.value() << "\n";
-                gen.push("rax");
+                gen.emit_mov_imm(expr_reg(reg), parse_int_lit(term_int_lit->int_lit));
             }
 
             void operator()(const NodeTermIdent *term_ident) const {
-                const auto it = std::ranges::find_if(
-                    gen.m_vars.cbegin(),
-                    gen.m_vars.cend(),
-                    [&](const Var &var) { return var.name == term_ident->ident.value.value(); });
-                if (it == gen.m_vars.cend()) {
-                    std::cerr << "Undeclared Identifier: " << term_ident->ident.value.value() << std::endl;
-                    exit(EXIT_FAILURE);
-                }
-                std::stringstream offset;
-                offset << "QWORD [rsp + " << (gen.m_stack_size - it->stack_loc - 1) * 8 << "]";
-                gen.push(offset.str());
+                gen.m_code.emit(MOp::mov, {expr_reg(reg), gen.ident_operand(term_ident->ident)});
             }
 
             void operator()(const NodeTermParen *term_paren) const {
-                gen.gen_expr(term_paren->expr);
+                gen.gen_expr(term_paren->expr, reg);
             }
         };
-        TermVisitor visitor({.gen = *this});
+        TermVisitor visitor({.gen = *this, .reg = reg});
         std::visit(visitor, term->var);
     }
 
-    void gen_bin_expr(const NodeBinExpr *bin_expr) {
+    void gen_bin_expr(const NodeBinExpr *bin_expr, const size_t reg) {
         struct BinExprVisitor {
             Generator &gen;
+            size_t reg;
 
             void operator()(const NodeBinExprSub *sub) const {
-                gen.gen_expr(sub->rhs);
-                gen.gen_expr(sub->lhs);
-                gen.pop("rax");
-                gen.pop("rbx");
-                gen.m_output << "    sub rax, rbx\n";
-                gen.push("rax");
+                gen.gen_binary(IrOp::sub, sub->lhs, sub->rhs, reg);
             }
 
             void operator()(const NodeBinExprAdd *add) const {
-                gen.gen_expr(add->rhs);
-                gen.gen_expr(add->lhs);
-                gen.pop("rax");
-                gen.pop("rbx");
-                gen.m_output << "    add rax, rbx\n";
-                gen.push("rax");
+                gen.gen_binary(IrOp::add, add->lhs, add->rhs, reg);
             }
 
             void operator()(const NodeBinExprMult *mult) const {
-                gen.gen_expr(mult->rhs);
-                gen.gen_expr(mult->lhs);
-                gen.pop("rax");
-                gen.pop("rbx");
-                gen.m_output << "    mul rbx\n";
-                gen.push("rax");
+                gen.gen_binary(IrOp::mul, mult->lhs, mult->rhs, reg);
             }
 
             void operator()(const NodeBinExprDiv *div) const {
-                gen.gen_expr(div->rhs);
-                gen.gen_expr(div->lhs);
-                gen.pop("rax");
-                gen.pop("rbx");
-                gen.m_output << "    div rbx\n";
-                gen.push("rax");
+                gen.gen_binary(IrOp::div, div->lhs, div->rhs, reg);
+            }
+
+            void operator()(const NodeBinExprMod *mod) const {
+                gen.gen_binary(IrOp::mod, mod->lhs, mod->rhs, reg);
             }
         };
 
-        BinExprVisitor visitor{.gen = *this};
+        BinExprVisitor visitor{.gen = *this, .reg = reg};
         std::visit(visitor, bin_expr->var);
     }
 
-    void gen_cond_expr(const NodeCondExpr *cond_expr) {
+    void gen_cond_expr(const NodeCondExpr *cond_expr, const size_t reg) {
         struct CondExprVisitor {
             Generator &gen;
+            size_t reg;
 
             void operator()(const NodeCondExprGreater *greater) const {
-                gen.gen_expr(greater->lhs);
-                gen.gen_expr(greater->rhs);
-                gen.pop("rax");
-                gen.pop("rbx");
-                const std::string true_label = "greater_" + gen.create_label();
-                const std::string end_label = "end_" + gen.create_label();
-
-                gen.m_output << "    cmp rbx, rax\n";
-                gen.m_output << "    jg " << true_label <<"\n";
-                gen.push("0");
-                gen.m_output << "    jmp " << end_label << "\n";
-                gen.m_output << true_label << ":\n";
-
-                gen.push("1");
-                gen.m_output << end_label << ":\n";
+                gen.gen_binary(IrOp::cmp, greater->lhs, greater->rhs, reg, IrCond::greater);
             }
+
             void operator()(const NodeCondExprGreaterEq *greater_eq) const {
-                gen.m_output << "    ;;comparing\n";
-                gen.gen_expr(greater_eq->lhs);
-                gen.gen_expr(greater_eq->rhs);
-                gen.pop("rax");
-                gen.pop("rbx");
-                const std::string true_label = "greater_eq_" + gen.create_label();
-                const std::string end_label = "end_" + gen.create_label();
-
-                gen.m_output << "    cmp rbx, rax\n";
-                gen.m_output << "    jge " << true_label <<"\n";
-                gen.push("0");
-                gen.m_output << "    jmp " << end_label << "\n";
-                gen.m_output << true_label << ":\n";
-
-                gen.push("1");
-                gen.m_output << end_label << ":\n";
-                gen.pop("rcx");
+                gen.gen_binary(IrOp::cmp, greater_eq->lhs, greater_eq->rhs, reg, IrCond::greater_eq);
             }
+
             void operator()(const NodeCondExprLess *less) const {
-                gen.gen_expr(less->lhs);
-                gen.gen_expr(less->rhs);
-                gen.pop("rax");
-                gen.pop("rbx");
-                const std::string true_label = "less_" + gen.create_label();
-                const std::string end_label = "end_" + gen.create_label();
-
-                gen.m_output << "    cmp rbx, rax\n";
-                gen.m_output << "    jl " << true_label <<"\n";
-                gen.push("0");
-                gen.m_output << "    jmp " << end_label << "\n";
-                gen.m_output << true_label << ":\n";
-
-                gen.push("1");
-                gen.m_output << end_label << ":\n";
+                gen.gen_binary(IrOp::cmp, less->lhs, less->rhs, reg, IrCond::less);
             }
+
             void operator()(const NodeCondExprLessEq *less_eq) const {
-                gen.gen_expr(less_eq->lhs);
-                gen.gen_expr(less_eq->rhs);
-                gen.pop("rax");
-                gen.pop("rbx");
-                const std::string true_label = "less_eq_" + gen.create_label();
-                const std::string end_label = "end_" + gen.create_label();
-
-                gen.m_output << "    cmp rbx, rax\n";
-                gen.m_output << "    jle " << true_label <<"\n";
-                gen.push("0");
-                gen.m_output << "    jmp " << end_label << "\n";
-                gen.m_output << true_label << ":\n";
-
-                gen.push("1");
-                gen.m_output << end_label << ":\n";
+                gen.gen_binary(IrOp::cmp, less_eq->lhs, less_eq->rhs, reg, IrCond::less_eq);
             }
+
             void operator()(const NodeCondExprEq *eq) const {
-                gen.gen_expr(eq->lhs);
-                gen.gen_expr(eq->rhs);
-                gen.pop("rax");
-                gen.pop("rbx");
-                const std::string true_label = "eq_" + gen.create_label();
-                const std::string end_label = "end_" + gen.create_label();
-
-                gen.m_output << "    cmp rbx, rax\n";
-                gen.m_output << "    je " << true_label <<"\n";
-                gen.push("0");
-                gen.m_output << "    jmp " << end_label << "\n";
-                gen.m_output << true_label << ":\n";
-
-                gen.push("1");
-                gen.m_output << end_label << ":\n";
-            }
-            void operator()(const NodeCondExprNotEq* _not_eq) const {
-                gen.gen_expr(_not_eq->lhs);
-                gen.gen_expr(_not_eq->rhs);
-                gen.pop("rax");
-                gen.pop("rbx");
-                const std::string true_label = "not_eq_" + gen.create_label();
-                const std::string end_label = "end_" + gen.create_label();
-
-                gen.m_output << "    cmp rbx, rax\n";
-                gen.m_output << "    jne " << true_label <<"\n";
-                gen.push("0");
-                gen.m_output << "    jmp " << end_label << "\n";
-                gen.m_output << true_label << ":\n";
-
-                gen.push("1");
-                gen.m_output << end_label << ":\n";
+                gen.gen_binary(IrOp::cmp, eq->lhs, eq->rhs, reg, IrCond::eq);
             }
 
+            void operator()(const NodeCondExprNotEq *not_eq_) const {
+                gen.gen_binary(IrOp::cmp, not_eq_->lhs, not_eq_->rhs, reg, IrCond::not_eq_);
+            }
         };
-        CondExprVisitor visitor{.gen = *this};
+        CondExprVisitor visitor{.gen = *this, .reg = reg};
         std::visit(visitor, cond_expr->var);
     }
-    void gen_expr(const NodeExpr *expr) {
+
+    // Evaluates `expr` into s_expr_regs[reg], using only that register and the ones after it.
+    void gen_expr(const NodeExpr *expr, const size_t reg) {
         struct ExprVisitor {
             Generator &gen;
+            size_t reg;
 
             void operator()(const NodeTerm *term) const {
-                gen.gen_term(term);
+                gen.gen_term(term, reg);
             }
 
             void operator()(const NodeBinExpr *bin_expr) const {
-                gen.gen_bin_expr(bin_expr);
+                gen.gen_bin_expr(bin_expr, reg);
             }
-            void operator()(const NodeCondExpr* cond_expr) const {
-                gen.gen_cond_expr(cond_expr);
+
+            void operator()(const NodeCondExpr *cond_expr) const {
+                gen.gen_cond_expr(cond_expr, reg);
             }
         };
-        ExprVisitor visitor{.gen = *this};
+        ExprVisitor visitor{.gen = *this, .reg = reg};
         std::visit(visitor, expr->var);
     }
 
@@ -226,31 +158,28 @@ public:
         }
         end_scope();
     }
-    void gen_if_pred(const NodeIfPred* pred, const std::string& end_label)
+    void gen_if_pred(const NodeIfPred* pred, const int64_t end_label)
     {
         struct PredVisitor {
             Generator& gen;
-            const std::string& end_label;
+            int64_t end_label;
 
             void operator()(const NodeIfPredElif* elif) const
             {
-                gen.m_output << "    ;; elif\n";
-                gen.gen_expr(elif->expr);
-                gen.pop("rax");
-                const std::string label = gen.create_label();
-                gen.m_output << "    test rax, rax\n";
-                gen.m_output << "    jz " << label << "\n";
+                gen.m_code.comment("elif");
+                const int64_t label = gen.create_label();
+                gen.gen_branch(elif->expr, false, label);
                 gen.gen_scope(elif->scope);
-                gen.m_output << "    jmp " << end_label << "\n";
+                gen.m_code.emit(MOp::jmp, {mlabel(end_label)});
+                gen.m_code.label(label);
                 if (elif->pred.has_value()) {
-                    gen.m_output << label << ":\n";
                     gen.gen_if_pred(elif->pred.value(), end_label);
                 }
             }
 
             void operator()(const NodeIfPredElse* else_) const
             {
-                gen.m_output << "    ;; else\n";
+                gen.m_code.comment("else");
                 gen.gen_scope(else_->scope);
             }
         };
@@ -259,17 +188,95 @@ public:
         std::visit(visitor, pred->var);
     }
 
+    size_t var_offset(const NodeTermIdent *term_ident) const {
+        const auto it = std::ranges::find_if(m_vars, [&](const Var &var) {
+            return var.name == term_ident->ident.value.value();
+        });
+        if (it == m_vars.end()) {
+            std::cerr << "Undeclared identifier" << term_ident->ident.value.value() << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        return it->slot * 8;
+    }
+
+    void gen_compound(const NodeCompound *stmt) {
+        struct CompoundVisitor {
+            Generator &gen;
+
+            void operator()(const NodeCompoundPlus *stmt_compound_plus) const {
+                gen.m_code.comment("compound-plus");
+                gen.gen_update(IrOp::add, stmt_compound_plus->term_ident, stmt_compound_plus->term);
+            }
+
+            void operator()(const NodeCompoundSub *stmt_compound_sub) const {
+                gen.m_code.comment("compound-sub");
+                gen.gen_update(IrOp::sub, stmt_compound_sub->term_ident, stmt_compound_sub->term);
+            }
+
+            void operator()(const NodeCompoundMult *stmt_compound_mult) const {
+                gen.m_code.comment("compound-mult");
+                gen.gen_update(IrOp::mul, stmt_compound_mult->term_ident, stmt_compound_mult->term);
+            }
+
+            void operator()(const NodeCompoundDiv *stmt_compound_div) const {
+                gen.m_code.comment("compound-div");
+                gen.gen_update(IrOp::div, stmt_compound_div->term_ident, stmt_compound_div->term);
+            }
+
+            void operator()(const NodeCompoundMod *stmt_compound_mod) const {
+                gen.m_code.comment("compound-mod");
+                gen.gen_update(IrOp::mod, stmt_compound_mod->term_ident, stmt_compound_mod->term);
+            }
+        };
+        CompoundVisitor visitor{.gen = *this};
+        std::visit(visitor, stmt->var);
+    }
+
+    void gen_unary(const NodeUnary *stmt) {
+        struct UnaryVisitor {
+            Generator &gen;
+
+            void operator()(const NodeUnaryAdd *stmt_unary_add) const {
+                gen.m_code.comment("increment");
+                gen.emit_update(IrOp::add, gen.ident_operand(stmt_unary_add->term_ident->ident), mimm(1));
+            }
+
+            void operator()(const NodeUnarySub *stmt_unary_sub) const {
+                gen.m_code.comment("decrement");
+                gen.emit_update(IrOp::sub, gen.ident_operand(stmt_unary_sub->term_ident->ident), mimm(1));
+            }
+        };
+        UnaryVisitor visitor{.gen = *this};
+        std::visit(visitor, stmt->var);
+    }
+
+    void gen_var_reassign(const NodeVarReassign *var_reassign) {
+        struct VarReassignVisitor {
+            Generator &gen;
+
+            void operator()(const NodeCompound *stmt) const {
+                gen.gen_compound(stmt);
+            }
+
+            void operator()(const NodeUnary *stmt) const {
+                gen.gen_unary(stmt);
+            }
+        };
+        VarReassignVisitor visitor{.gen = *this};
+        std::visit(visitor, var_reassign->var);
+    }
+
     void gen_stmt(const NodeStmt *stmt) {
         struct StmtVisitor {
             Generator &gen;
 
             void operator()(const NodeStmtExit *stmt_exit) const {
-                gen.gen_expr(stmt_exit->expr);
-                gen.m_output << "    ;; exit\n";
-                gen.m_output << "    mov rax, 60\n";
-                gen.pop("rdi");
-                gen.m_output << "    syscall\n";
-                gen.m_output << "    ;; /exit\n";
+                gen.gen_expr(stmt_exit->expr, 0);
+                gen.m_code.comment("exit");
+                gen.m_code.emit(MOp::mov, {s_rax, mimm(60)});
+                gen.m_code.emit(MOp::mov, {s_rdi, s_rbx});
+                gen.m_code.emit(MOp::syscall);
+                gen.m_code.comment("/exit");
             }
 
             void operator()(const NodeStmtLet *stmt_let) const {
@@ -281,24 +288,15 @@ public:
                     std::cerr << "Identifier already used: " << stmt_let->ident.value.value() << std::endl;
                     exit(EXIT_FAILURE);
                 }
-
-
-                gen.m_vars.push_back({.name = stmt_let->ident.value.value(), .stack_loc = gen.m_stack_size});
-                gen.gen_expr(stmt_let->expr);
+                const size_t slot =
+                    gen.m_slot_coloring.has_value() ? gen.m_slot_coloring->slot(stmt_let) : gen.m_vars.size();
+                gen.m_vars.push_back({.name = stmt_let->ident.value.value(), .slot = slot});
+                gen.reserve_slots(slot + 1);
+                gen.gen_assign(stmt_let->ident, stmt_let->expr);
             }
             void operator()(const NodeStmtAssign* stmt_assign) const {
-                const auto it = std::ranges::find_if(gen.m_vars, [&](const Var& var) {
-                    return var.name == stmt_assign->ident.value.value();
-                });
-                if (it == gen.m_vars.end()) {
-                    std::cerr << "Undeclared identifier" << stmt_assign->ident.value.value() << std::endl;
-                    exit(EXIT_FAILURE);
-                }
-                gen.m_output << "    ;;reassigning\n";
-                gen.gen_expr(stmt_assign->expr);
-                gen.pop("rax");
-                const size_t offset = (gen.m_stack_size - it->stack_loc -1) * 8;
-                gen.m_output << "    mov [rsp + " << offset << "], rax\n";
+                gen.m_code.comment("reassigning");
+                gen.gen_assign(stmt_assign->ident, stmt_assign->expr);
             }
 
             void operator()(const NodeScope *scope) const {
@@ -307,32 +305,55 @@ public:
 
             void operator()(const NodeStmtIf* stmt_if) const
             {
-                gen.m_output << "    ;; if\n";
-                // size_t size = gen.m_stack_size;
-                gen.gen_expr(stmt_if->expr);
-                gen.pop("rax");
-                // gen.m_stack_size = size;
-                const std::string label = gen.create_label();
-                gen.m_output << "    test rax, rax\n";
-                gen.m_output << "    jz " << label << "\n";
+                if (gen.m_if_converter.has_value()) {
+                    if (const auto select = gen.m_if_converter->convert(stmt_if)) {
+                        gen.gen_select(select.value());
+                        return;
+                    }
+                }
+                gen.m_code.comment("if");
+                const int64_t label = gen.create_label();
+                gen.gen_branch(stmt_if->expr, false, label);
                 gen.gen_scope(stmt_if->scope);
                 if (stmt_if->pred.has_value()) {
-                    const std::string end_label = gen.create_label();
-                    gen.m_output << "    jmp " << end_label << "\n";
-                    gen.m_output << label << ":\n";
+                    const int64_t end_label = gen.create_label();
+                    gen.m_code.emit(MOp::jmp, {mlabel(end_label)});
+                    gen.m_code.label(label);
                     gen.gen_if_pred(stmt_if->pred.value(), end_label);
-                    gen.m_output << end_label << ":\n";
+                    gen.m_code.label(end_label);
                 }
                 else {
-                    gen.m_output << label << ":\n";
+                    gen.m_code.label(label);
                 }
-                gen.m_output << "    ;; /if\n";
+                gen.m_code.comment("/if");
             }
-            void operator()(const NodeStmtUnary* stmt_unary) const {
-
+            void operator()(const NodeStmtWhile* stmt_while) const {
+                gen.m_code.comment("while");
+                const int64_t loop_start = gen.create_label();
+                const int64_t loop_end = gen.create_label();
+                if (!gen.m_rotate_loops) {
+                    gen.emit_align();
+                    gen.m_code.label(loop_start);
+                    gen.gen_branch(stmt_while->expr, false, loop_end);
+                    gen.gen_scope(stmt_while->scope);
+                    gen.m_code.emit(MOp::jmp, {mlabel(loop_start)});
+                    gen.m_code.label(loop_end);
+                    gen.m_code.comment("/while");
+                    return;
+                }
+                // Rotated: a guard, then the body with the condition tested at
+                // its bottom, so each iteration takes one branch.
+                gen.gen_branch(stmt_while->expr, false, loop_end);
+                gen.emit_align();
+                gen.m_code.label(loop_start);
+                gen.gen_scope(stmt_while->scope);
+                gen.gen_branch(stmt_while->expr, true, loop_start);
+                gen.m_code.label(loop_end);
+                gen.m_code.comment("/while");
             }
-            void operator()(const NodeCompound* stmt_compound) const {
 
+            void operator()(const NodeVarReassign* var_reassign) const {
+                gen.gen_var_reassign(var_reassign);
             }
 
         };
@@ -341,28 +362,766 @@ public:
         std::visit(visitor, stmt->var);
     }
 
-    [[nodiscard]] std::string gen_prog() {
-        m_output << "global _start\n_start:\n";
-
-        for (const NodeStmt *stmt: m_prog.stmts) {
-            gen_stmt(stmt);
+    [[nodiscard]] MachineCode gen_prog() {
+        if (m_regalloc != RegAllocKind::stack) {
+            gen_prog_allocated();
+            return finish();
         }
+        m_pass_timings.time("codegen", [&] { return m_code.insts.size(); }, [&] {
+            for (const NodeStmt *stmt: m_prog.stmts) {
+                gen_stmt(stmt);
+            }
+            m_code.emit(MOp::mov, {s_rax, mimm(60)});
+            m_code.emit(MOp::mov, {s_rdi, mimm(0)});
+            m_code.emit(MOp::syscall);
+
+            // The frame is only known once every scope has been generated.
+            m_frame_stats = {.uncolored_bytes = frame_bytes(m_uncolored_slots), .bytes = frame_bytes(m_frame_slots)};
+            gen_frame(m_frame_slots);
+        });
+        return finish();
+    }
 
-        m_output << "    mov rax, 60\n";
-        m_output << "    mov rdi, 0\n";
-        m_output << "    syscall";
-        return m_output.str();
+    static const MachineTarget &target() {
+        return s_x86_machine;
+    }
+
+    struct FrameStats {
+        // The frame if every variable or spilled value kept a slot to itself.
+        size_t uncolored_bytes = 0;
+        size_t bytes = 0;
+    };
+
+    [[nodiscard]] const FrameStats &frame_stats() const {
+        return m_frame_stats;
+    }
+
+    // The rules that fired, when the peephole pass ran.
+    [[nodiscard]] const Peephole *peephole() const {
+        return m_peephole.has_value() ? &m_peephole.value() : nullptr;
+    }
+
+    // The codegen passes that ran, for --time-passes.
+    [[nodiscard]] const PassTimings &pass_timings() const {
+        return m_pass_timings;
     }
 
 private:
-    void push(const std::string &reg) {
-        m_output << "    push " << reg << "\n";
-        m_stack_size++;
+    [[nodiscard]] MachineCode finish() {
+        if (m_peephole.has_value()) {
+            m_pass_timings.time("peephole", [&] { return m_code.insts.size(); }, [&] { m_peephole->run(m_code); });
+        }
+        return std::move(m_code);
+    }
+    // rax and rdx are left out for div, r10 and r11 for operands that were spilled.
+    static constexpr std::array<X86Reg, 10> s_alloc_regs = {
+        X86Reg::rbx, X86Reg::rcx, X86Reg::rsi, X86Reg::rdi, X86Reg::r8,
+        X86Reg::r9,  X86Reg::r12, X86Reg::r13, X86Reg::r14, X86Reg::r15};
+    // The register stack expressions are evaluated into at -O0. rax and rdx
+    // are left out for div, r11 for leaf operands that can't be used in place.
+    static constexpr std::array<X86Reg, 12> s_expr_regs = {
+        X86Reg::rbx, X86Reg::rcx, X86Reg::rsi, X86Reg::rdi, X86Reg::rbp, X86Reg::r8,
+        X86Reg::r9,  X86Reg::r10, X86Reg::r12, X86Reg::r13, X86Reg::r14, X86Reg::r15};
+    static constexpr MOperand s_rax = mreg(X86Reg::rax);
+    static constexpr MOperand s_rbx = mreg(X86Reg::rbx);
+    static constexpr MOperand s_rcx = mreg(X86Reg::rcx);
+    static constexpr MOperand s_rdx = mreg(X86Reg::rdx);
+    static constexpr MOperand s_rdi = mreg(X86Reg::rdi);
+    static constexpr MOperand s_rsp = mreg(X86Reg::rsp);
+    static constexpr MOperand s_r10 = mreg(X86Reg::r10);
+    static constexpr MOperand s_r11 = mreg(X86Reg::r11);
+
+    static MOperand expr_reg(const size_t reg) {
+        return mreg(s_expr_regs[reg]);
+    }
+
+    // `mov reg, value`, through the 32-bit register when the value fits in
+    // one: writing it zeroes the upper half and needs no REX.W or imm64.
+    void emit_mov_imm(const MOperand &reg, const int64_t value) {
+        if (value >= 0 && value <= UINT32_MAX) {
+            m_code.emit(MOp::mov, {with_bits(reg, 32), mimm(value)});
+        } else {
+            m_code.emit(MOp::mov, {reg, mimm(value)});
+        }
+    }
+
+    // Materializes the flags of the last cmp as 0 or 1 in `reg` without a branch.
+    void emit_setcc(const IrCond cond, const MOperand &reg) {
+        m_code.emit_cond(MOp::setcc, cond, {with_bits(reg, 8)});
+        m_code.emit(MOp::movzx, {with_bits(reg, 32), with_bits(reg, 8)});
+    }
+
+    MOperand ident_operand(const Token &ident) const {
+        const auto it = std::ranges::find_if(m_vars, [&](const Var &var) {
+            return var.name == ident.value.value();
+        });
+        if (it == m_vars.cend()) {
+            std::cerr << "Undeclared Identifier: " << ident.value.value() << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        return mmem(s_rsp, static_cast<int64_t>(it->slot * 8));
+    }
+
+    // A variable or literal used in place, or loaded into r11 when it can't be.
+    MOperand leaf_operand(const NodeTerm *leaf, const bool allow_imm) {
+        if (const auto term_int_lit = std::get_if<NodeTermIntLit *>(&leaf->var)) {
+            const int64_t value = parse_int_lit((*term_int_lit)->int_lit);
+            if (allow_imm && value >= INT32_MIN && value <= INT32_MAX) {
+                return mimm(value);
+            }
+            emit_mov_imm(s_r11, value);
+            return s_r11;
+        }
+        return ident_operand(std::get<NodeTermIdent *>(leaf->var)->ident);
+    }
+
+    // The rule for `lhs op rhs`, with the operands swapped and `cond` mirrored
+    // when the rule takes them the other way around.
+    const IselRule &select_rule(const IrOp op, const NodeExpr *&lhs, const NodeExpr *&rhs, IrCond &cond) {
+        const IselMatch match = m_isel.select(op, lhs, rhs).value();
+        if (match.swapped) {
+            std::swap(lhs, rhs);
+            cond = mirror(cond);
+        }
+        return *match.rule;
+    }
+
+    // Evaluates the operands in the forms `rule` wants: a literal, a variable's
+    // slot, or a register. Returns the lhs and rhs operands.
+    std::pair<MOperand, MOperand> gen_operands(const IselRule &rule, const NodeExpr *lhs, const NodeExpr *rhs,
+                                               const size_t reg) {
+        const MOperand dst = expr_reg(reg);
+        if (rule.lhs == IselOperand::mem) {
+            const MOperand slot = leaf_operand(as_leaf(lhs), false);
+            if (rule.rhs == IselOperand::imm) {
+                return {slot, leaf_operand(as_leaf(rhs), true)};
+            }
+            gen_expr(rhs, reg);
+            return {slot, dst};
+        }
+        if (rule.rhs == IselOperand::imm || rule.rhs == IselOperand::mem) {
+            gen_expr(lhs, reg);
+            return {dst, leaf_operand(as_leaf(rhs), true)};
+        }
+        return gen_registers(lhs, rhs, reg);
+    }
+
+    // Both operands in registers. Sethi-Ullman ordering: the operand that
+    // needs more registers is evaluated first so the other one can use what
+    // is left. Only when neither fits in the remaining registers does one go
+    // through the stack.
+    std::pair<MOperand, MOperand> gen_registers(const NodeExpr *lhs, const NodeExpr *rhs, const size_t reg) {
+        const MOperand dst = expr_reg(reg);
+        if (const NodeTerm *leaf = as_leaf(rhs)) {
+            gen_expr(lhs, reg);
+            if (std::holds_alternative<NodeTermIdent *>(leaf->var)) {
+                m_code.emit(MOp::mov, {s_r11, leaf_operand(leaf, false)});
+                return {dst, s_r11};
+            }
+            return {dst, leaf_operand(leaf, false)};
+        }
+        const size_t free = s_expr_regs.size() - reg;
+        const size_t lhs_need = m_need(lhs);
+        const size_t rhs_need = m_need(rhs);
+        if (lhs_need >= rhs_need && rhs_need < free) {
+            gen_expr(lhs, reg);
+            gen_expr(rhs, reg + 1);
+            return {dst, expr_reg(reg + 1)};
+        }
+        if (rhs_need > lhs_need && lhs_need < free) {
+            gen_expr(rhs, reg);
+            gen_expr(lhs, reg + 1);
+            return {expr_reg(reg + 1), dst};
+        }
+        gen_expr(rhs, reg);
+        spill_temp(dst);
+        gen_expr(lhs, reg);
+        reload_temp(s_r11);
+        return {dst, s_r11};
+    }
+
+    void gen_binary(const IrOp op, const NodeExpr *lhs, const NodeExpr *rhs, const size_t reg,
+                    IrCond cond = IrCond::eq) {
+        const bool divides = op == IrOp::div || op == IrOp::mod;
+        if (const auto divisor = divides ? const_divisor(as_leaf(rhs)) : std::nullopt) {
+            gen_expr(lhs, reg);
+            emit_div_const(op, expr_reg(reg), expr_reg(reg), divisor.value());
+            return;
+        }
+        if (op == IrOp::mul) {
+            if (!as_int_lit(rhs).has_value() && as_int_lit(lhs).has_value()) {
+                std::swap(lhs, rhs);
+            }
+            if (const auto factor = as_int_lit(rhs)) {
+                gen_expr(lhs, reg);
+                emit_mul_const(expr_reg(reg), expr_reg(reg), factor.value());
+                return;
+            }
+        }
+        const IselRule &rule = select_rule(op, lhs, rhs, cond);
+        if (rule.rhs == IselOperand::scaled) {
+            const auto [index, shift] = m_isel.scaled_operand(rhs).value();
+            const auto [base_operand, index_operand] = gen_registers(lhs, index, reg);
+            m_code.emit(MOp::lea, {expr_reg(reg), mmem(base_operand, 0, index_operand, 1 << shift)});
+            return;
+        }
+        const auto [lhs_operand, rhs_operand] = gen_operands(rule, lhs, rhs, reg);
+        emit_op(op, cond, expr_reg(reg), lhs_operand, rhs_operand);
+    }
+
+    // Jumps to `label` when `expr` is `when`. A comparison branches on its
+    // flags directly instead of materializing 0 or 1 and testing it.
+    void gen_branch(const NodeExpr *expr, const bool when, const int64_t label) {
+        if (const NodeCondExpr *cond_expr = as_cond(expr)) {
+            auto [lhs, rhs, cond] = cond_operands(cond_expr);
+            const IselRule &rule = select_rule(IrOp::cmp, lhs, rhs, cond);
+            const auto [lhs_operand, rhs_operand] = gen_operands(rule, lhs, rhs, 0);
+            m_code.emit(MOp::cmp, {lhs_operand, rhs_operand});
+            m_code.emit_cond(MOp::jcc, when ? cond : invert(cond), {mlabel(label)});
+            return;
+        }
+        gen_expr(expr, 0);
+        m_code.emit(MOp::test, {s_rbx, s_rbx});
+        m_code.emit_cond(MOp::jcc, when ? IrCond::not_eq_ : IrCond::eq, {mlabel(label)});
+    }
+
+    // Pads to the loop alignment with multi-byte nops.
+    void emit_align() {
+        if (m_loop_align > 1) {
+            m_code.align(m_loop_align);
+        }
+    }
+
+    // 16-byte aligned, like rsp on entry.
+    static size_t frame_bytes(const size_t slots) {
+        return (slots * 8 + 15) / 16 * 16;
+    }
+
+    // Allocates the whole frame at once, in front of the code generated so far.
+    void gen_frame(const size_t slots) {
+        if (slots > 0) {
+            m_code.emit(MOp::sub, {s_rsp, mimm(static_cast<int64_t>(frame_bytes(slots)))});
+            std::rotate(m_code.insts.begin(), m_code.insts.end() - 1, m_code.insts.end());
+        }
+    }
+
+    // `ident = expr`, a literal stored straight to the slot.
+    void gen_assign(const Token &ident, const NodeExpr *expr) {
+        const MOperand slot = ident_operand(ident);
+        const auto value = as_int_lit(expr);
+        if (value.has_value() && value.value() >= INT32_MIN && value.value() <= INT32_MAX) {
+            m_code.emit(MOp::mov, {slot, mimm(value.value())});
+            return;
+        }
+        gen_expr(expr, 0);
+        m_code.emit(MOp::mov, {slot, s_rbx});
+    }
+
+    // The if as conditional moves into rbx, last arm first so the first true
+    // condition wins. A variable's value is moved straight from its slot.
+    void gen_select(const IfSelect &select) {
+        m_code.comment("select");
+        if (select.otherwise != nullptr) {
+            gen_expr(select.otherwise, 0);
+        } else {
+            m_code.emit(MOp::mov, {s_rbx, ident_operand(*select.ident)});
+        }
+        for (auto arm = select.arms.rbegin(); arm != select.arms.rend(); ++arm) {
+            const NodeTerm *leaf = as_leaf(arm->value);
+            const bool from_slot = leaf != nullptr && std::holds_alternative<NodeTermIdent *>(leaf->var);
+            if (!from_slot) {
+                gen_expr(arm->value, 1);
+            }
+            auto [lhs, rhs, cond] = cond_operands(arm->cond);
+            const IselRule &rule = select_rule(IrOp::cmp, lhs, rhs, cond);
+            const auto [lhs_operand, rhs_operand] = gen_operands(rule, lhs, rhs, 2);
+            m_code.emit(MOp::cmp, {lhs_operand, rhs_operand});
+            m_code.emit_cond(MOp::cmovcc, cond,
+                             {s_rbx, from_slot ? ident_operand(std::get<NodeTermIdent *>(leaf->var)->ident) : s_rcx});
+        }
+        m_code.emit(MOp::mov, {ident_operand(*select.ident), s_rbx});
+        m_code.comment("/select");
+    }
+
+    // `dst = src / divisor` or `src % divisor` through rax and rdx, with shifts
+    // for a power of two and a multiply-high by the magic number otherwise.
+    // `src` is read more than once, so it must not be rax or rdx.
+    void emit_div_const(const IrOp op, const MOperand &dst, const MOperand &src, const int64_t divisor) {
+        if (divisor == 1) {
+            if (op == IrOp::div && dst != src && dst.kind == MOperandKind::mem && src.kind == MOperandKind::mem) {
+                m_code.emit(MOp::mov, {s_rax, src});
+                m_code.emit(MOp::mov, {dst, s_rax});
+            } else if (op == IrOp::div && dst != src) {
+                m_code.emit(MOp::mov, {dst, src});
+            } else if (op == IrOp::mod) {
+                m_code.emit(MOp::mov, {dst, mimm(0)});
+            }
+            return;
+        }
+        if (const auto shift = pow2_shift(divisor)) {
+            const int k = shift.value();
+            // Adding 2^k - 1 to a negative dividend makes the shift round toward zero.
+            m_code.emit(MOp::mov, {s_rax, src});
+            m_code.emit(MOp::mov, {s_rdx, s_rax});
+            if (k > 1) {
+                m_code.emit(MOp::sar, {s_rdx, mimm(63)});
+            }
+            m_code.emit(MOp::shr, {s_rdx, mimm(64 - k)});
+            m_code.emit(MOp::add, {s_rdx, s_rax});
+            if (op == IrOp::div) {
+                m_code.emit(MOp::sar, {s_rdx, mimm(k)});
+                if (divisor < 0) {
+                    m_code.emit(MOp::neg, {s_rdx});
+                }
+                m_code.emit(MOp::mov, {dst, s_rdx});
+                return;
+            }
+            if (k < 32) {
+                m_code.emit(MOp::and_, {s_rdx, mimm(-(int64_t{1} << k))});
+            } else {
+                m_code.emit(MOp::sar, {s_rdx, mimm(k)});
+                m_code.emit(MOp::shl, {s_rdx, mimm(k)});
+            }
+            m_code.emit(MOp::sub, {s_rax, s_rdx});
+            m_code.emit(MOp::mov, {dst, s_rax});
+            return;
+        }
+        const auto [multiplier, shift] = div_magic(divisor);
+        m_code.emit(MOp::mov, {s_rax, mimm(multiplier)});
+        m_code.emit(MOp::imul, {src});
+        if (divisor > 0 && multiplier < 0) {
+            m_code.emit(MOp::add, {s_rdx, src});
+        } else if (divisor < 0 && multiplier > 0) {
+            m_code.emit(MOp::sub, {s_rdx, src});
+        }
+        if (shift > 0) {
+            m_code.emit(MOp::sar, {s_rdx, mimm(shift)});
+        }
+        m_code.emit(MOp::mov, {s_rax, s_rdx});
+        m_code.emit(MOp::shr, {s_rax, mimm(63)});
+        m_code.emit(MOp::add, {s_rdx, s_rax});
+        if (op == IrOp::div) {
+            m_code.emit(MOp::mov, {dst, s_rdx});
+            return;
+        }
+        if (divisor >= INT32_MIN && divisor <= INT32_MAX) {
+            m_code.emit(MOp::imul, {s_rdx, s_rdx, mimm(divisor)});
+        } else {
+            m_code.emit(MOp::mov, {s_rax, mimm(divisor)});
+            m_code.emit(MOp::imul, {s_rdx, s_rax});
+        }
+        m_code.emit(MOp::mov, {s_rax, src});
+        m_code.emit(MOp::sub, {s_rax, s_rdx});
+        m_code.emit(MOp::mov, {dst, s_rax});
+    }
+
+    // `dst = src * factor` as the shl, lea, add and sub sequence that beats
+    // imul on the tuned-for microarchitecture, if there is one. Both must be
+    // registers; rax or rdx holds the product when `src` is still needed.
+    void emit_mul_const(const MOperand &dst, const MOperand &src, const int64_t factor) {
+        if (factor == 0) {
+            m_code.emit(MOp::mov, {dst, mimm(0)});
+            return;
+        }
+        const MOperand scratch = src == s_rax ? s_rdx : s_rax;
+        const auto steps = MulSynth(*m_tuning).synthesize(factor);
+        if (!steps.has_value()) {
+            if (factor >= INT32_MIN && factor <= INT32_MAX) {
+                m_code.emit(MOp::imul, {dst, src, mimm(factor)});
+                return;
+            }
+            m_code.emit(MOp::mov, {scratch, mimm(factor)});
+            if (dst != src) {
+                m_code.emit(MOp::mov, {dst, src});
+            }
+            m_code.emit(MOp::imul, {dst, scratch});
+            return;
+        }
+        const MOperand t = dst == src && MulSynth::uses_x(steps.value()) ? scratch : dst;
+        MOperand cur = src;
+        const auto copy_to_t = [&] {
+            if (cur != t) {
+                m_code.emit(MOp::mov, {t, cur});
+            }
+        };
+        for (const auto [op, k]: steps.value()) {
+            const int scale = 1 << k;
+            switch (op) {
+                case MulOp::shl:
+                    copy_to_t();
+                    m_code.emit(MOp::shl, {t, mimm(k)});
+                    break;
+                case MulOp::add_self:
+                    m_code.emit(MOp::lea, {t, mmem(cur, 0, cur, scale)});
+                    break;
+                case MulOp::add_x:
+                    if (k == 0 && cur == t) {
+                        m_code.emit(MOp::add, {t, src});
+                    } else {
+                        m_code.emit(MOp::lea, {t, mmem(src, 0, cur, scale)});
+                    }
+                    break;
+                case MulOp::sub_x:
+                    copy_to_t();
+                    m_code.emit(MOp::sub, {t, src});
+                    break;
+                case MulOp::neg:
+                    copy_to_t();
+                    m_code.emit(MOp::neg, {t});
+                    break;
+                default:
+                    assert(false && "no shifted subtract on x86");
+            }
+            cur = t;
+        }
+        if (cur != dst) {
+            m_code.emit(MOp::mov, {dst, cur});
+        }
     }
 
-    void pop(const std::string &reg) {
-        m_output << "    pop " << reg << "\n";
-        m_stack_size--;
+    void emit_op(const IrOp op, const IrCond cond, const MOperand &dst, const MOperand &lhs, const MOperand &rhs) {
+        switch (op) {
+            case IrOp::div:
+            case IrOp::mod: {
+                if (lhs != s_rax) {
+                    m_code.emit(MOp::mov, {s_rax, lhs});
+                }
+                m_code.emit(MOp::cqo);
+                m_code.emit(MOp::idiv, {rhs});
+                const MOperand result = op == IrOp::div ? s_rax : s_rdx;
+                if (dst != result) {
+                    m_code.emit(MOp::mov, {dst, result});
+                }
+                break;
+            }
+            case IrOp::cmp:
+                m_code.emit(MOp::cmp, {lhs, rhs});
+                emit_setcc(cond, dst);
+                break;
+            default: {
+                const MOp mop = op == IrOp::add ? MOp::add : op == IrOp::sub ? MOp::sub : MOp::imul;
+                if (dst == rhs && dst != lhs) {
+                    if (op == IrOp::sub) {
+                        m_code.emit(MOp::neg, {dst});
+                        m_code.emit(MOp::add, {dst, lhs});
+                    } else {
+                        m_code.emit(mop, {dst, lhs});
+                    }
+                    break;
+                }
+                if (dst != lhs) {
+                    m_code.emit(MOp::mov, {dst, lhs});
+                }
+                m_code.emit(mop, {dst, rhs});
+                break;
+            }
+        }
+    }
+
+    // `dst += operand` or `dst -= operand` in place, `inc` or `dec` for a step of one.
+    void emit_update(const IrOp op, const MOperand &dst, const MOperand &operand) {
+        if (operand == mimm(1)) {
+            m_code.emit(op == IrOp::add ? MOp::inc : MOp::dec, {dst});
+            return;
+        }
+        m_code.emit(op == IrOp::add ? MOp::add : MOp::sub, {dst, operand});
+    }
+
+    // `ident op= term`
+    void gen_update(const IrOp op, const NodeTermIdent *term_ident, const NodeTerm *term) {
+        const bool divides = op == IrOp::div || op == IrOp::mod;
+        if (const auto divisor = divides ? const_divisor(as_leaf(term)) : std::nullopt) {
+            const MOperand slot = ident_operand(term_ident->ident);
+            emit_div_const(op, slot, slot, divisor.value());
+            return;
+        }
+        const MOperand slot = mmem(s_rsp, static_cast<int64_t>(var_offset(term_ident)));
+        if (const auto factor = op == IrOp::mul ? as_int_lit(term) : std::nullopt) {
+            m_code.emit(MOp::mov, {s_rax, slot});
+            emit_mul_const(s_rax, s_rax, factor.value());
+            m_code.emit(MOp::mov, {slot, s_rax});
+            return;
+        }
+        if (const auto match = m_isel.select_update(op, term)) {
+            MOperand operand = s_rbx;
+            if (match->rule->rhs == IselOperand::imm) {
+                operand = leaf_operand(as_leaf(term), true);
+            } else {
+                gen_term(term, 0);
+            }
+            emit_update(op, ident_operand(term_ident->ident), operand);
+            return;
+        }
+        MOperand operand = s_rbx;
+        if (const NodeTerm *leaf = as_leaf(term)) {
+            operand = leaf_operand(leaf, !divides);
+        } else {
+            gen_term(term, 0);
+        }
+        m_code.emit(MOp::mov, {s_rax, slot});
+        emit_op(op, IrCond::eq, s_rax, s_rax, operand);
+        m_code.emit(MOp::mov, {slot, s_rax});
+    }
+
+    [[nodiscard]] Allocation allocate(IrFunction &fn) const {
+        if (m_regalloc == RegAllocKind::graph_coloring) {
+            return GraphColoring(fn, m_alloc_reg_count).run();
+        }
+        return LinearScan(fn, m_alloc_reg_count).run();
+    }
+
+    void gen_prog_allocated() {
+        IrFunction fn;
+        const auto ir_size = [&] { return fn.insts.size(); };
+        m_pass_timings.time("lower-to-ir", ir_size, [&] {
+            fn = IrBuilder(m_prog, m_if_converter.has_value() ? &m_if_converter.value() : nullptr, m_rotate_loops)
+                     .build();
+        });
+        if (m_sched_model != nullptr) {
+            IrFunction scheduled = fn;
+            m_pass_timings.time("schedule", ir_size, [&] {
+                ListScheduler(scheduled, *m_sched_model, static_cast<int>(m_alloc_reg_count)).run();
+            });
+            m_pass_timings.time("regalloc", ir_size, [&] {
+                Allocation alloc = allocate(scheduled);
+                m_alloc = allocate(fn);
+                // The allocators don't see pressure the way the scheduler does,
+                // so an order that ends up spilling more is dropped.
+                if (alloc.slot_count <= m_alloc.slot_count) {
+                    fn = std::move(scheduled);
+                    m_alloc = std::move(alloc);
+                }
+            });
+        } else {
+            m_pass_timings.time("regalloc", ir_size, [&] { m_alloc = allocate(fn); });
+        }
+        m_frame_stats.uncolored_bytes = frame_bytes(m_alloc.slot_count);
+        if (m_slot_coloring.has_value()) {
+            m_pass_timings.time("stack-coloring", ir_size, [&] { color_spill_slots(fn, m_alloc); });
+        }
+        m_frame_stats.bytes = frame_bytes(m_alloc.slot_count);
+
+        // A label jumped to from further down starts a loop.
+        m_loop_headers.assign(fn.label_count, false);
+        std::vector<bool> placed(fn.label_count, false);
+        for (const IrInst &inst: fn.insts) {
+            if (inst.op == IrOp::label) {
+                placed[inst.label] = true;
+            } else if (ir_is_branch(inst.op) && placed[inst.label]) {
+                m_loop_headers[inst.label] = true;
+            }
+        }
+
+        m_pass_timings.time("isel", [&] { return m_code.insts.empty() ? fn.insts.size() : m_code.insts.size(); }, [&] {
+            m_code.insts.reserve(fn.insts.size() * 2);
+            gen_frame(m_alloc.slot_count);
+            for (const IrInst &inst: fn.insts) {
+                gen_inst(inst);
+            }
+        });
+    }
+
+    [[nodiscard]] bool in_reg(const int vreg) const {
+        return m_alloc.reg[vreg] >= 0;
+    }
+
+    [[nodiscard]] MOperand loc(const int vreg) const {
+        if (in_reg(vreg)) {
+            return mreg(s_alloc_regs[m_alloc.reg[vreg]]);
+        }
+        return mmem(s_rsp, static_cast<int64_t>(m_alloc.slot[vreg] * 8));
+    }
+
+    // The right operand: `rhs`, or the literal, in r11 if it is not an imm32.
+    MOperand rhs_operand(const IrInst &inst) {
+        if (inst.rhs >= 0) {
+            return loc(inst.rhs);
+        }
+        if (s_x86_isel.fits_imm(inst.op, inst.imm)) {
+            return mimm(inst.imm);
+        }
+        m_code.emit(MOp::mov, {s_r11, mimm(inst.imm)});
+        return s_r11;
+    }
+
+    void gen_arith(const IrInst &inst, const MOp mop, const bool commutative) {
+        const MOperand dst = in_reg(inst.dst) ? loc(inst.dst) : s_r10;
+        const MOperand lhs = loc(inst.lhs);
+        const MOperand rhs = rhs_operand(inst);
+        // `x += y` on a variable's own register or slot.
+        const bool in_place = inst.op != IrOp::mul && loc(inst.dst) == lhs;
+        if (in_place && (in_reg(inst.dst) || inst.rhs < 0 || in_reg(inst.rhs))) {
+            emit_update(inst.op, lhs, rhs);
+            return;
+        }
+        // A sum into a third register is a single lea.
+        const bool rhs_fits = inst.rhs >= 0 ? in_reg(inst.rhs) : rhs != s_r11;
+        if (inst.op == IrOp::add && in_reg(inst.dst) && in_reg(inst.lhs) && rhs_fits && dst != lhs && dst != rhs) {
+            m_code.emit(MOp::lea, {dst, rhs.kind == MOperandKind::imm ? mmem(lhs, rhs.value) : mmem(lhs, 0, rhs)});
+            return;
+        }
+        if (dst == rhs && lhs != rhs) {
+            if (commutative) {
+                m_code.emit(mop, {dst, lhs});
+            } else {
+                m_code.emit(MOp::mov, {s_r11, lhs});
+                m_code.emit(mop, {s_r11, rhs});
+                m_code.emit(MOp::mov, {dst, s_r11});
+            }
+        } else {
+            if (dst != lhs) {
+                m_code.emit(MOp::mov, {dst, lhs});
+            }
+            m_code.emit(mop, {dst, rhs});
+        }
+        if (dst != loc(inst.dst)) {
+            m_code.emit(MOp::mov, {loc(inst.dst), dst});
+        }
+    }
+
+    void gen_cmp(const IrInst &inst) {
+        MOperand lhs = loc(inst.lhs);
+        if (inst.rhs >= 0 && !in_reg(inst.lhs) && !in_reg(inst.rhs)) {
+            m_code.emit(MOp::mov, {s_r10, lhs});
+            lhs = s_r10;
+        }
+        const MOperand rhs = rhs_operand(inst);
+        m_code.emit(MOp::cmp, {lhs, rhs});
+    }
+
+    void gen_inst(const IrInst &inst) {
+        switch (inst.op) {
+            case IrOp::imm:
+                if (in_reg(inst.dst)) {
+                    emit_mov_imm(loc(inst.dst), inst.imm);
+                } else if (inst.imm < INT32_MIN || inst.imm > INT32_MAX) {
+                    m_code.emit(MOp::mov, {s_r10, mimm(inst.imm)});
+                    m_code.emit(MOp::mov, {loc(inst.dst), s_r10});
+                } else {
+                    m_code.emit(MOp::mov, {loc(inst.dst), mimm(inst.imm)});
+                }
+                break;
+            case IrOp::copy:
+                if (loc(inst.dst) == loc(inst.lhs)) {
+                    break;
+                }
+                if (!in_reg(inst.dst) && !in_reg(inst.lhs)) {
+                    m_code.emit(MOp::mov, {s_r10, loc(inst.lhs)});
+                    m_code.emit(MOp::mov, {loc(inst.dst), s_r10});
+                } else {
+                    m_code.emit(MOp::mov, {loc(inst.dst), loc(inst.lhs)});
+                }
+                break;
+            case IrOp::add:
+                gen_arith(inst, MOp::add, true);
+                break;
+            case IrOp::sub:
+                gen_arith(inst, MOp::sub, false);
+                break;
+            case IrOp::mul:
+                if (inst.rhs >= 0) {
+                    gen_arith(inst, MOp::imul, true);
+                    break;
+                }
+                if (!in_reg(inst.lhs)) {
+                    m_code.emit(MOp::mov, {s_r11, loc(inst.lhs)});
+                }
+                emit_mul_const(in_reg(inst.dst) ? loc(inst.dst) : s_r10, in_reg(inst.lhs) ? loc(inst.lhs) : s_r11,
+                               inst.imm);
+                if (!in_reg(inst.dst)) {
+                    m_code.emit(MOp::mov, {loc(inst.dst), s_r10});
+                }
+                break;
+            case IrOp::div:
+            case IrOp::mod:
+                if (inst.rhs < 0) {
+                    emit_div_const(inst.op, loc(inst.dst), loc(inst.lhs), inst.imm);
+                } else {
+                    emit_op(inst.op, inst.cond, loc(inst.dst), loc(inst.lhs), loc(inst.rhs));
+                }
+                break;
+            case IrOp::cmp:
+                gen_cmp(inst);
+                emit_setcc(inst.cond, in_reg(inst.dst) ? loc(inst.dst) : s_r10);
+                if (!in_reg(inst.dst)) {
+                    m_code.emit(MOp::mov, {loc(inst.dst), s_r10});
+                }
+                break;
+            case IrOp::select: {
+                // A spilled destination goes through rax: gen_cmp can use both
+                // r10 and r11, and it runs between the load and the cmov.
+                const MOperand dst = in_reg(inst.dst) ? loc(inst.dst) : s_rax;
+                if (!in_reg(inst.dst)) {
+                    m_code.emit(MOp::mov, {s_rax, loc(inst.dst)});
+                }
+                gen_cmp(inst);
+                m_code.emit_cond(MOp::cmovcc, inst.cond, {dst, loc(inst.src)});
+                if (!in_reg(inst.dst)) {
+                    m_code.emit(MOp::mov, {loc(inst.dst), s_rax});
+                }
+                break;
+            }
+            case IrOp::branch_cmp:
+                gen_cmp(inst);
+                m_code.emit_cond(MOp::jcc, invert(inst.cond), {mlabel(inst.label)});
+                break;
+            case IrOp::jump:
+                m_code.emit(MOp::jmp, {mlabel(inst.label)});
+                break;
+            case IrOp::branch_zero:
+                if (in_reg(inst.lhs)) {
+                    m_code.emit(MOp::test, {loc(inst.lhs), loc(inst.lhs)});
+                } else {
+                    m_code.emit(MOp::cmp, {loc(inst.lhs), mimm(0)});
+                }
+                m_code.emit_cond(MOp::jcc, IrCond::eq, {mlabel(inst.label)});
+                break;
+            case IrOp::label:
+                if (m_loop_headers[inst.label]) {
+                    emit_align();
+                }
+                m_code.label(inst.label);
+                break;
+            case IrOp::load:
+                m_code.emit(MOp::mov, {in_reg(inst.dst) ? loc(inst.dst) : s_r10, mmem(s_rsp, inst.imm * 8)});
+                if (!in_reg(inst.dst)) {
+                    m_code.emit(MOp::mov, {loc(inst.dst), s_r10});
+                }
+                break;
+            case IrOp::store:
+                if (!in_reg(inst.lhs)) {
+                    m_code.emit(MOp::mov, {s_r10, loc(inst.lhs)});
+                }
+                m_code.emit(MOp::mov, {mmem(s_rsp, inst.imm * 8), in_reg(inst.lhs) ? loc(inst.lhs) : s_r10});
+                break;
+            case IrOp::exit:
+                m_code.emit(MOp::mov, {s_rdi, loc(inst.lhs)});
+                m_code.emit(MOp::mov, {s_rax, mimm(60)});
+                m_code.emit(MOp::syscall);
+                break;
+        }
+    }
+
+    void reserve_slots(const size_t slots) {
+        m_frame_slots = std::max(m_frame_slots, slots);
+        m_uncolored_slots = std::max(m_uncolored_slots, m_vars.size() + m_temp_count);
+    }
+
+    // Temporaries live above the variables, and only for the statement that
+    // needs them.
+    [[nodiscard]] size_t temp_slot(const size_t temp) const {
+        return (m_slot_coloring.has_value() ? m_slot_coloring->slot_count() : m_vars.size()) + temp;
+    }
+
+    void spill_temp(const MOperand &reg) {
+        const size_t slot = temp_slot(m_temp_count++);
+        reserve_slots(slot + 1);
+        m_code.emit(MOp::mov, {mmem(s_rsp, static_cast<int64_t>(slot * 8)), reg});
+    }
+
+    void reload_temp(const MOperand &reg) {
+        const size_t slot = temp_slot(--m_temp_count);
+        m_code.emit(MOp::mov, {reg, mmem(s_rsp, static_cast<int64_t>(slot * 8))});
     }
 
     void begin_scope() {
@@ -370,32 +1129,44 @@ private:
     }
 
     void end_scope() {
-        size_t pop_count = m_vars.size() - m_scopes.back();
-        m_output << "    add rsp, " << pop_count * 8 << "\n";
-        m_stack_size -= pop_count;
-        for (int i = 0; i < pop_count; i++) {
-            m_vars.pop_back();
-        }
+        m_vars.resize(m_scopes.back());
         m_scopes.pop_back();
     }
 
-    std::string create_label()
+    int64_t create_label()
     {
-        std::stringstream ss;
-        ss << "label" << m_label_count++;
-        return ss.str();
+        return m_label_count++;
     }
 
     struct Var {
         std::string name;
-        size_t stack_loc;
+        // Index of the variable's 8 bytes in the frame.
+        size_t slot;
     };
 
     const NodeProgram m_prog;
-    std::stringstream m_output;
-    size_t m_stack_size = 0;
+    RegAllocKind m_regalloc;
+    size_t m_alloc_reg_count;
+    const MulTuning *m_tuning;
+    bool m_rotate_loops;
+    uint64_t m_loop_align;
+    const SchedModel *m_sched_model = nullptr;
+    // Indexed by IR label.
+    std::vector<bool> m_loop_headers;
+    InstructionSelector m_isel{s_x86_isel};
+    std::optional<IfConverter> m_if_converter;
+    std::optional<Peephole> m_peephole;
+    RegisterNeed m_need;
+    Allocation m_alloc;
+    MachineCode m_code;
+    PassTimings m_pass_timings;
+    std::optional<StackSlotColoring> m_slot_coloring;
+    size_t m_frame_slots = 0;
+    size_t m_uncolored_slots = 0;
+    FrameStats m_frame_stats;
+    size_t m_temp_count = 0;
     std::vector<Var> m_vars{};
     std::vector<size_t> m_scopes{};
-    int m_label_count = 0;
+    int64_t m_label_count = 0;
 };
 #
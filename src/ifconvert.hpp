@@ -0,0 +1,159 @@
+#pragma once
+#include <algorithm>
+#include <vector>
+
+#include "./profile.hpp"
+
+// An if/elif/else chain in which every arm is a single assignment to the
+// same variable and every condition is a comparison.
+struct IfSelect {
+    struct Arm {
+        const NodeCondExpr *cond;
+        const NodeExpr *value;
+    };
+
+    const Token *ident = nullptr;
+    std::vector<Arm> arms;
+    // The value of the else arm; without one the variable keeps its value.
+    const NodeExpr *otherwise = nullptr;
+};
+
+// Decides which ifs become conditional moves. A conditional move evaluates
+// every arm and every condition, so an if is only converted when none of
+// them can trap and that extra work costs less than the mispredictions it
+// saves, judged from the branch profile when there is one.
+class IfConverter {
+public:
+    static constexpr double s_mispredict_penalty = 16;
+    // Without a profile a branch is assumed to go either way at random.
+    static constexpr double s_default_mispredict_rate = 0.5;
+
+    explicit IfConverter(const BranchProfile *profile = nullptr)
+        : m_profile(profile) {
+    }
+
+    [[nodiscard]] std::optional<IfSelect> convert(const NodeStmtIf *stmt_if) const {
+        IfSelect select;
+        if (!add_arm(select, stmt_if->expr, stmt_if->scope)) {
+            return {};
+        }
+        std::optional<NodeIfPred *> pred = stmt_if->pred;
+        while (pred.has_value()) {
+            if (const auto elif = std::get_if<NodeIfPredElif *>(&pred.value()->var)) {
+                if (!add_arm(select, (*elif)->expr, (*elif)->scope)) {
+                    return {};
+                }
+                pred = (*elif)->pred;
+                continue;
+            }
+            const NodeStmtAssign *assign = single_assign(std::get<NodeIfPredElse *>(pred.value()->var)->scope);
+            if (assign == nullptr || assign->ident.value != select.ident->value || may_trap(assign->expr)) {
+                return {};
+            }
+            select.otherwise = assign->expr;
+            break;
+        }
+        if (speculated_cost(select) > s_mispredict_penalty * mispredict_rate(select)) {
+            return {};
+        }
+        return select;
+    }
+
+private:
+    static const NodeStmtAssign *single_assign(const NodeScope *scope) {
+        if (scope->stmts.size() != 1) {
+            return nullptr;
+        }
+        const auto assign = std::get_if<NodeStmtAssign *>(&scope->stmts.front()->var);
+        return assign != nullptr ? *assign : nullptr;
+    }
+
+    static bool add_arm(IfSelect &select, const NodeExpr *cond_expr, const NodeScope *scope) {
+        const NodeCondExpr *cond = as_cond(cond_expr);
+        const NodeStmtAssign *assign = single_assign(scope);
+        if (cond == nullptr || assign == nullptr || may_trap(cond_expr) || may_trap(assign->expr)) {
+            return false;
+        }
+        if (select.ident != nullptr && select.ident->value != assign->ident.value) {
+            return false;
+        }
+        select.ident = &assign->ident;
+        select.arms.push_back({.cond = cond, .value = assign->expr});
+        return true;
+    }
+
+    // Only a division or remainder by a literal other than 0 and -1 is safe
+    // to evaluate when its arm would not have run.
+    static bool may_trap(const NodeExpr *expr) {
+        if (const auto term = std::get_if<NodeTerm *>(&expr->var)) {
+            const auto paren = std::get_if<NodeTermParen *>(&(*term)->var);
+            return paren != nullptr && may_trap((*paren)->expr);
+        }
+        if (const auto bin_expr = std::get_if<NodeBinExpr *>(&expr->var)) {
+            return std::visit([]<typename T>(const T *bin) {
+                if constexpr (std::is_same_v<T, NodeBinExprDiv> || std::is_same_v<T, NodeBinExprMod>) {
+                    const NodeTerm *divisor = as_leaf(bin->rhs);
+                    const auto lit = divisor != nullptr ? std::get_if<NodeTermIntLit *>(&divisor->var) : nullptr;
+                    if (lit == nullptr || parse_int_lit((*lit)->int_lit) == 0 || parse_int_lit((*lit)->int_lit) == -1) {
+                        return true;
+                    }
+                }
+                return may_trap(bin->lhs) || may_trap(bin->rhs);
+            }, (*bin_expr)->var);
+        }
+        return std::visit([](const auto *cond) { return may_trap(cond->lhs) || may_trap(cond->rhs); },
+                          std::get<NodeCondExpr *>(expr->var)->var);
+    }
+
+    // Rough cycle counts of evaluating an expression.
+    static double cost(const NodeExpr *expr) {
+        if (const auto term = std::get_if<NodeTerm *>(&expr->var)) {
+            const auto paren = std::get_if<NodeTermParen *>(&(*term)->var);
+            return paren != nullptr ? cost((*paren)->expr) : 0;
+        }
+        if (const auto bin_expr = std::get_if<NodeBinExpr *>(&expr->var)) {
+            return std::visit([]<typename T>(const T *bin) {
+                double op_cost = 1;
+                if constexpr (std::is_same_v<T, NodeBinExprMult>) {
+                    op_cost = 3;
+                } else if constexpr (std::is_same_v<T, NodeBinExprDiv> || std::is_same_v<T, NodeBinExprMod>) {
+                    op_cost = 6;
+                }
+                return op_cost + cost(bin->lhs) + cost(bin->rhs);
+            }, (*bin_expr)->var);
+        }
+        return std::visit([](const auto *cond) { return 1 + cost(cond->lhs) + cost(cond->rhs); },
+                          std::get<NodeCondExpr *>(expr->var)->var);
+    }
+
+    // Work done on every path once the branch is gone: one conditional move
+    // per arm, all the values, and the conditions the chain might have
+    // skipped.
+    static double speculated_cost(const IfSelect &select) {
+        double total = select.otherwise != nullptr ? cost(select.otherwise) : 0;
+        for (size_t i = 0; i < select.arms.size(); i++) {
+            total += 1 + cost(select.arms[i].value);
+            if (i > 0) {
+                total += std::visit([](const auto *cond) { return 1 + cost(cond->lhs) + cost(cond->rhs); },
+                                    select.arms[i].cond->var);
+            }
+        }
+        return total;
+    }
+
+    [[nodiscard]] double mispredict_rate(const IfSelect &select) const {
+        if (m_profile == nullptr) {
+            return s_default_mispredict_rate;
+        }
+        std::optional<double> rate;
+        for (const IfSelect::Arm &arm: select.arms) {
+            const int line = std::visit([](const auto *cond) { return expr_line(cond->lhs); }, arm.cond->var);
+            if (const auto taken = m_profile->taken_rate(line)) {
+                rate = std::max(rate.value_or(0), std::min(taken.value(), 1 - taken.value()));
+            }
+        }
+        return rate.value_or(s_default_mispredict_rate);
+    }
+
+    const BranchProfile *m_profile;
+};
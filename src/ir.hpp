@@ -0,0 +1,608 @@
+#pragma once
+#include <vector>
+
+#include "./div_magic.hpp"
+#include "./ifconvert.hpp"
+
+// A flat three-address form of the program over an unbounded set of virtual
+// registers. Every `let` gets its own virtual register; expression
+// temporaries get fresh ones. Arithmetic, compares and branches on compares
+// take a literal right operand in `imm` instead of `rhs`.
+enum class IrOp {
+    imm,
+    copy,
+    add,
+    sub,
+    mul,
+    // Signed, truncating toward zero.
+    div,
+    mod,
+    cmp,
+    jump,
+    branch_zero,
+    // Jumps to `imm` unless `lhs cond rhs`: a compare fused with the branch
+    // of an if, elif or while condition.
+    branch_cmp,
+    // dst = src if `lhs cond rhs`, else dst is left alone: a conditional move.
+    select,
+    label,
+    exit,
+    // Spill code inserted by the register allocator; `imm` is the frame slot.
+    load,
+    store,
+};
+
+enum class IrCond {
+    greater,
+    greater_eq,
+    less,
+    less_eq,
+    eq,
+    not_eq_,
+};
+
+// The condition that holds with the operands swapped.
+inline IrCond mirror(const IrCond cond) {
+    switch (cond) {
+        case IrCond::greater:
+            return IrCond::less;
+        case IrCond::greater_eq:
+            return IrCond::less_eq;
+        case IrCond::less:
+            return IrCond::greater;
+        case IrCond::less_eq:
+            return IrCond::greater_eq;
+        default:
+            return cond;
+    }
+}
+
+inline IrCond invert(const IrCond cond) {
+    switch (cond) {
+        case IrCond::greater:
+            return IrCond::less_eq;
+        case IrCond::greater_eq:
+            return IrCond::less;
+        case IrCond::less:
+            return IrCond::greater_eq;
+        case IrCond::less_eq:
+            return IrCond::greater;
+        case IrCond::eq:
+            return IrCond::not_eq_;
+        default:
+            return IrCond::eq;
+    }
+}
+
+struct CondOperands {
+    const NodeExpr *lhs;
+    const NodeExpr *rhs;
+    IrCond cond;
+};
+
+inline CondOperands cond_operands(const NodeCondExpr *cond_expr) {
+    return std::visit([]<typename T>(const T *cond) {
+        IrCond kind = IrCond::not_eq_;
+        if constexpr (std::is_same_v<T, NodeCondExprGreater>) {
+            kind = IrCond::greater;
+        } else if constexpr (std::is_same_v<T, NodeCondExprGreaterEq>) {
+            kind = IrCond::greater_eq;
+        } else if constexpr (std::is_same_v<T, NodeCondExprLess>) {
+            kind = IrCond::less;
+        } else if constexpr (std::is_same_v<T, NodeCondExprLessEq>) {
+            kind = IrCond::less_eq;
+        } else if constexpr (std::is_same_v<T, NodeCondExprEq>) {
+            kind = IrCond::eq;
+        }
+        return CondOperands{.lhs = cond->lhs, .rhs = cond->rhs, .cond = kind};
+    }, cond_expr->var);
+}
+
+struct IrInst {
+    IrOp op;
+    int dst = -1;
+    int lhs = -1;
+    int rhs = -1;
+    int src = -1;
+    // The constant for `imm`, the right operand when there is no `rhs`, and
+    // the frame slot of `load` and `store`.
+    int64_t imm = 0;
+    // The target of jumps and branches, and the id of `label`.
+    int label = -1;
+    IrCond cond = IrCond::eq;
+    int loop_depth = 0;
+};
+
+struct IrFunction {
+    std::vector<IrInst> insts;
+    int vreg_count = 0;
+    int label_count = 0;
+};
+
+inline bool ir_is_branch(const IrOp op) {
+    return op == IrOp::jump || op == IrOp::branch_zero || op == IrOp::branch_cmp;
+}
+
+inline int ir_def(const IrInst &inst) {
+    return inst.dst;
+}
+
+inline std::vector<int> ir_uses(const IrInst &inst) {
+    std::vector<int> uses;
+    for (const int vreg: {inst.lhs, inst.rhs, inst.src, inst.op == IrOp::select ? inst.dst : -1}) {
+        if (vreg >= 0 && std::ranges::find(uses, vreg) == uses.end()) {
+            uses.push_back(vreg);
+        }
+    }
+    return uses;
+}
+
+class IrBuilder {
+public:
+    explicit IrBuilder(const NodeProgram &prog, const IfConverter *if_converter = nullptr,
+                       const bool rotate_loops = true)
+        : m_prog(prog)
+        , m_if_converter(if_converter)
+        , m_rotate_loops(rotate_loops) {
+    }
+
+    IrFunction build() {
+        for (const NodeStmt *stmt: m_prog.stmts) {
+            lower_stmt(stmt);
+        }
+        const int zero = new_vreg();
+        emit({.op = IrOp::imm, .dst = zero, .imm = 0});
+        emit({.op = IrOp::exit, .lhs = zero});
+        return std::move(m_fn);
+    }
+
+private:
+    struct Var {
+        std::string name;
+        int vreg;
+    };
+
+    int new_vreg() {
+        return m_fn.vreg_count++;
+    }
+
+    int new_label() {
+        return m_fn.label_count++;
+    }
+
+    void emit(IrInst inst) {
+        inst.loop_depth = m_loop_depth;
+        m_fn.insts.push_back(inst);
+    }
+
+    void emit_label(const int label) {
+        emit({.op = IrOp::label, .label = label});
+    }
+
+    int lookup(const Token &ident) const {
+        const auto it = std::ranges::find_if(m_vars, [&](const Var &var) { return var.name == ident.value.value(); });
+        if (it == m_vars.end()) {
+            std::cerr << "Undeclared Identifier: " << ident.value.value() << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        return it->vreg;
+    }
+
+    int lower_term(const NodeTerm *term) {
+        if (const auto term_int_lit = std::get_if<NodeTermIntLit *>(&term->var)) {
+            const int dst = new_vreg();
+            emit({.op = IrOp::imm, .dst = dst, .imm = parse_int_lit((*term_int_lit)->int_lit)});
+            return dst;
+        }
+        if (const auto term_paren = std::get_if<NodeTermParen *>(&term->var)) {
+            return lower_expr((*term_paren)->expr);
+        }
+        return lookup(std::get<NodeTermIdent *>(term->var)->ident);
+    }
+
+    // Whether a literal right operand of `op` can be left in `imm`. A divisor
+    // only can when the division lowers to a multiply.
+    static bool takes_imm(const IrOp op, const int64_t value) {
+        return (op != IrOp::div && op != IrOp::mod) || lowers_to_multiply(value);
+    }
+
+    // A literal on the right is left in `imm`. One on the left of a
+    // commutative operator or a compare is moved to the right.
+    IrInst lower_operands(const IrOp op, const NodeExpr *lhs, const NodeExpr *rhs, const IrCond cond = IrCond::eq) {
+        const bool swappable = op == IrOp::add || op == IrOp::mul || op == IrOp::cmp || op == IrOp::branch_cmp ||
+                               op == IrOp::select;
+        if (swappable && !as_int_lit(rhs).has_value() && as_int_lit(lhs).has_value()) {
+            return lower_operands(op, rhs, lhs, mirror(cond));
+        }
+        if (const auto value = as_int_lit(rhs); value.has_value() && takes_imm(op, value.value())) {
+            return {.op = op, .lhs = lower_expr(lhs), .imm = value.value(), .cond = cond};
+        }
+        if (m_need(rhs) > m_need(lhs)) {
+            const int rhs_vreg = lower_expr(rhs);
+            return {.op = op, .lhs = lower_expr(lhs), .rhs = rhs_vreg, .cond = cond};
+        }
+        const int lhs_vreg = lower_expr(lhs);
+        return {.op = op, .lhs = lhs_vreg, .rhs = lower_expr(rhs), .cond = cond};
+    }
+
+    int lower_binary(const IrOp op, const NodeExpr *lhs, const NodeExpr *rhs, const IrCond cond = IrCond::eq) {
+        IrInst inst = lower_operands(op, lhs, rhs, cond);
+        inst.dst = new_vreg();
+        emit(inst);
+        return inst.dst;
+    }
+
+    int lower_expr(const NodeExpr *expr) {
+        if (const auto term = std::get_if<NodeTerm *>(&expr->var)) {
+            return lower_term(*term);
+        }
+        if (const auto bin_expr = std::get_if<NodeBinExpr *>(&expr->var)) {
+            return std::visit([&]<typename T>(const T *bin) {
+                if constexpr (std::is_same_v<T, NodeBinExprAdd>) {
+                    return lower_binary(IrOp::add, bin->lhs, bin->rhs);
+                } else if constexpr (std::is_same_v<T, NodeBinExprSub>) {
+                    return lower_binary(IrOp::sub, bin->lhs, bin->rhs);
+                } else if constexpr (std::is_same_v<T, NodeBinExprMult>) {
+                    return lower_binary(IrOp::mul, bin->lhs, bin->rhs);
+                } else if constexpr (std::is_same_v<T, NodeBinExprDiv>) {
+                    return lower_binary(IrOp::div, bin->lhs, bin->rhs);
+                } else {
+                    return lower_binary(IrOp::mod, bin->lhs, bin->rhs);
+                }
+            }, (*bin_expr)->var);
+        }
+        const auto [lhs, rhs, cond] = cond_operands(std::get<NodeCondExpr *>(expr->var));
+        return lower_binary(IrOp::cmp, lhs, rhs, cond);
+    }
+
+    void lower_branch_false(const NodeExpr *expr, const int label) {
+        if (const NodeCondExpr *cond_expr = as_cond(expr)) {
+            const auto [lhs, rhs, cond] = cond_operands(cond_expr);
+            IrInst inst = lower_operands(IrOp::branch_cmp, lhs, rhs, cond);
+            inst.label = label;
+            emit(inst);
+            return;
+        }
+        emit({.op = IrOp::branch_zero, .lhs = lower_expr(expr), .label = label});
+    }
+
+    // Jumps to `label` when `expr` holds: the test at the bottom of a rotated loop.
+    void lower_branch_true(const NodeExpr *expr, const int label) {
+        if (const NodeCondExpr *cond_expr = as_cond(expr)) {
+            const auto [lhs, rhs, cond] = cond_operands(cond_expr);
+            IrInst inst = lower_operands(IrOp::branch_cmp, lhs, rhs, invert(cond));
+            inst.label = label;
+            emit(inst);
+            return;
+        }
+        emit({.op = IrOp::branch_cmp, .lhs = lower_expr(expr), .imm = 0, .label = label, .cond = IrCond::eq});
+    }
+
+    // The selects overwrite a temporary, last arm first so the first true
+    // condition wins, and the variable is only written once they are all
+    // done so every condition still sees its old value. Nothing in an arm has
+    // side effects, so each one is lowered right before its select to keep
+    // register pressure down.
+    void lower_select(const IfSelect &select) {
+        const int vreg = lookup(*select.ident);
+        const int result = new_vreg();
+        emit({.op = IrOp::copy, .dst = result, .lhs = select.otherwise != nullptr ? lower_expr(select.otherwise) : vreg});
+        for (auto arm = select.arms.rbegin(); arm != select.arms.rend(); ++arm) {
+            const int value = lower_expr(arm->value);
+            const auto [lhs, rhs, cond] = cond_operands(arm->cond);
+            IrInst inst = lower_operands(IrOp::select, lhs, rhs, cond);
+            inst.dst = result;
+            inst.src = value;
+            emit(inst);
+        }
+        emit({.op = IrOp::copy, .dst = vreg, .lhs = result});
+    }
+
+    void lower_scope(const NodeScope *scope) {
+        const size_t var_count = m_vars.size();
+        for (const NodeStmt *stmt: scope->stmts) {
+            lower_stmt(stmt);
+        }
+        m_vars.resize(var_count);
+    }
+
+    void lower_if_pred(const NodeIfPred *pred, const int end_label) {
+        if (const auto elif = std::get_if<NodeIfPredElif *>(&pred->var)) {
+            const int next_label = new_label();
+            lower_branch_false((*elif)->expr, next_label);
+            lower_scope((*elif)->scope);
+            emit({.op = IrOp::jump, .label = end_label});
+            emit_label(next_label);
+            if ((*elif)->pred.has_value()) {
+                lower_if_pred((*elif)->pred.value(), end_label);
+            }
+            return;
+        }
+        lower_scope(std::get<NodeIfPredElse *>(pred->var)->scope);
+    }
+
+    void lower_update(const Token &ident, const IrOp op, const NodeTerm *term) {
+        const int vreg = lookup(ident);
+        if (const auto value = as_int_lit(term); value.has_value() && takes_imm(op, value.value())) {
+            emit({.op = op, .dst = vreg, .lhs = vreg, .imm = value.value()});
+            return;
+        }
+        emit({.op = op, .dst = vreg, .lhs = vreg, .rhs = lower_term(term)});
+    }
+
+    void lower_stmt(const NodeStmt *stmt) {
+        struct StmtVisitor {
+            IrBuilder &ir;
+
+            void operator()(const NodeStmtExit *stmt_exit) const {
+                ir.emit({.op = IrOp::exit, .lhs = ir.lower_expr(stmt_exit->expr)});
+            }
+
+            void operator()(const NodeStmtLet *stmt_let) const {
+                if (std::ranges::any_of(ir.m_vars, [&](const Var &var) {
+                    return var.name == stmt_let->ident.value.value();
+                })) {
+                    std::cerr << "Identifier already used: " << stmt_let->ident.value.value() << std::endl;
+                    exit(EXIT_FAILURE);
+                }
+                const int value = ir.lower_expr(stmt_let->expr);
+                const int vreg = ir.new_vreg();
+                ir.emit({.op = IrOp::copy, .dst = vreg, .lhs = value});
+                ir.m_vars.push_back({.name = stmt_let->ident.value.value(), .vreg = vreg});
+            }
+
+            void operator()(const NodeStmtAssign *stmt_assign) const {
+                const int value = ir.lower_expr(stmt_assign->expr);
+                ir.emit({.op = IrOp::copy, .dst = ir.lookup(stmt_assign->ident), .lhs = value});
+            }
+
+            void operator()(const NodeScope *scope) const {
+                ir.lower_scope(scope);
+            }
+
+            void operator()(const NodeStmtIf *stmt_if) const {
+                if (ir.m_if_converter != nullptr) {
+                    if (const auto select = ir.m_if_converter->convert(stmt_if)) {
+                        ir.lower_select(select.value());
+                        return;
+                    }
+                }
+                const int else_label = ir.new_label();
+                ir.lower_branch_false(stmt_if->expr, else_label);
+                ir.lower_scope(stmt_if->scope);
+                if (!stmt_if->pred.has_value()) {
+                    ir.emit_label(else_label);
+                    return;
+                }
+                const int end_label = ir.new_label();
+                ir.emit({.op = IrOp::jump, .label = end_label});
+                ir.emit_label(else_label);
+                ir.lower_if_pred(stmt_if->pred.value(), end_label);
+                ir.emit_label(end_label);
+            }
+
+            void operator()(const NodeStmtWhile *stmt_while) const {
+                const int start_label = ir.new_label();
+                const int end_label = ir.new_label();
+                if (!ir.m_rotate_loops) {
+                    ir.m_loop_depth++;
+                    ir.emit_label(start_label);
+                    ir.lower_branch_false(stmt_while->expr, end_label);
+                    ir.lower_scope(stmt_while->scope);
+                    ir.emit({.op = IrOp::jump, .label = start_label});
+                    ir.m_loop_depth--;
+                    ir.emit_label(end_label);
+                    return;
+                }
+                // Rotated: a guard, then the body with the condition tested at
+                // its bottom, so each iteration takes one branch.
+                ir.lower_branch_false(stmt_while->expr, end_label);
+                ir.m_loop_depth++;
+                ir.emit_label(start_label);
+                ir.lower_scope(stmt_while->scope);
+                ir.lower_branch_true(stmt_while->expr, start_label);
+                ir.m_loop_depth--;
+                ir.emit_label(end_label);
+            }
+
+            void operator()(const NodeVarReassign *var_reassign) const {
+                if (const auto unary = std::get_if<NodeUnary *>(&var_reassign->var)) {
+                    const int vreg = ir.lookup(reassign_target(var_reassign));
+                    const IrOp op = std::holds_alternative<NodeUnaryAdd *>((*unary)->var) ? IrOp::add : IrOp::sub;
+                    ir.emit({.op = op, .dst = vreg, .lhs = vreg, .imm = 1});
+                    return;
+                }
+                std::visit([&]<typename T>(const T *compound) {
+                    IrOp op = IrOp::mod;
+                    if constexpr (std::is_same_v<T, NodeCompoundPlus>) {
+                        op = IrOp::add;
+                    } else if constexpr (std::is_same_v<T, NodeCompoundSub>) {
+                        op = IrOp::sub;
+                    } else if constexpr (std::is_same_v<T, NodeCompoundMult>) {
+                        op = IrOp::mul;
+                    } else if constexpr (std::is_same_v<T, NodeCompoundDiv>) {
+                        op = IrOp::div;
+                    }
+                    ir.lower_update(compound->term_ident->ident, op, compound->term);
+                }, std::get<NodeCompound *>(var_reassign->var)->var);
+            }
+        };
+        std::visit(StmtVisitor{.ir = *this}, stmt->var);
+    }
+
+    const NodeProgram &m_prog;
+    const IfConverter *m_if_converter;
+    bool m_rotate_loops;
+    IrFunction m_fn;
+    std::vector<Var> m_vars;
+    RegisterNeed m_need;
+    int m_loop_depth = 0;
+};
+
+class VRegSet {
+public:
+    explicit VRegSet(const int size = 0)
+        : m_words((size + 63) / 64, 0) {
+    }
+
+    void insert(const int vreg) {
+        m_words[vreg / 64] |= uint64_t{1} << (vreg % 64);
+    }
+
+    void erase(const int vreg) {
+        m_words[vreg / 64] &= ~(uint64_t{1} << (vreg % 64));
+    }
+
+    [[nodiscard]] bool contains(const int vreg) const {
+        return (m_words[vreg / 64] >> (vreg % 64)) & 1;
+    }
+
+    [[nodiscard]] size_t count() const {
+        size_t count = 0;
+        for (const uint64_t word: m_words) {
+            count += std::popcount(word);
+        }
+        return count;
+    }
+
+    // Returns true if any bit was added.
+    bool insert_all(const VRegSet &other) {
+        bool changed = false;
+        for (size_t i = 0; i < m_words.size(); i++) {
+            const uint64_t merged = m_words[i] | other.m_words[i];
+            changed |= merged != m_words[i];
+            m_words[i] = merged;
+        }
+        return changed;
+    }
+
+    template<typename Fn>
+    void for_each(Fn &&fn) const {
+        for (size_t i = 0; i < m_words.size(); i++) {
+            uint64_t word = m_words[i];
+            while (word != 0) {
+                fn(static_cast<int>(i * 64 + std::countr_zero(word)));
+                word &= word - 1;
+            }
+        }
+    }
+
+private:
+    std::vector<uint64_t> m_words;
+};
+
+// Backward dataflow liveness over the basic blocks of an IrFunction.
+class Liveness {
+public:
+    struct Block {
+        size_t begin;
+        size_t end;
+        std::vector<size_t> succs;
+    };
+
+    explicit Liveness(const IrFunction &fn)
+        : m_fn(fn) {
+        build_blocks();
+        std::vector<VRegSet> uses(m_blocks.size(), VRegSet(fn.vreg_count));
+        std::vector<VRegSet> defs(m_blocks.size(), VRegSet(fn.vreg_count));
+        for (size_t b = 0; b < m_blocks.size(); b++) {
+            for (size_t i = m_blocks[b].begin; i < m_blocks[b].end; i++) {
+                for (const int use: ir_uses(fn.insts[i])) {
+                    if (!defs[b].contains(use)) {
+                        uses[b].insert(use);
+                    }
+                }
+                if (ir_def(fn.insts[i]) >= 0) {
+                    defs[b].insert(ir_def(fn.insts[i]));
+                }
+            }
+        }
+        m_live_in.assign(m_blocks.size(), VRegSet(fn.vreg_count));
+        m_live_out.assign(m_blocks.size(), VRegSet(fn.vreg_count));
+        bool changed = true;
+        while (changed) {
+            changed = false;
+            for (size_t b = m_blocks.size(); b-- > 0;) {
+                for (const size_t succ: m_blocks[b].succs) {
+                    changed |= m_live_out[b].insert_all(m_live_in[succ]);
+                }
+                VRegSet live_in = uses[b];
+                m_live_out[b].for_each([&](const int vreg) {
+                    if (!defs[b].contains(vreg)) {
+                        live_in.insert(vreg);
+                    }
+                });
+                changed |= m_live_in[b].insert_all(live_in);
+            }
+        }
+    }
+
+    [[nodiscard]] const std::vector<Block> &blocks() const {
+        return m_blocks;
+    }
+
+    [[nodiscard]] const VRegSet &live_in(const size_t block) const {
+        return m_live_in[block];
+    }
+
+    [[nodiscard]] const VRegSet &live_out(const size_t block) const {
+        return m_live_out[block];
+    }
+
+    // Calls fn(index, live) for every instruction, last to first within each
+    // block, where `live` holds the registers live right after it.
+    template<typename Fn>
+    void for_each_live_after(Fn &&fn) const {
+        for (size_t b = 0; b < m_blocks.size(); b++) {
+            VRegSet live = m_live_out[b];
+            for (size_t i = m_blocks[b].end; i-- > m_blocks[b].begin;) {
+                fn(i, static_cast<const VRegSet &>(live));
+                if (ir_def(m_fn.insts[i]) >= 0) {
+                    live.erase(ir_def(m_fn.insts[i]));
+                }
+                for (const int use: ir_uses(m_fn.insts[i])) {
+                    live.insert(use);
+                }
+            }
+        }
+    }
+
+private:
+    void build_blocks() {
+        const std::vector<IrInst> &insts = m_fn.insts;
+        std::vector<size_t> label_block(m_fn.label_count, 0);
+        size_t begin = 0;
+        for (size_t i = 0; i < insts.size(); i++) {
+            const bool starts_block = insts[i].op == IrOp::label && i != begin;
+            if (starts_block) {
+                m_blocks.push_back({.begin = begin, .end = i, .succs = {}});
+                begin = i;
+            }
+            if (insts[i].op == IrOp::label) {
+                label_block[insts[i].label] = m_blocks.size();
+            }
+            const bool ends_block = ir_is_branch(insts[i].op) || insts[i].op == IrOp::exit;
+            if (ends_block) {
+                m_blocks.push_back({.begin = begin, .end = i + 1, .succs = {}});
+                begin = i + 1;
+            }
+        }
+        if (begin < insts.size()) {
+            m_blocks.push_back({.begin = begin, .end = insts.size(), .succs = {}});
+        }
+        for (size_t b = 0; b < m_blocks.size(); b++) {
+            const IrInst &last = insts[m_blocks[b].end - 1];
+            if (ir_is_branch(last.op)) {
+                m_blocks[b].succs.push_back(label_block[last.label]);
+            }
+            if (last.op != IrOp::jump && last.op != IrOp::exit && b + 1 < m_blocks.size()) {
+                m_blocks[b].succs.push_back(b + 1);
+            }
+        }
+    }
+
+    const IrFunction &m_fn;
+    std::vector<Block> m_blocks;
+    std::vector<VRegSet> m_live_in;
+    std::vector<VRegSet> m_live_out;
+};
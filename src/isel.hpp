@@ -0,0 +1,316 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <limits>
+#include <span>
+#include <unordered_map>
+
+#include "./ir.hpp"
+
+// The nonterminals of the tree grammar: a value in a register, a literal
+// the instruction encodes, a variable's stack slot used in place, a literal
+// power of two, and a register multiplied by one (lea's scaled index or an
+// AArch64 shifted register).
+enum class IselOperand {
+    reg,
+    imm,
+    mem,
+    scale,
+    scaled,
+};
+
+// `result <- op(lhs, rhs)` in `cost` instructions.
+struct IselRule {
+    IrOp op;
+    IselOperand lhs;
+    IselOperand rhs;
+    IselOperand result = IselOperand::reg;
+    int cost = 1;
+};
+
+struct IselTarget {
+    std::span<const IselRule> rules;
+    // Whether `op` encodes `value` as an immediate.
+    bool (*fits_imm)(IrOp op, int64_t value);
+    // Instructions that put `value` in a register.
+    int (*imm_cost)(int64_t value);
+    // The largest shift a scaled operand takes.
+    int max_scale_shift;
+    bool has_mem_operands;
+};
+
+inline constexpr std::array s_x86_isel_rules = std::to_array<IselRule>({
+    {.op = IrOp::add, .lhs = IselOperand::reg, .rhs = IselOperand::reg},
+    {.op = IrOp::add, .lhs = IselOperand::reg, .rhs = IselOperand::imm},
+    {.op = IrOp::add, .lhs = IselOperand::reg, .rhs = IselOperand::mem},
+    // lea dst, [lhs + index*scale]
+    {.op = IrOp::add, .lhs = IselOperand::reg, .rhs = IselOperand::scaled},
+    {.op = IrOp::sub, .lhs = IselOperand::reg, .rhs = IselOperand::reg},
+    {.op = IrOp::sub, .lhs = IselOperand::reg, .rhs = IselOperand::imm},
+    {.op = IrOp::sub, .lhs = IselOperand::reg, .rhs = IselOperand::mem},
+    {.op = IrOp::mul, .lhs = IselOperand::reg, .rhs = IselOperand::reg},
+    {.op = IrOp::mul, .lhs = IselOperand::reg, .rhs = IselOperand::imm},
+    {.op = IrOp::mul, .lhs = IselOperand::reg, .rhs = IselOperand::mem},
+    {.op = IrOp::mul, .lhs = IselOperand::reg, .rhs = IselOperand::scale, .result = IselOperand::scaled, .cost = 0},
+    {.op = IrOp::div, .lhs = IselOperand::reg, .rhs = IselOperand::reg},
+    {.op = IrOp::div, .lhs = IselOperand::reg, .rhs = IselOperand::mem},
+    {.op = IrOp::mod, .lhs = IselOperand::reg, .rhs = IselOperand::reg},
+    {.op = IrOp::mod, .lhs = IselOperand::reg, .rhs = IselOperand::mem},
+    {.op = IrOp::cmp, .lhs = IselOperand::reg, .rhs = IselOperand::reg},
+    {.op = IrOp::cmp, .lhs = IselOperand::reg, .rhs = IselOperand::imm},
+    {.op = IrOp::cmp, .lhs = IselOperand::reg, .rhs = IselOperand::mem},
+    {.op = IrOp::cmp, .lhs = IselOperand::mem, .rhs = IselOperand::reg},
+    // Doesn't macro-fuse with the jcc after it.
+    {.op = IrOp::cmp, .lhs = IselOperand::mem, .rhs = IselOperand::imm, .cost = 2},
+    // Read-modify-write updates of a variable.
+    {.op = IrOp::add, .lhs = IselOperand::mem, .rhs = IselOperand::imm, .result = IselOperand::mem},
+    {.op = IrOp::add, .lhs = IselOperand::mem, .rhs = IselOperand::reg, .result = IselOperand::mem},
+    {.op = IrOp::sub, .lhs = IselOperand::mem, .rhs = IselOperand::imm, .result = IselOperand::mem},
+    {.op = IrOp::sub, .lhs = IselOperand::mem, .rhs = IselOperand::reg, .result = IselOperand::mem},
+});
+
+inline constexpr std::array s_aarch64_isel_rules = std::to_array<IselRule>({
+    {.op = IrOp::add, .lhs = IselOperand::reg, .rhs = IselOperand::reg},
+    {.op = IrOp::add, .lhs = IselOperand::reg, .rhs = IselOperand::imm},
+    // add dst, lhs, rhs, lsl #k
+    {.op = IrOp::add, .lhs = IselOperand::reg, .rhs = IselOperand::scaled},
+    {.op = IrOp::sub, .lhs = IselOperand::reg, .rhs = IselOperand::reg},
+    {.op = IrOp::sub, .lhs = IselOperand::reg, .rhs = IselOperand::imm},
+    {.op = IrOp::sub, .lhs = IselOperand::reg, .rhs = IselOperand::scaled},
+    {.op = IrOp::mul, .lhs = IselOperand::reg, .rhs = IselOperand::reg},
+    {.op = IrOp::mul, .lhs = IselOperand::reg, .rhs = IselOperand::scale, .result = IselOperand::scaled, .cost = 0},
+    {.op = IrOp::div, .lhs = IselOperand::reg, .rhs = IselOperand::reg},
+    {.op = IrOp::mod, .lhs = IselOperand::reg, .rhs = IselOperand::reg, .cost = 2},
+    {.op = IrOp::cmp, .lhs = IselOperand::reg, .rhs = IselOperand::reg},
+    {.op = IrOp::cmp, .lhs = IselOperand::reg, .rhs = IselOperand::imm},
+    {.op = IrOp::cmp, .lhs = IselOperand::reg, .rhs = IselOperand::scaled},
+});
+
+// An AArch64 add, sub or cmp immediate: 12 bits, optionally shifted left by
+// 12. A negative one flips add and sub, and cmp to cmn.
+inline bool aarch64_add_imm(const int64_t value) {
+    if (value == INT64_MIN) {
+        return false;
+    }
+    const int64_t magnitude = value < 0 ? -value : value;
+    return magnitude < 4096 || (magnitude % 4096 == 0 && magnitude / 4096 < 4096);
+}
+
+// movz or movn for the first 16-bit chunk, movk for each other one.
+inline int aarch64_mov_imm_count(const int64_t value) {
+    const auto bits = static_cast<uint64_t>(value);
+    int zero_chunks = 0;
+    int ones_chunks = 0;
+    for (int shift = 0; shift < 64; shift += 16) {
+        zero_chunks += ((bits >> shift) & 0xffff) == 0;
+        ones_chunks += ((bits >> shift) & 0xffff) == 0xffff;
+    }
+    return std::max(1, 4 - std::max(zero_chunks, ones_chunks));
+}
+
+inline constexpr IselTarget s_x86_isel = {
+    .rules = s_x86_isel_rules,
+    .fits_imm = [](IrOp, const int64_t value) { return value >= INT32_MIN && value <= INT32_MAX; },
+    .imm_cost = [](int64_t) { return 1; },
+    .max_scale_shift = 3,
+    .has_mem_operands = true,
+};
+
+inline constexpr IselTarget s_aarch64_isel = {
+    .rules = s_aarch64_isel_rules,
+    .fits_imm = [](const IrOp op, const int64_t value) {
+        return (op == IrOp::add || op == IrOp::sub || op == IrOp::cmp) && aarch64_add_imm(value);
+    },
+    .imm_cost = aarch64_mov_imm_count,
+    .max_scale_shift = 63,
+    .has_mem_operands = false,
+};
+
+struct IselMatch {
+    const IselRule *rule;
+    // The operands are used the other way around (the condition mirrored).
+    bool swapped;
+};
+
+// The operator and operands of a binary expression or comparison.
+struct IselNode {
+    IrOp op;
+    const NodeExpr *lhs;
+    const NodeExpr *rhs;
+};
+
+inline std::optional<IselNode> isel_node(const NodeExpr *expr) {
+    if (const auto term = std::get_if<NodeTerm *>(&expr->var)) {
+        const auto paren = std::get_if<NodeTermParen *>(&(*term)->var);
+        return paren != nullptr ? isel_node((*paren)->expr) : std::nullopt;
+    }
+    if (const auto bin_expr = std::get_if<NodeBinExpr *>(&expr->var)) {
+        return std::visit([]<typename T>(const T *bin) {
+            IrOp op = IrOp::mod;
+            if constexpr (std::is_same_v<T, NodeBinExprAdd>) {
+                op = IrOp::add;
+            } else if constexpr (std::is_same_v<T, NodeBinExprSub>) {
+                op = IrOp::sub;
+            } else if constexpr (std::is_same_v<T, NodeBinExprMult>) {
+                op = IrOp::mul;
+            } else if constexpr (std::is_same_v<T, NodeBinExprDiv>) {
+                op = IrOp::div;
+            }
+            return IselNode{.op = op, .lhs = bin->lhs, .rhs = bin->rhs};
+        }, (*bin_expr)->var);
+    }
+    const auto [lhs, rhs, cond] = cond_operands(std::get<NodeCondExpr *>(expr->var));
+    return IselNode{.op = IrOp::cmp, .lhs = lhs, .rhs = rhs};
+}
+
+// Bottom-up tree-pattern matching over the target's rule table (BURS):
+// every expression gets the cost of producing it in a register or as a
+// scaled operand, and each operator takes the cheapest rule given what its
+// operands cost in the forms that rule wants.
+class InstructionSelector {
+public:
+    static constexpr int s_no_match = std::numeric_limits<int>::max() / 4;
+
+    explicit InstructionSelector(const IselTarget &target)
+        : m_target(target) {
+    }
+
+    [[nodiscard]] const IselTarget &target() const {
+        return m_target;
+    }
+
+    // The cheapest rule computing `lhs op rhs` as `result`.
+    [[nodiscard]] std::optional<IselMatch> select(const IrOp op, const NodeExpr *lhs, const NodeExpr *rhs,
+                                                  const IselOperand result = IselOperand::reg) {
+        std::optional<IselMatch> best;
+        int best_cost = s_no_match;
+        const bool commutative = op == IrOp::add || op == IrOp::mul || op == IrOp::cmp;
+        for (const IselRule &rule: m_target.rules) {
+            if (rule.op != op || rule.result != result) {
+                continue;
+            }
+            for (const bool swapped: {false, true}) {
+                if (swapped && !commutative) {
+                    break;
+                }
+                const int cost = rule.cost + cost_as(swapped ? rhs : lhs, rule.lhs, op) +
+                                 cost_as(swapped ? lhs : rhs, rule.rhs, op);
+                if (cost < best_cost) {
+                    best_cost = cost;
+                    best = IselMatch{.rule = &rule, .swapped = swapped};
+                }
+            }
+        }
+        return best;
+    }
+
+    // The cheapest rule for `var op= rhs` that updates the variable in place.
+    [[nodiscard]] std::optional<IselMatch> select_update(const IrOp op, const NodeTerm *rhs) {
+        std::optional<IselMatch> best;
+        int best_cost = s_no_match;
+        for (const IselRule &rule: m_target.rules) {
+            if (rule.op != op || rule.lhs != IselOperand::mem || rule.result != IselOperand::mem) {
+                continue;
+            }
+            const auto paren = std::get_if<NodeTermParen *>(&rhs->var);
+            const int cost = rule.cost + (paren != nullptr ? cost_as((*paren)->expr, rule.rhs, op)
+                                                           : leaf_cost(rhs, rule.rhs, op));
+            if (cost < best_cost) {
+                best_cost = cost;
+                best = IselMatch{.rule = &rule, .swapped = false};
+            }
+        }
+        return best;
+    }
+
+    // `expr` as a register times 2^shift, when it matches a scaled operand.
+    [[nodiscard]] std::optional<std::pair<const NodeExpr *, int>> scaled_operand(const NodeExpr *expr) const {
+        const auto node = isel_node(expr);
+        if (!node.has_value() || node->op != IrOp::mul) {
+            return {};
+        }
+        if (const auto shift = scale_shift(node->rhs)) {
+            return std::pair{node->lhs, shift.value()};
+        }
+        if (const auto shift = scale_shift(node->lhs)) {
+            return std::pair{node->rhs, shift.value()};
+        }
+        return {};
+    }
+
+    // The cost of `expr` in the form `operand` as an operand of `op`.
+    int cost_as(const NodeExpr *expr, const IselOperand operand, const IrOp op) {
+        if (const NodeTerm *leaf = as_leaf(expr)) {
+            return leaf_cost(leaf, operand, op);
+        }
+        switch (operand) {
+            case IselOperand::reg:
+                return label(expr).reg;
+            case IselOperand::scaled:
+                return scaled_operand(expr).has_value() ? label(expr).scaled : s_no_match;
+            default:
+                return s_no_match;
+        }
+    }
+
+private:
+    struct Costs {
+        int reg;
+        int scaled;
+    };
+
+    [[nodiscard]] int leaf_cost(const NodeTerm *leaf, const IselOperand operand, const IrOp op) const {
+        const std::optional<int64_t> value = as_int_lit(leaf);
+        switch (operand) {
+            case IselOperand::reg:
+                return value.has_value() ? m_target.imm_cost(value.value()) : 1;
+            case IselOperand::imm:
+                return value.has_value() && m_target.fits_imm(op, value.value()) ? 0 : s_no_match;
+            case IselOperand::mem:
+                return !value.has_value() && m_target.has_mem_operands ? 0 : s_no_match;
+            case IselOperand::scale:
+                return value.has_value() && scale_shift(value.value()).has_value() ? 0 : s_no_match;
+            default:
+                return s_no_match;
+        }
+    }
+
+    [[nodiscard]] std::optional<int> scale_shift(const NodeExpr *expr) const {
+        const auto value = as_int_lit(expr);
+        return value.has_value() ? scale_shift(value.value()) : std::nullopt;
+    }
+
+    [[nodiscard]] std::optional<int> scale_shift(const int64_t value) const {
+        if (value <= 1 || !std::has_single_bit(static_cast<uint64_t>(value))) {
+            return {};
+        }
+        const int shift = std::countr_zero(static_cast<uint64_t>(value));
+        return shift <= m_target.max_scale_shift ? std::optional(shift) : std::nullopt;
+    }
+
+    const Costs &label(const NodeExpr *expr) {
+        if (const auto it = m_costs.find(expr); it != m_costs.end()) {
+            return it->second;
+        }
+        Costs costs{.reg = s_no_match, .scaled = s_no_match};
+        if (const auto node = isel_node(expr)) {
+            const auto match_cost = [&](const IselOperand result) {
+                const auto match = select(node->op, node->lhs, node->rhs, result);
+                if (!match.has_value()) {
+                    return s_no_match;
+                }
+                const NodeExpr *lhs = match->swapped ? node->rhs : node->lhs;
+                const NodeExpr *rhs = match->swapped ? node->lhs : node->rhs;
+                return match->rule->cost + cost_as(lhs, match->rule->lhs, node->op) +
+                       cost_as(rhs, match->rule->rhs, node->op);
+            };
+            costs.reg = match_cost(IselOperand::reg);
+            costs.scaled = match_cost(IselOperand::scaled);
+        }
+        return m_costs.emplace(expr, costs).first->second;
+    }
+
+    const IselTarget &m_target;
+    std::unordered_map<const NodeExpr *, Costs> m_costs;
+};
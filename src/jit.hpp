@@ -0,0 +1,43 @@
+#pragma once
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <span>
+
+#include "./process.hpp"
+
+// Runs encoded x86-64 code in a forked child and returns the exit code it
+// ends with, or 128 plus the signal number if a signal ended it, like a
+// shell. The code is copied into a fresh mapping that is only ever writable
+// or executable, never both, and entered like a function. Generated code
+// ends every path with the exit syscall, so `exit` ends just the child, and
+// a fault in the code cannot take the driver down with it.
+inline int run_machine_code(const std::span<const uint8_t> code) {
+    void *memory = mmap(nullptr, code.size(), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) {
+        std::cerr << "Could not map memory for the code: " << strerror(errno) << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    std::memcpy(memory, code.data(), code.size());
+    if (mprotect(memory, code.size(), PROT_READ | PROT_EXEC) != 0) {
+        std::cerr << "Could not make the code executable: " << strerror(errno) << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    // The child inherits whatever is still buffered and would print it again.
+    std::cout.flush();
+    const pid_t pid = fork();
+    if (pid < 0) {
+        std::cerr << "Could not fork: " << strerror(errno) << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    if (pid == 0) {
+        reinterpret_cast<void (*)()>(memory)();
+        _exit(EXIT_FAILURE);
+    }
+    munmap(memory, code.size());
+    return wait_exit_status(pid);
+}
@@ -0,0 +1,587 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <charconv>
+#include <cstdint>
+#include <initializer_list>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "./ir.hpp"
+
+// The instructions a backend emits, kept in memory so later passes can see
+// them, and printed as assembly text in one go at the end.
+
+enum class MOp : uint8_t {
+    // Not instructions: a label, a comment, and padding with nops to the
+    // boundary in the operand.
+    label,
+    comment,
+    align,
+    mov,
+    add,
+    sub,
+    neg,
+    and_,
+    cmp,
+    // x86-64
+    push,
+    pop,
+    movzx,
+    imul,
+    idiv,
+    cqo,
+    inc,
+    dec,
+    shl,
+    shr,
+    sar,
+    lea,
+    test,
+    setcc,
+    cmovcc,
+    jcc,
+    jmp,
+    syscall,
+    // AArch64
+    movz,
+    movn,
+    movk,
+    mul,
+    sdiv,
+    msub,
+    smulh,
+    lsl,
+    lsr,
+    asr,
+    cmn,
+    cset,
+    csel,
+    b,
+    bcc,
+    cbz,
+    ldr,
+    str,
+    svc,
+    count,
+};
+
+// Whether the condition of the instruction is part of its mnemonic (`jg`, `b.gt`).
+inline bool mop_has_cond(const MOp op) {
+    return op == MOp::setcc || op == MOp::cmovcc || op == MOp::jcc || op == MOp::bcc;
+}
+
+// In hardware encoding order.
+enum class X86Reg : uint8_t { rax, rcx, rdx, rbx, rsp, rbp, rsi, rdi, r8, r9, r10, r11, r12, r13, r14, r15 };
+
+enum class A64Reg : uint8_t {
+    x0, x1, x2, x3, x4, x5, x6, x7, x8, x9, x10, x11, x12, x13, x14, x15,
+    x16, x17, x18, x19, x20, x21, x22, x23, x24, x25, x26, x27, x28, x29, x30, sp,
+};
+
+enum class MOperandKind : uint8_t { none, reg, imm, mem, label, shift, cond };
+
+enum class MShift : uint8_t { lsl, lsr, asr };
+
+inline constexpr uint8_t s_no_index = 0xff;
+
+struct MOperand {
+    MOperandKind kind = MOperandKind::none;
+    // The register, or the base register of a memory operand.
+    uint8_t reg = 0;
+    uint8_t bits = 64;
+    // The index register of a memory operand, scaled by `scale`.
+    uint8_t index = s_no_index;
+    uint8_t scale = 1;
+    MShift shift = MShift::lsl;
+    // The immediate, displacement, label number, shift amount, or IrCond.
+    int64_t value = 0;
+
+    bool operator==(const MOperand &) const = default;
+};
+
+inline constexpr MOperand mreg(const X86Reg reg, const uint8_t bits = 64) {
+    return {.kind = MOperandKind::reg, .reg = static_cast<uint8_t>(reg), .bits = bits};
+}
+
+inline constexpr MOperand mreg(const A64Reg reg) {
+    return {.kind = MOperandKind::reg, .reg = static_cast<uint8_t>(reg)};
+}
+
+// The same register at another width, e.g. ebx or bl for rbx.
+inline constexpr MOperand with_bits(MOperand reg, const uint8_t bits) {
+    reg.bits = bits;
+    return reg;
+}
+
+inline constexpr MOperand mimm(const int64_t value) {
+    return {.kind = MOperandKind::imm, .value = value};
+}
+
+// [base + index*scale + disp]
+inline constexpr MOperand mmem(const MOperand base, const int64_t disp, const MOperand index = {},
+                               const uint8_t scale = 1) {
+    return {.kind = MOperandKind::mem,
+            .reg = base.reg,
+            .index = index.kind == MOperandKind::reg ? index.reg : s_no_index,
+            .scale = scale,
+            .value = disp};
+}
+
+inline constexpr MOperand mlabel(const int64_t label) {
+    return {.kind = MOperandKind::label, .value = label};
+}
+
+inline constexpr MOperand mshift(const MShift shift, const int64_t amount) {
+    return {.kind = MOperandKind::shift, .shift = shift, .value = amount};
+}
+
+inline constexpr MOperand mcond(const IrCond cond) {
+    return {.kind = MOperandKind::cond, .value = static_cast<int64_t>(cond)};
+}
+
+struct MInst {
+    MOp op;
+    // Of setcc, cmovcc, jcc and bcc.
+    IrCond cond = IrCond::eq;
+    uint8_t operand_count = 0;
+    std::array<MOperand, 4> operands{};
+
+    [[nodiscard]] std::span<const MOperand> args() const {
+        return {operands.data(), operand_count};
+    }
+};
+
+struct MachineCode {
+    std::vector<MInst> insts;
+    // Text of the comments, indexed by their operand.
+    std::vector<std::string> comments;
+
+    // Operands of kind `none` are left out, so an optional one can be passed
+    // either way.
+    MInst &emit(const MOp op, const std::initializer_list<MOperand> operands = {}) {
+        MInst &inst = insts.emplace_back(MInst{.op = op});
+        for (const MOperand &operand: operands) {
+            if (operand.kind != MOperandKind::none) {
+                inst.operands[inst.operand_count++] = operand;
+            }
+        }
+        return inst;
+    }
+
+    void emit_cond(const MOp op, const IrCond cond, const std::initializer_list<MOperand> operands) {
+        emit(op, operands).cond = cond;
+    }
+
+    void label(const int64_t label) {
+        emit(MOp::label, {mlabel(label)});
+    }
+
+    void align(const uint64_t boundary) {
+        emit(MOp::align, {mimm(static_cast<int64_t>(boundary))});
+    }
+
+    void comment(std::string text) {
+        emit(MOp::comment, {mimm(static_cast<int64_t>(comments.size()))});
+        comments.push_back(std::move(text));
+    }
+};
+
+enum class MachineArch { x86_64, aarch64 };
+
+// How a target spells instructions and operands.
+struct MachineTarget {
+    MachineArch arch;
+    // Empty for operations the target doesn't have; the prefix the condition
+    // is appended to for the ones with a condition in the mnemonic.
+    std::string_view (*mnemonic)(MOp);
+    // Indexed by IrCond.
+    std::array<std::string_view, 6> conds;
+    // Indexed by register number.
+    std::span<const std::string_view> regs64;
+    std::span<const std::string_view> regs32;
+    std::span<const std::string_view> regs8;
+    std::string_view imm_prefix;
+    std::string_view label_prefix;
+    std::string_view header;
+    // Emitted before `header` when the code pads anything.
+    std::string_view align_header;
+    std::string_view align_directive;
+};
+
+inline constexpr std::array<std::string_view, 16> s_x86_regs64 = {
+    "rax", "rcx", "rdx", "rbx", "rsp", "rbp", "rsi", "rdi", "r8", "r9", "r10", "r11", "r12", "r13", "r14", "r15"};
+inline constexpr std::array<std::string_view, 16> s_x86_regs32 = {
+    "eax", "ecx", "edx", "ebx", "esp", "ebp", "esi", "edi",
+    "r8d", "r9d", "r10d", "r11d", "r12d", "r13d", "r14d", "r15d"};
+inline constexpr std::array<std::string_view, 16> s_x86_regs8 = {
+    "al", "cl", "dl", "bl", "spl", "bpl", "sil", "dil", "r8b", "r9b", "r10b", "r11b", "r12b", "r13b", "r14b", "r15b"};
+inline constexpr std::array<std::string_view, 32> s_aarch64_regs64 = {
+    "x0",  "x1",  "x2",  "x3",  "x4",  "x5",  "x6",  "x7",  "x8",  "x9",  "x10", "x11", "x12", "x13", "x14", "x15",
+    "x16", "x17", "x18", "x19", "x20", "x21", "x22", "x23", "x24", "x25", "x26", "x27", "x28", "x29", "x30", "sp"};
+
+inline constexpr std::string_view x86_mnemonic(const MOp op) {
+    switch (op) {
+        case MOp::mov: return "mov";
+        case MOp::add: return "add";
+        case MOp::sub: return "sub";
+        case MOp::neg: return "neg";
+        case MOp::and_: return "and";
+        case MOp::cmp: return "cmp";
+        case MOp::push: return "push";
+        case MOp::pop: return "pop";
+        case MOp::movzx: return "movzx";
+        case MOp::imul: return "imul";
+        case MOp::idiv: return "idiv";
+        case MOp::cqo: return "cqo";
+        case MOp::inc: return "inc";
+        case MOp::dec: return "dec";
+        case MOp::shl: return "shl";
+        case MOp::shr: return "shr";
+        case MOp::sar: return "sar";
+        case MOp::lea: return "lea";
+        case MOp::test: return "test";
+        case MOp::setcc: return "set";
+        case MOp::cmovcc: return "cmov";
+        case MOp::jcc: return "j";
+        case MOp::jmp: return "jmp";
+        case MOp::syscall: return "syscall";
+        default: return {};
+    }
+}
+
+inline constexpr std::string_view aarch64_mnemonic(const MOp op) {
+    switch (op) {
+        case MOp::mov: return "mov";
+        case MOp::add: return "add";
+        case MOp::sub: return "sub";
+        case MOp::neg: return "neg";
+        case MOp::and_: return "and";
+        case MOp::cmp: return "cmp";
+        case MOp::movz: return "movz";
+        case MOp::movn: return "movn";
+        case MOp::movk: return "movk";
+        case MOp::mul: return "mul";
+        case MOp::sdiv: return "sdiv";
+        case MOp::msub: return "msub";
+        case MOp::smulh: return "smulh";
+        case MOp::lsl: return "lsl";
+        case MOp::lsr: return "lsr";
+        case MOp::asr: return "asr";
+        case MOp::cmn: return "cmn";
+        case MOp::cset: return "cset";
+        case MOp::csel: return "csel";
+        case MOp::b: return "b";
+        case MOp::bcc: return "b.";
+        case MOp::cbz: return "cbz";
+        case MOp::ldr: return "ldr";
+        case MOp::str: return "str";
+        case MOp::svc: return "svc";
+        default: return {};
+    }
+}
+
+inline constexpr MachineTarget s_x86_machine = {
+    .arch = MachineArch::x86_64,
+    .mnemonic = x86_mnemonic,
+    .conds = {"g", "ge", "l", "le", "e", "ne"},
+    .regs64 = s_x86_regs64,
+    .regs32 = s_x86_regs32,
+    .regs8 = s_x86_regs8,
+    .imm_prefix = "",
+    .label_prefix = ".L",
+    .header = "global _start\n_start:\n",
+    // Long nops for `align` instead of runs of single-byte ones.
+    .align_header = "%use smartalign\nalignmode p6\n",
+    .align_directive = "align ",
+};
+
+inline constexpr MachineTarget s_aarch64_machine = {
+    .arch = MachineArch::aarch64,
+    .mnemonic = aarch64_mnemonic,
+    .conds = {"gt", "ge", "lt", "le", "eq", "ne"},
+    .regs64 = s_aarch64_regs64,
+    .regs32 = {},
+    .regs8 = {},
+    .imm_prefix = "#",
+    .label_prefix = "label",
+    .header = ".global _main\n_main:\n",
+    .align_header = "",
+    .align_directive = ".balign ",
+};
+
+// A full-width general purpose register.
+inline bool is_gpr(const MachineTarget &target, const MOperand &operand) {
+    return operand.kind == MOperandKind::reg && operand.bits == 64 &&
+           (target.arch == MachineArch::x86_64 || operand.reg != static_cast<uint8_t>(A64Reg::sp));
+}
+
+inline std::optional<std::pair<MOp, IrCond>> find_mnemonic(const MachineTarget &target, const std::string_view text) {
+    for (size_t i = 0; i < static_cast<size_t>(MOp::count); i++) {
+        const auto op = static_cast<MOp>(i);
+        const std::string_view mnemonic = target.mnemonic(op);
+        if (mnemonic.empty() || !text.starts_with(mnemonic)) {
+            continue;
+        }
+        if (!mop_has_cond(op)) {
+            if (text == mnemonic) {
+                return std::pair{op, IrCond::eq};
+            }
+            continue;
+        }
+        for (size_t cond = 0; cond < target.conds.size(); cond++) {
+            if (text.substr(mnemonic.size()) == target.conds[cond]) {
+                return std::pair{op, static_cast<IrCond>(cond)};
+            }
+        }
+    }
+    return {};
+}
+
+inline std::optional<int64_t> parse_asm_int(std::string_view text) {
+    int64_t value = 0;
+    const auto [end, error] = std::from_chars(text.data(), text.data() + text.size(), value);
+    if (error != std::errc() || end != text.data() + text.size()) {
+        return {};
+    }
+    return value;
+}
+
+inline std::optional<MOperand> parse_asm_reg(const MachineTarget &target, const std::string_view text) {
+    for (const auto &[names, bits]: {std::pair{target.regs64, 64}, {target.regs32, 32}, {target.regs8, 8}}) {
+        const auto it = std::ranges::find(names, text);
+        if (it != names.end()) {
+            return MOperand{.kind = MOperandKind::reg, .reg = static_cast<uint8_t>(it - names.begin()),
+                            .bits = static_cast<uint8_t>(bits)};
+        }
+    }
+    return {};
+}
+
+// `[rsp + 8]`, `QWORD [rbx + rcx*4 - 16]` or `[sp, #8]`.
+inline std::optional<MOperand> parse_asm_mem(const MachineTarget &target, std::string_view text) {
+    if (text.starts_with("QWORD ")) {
+        text.remove_prefix(6);
+    }
+    if (!text.starts_with('[') || !text.ends_with(']')) {
+        return {};
+    }
+    text = text.substr(1, text.size() - 2);
+    MOperand mem{.kind = MOperandKind::mem};
+    bool has_base = false;
+    int64_t sign = 1;
+    while (!text.empty()) {
+        const size_t end = std::min(text.find_first_of("+-,"), text.size());
+        std::string_view term = text.substr(0, end);
+        while (term.starts_with(' ')) {
+            term.remove_prefix(1);
+        }
+        while (term.ends_with(' ')) {
+            term.remove_suffix(1);
+        }
+        if (term.starts_with('#')) {
+            term.remove_prefix(1);
+        }
+        const size_t star = term.find('*');
+        const auto reg = parse_asm_reg(target, term.substr(0, star));
+        if (reg.has_value() && !has_base && star == std::string_view::npos && sign > 0) {
+            mem.reg = reg->reg;
+            has_base = true;
+        } else if (reg.has_value() && mem.index == s_no_index && sign > 0) {
+            const auto scale = star == std::string_view::npos ? std::optional<int64_t>(1)
+                                                               : parse_asm_int(term.substr(star + 1));
+            if (!scale.has_value()) {
+                return {};
+            }
+            mem.index = reg->reg;
+            mem.scale = static_cast<uint8_t>(scale.value());
+        } else if (const auto disp = parse_asm_int(term)) {
+            mem.value += sign * disp.value();
+        } else if (!term.empty()) {
+            return {};
+        }
+        sign = end < text.size() && text[end] == '-' ? -1 : 1;
+        text.remove_prefix(std::min(end + 1, text.size()));
+    }
+    if (!has_base) {
+        return {};
+    }
+    return mem;
+}
+
+inline std::optional<MOperand> parse_asm_operand(const MachineTarget &target, const std::string_view text) {
+    if (const auto reg = parse_asm_reg(target, text)) {
+        return reg;
+    }
+    if (const auto mem = parse_asm_mem(target, text)) {
+        return mem;
+    }
+    const std::string_view digits = text.starts_with(target.imm_prefix) ? text.substr(target.imm_prefix.size()) : text;
+    if (const auto value = parse_asm_int(digits)) {
+        return mimm(value.value());
+    }
+    if (text.starts_with(target.label_prefix)) {
+        if (const auto label = parse_asm_int(text.substr(target.label_prefix.size()))) {
+            return mlabel(label.value());
+        }
+    }
+    static constexpr std::array<std::string_view, 3> s_shifts = {"lsl #", "lsr #", "asr #"};
+    for (size_t shift = 0; shift < s_shifts.size(); shift++) {
+        if (text.starts_with(s_shifts[shift])) {
+            if (const auto amount = parse_asm_int(text.substr(s_shifts[shift].size()))) {
+                return mshift(static_cast<MShift>(shift), amount.value());
+            }
+        }
+    }
+    const auto cond = std::ranges::find(target.conds, text);
+    if (target.arch == MachineArch::aarch64 && cond != target.conds.end()) {
+        return mcond(static_cast<IrCond>(cond - target.conds.begin()));
+    }
+    return {};
+}
+
+// Fills `inst` from `mnemonic` and `operands`, false if any can't be read.
+inline bool parse_asm_inst(const MachineTarget &target, const std::string_view mnemonic,
+                           const std::vector<std::string> &operands, MInst &inst) {
+    const auto op = find_mnemonic(target, mnemonic);
+    if (!op.has_value() || operands.size() > inst.operands.size()) {
+        return false;
+    }
+    inst = {.op = op->first, .cond = op->second};
+    for (const std::string &text: operands) {
+        const auto operand = parse_asm_operand(target, text);
+        if (!operand.has_value()) {
+            return false;
+        }
+        inst.operands[inst.operand_count++] = operand.value();
+    }
+    return true;
+}
+
+// Renders code as assembly into a single buffer sized up front.
+class AsmPrinter {
+public:
+    explicit AsmPrinter(const MachineTarget &target)
+        : m_target(target) {
+    }
+
+    [[nodiscard]] std::string print(const MachineCode &code) {
+        m_out.clear();
+        size_t size = m_target.align_header.size() + m_target.header.size() + code.insts.size() * 32;
+        for (const std::string &comment: code.comments) {
+            size += comment.size();
+        }
+        m_out.reserve(size);
+        if (std::ranges::any_of(code.insts, [](const MInst &inst) { return inst.op == MOp::align; })) {
+            m_out += m_target.align_header;
+        }
+        m_out += m_target.header;
+        for (const MInst &inst: code.insts) {
+            print(code, inst);
+        }
+        return std::move(m_out);
+    }
+
+private:
+    void put_int(const int64_t value) {
+        std::array<char, 24> digits{};
+        const auto [end, error] = std::to_chars(digits.data(), digits.data() + digits.size(), value);
+        m_out.append(digits.data(), end);
+    }
+
+    void put_reg(const uint8_t reg, const uint8_t bits) {
+        m_out += (bits == 64 ? m_target.regs64 : bits == 32 ? m_target.regs32 : m_target.regs8)[reg];
+    }
+
+    void put_mem(const MInst &inst, const MOperand &mem) {
+        if (m_target.arch == MachineArch::aarch64) {
+            m_out += '[';
+            put_reg(mem.reg, 64);
+            m_out += ", #";
+            put_int(mem.value);
+            m_out += ']';
+            return;
+        }
+        m_out += inst.op == MOp::lea ? "[" : "QWORD [";
+        put_reg(mem.reg, 64);
+        if (mem.index != s_no_index) {
+            m_out += " + ";
+            put_reg(mem.index, 64);
+            if (mem.scale != 1) {
+                m_out += '*';
+                put_int(mem.scale);
+            }
+        }
+        if (mem.value != 0) {
+            m_out += mem.value < 0 ? " - " : " + ";
+            put_int(mem.value < 0 ? -mem.value : mem.value);
+        }
+        m_out += ']';
+    }
+
+    void put_operand(const MInst &inst, const MOperand &operand) {
+        switch (operand.kind) {
+            case MOperandKind::reg:
+                put_reg(operand.reg, operand.bits);
+                break;
+            case MOperandKind::imm:
+                m_out += m_target.imm_prefix;
+                put_int(operand.value);
+                break;
+            case MOperandKind::mem:
+                put_mem(inst, operand);
+                break;
+            case MOperandKind::label:
+                m_out += m_target.label_prefix;
+                put_int(operand.value);
+                break;
+            case MOperandKind::shift:
+                m_out += operand.shift == MShift::lsl ? "lsl #" : operand.shift == MShift::lsr ? "lsr #" : "asr #";
+                put_int(operand.value);
+                break;
+            case MOperandKind::cond:
+                m_out += m_target.conds[static_cast<size_t>(operand.value)];
+                break;
+            case MOperandKind::none:
+                break;
+        }
+    }
+
+    void print(const MachineCode &code, const MInst &inst) {
+        switch (inst.op) {
+            case MOp::label:
+                m_out += m_target.label_prefix;
+                put_int(inst.operands[0].value);
+                m_out += ":\n";
+                return;
+            case MOp::comment:
+                m_out += "    ;; ";
+                m_out += code.comments[inst.operands[0].value];
+                m_out += '\n';
+                return;
+            case MOp::align:
+                m_out += m_target.align_directive;
+                put_int(inst.operands[0].value);
+                m_out += '\n';
+                return;
+            default:
+                break;
+        }
+        m_out += "    ";
+        m_out += m_target.mnemonic(inst.op);
+        if (mop_has_cond(inst.op)) {
+            m_out += m_target.conds[static_cast<size_t>(inst.cond)];
+        }
+        for (uint8_t i = 0; i < inst.operand_count; i++) {
+            m_out += i == 0 ? " " : ", ";
+            put_operand(inst, inst.operands[i]);
+        }
+        m_out += '\n';
+    }
+
+    const MachineTarget &m_target;
+    std::string m_out;
+};
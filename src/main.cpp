@@ -1,15 +1,26 @@
+#include <cerrno>
+#include <csignal>
+#include <cstring>
 #include <iostream>
 #include <fstream>
 #include <sstream>
 #include <optional>
 #include <vector>
 
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 #if defined(_WIN32) || defined(__CYGWIN__)
     #define OS "win"
     // Windows (x86 or x64)
 #elif defined(__linux__)
     #define OS "linux"
+    #include "./elf.hpp"
     #include "./generation.hpp"
+    #include "./jit.hpp"
+    #include "./tiered.hpp"
+    #include "./x86_encoder.hpp"
 
 
     // Linux
@@ -28,18 +39,184 @@
 
 #endif
 
+#include "./bytecode.hpp"
+#include "./pass_manager.hpp"
+#include "./process.hpp"
+
+// Writes `text` with as few write calls as the kernel allows, instead of
+// through a stream's buffer.
+void write_file(const char *path, const std::string_view text, const mode_t mode = 0644) {
+    const int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, mode);
+    if (fd < 0 || fchmod(fd, mode) != 0) {
+        std::cerr << "Could not open " << path << ": " << strerror(errno) << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    if (!write_all(fd, text)) {
+        std::cerr << "Could not write " << path << ": " << strerror(errno) << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    close(fd);
+}
+
+void usage() {
+    std::cout << "Incorrect usage. Correct usage is..." << std::endl;
+    std::cout << "hydro [-O0|-O1|-O2|-Os] [--passes=a,b,...] [--time-passes] [--regalloc=stack|linear-scan|graph] [--regalloc-regs=N] [--unroll-factor=N] [--unroll-full-max=N] [--unroll-budget=N]"
+              << " [--no-if-convert] [--profile-generate=FILE] [--profile-use=FILE] [--mtune=NAME] [--sched-model=NAME|none]"
+              << " [--no-peephole] [--peephole-stats] [--no-rotate-loops] [--loop-align=N]"
+              << " [--no-stack-coloring] [--frame-stats] [--use-external-as] [--run] [--interpret]"
+              << " [--tiered] [--tier-threshold=N] [--trace-tiers]"
+              << " [--eval] [--eval-steps=N] [--eval-memory=N] [--eval-keep-prefix] <input.hy>" << std::endl;
+}
+
+std::optional<uint64_t> parse_flag_value(const std::string& arg, const std::string& flag) {
+    if (!arg.starts_with(flag)) {
+        return {};
+    }
+    const std::string value = arg.substr(flag.size());
+    if (value.empty() || !std::ranges::all_of(value, [](const char c) { return std::isdigit(c); })) {
+        std::cerr << "Invalid value for " << flag << " " << value << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    return std::stoull(value);
+}
+
+RegAllocKind default_regalloc(const std::string& opt_level) {
+    if (opt_level == "0") {
+        return RegAllocKind::stack;
+    }
+    if (opt_level == "2" || opt_level == "3") {
+        return RegAllocKind::graph_coloring;
+    }
+    return RegAllocKind::linear_scan;
+}
+
 int main(int argc, char* argv[]) {
-    if (argc != 2) {
-        std::cout << "Incorrect usage. Correct usage is..." << std::endl;
-        std::cout << "hydro <input.hy>" << std::endl;
+    std::optional<std::string> input_path;
+    std::string opt_level = "0";
+    std::optional<uint64_t> unroll_factor;
+    std::optional<uint64_t> unroll_full_max;
+    std::optional<uint64_t> unroll_budget;
+    std::optional<std::string> passes;
+    bool time_passes = false;
+    std::optional<RegAllocKind> regalloc;
+    bool if_convert = true;
+    std::optional<std::string> profile_generate;
+    std::optional<std::string> profile_use;
+    std::string tune = "generic";
+    size_t alloc_regs = SIZE_MAX;
+    std::optional<std::string> sched_model;
+    bool peephole = true;
+    bool peephole_stats = false;
+    bool rotate_loops = true;
+    uint64_t loop_align = 16;
+    bool stack_coloring = true;
+#if defined(__linux__)
+    bool frame_stats = false;
+#endif
+    bool use_external_as = false;
+    bool run = false;
+    bool interpret = false;
+    bool tiered = false;
+    // Only read on Linux, where --tiered is supported.
+    [[maybe_unused]] uint64_t tier_threshold = 1000;
+    [[maybe_unused]] bool trace_tiers = false;
+    bool eval = false;
+    EvalOptions eval_options;
+    for (int i = 1; i < argc; i++) {
+        const std::string arg = argv[i];
+        if (arg == "-O0" || arg == "-O1" || arg == "-O2" || arg == "-O3" || arg == "-Os") {
+            opt_level = arg.substr(2);
+        } else if (const auto factor = parse_flag_value(arg, "--unroll-factor=")) {
+            unroll_factor = factor;
+        } else if (const auto full_max = parse_flag_value(arg, "--unroll-full-max=")) {
+            unroll_full_max = full_max;
+        } else if (const auto budget = parse_flag_value(arg, "--unroll-budget=")) {
+            unroll_budget = budget;
+        } else if (arg.starts_with("--passes=")) {
+            passes = arg.substr(std::string("--passes=").size());
+        } else if (arg == "--regalloc=stack") {
+            regalloc = RegAllocKind::stack;
+        } else if (arg == "--regalloc=linear-scan") {
+            regalloc = RegAllocKind::linear_scan;
+        } else if (arg == "--regalloc=graph") {
+            regalloc = RegAllocKind::graph_coloring;
+        } else if (const auto regs = parse_flag_value(arg, "--regalloc-regs=")) {
+            if (regs.value() < 2) {
+                std::cerr << "--regalloc-regs must be at least 2" << std::endl;
+                return EXIT_FAILURE;
+            }
+            alloc_regs = regs.value();
+        } else if (arg == "--no-if-convert") {
+            if_convert = false;
+        } else if (arg.starts_with("--profile-generate=")) {
+            profile_generate = arg.substr(std::string("--profile-generate=").size());
+        } else if (arg.starts_with("--profile-use=")) {
+            profile_use = arg.substr(std::string("--profile-use=").size());
+        } else if (arg.starts_with("--mtune=")) {
+            tune = arg.substr(std::string("--mtune=").size());
+        } else if (arg.starts_with("--sched-model=")) {
+            sched_model = arg.substr(std::string("--sched-model=").size());
+        } else if (arg == "--no-peephole") {
+            peephole = false;
+        } else if (arg == "--peephole-stats") {
+            peephole_stats = true;
+        } else if (arg == "--no-rotate-loops") {
+            rotate_loops = false;
+        } else if (const auto align = parse_flag_value(arg, "--loop-align=")) {
+            if (align.value() == 0 || (align.value() & (align.value() - 1)) != 0) {
+                std::cerr << "--loop-align must be a power of two" << std::endl;
+                return EXIT_FAILURE;
+            }
+            loop_align = align.value();
+        } else if (arg == "--no-stack-coloring") {
+            stack_coloring = false;
+#if defined(__linux__)
+        } else if (arg == "--frame-stats") {
+            frame_stats = true;
+#endif
+        } else if (arg == "--use-external-as") {
+            use_external_as = true;
+        } else if (arg == "--run") {
+            run = true;
+        } else if (arg == "--interpret") {
+            interpret = true;
+        } else if (arg == "--tiered") {
+            tiered = true;
+        } else if (const auto threshold = parse_flag_value(arg, "--tier-threshold=")) {
+            tiered = true;
+            tier_threshold = threshold.value();
+        } else if (arg == "--trace-tiers") {
+            tiered = true;
+            trace_tiers = true;
+        } else if (arg == "--time-passes") {
+            time_passes = true;
+        } else if (arg == "--eval") {
+            eval = true;
+        } else if (arg == "--eval-keep-prefix") {
+            eval = true;
+            eval_options.keep_prefix = true;
+        } else if (const auto steps = parse_flag_value(arg, "--eval-steps=")) {
+            eval = true;
+            eval_options.max_steps = steps.value();
+        } else if (const auto memory = parse_flag_value(arg, "--eval-memory=")) {
+            eval = true;
+            eval_options.max_memory = memory.value();
+        } else if (!arg.starts_with("-") && !input_path.has_value()) {
+            input_path = arg;
+        } else {
+            usage();
+            return EXIT_FAILURE;
+        }
+    }
+    if (!input_path.has_value()) {
+        usage();
         return EXIT_FAILURE;
-
     }
 
     std::string contents;
     {
         std::stringstream contents_stream;
-        std::fstream input(argv[1], std::ios::in);
+        std::fstream input(input_path.value(), std::ios::in);
         contents_stream << input.rdbuf();
         contents = contents_stream.str();
     }
@@ -52,19 +229,130 @@ int main(int argc, char* argv[]) {
     if (!prog.has_value()) {
         std::cerr << "Invalid Program" << std::endl;
         exit(EXIT_FAILURE);
-    } {
-        Generator generator(prog.value());
-        std::fstream file("out.asm", std::ios::out);
-        file << generator.gen_prog();
+    }
+
+    ArenaAllocator opt_allocator(1024 * 1024 * 64); // 64 MB
+    if (profile_generate.has_value()) {
+        BranchProfile profile;
+        PartialEvaluator(opt_allocator, eval_options).collect_profile(prog.value(), profile);
+        std::ofstream out(profile_generate.value());
+        profile.save(out);
+        std::cout << "[profile] " << profile.size() << " branches written to " << profile_generate.value() << std::endl;
+    }
+    std::optional<BranchProfile> profile;
+    if (profile_use.has_value()) {
+        profile = BranchProfile::load(profile_use.value());
+    }
+
+    PassOptions pass_options{.unroll = UnrollOptions::for_level(opt_level), .eval = eval_options};
+    pass_options.unroll.factor = unroll_factor.value_or(pass_options.unroll.factor);
+    pass_options.unroll.max_full_trip_count = unroll_full_max.value_or(pass_options.unroll.max_full_trip_count);
+    pass_options.unroll.size_budget = unroll_budget.value_or(pass_options.unroll.size_budget);
+    PassManager pass_manager(opt_allocator, pass_options);
+    if (eval) {
+        pass_manager.add_pass("eval");
+    }
+    if (passes.has_value()) {
+        pass_manager.add_pipeline(passes.value());
+    } else {
+        for (const std::string &name: PassManager::pipeline_for_level(opt_level)) {
+            pass_manager.add_pass(name);
+        }
+    }
+    pass_manager.run(prog.value());
+    if (time_passes) {
+        pass_manager.print_timings(std::cout);
+    }
+
+    if (interpret) {
+        const BcProgram bytecode = BytecodeCompiler().compile(prog.value());
+        return exit_status(BytecodeVm(bytecode).run());
+    }
+
+    if (!sched_model.has_value()) {
+        sched_model = opt_level == "2" || opt_level == "3" ? tune : "none";
+    }
+    {
+        const CodegenOptions codegen_options{
+            .regalloc = regalloc.value_or(default_regalloc(opt_level)),
+            .alloc_regs = alloc_regs,
+            .if_convert = if_convert && opt_level != "0",
+            .profile = profile.has_value() ? &profile.value() : nullptr,
+            .tune = tune,
+            .peephole = peephole,
+            .rotate_loops = rotate_loops,
+            .loop_align = loop_align,
+            .stack_coloring = stack_coloring,
+            .sched_model = sched_model.value(),
+        };
+        if (tiered) {
+#if defined(__linux__)
+            const TierOptions tier_options{
+                .hot_threshold = tier_threshold, .trace = trace_tiers, .codegen = codegen_options};
+            return TieredEngine(prog.value(), tier_options).run();
+#else
+            std::cerr << "--tiered is only supported on x86-64 Linux" << std::endl;
+            exit(EXIT_FAILURE);
+#endif
+        }
+#if defined(__APPLE__) && defined(__MACH__)
+        // Started now so that its startup overlaps with code generation; the
+        // assembly reaches it through a pipe instead of out.asm.
+        std::optional<Tool> assembler;
+        if (!run) {
+            assembler.emplace(std::vector<std::string>{"as", "-arch", "arm64", "-o", "out.o", "-"}, true);
+        }
+#endif
+        Generator generator(prog.value(), codegen_options);
+        const MachineCode code = generator.gen_prog();
+#if defined(__linux__)
+        if (time_passes) {
+            generator.pass_timings().print(std::cout, "instructions");
+        }
+        if (frame_stats) {
+            std::cout << "frame: " << generator.frame_stats().bytes << " bytes, "
+                      << generator.frame_stats().uncolored_bytes << " without sharing slots" << std::endl;
+        }
+#endif
+        if (peephole_stats && generator.peephole() != nullptr) {
+            generator.peephole()->print_stats(std::cout);
+        }
+        if (run) {
+#if defined(__linux__)
+            return run_machine_code(X86Encoder().encode(code));
+#else
+            std::cerr << "--run is only supported on x86-64 Linux" << std::endl;
+            exit(EXIT_FAILURE);
+#endif
+        }
+        const std::string assembly = AsmPrinter(Generator::target()).print(code);
+#if defined(__APPLE__) && defined(__MACH__)
+        assembler->feed(assembly);
+        write_file("out.asm", assembly);
+        assembler->finish();
+#else
+        write_file("out.asm", assembly);
+#endif
+#if defined(__linux__)
+        if (!use_external_as) {
+            const std::vector<uint8_t> image = elf_executable(X86Encoder().encode(code));
+            // A fresh inode, so that a copy of the old `out` that is still
+            // running keeps its file.
+            unlink("out");
+            write_file("out", {reinterpret_cast<const char *>(image.data()), image.size()}, 0755);
+        }
+#endif
     }
 
     if (strcmp(OS, "linux") == 0) {
-        system("nasm -felf64 out.asm");
-        system("ld -o out out.o");
+        // nasm reads its input again on every pass, so it gets the file.
+        if (use_external_as) {
+            run_tool({"nasm", "-felf64", "-o", "out.o", "out.asm"});
+            run_tool({"ld", "-o", "out", "out.o"});
+        }
     }
     else if (strcmp(OS, "mac") == 0) {
-        system("as -arch arm64 -o out.o out.asm");
-        system("clang++ -o out out.o");
+        run_tool({"clang++", "-o", "out", "out.o"});
     }
     else if (strcmp(OS, "win") == 0) {
         // Add Windows compilation commands here
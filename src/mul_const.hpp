@@ -0,0 +1,171 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cstdint>
+#include <optional>
+#include <string_view>
+#include <vector>
+
+// Approximate latencies in cycles of the instructions a multiplication by a
+// constant can be rewritten into, for one target microarchitecture. Register
+// copies are taken to be free, as renaming eliminates them.
+struct MulTuning {
+    std::string_view name;
+    int mul;
+    int shift;
+    // add, sub and neg.
+    int add;
+    // x86 lea with a scaled index, or an AArch64 add or sub of a shifted
+    // register.
+    int shifted_add;
+    int max_shifted_add;
+    // Whether a shifted register can be subtracted (AArch64 only).
+    bool shifted_sub;
+};
+
+// A lea with a scaled index takes two cycles from Ice Lake on and one before,
+// so the generic tuning assumes two.
+inline constexpr std::array<MulTuning, 4> s_x86_tunings = {{
+    {.name = "generic", .mul = 3, .shift = 1, .add = 1, .shifted_add = 2, .max_shifted_add = 3, .shifted_sub = false},
+    {.name = "skylake", .mul = 3, .shift = 1, .add = 1, .shifted_add = 1, .max_shifted_add = 3, .shifted_sub = false},
+    {.name = "icelake", .mul = 3, .shift = 1, .add = 1, .shifted_add = 2, .max_shifted_add = 3, .shifted_sub = false},
+    {.name = "silvermont", .mul = 5, .shift = 1, .add = 1, .shifted_add = 1, .max_shifted_add = 3, .shifted_sub = false},
+}};
+
+inline constexpr std::array<MulTuning, 2> s_aarch64_tunings = {{
+    {.name = "generic", .mul = 4, .shift = 1, .add = 1, .shifted_add = 2, .max_shifted_add = 63, .shifted_sub = true},
+    {.name = "apple-m1", .mul = 3, .shift = 1, .add = 1, .shifted_add = 1, .max_shifted_add = 63, .shifted_sub = true},
+}};
+
+template<size_t N>
+const MulTuning *find_tuning(const std::array<MulTuning, N> &tunings, const std::string_view name) {
+    for (const MulTuning &tuning: tunings) {
+        if (tuning.name == name) {
+            return &tuning;
+        }
+    }
+    return nullptr;
+}
+
+// One step of computing t = n * x, where t starts out as x. `shift` is k.
+enum class MulOp {
+    shl, // t << k
+    add_self, // t + (t << k)
+    sub_self, // t - (t << k)
+    add_x, // (t << k) + x
+    sub_x, // t - x
+    rsub_x, // x - (t << k)
+    neg, // -t
+};
+
+struct MulStep {
+    MulOp op;
+    int shift = 0;
+};
+
+// The cheapest shift/add sequence computing n * x that beats a multiply,
+// found by peeling the last step off n the way GCC's synth_mult does.
+class MulSynth {
+public:
+    explicit MulSynth(const MulTuning &tuning)
+        : m_tuning(tuning) {
+    }
+
+    [[nodiscard]] std::optional<std::vector<MulStep>> synthesize(const int64_t n) const {
+        Plan best{.cost = m_tuning.mul, .steps = {}};
+        std::vector<MulStep> steps;
+        if (!search(n, 0, steps, best)) {
+            return {};
+        }
+        return best.steps;
+    }
+
+    [[nodiscard]] static bool uses_x(const std::vector<MulStep> &steps) {
+        for (const MulStep &step: steps) {
+            if (step.op == MulOp::add_x || step.op == MulOp::sub_x || step.op == MulOp::rsub_x) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+private:
+    struct Plan {
+        int cost;
+        std::vector<MulStep> steps;
+    };
+
+    [[nodiscard]] int step_cost(const MulStep &step) const {
+        switch (step.op) {
+            case MulOp::shl:
+                return m_tuning.shift;
+            case MulOp::sub_x:
+            case MulOp::neg:
+                return m_tuning.add;
+            case MulOp::add_x:
+                return step.shift == 0 ? m_tuning.add : m_tuning.shifted_add;
+            default:
+                return m_tuning.shifted_add;
+        }
+    }
+
+    // `steps` holds, last first, the steps that take n to the original target.
+    // Returns whether a plan cheaper than `best` was found.
+    bool search(const int64_t n, const int cost, std::vector<MulStep> &steps, Plan &best) const {
+        if (cost >= best.cost) {
+            return false;
+        }
+        if (n == 1) {
+            best = {.cost = cost, .steps = {steps.rbegin(), steps.rend()}};
+            return true;
+        }
+        bool found = false;
+        const auto try_step = [&](const int64_t m, const MulStep step) {
+            steps.push_back(step);
+            found |= search(m, cost + step_cost(step), steps, best);
+            steps.pop_back();
+        };
+        if (n == 0) {
+            return false;
+        }
+        const int zeros = std::countr_zero(static_cast<uint64_t>(n));
+        if (zeros > 0) {
+            try_step(n >> zeros, {.op = MulOp::shl, .shift = zeros});
+        }
+        for (int k = 1; k <= m_tuning.max_shifted_add && k < 63; k++) {
+            const int64_t add_factor = (int64_t{1} << k) + 1;
+            if (n % add_factor == 0) {
+                try_step(n / add_factor, {.op = MulOp::add_self, .shift = k});
+            }
+            // k = 1 would just be a neg.
+            const int64_t sub_factor = 1 - (int64_t{1} << k);
+            if (m_tuning.shifted_sub && k > 1 && n % sub_factor == 0) {
+                try_step(n / sub_factor, {.op = MulOp::sub_self, .shift = k});
+            }
+        }
+        if (n != INT64_MIN) {
+            const auto below = static_cast<uint64_t>(n - 1);
+            const int max_k = std::min(std::countr_zero(below), m_tuning.max_shifted_add);
+            for (int k = 0; k <= max_k && below != 0; k++) {
+                try_step((n - 1) >> k, {.op = MulOp::add_x, .shift = k});
+            }
+            if (m_tuning.shifted_sub && n != INT64_MIN + 1) {
+                const auto above = static_cast<uint64_t>(1 - n);
+                const int max_rk = std::min(std::countr_zero(above), m_tuning.max_shifted_add);
+                for (int k = 0; k <= max_rk && above != 0; k++) {
+                    try_step((1 - n) >> k, {.op = MulOp::rsub_x, .shift = k});
+                }
+            }
+        }
+        if (n != INT64_MAX && (n & 1) != 0) {
+            try_step(n + 1, {.op = MulOp::sub_x});
+        }
+        if (n < 0 && n != INT64_MIN) {
+            try_step(-n, {.op = MulOp::neg});
+        }
+        return found;
+    }
+
+    const MulTuning &m_tuning;
+};
@@ -39,8 +39,13 @@ struct NodeBinExprDiv {
     NodeExpr* rhs;
 };
 
+struct NodeBinExprMod {
+    NodeExpr* lhs;
+    NodeExpr* rhs;
+};
+
 struct NodeBinExpr {
-    std::variant<NodeBinExprAdd*, NodeBinExprMult*, NodeBinExprSub*, NodeBinExprDiv*> var;
+    std::variant<NodeBinExprAdd*, NodeBinExprMult*, NodeBinExprSub*, NodeBinExprDiv*, NodeBinExprMod*> var;
 };
 
 
@@ -149,8 +154,12 @@ struct NodeCompoundDiv{
     NodeTermIdent* term_ident;
     NodeTerm* term;
 };
+struct NodeCompoundMod{
+    NodeTermIdent* term_ident;
+    NodeTerm* term;
+};
 struct NodeCompound {
-    std::variant<NodeCompoundPlus*, NodeCompoundSub*, NodeCompoundDiv*, NodeCompoundMult*> var;
+    std::variant<NodeCompoundPlus*, NodeCompoundSub*, NodeCompoundDiv*, NodeCompoundMult*, NodeCompoundMod*> var;
 };
 struct NodeVarReassign {
     std::variant<NodeUnary*, NodeCompound*> var;
@@ -266,6 +275,14 @@ public:
                 bin_expr->var = div;
                 expr_lhs->var = bin_expr;
 
+            } else if (type == TokenType::percent) {
+                auto mod = m_allocator.emplace<NodeBinExprMod>();
+                mod->lhs = expr_lhs2;
+                mod->rhs = expr_rhs.value();
+                auto bin_expr = m_allocator.emplace<NodeBinExpr>();
+                bin_expr->var = mod;
+                expr_lhs->var = bin_expr;
+
             } else if (type == TokenType::greater) {
                 auto greater = m_allocator.emplace<NodeCondExprGreater>();
                 greater->lhs = expr_lhs2;
@@ -413,7 +430,8 @@ public:
             peek(1).has_value() && (peek(1).value().type == TokenType::compound_add ||
             peek(1).value().type == TokenType::compound_sub ||
             peek(1).value().type == TokenType::compound_mul ||
-            peek(1).value().type == TokenType::compound_div)) {
+            peek(1).value().type == TokenType::compound_div ||
+            peek(1).value().type == TokenType::compound_mod)) {
 
             const auto term_ident = m_allocator.emplace<NodeTermIdent>();
             term_ident->ident = consume();
@@ -466,6 +484,22 @@ public:
                 try_consume_err(TokenType::semi);
                 return var_reassign;
             }
+            if (try_consume(TokenType::compound_mod).has_value()) {
+                auto mod = m_allocator.emplace<NodeCompoundMod>();
+                mod->term_ident = term_ident;
+                if (const auto term = parse_term()) {
+                    mod->term = term.value();
+                }
+                else {
+                    error_expected("'term'");
+                }
+                auto compound = m_allocator.emplace<NodeCompound>();
+                compound->var = mod;
+                auto var_reassign = m_allocator.emplace<NodeVarReassign>();
+                var_reassign->var = compound;
+                try_consume_err(TokenType::semi);
+                return var_reassign;
+            }
             if (try_consume(TokenType::compound_mul).has_value()) {
                 auto mul = m_allocator.emplace<NodeCompoundMult>();
                 mul->term_ident = term_ident;
@@ -620,7 +654,7 @@ public:
 
 private:
     [[nodiscard]] std::optional<Token> peek(const int offset = 0) const {
-        if (m_index + offset >= m_tokens.size()) {
+        if (static_cast<size_t>(m_index + offset) >= m_tokens.size()) {
             return {};
         }
         return m_tokens.at(m_index + offset);
@@ -0,0 +1,178 @@
+#pragma once
+#include <functional>
+#include <iostream>
+#include <sstream>
+#include <vector>
+
+#include "./evaluator.hpp"
+#include "./pass_timings.hpp"
+#include "./unroll.hpp"
+
+struct PassOptions {
+    UnrollOptions unroll;
+    EvalOptions eval;
+};
+
+struct LoopInfo {
+    size_t loops = 0;
+    size_t max_depth = 0;
+};
+
+// Results are computed on first use and kept until a pass reports a change.
+class AnalysisManager {
+public:
+    size_t program_size(const NodeProgram &prog) {
+        if (!m_program_size.has_value()) {
+            m_program_size = count_nodes(prog);
+        }
+        return m_program_size.value();
+    }
+
+    const LoopInfo &loop_info(const NodeProgram &prog) {
+        if (!m_loop_info.has_value()) {
+            LoopInfo info;
+            for (const NodeStmt *stmt: prog.stmts) {
+                collect_loops(stmt, 0, info);
+            }
+            m_loop_info = info;
+        }
+        return m_loop_info.value();
+    }
+
+    void invalidate() {
+        m_program_size.reset();
+        m_loop_info.reset();
+    }
+
+private:
+    static void collect_loops(const NodeScope *scope, const size_t depth, LoopInfo &info) {
+        for (const NodeStmt *stmt: scope->stmts) {
+            collect_loops(stmt, depth, info);
+        }
+    }
+
+    static void collect_loops(const NodeIfPred *pred, const size_t depth, LoopInfo &info) {
+        if (const auto elif = std::get_if<NodeIfPredElif *>(&pred->var)) {
+            collect_loops((*elif)->scope, depth, info);
+            if ((*elif)->pred.has_value()) {
+                collect_loops((*elif)->pred.value(), depth, info);
+            }
+            return;
+        }
+        collect_loops(std::get<NodeIfPredElse *>(pred->var)->scope, depth, info);
+    }
+
+    static void collect_loops(const NodeStmt *stmt, const size_t depth, LoopInfo &info) {
+        if (const auto scope = std::get_if<NodeScope *>(&stmt->var)) {
+            collect_loops(*scope, depth, info);
+        } else if (const auto stmt_if = std::get_if<NodeStmtIf *>(&stmt->var)) {
+            collect_loops((*stmt_if)->scope, depth, info);
+            if ((*stmt_if)->pred.has_value()) {
+                collect_loops((*stmt_if)->pred.value(), depth, info);
+            }
+        } else if (const auto stmt_while = std::get_if<NodeStmtWhile *>(&stmt->var)) {
+            info.loops++;
+            info.max_depth = std::max(info.max_depth, depth + 1);
+            collect_loops((*stmt_while)->scope, depth + 1, info);
+        }
+    }
+
+    std::optional<size_t> m_program_size;
+    std::optional<LoopInfo> m_loop_info;
+};
+
+struct Pass {
+    std::string name;
+    bool needs_loops = false;
+    // Returns true if the program was changed.
+    std::function<bool(NodeProgram &, ArenaAllocator &, const PassOptions &)> run;
+};
+
+class PassManager {
+public:
+    PassManager(ArenaAllocator &allocator, PassOptions options)
+        : m_allocator(allocator)
+        , m_options(std::move(options)) {
+    }
+
+    static std::optional<Pass> make_pass(const std::string &name) {
+        if (name == "eval") {
+            return Pass{.name = name, .needs_loops = false, .run = [](NodeProgram &prog, ArenaAllocator &allocator,
+                                                                     const PassOptions &options) {
+                PartialEvaluator evaluator(allocator, options.eval);
+                const bool changed = evaluator.run(prog);
+                evaluator.print_report(std::cout);
+                return changed;
+            }};
+        }
+        if (name == "closed-form") {
+            return Pass{.name = name, .needs_loops = true, .run = [](NodeProgram &prog, ArenaAllocator &allocator,
+                                                                    const PassOptions &) {
+                LoopClosedForm closed_form(allocator);
+                closed_form.run(prog);
+                return closed_form.replaced_count() > 0;
+            }};
+        }
+        if (name == "unroll") {
+            return Pass{.name = name, .needs_loops = true, .run = [](NodeProgram &prog, ArenaAllocator &allocator,
+                                                                    const PassOptions &options) {
+                LoopUnroller unroller(allocator, options.unroll);
+                unroller.run(prog);
+                return unroller.full_count() + unroller.partial_count() > 0;
+            }};
+        }
+        return {};
+    }
+
+    static std::vector<std::string> pipeline_for_level(const std::string &level) {
+        if (level == "0") {
+            return {};
+        }
+        return {"closed-form", "unroll"};
+    }
+
+    // Parses a comma separated list of pass names.
+    void add_pipeline(const std::string &passes) {
+        std::stringstream stream(passes);
+        std::string name;
+        while (std::getline(stream, name, ',')) {
+            add_pass(name);
+        }
+    }
+
+    void add_pass(const std::string &name) {
+        std::optional<Pass> pass = make_pass(name);
+        if (!pass.has_value()) {
+            std::cerr << "Unknown pass " << name << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        m_passes.push_back(std::move(pass.value()));
+    }
+
+    void run(NodeProgram &prog) {
+        for (const Pass &pass: m_passes) {
+            const size_t size_before = m_analyses.program_size(prog);
+            if (pass.needs_loops && m_analyses.loop_info(prog).loops == 0) {
+                m_timings.add({.name = pass.name, .seconds = 0, .size_before = size_before,
+                               .size_after = size_before, .skipped = true});
+                continue;
+            }
+            m_timings.time(pass.name, [&] { return m_analyses.program_size(prog); }, [&] {
+                if (pass.run(prog, m_allocator, m_options)) {
+                    m_analyses.invalidate();
+                }
+            });
+        }
+    }
+
+    void print_timings(std::ostream &out) const {
+        m_timings.print(out, "AST nodes");
+    }
+
+private:
+    ArenaAllocator &m_allocator;
+    PassOptions m_options;
+    AnalysisManager m_analyses;
+    std::vector<Pass> m_passes;
+    PassTimings m_timings;
+};
@@ -0,0 +1,67 @@
+#pragma once
+#include <chrono>
+#include <cstdint>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// Wall time and size change of each pass that ran, for --time-passes. The
+// size is in whatever unit the passes work on: AST nodes, IR or machine
+// instructions.
+class PassTimings {
+public:
+    struct Timing {
+        std::string name;
+        double seconds;
+        size_t size_before;
+        size_t size_after;
+        bool skipped;
+    };
+
+    void add(Timing timing) {
+        m_timings.push_back(std::move(timing));
+    }
+
+    // Runs `pass` and records it, with `size` measured before and after.
+    template<typename Pass, typename Size>
+    void time(const std::string &name, Size &&size, Pass &&pass) {
+        const size_t size_before = size();
+        const auto start = std::chrono::steady_clock::now();
+        pass();
+        const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        add({.name = name, .seconds = elapsed.count(), .size_before = size_before, .size_after = size(),
+             .skipped = false});
+    }
+
+    void print(std::ostream &out, const std::string &unit) const {
+        out << std::left << std::setw(16) << "pass" << std::right << std::setw(12) << "time (ms)" << std::setw(24)
+            << unit << "\n";
+        double total = 0;
+        for (const Timing &timing: m_timings) {
+            total += timing.seconds;
+            print_row(out, timing.name, timing.seconds, timing.size_before, timing.size_after);
+            if (timing.skipped) {
+                out << "  (skipped, no loops)";
+            }
+            out << "\n";
+        }
+        if (!m_timings.empty()) {
+            print_row(out, "total", total, m_timings.front().size_before, m_timings.back().size_after);
+            out << "\n";
+        }
+    }
+
+private:
+    static void print_row(std::ostream &out, const std::string &name, const double seconds, const size_t before,
+                          const size_t after) {
+        const auto delta = static_cast<int64_t>(after) - static_cast<int64_t>(before);
+        std::stringstream sizes;
+        sizes << before << " -> " << after << " (" << (delta >= 0 ? "+" : "") << delta << ")";
+        out << std::left << std::setw(16) << name << std::right << std::setw(12) << std::fixed
+            << std::setprecision(3) << seconds * 1000 << std::setw(24) << sizes.str();
+    }
+
+    std::vector<Timing> m_timings;
+};
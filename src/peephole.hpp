@@ -0,0 +1,389 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <cctype>
+#include <iomanip>
+#include <iostream>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "./machine.hpp"
+
+// A rewrite of adjacent instructions in the emitted code. `match` and
+// `replace` are instructions separated by ';'. A `$` followed by a class
+// letter and an optional number is a variable: `$r` a register, `$m` a memory
+// operand, `$i` an immediate, `$l` a label and `$a` any operand. A variable
+// used twice must bind the same operand, and the line `$l:` matches a label.
+// Comments between the instructions don't break a match; labels and
+// directives do.
+struct PeepholeRule {
+    std::string_view name;
+    std::string_view match;
+    std::string_view replace;
+    // Cycles of latency saved each time the rule fires, as measured by the
+    // superoptimizer that generated it.
+    int cycles = 0;
+};
+
+// Rules found by tools/superopt, regenerated with tools/regen_peephole_rules.sh.
+#include "./peephole_x86_generated.inc"
+#include "./peephole_aarch64_generated.inc"
+
+struct PeepholeTarget {
+    std::span<const PeepholeRule> rules;
+    // Applied after `rules`.
+    std::span<const PeepholeRule> generated;
+    const MachineTarget *machine;
+};
+
+inline constexpr std::array s_x86_peephole_rules = std::to_array<PeepholeRule>({
+    {.name = "push-pop-same", .match = "push $r; pop $r", .replace = ""},
+    {.name = "push-pop", .match = "push $a; pop $r", .replace = "mov $r, $a"},
+    {.name = "jmp-next", .match = "jmp $l; $l:", .replace = "$l:"},
+    {.name = "add-rsp-0", .match = "add rsp, 0", .replace = ""},
+    {.name = "reload-stored", .match = "mov $m, $r; mov $r, $m", .replace = "mov $m, $r"},
+    {.name = "forward-store", .match = "mov $m, $r1; mov $r2, $m", .replace = "mov $m, $r1; mov $r2, $r1"},
+    {.name = "forward-store-imm", .match = "mov $m, $i; mov $r, $m", .replace = "mov $m, $i; mov $r, $i"},
+    {.name = "reload", .match = "mov $r, $m; mov $r, $m", .replace = "mov $r, $m"},
+    {.name = "store-loaded", .match = "mov $r, $m; mov $m, $r", .replace = "mov $r, $m"},
+    {.name = "mov-self", .match = "mov $r, $r", .replace = ""},
+});
+
+inline constexpr std::array s_aarch64_peephole_rules = std::to_array<PeepholeRule>({
+    {.name = "reload-stored", .match = "str $r, $m; ldr $r, $m", .replace = "str $r, $m"},
+    {.name = "forward-store", .match = "str $r1, $m; ldr $r2, $m", .replace = "str $r1, $m; mov $r2, $r1"},
+    {.name = "reload", .match = "ldr $r, $m; ldr $r, $m", .replace = "ldr $r, $m"},
+    {.name = "store-loaded", .match = "ldr $r, $m; str $r, $m", .replace = "ldr $r, $m"},
+    {.name = "b-next", .match = "b $l; $l:", .replace = "$l:"},
+    {.name = "mov-self", .match = "mov $r, $r", .replace = ""},
+});
+
+inline constexpr PeepholeTarget s_x86_peephole = {
+    .rules = s_x86_peephole_rules,
+    .generated = s_x86_generated_peephole_rules,
+    .machine = &s_x86_machine,
+};
+
+inline constexpr PeepholeTarget s_aarch64_peephole = {
+    .rules = s_aarch64_peephole_rules,
+    .generated = s_aarch64_generated_peephole_rules,
+    .machine = &s_aarch64_machine,
+};
+
+enum class AsmLineKind { instruction, label, comment, directive };
+
+// A parsed instruction, or a label with the name as its only operand.
+struct AsmLine {
+    bool label = false;
+    std::string mnemonic;
+    std::vector<std::string> operands;
+};
+
+inline AsmLineKind asm_line_kind(const std::string_view line) {
+    const size_t first = line.find_first_not_of(' ');
+    if (first == std::string_view::npos || line[first] == ';' || line.substr(first).starts_with("//")) {
+        return AsmLineKind::comment;
+    }
+    if (first == 0) {
+        return line.ends_with(':') ? AsmLineKind::label : AsmLineKind::directive;
+    }
+    return AsmLineKind::instruction;
+}
+
+inline std::string_view trim_spaces(std::string_view text) {
+    const size_t first = text.find_first_not_of(' ');
+    if (first == std::string_view::npos) {
+        return {};
+    }
+    text.remove_prefix(first);
+    return text.substr(0, text.find_last_not_of(' ') + 1);
+}
+
+// Operands are split on commas outside brackets.
+inline AsmLine parse_asm_line(std::string_view text) {
+    text = trim_spaces(text);
+    if (text.ends_with(':')) {
+        return AsmLine{.label = true, .mnemonic = {}, .operands = {std::string(text.substr(0, text.size() - 1))}};
+    }
+    const size_t space = text.find(' ');
+    AsmLine line{.label = false, .mnemonic = std::string(text.substr(0, space)), .operands = {}};
+    if (space == std::string_view::npos) {
+        return line;
+    }
+    const std::string_view operands = text.substr(space + 1);
+    int depth = 0;
+    size_t begin = 0;
+    for (size_t i = 0; i <= operands.size(); i++) {
+        if (i == operands.size() || (operands[i] == ',' && depth == 0)) {
+            line.operands.emplace_back(trim_spaces(operands.substr(begin, i - begin)));
+            begin = i + 1;
+        } else if (operands[i] == '[') {
+            depth++;
+        } else if (operands[i] == ']') {
+            depth--;
+        }
+    }
+    return line;
+}
+
+inline bool asm_is_memory(const std::string_view operand) {
+    return operand.ends_with(']') && (operand.starts_with('[') || operand.starts_with("QWORD ["));
+}
+
+inline bool asm_is_imm(const std::string_view operand) {
+    return !operand.empty() && (operand[0] == '#' || operand[0] == '-' || (operand[0] >= '0' && operand[0] <= '9'));
+}
+
+// Reads assembly printed by AsmPrinter back into code. Directives and labels
+// that aren't numbered, like the header's, are dropped; an instruction that
+// can't be read makes the whole text unreadable.
+inline std::optional<MachineCode> parse_asm(const MachineTarget &target, const std::string_view text) {
+    MachineCode code;
+    size_t begin = 0;
+    while (begin < text.size()) {
+        const size_t end = std::min(text.find('\n', begin), text.size());
+        const std::string_view line = text.substr(begin, end - begin);
+        begin = end + 1;
+        switch (asm_line_kind(line)) {
+            case AsmLineKind::comment:
+                if (const std::string_view body = trim_spaces(line); body.starts_with(";; ")) {
+                    code.comment(std::string(body.substr(3)));
+                }
+                break;
+            case AsmLineKind::label: {
+                const auto label = parse_asm_operand(target, line.substr(0, line.size() - 1));
+                if (label.has_value() && label->kind == MOperandKind::label) {
+                    code.label(label->value);
+                }
+                break;
+            }
+            case AsmLineKind::directive:
+                if (line.starts_with(target.align_directive)) {
+                    if (const auto boundary = parse_asm_int(line.substr(target.align_directive.size()))) {
+                        code.align(boundary.value());
+                    }
+                }
+                break;
+            case AsmLineKind::instruction: {
+                const AsmLine asm_line = parse_asm_line(line);
+                if (!parse_asm_inst(target, asm_line.mnemonic, asm_line.operands, code.insts.emplace_back())) {
+                    return {};
+                }
+                break;
+            }
+        }
+    }
+    return code;
+}
+
+// Runs the target's rules over the code, one instruction at a time: each new
+// instruction is matched against the rules as the last one of a window, and a
+// replacement goes back in front of the input so it is matched again.
+class Peephole {
+public:
+    explicit Peephole(const PeepholeTarget &target)
+        : m_target(target) {
+        for (const std::span<const PeepholeRule> rules: {target.rules, target.generated}) {
+            for (const PeepholeRule &rule: rules) {
+                m_rules.push_back({.name = rule.name, .match = parse_lines(rule.match),
+                                   .replace = parse_lines(rule.replace), .cycles = rule.cycles, .fired = 0});
+            }
+        }
+    }
+
+    void run(MachineCode &code) {
+        std::vector<MInst> pending(code.insts.rbegin(), code.insts.rend());
+        std::vector<MInst> out;
+        out.reserve(code.insts.size());
+        while (!pending.empty()) {
+            out.push_back(pending.back());
+            pending.pop_back();
+            if (out.back().op == MOp::comment) {
+                continue;
+            }
+            for (Rule &rule: m_rules) {
+                if (apply(rule, out, pending)) {
+                    break;
+                }
+            }
+        }
+        code.insts = std::move(out);
+    }
+
+    // How often each rule fired and, for generated rules, the cycles of
+    // latency that saved.
+    void print_stats(std::ostream &out) const {
+        out << std::left << std::setw(24) << "peephole rule" << std::right << std::setw(8) << "fired"
+            << std::setw(10) << "cycles" << "\n";
+        size_t total = 0;
+        size_t total_cycles = 0;
+        for (const Rule &rule: m_rules) {
+            const size_t cycles = rule.fired * rule.cycles;
+            out << std::left << std::setw(24) << rule.name << std::right << std::setw(8) << rule.fired
+                << std::setw(10) << cycles << "\n";
+            total += rule.fired;
+            total_cycles += cycles;
+        }
+        out << std::left << std::setw(24) << "total" << std::right << std::setw(8) << total << std::setw(10)
+            << total_cycles << "\n";
+    }
+
+private:
+    // A literal operand, or a variable when `var` isn't empty.
+    struct PatternOperand {
+        std::string var;
+        MOperand literal;
+    };
+
+    struct Pattern {
+        MOp op;
+        IrCond cond;
+        std::vector<PatternOperand> operands;
+    };
+
+    struct Rule {
+        std::string_view name;
+        std::vector<Pattern> match;
+        std::vector<Pattern> replace;
+        int cycles;
+        size_t fired;
+    };
+
+    struct Binding {
+        std::string_view var;
+        MOperand operand;
+    };
+
+    [[nodiscard]] std::vector<Pattern> parse_lines(const std::string_view text) const {
+        std::vector<Pattern> patterns;
+        size_t begin = 0;
+        while (begin < text.size()) {
+            const size_t end = std::min(text.find(';', begin), text.size());
+            if (!trim_spaces(text.substr(begin, end - begin)).empty()) {
+                patterns.push_back(parse_pattern(parse_asm_line(text.substr(begin, end - begin))));
+            }
+            begin = end + 1;
+        }
+        return patterns;
+    }
+
+    [[nodiscard]] Pattern parse_pattern(const AsmLine &line) const {
+        Pattern pattern{.op = MOp::label, .cond = IrCond::eq, .operands = {}};
+        if (!line.label) {
+            const auto op = find_mnemonic(*m_target.machine, line.mnemonic);
+            if (!op.has_value()) {
+                std::cerr << "Unknown instruction in peephole rule: " << line.mnemonic << std::endl;
+                exit(EXIT_FAILURE);
+            }
+            pattern.op = op->first;
+            pattern.cond = op->second;
+        }
+        for (const std::string &operand: line.operands) {
+            if (operand.starts_with('$')) {
+                pattern.operands.push_back({.var = operand, .literal = {}});
+                continue;
+            }
+            const auto literal = parse_asm_operand(*m_target.machine, operand);
+            if (!literal.has_value()) {
+                std::cerr << "Unknown operand in peephole rule: " << operand << std::endl;
+                exit(EXIT_FAILURE);
+            }
+            pattern.operands.push_back({.var = {}, .literal = literal.value()});
+        }
+        return pattern;
+    }
+
+    [[nodiscard]] bool bind(const PatternOperand &pattern, const MOperand &operand,
+                            std::vector<Binding> &bindings) const {
+        if (pattern.var.empty()) {
+            return pattern.literal == operand;
+        }
+        for (const Binding &binding: bindings) {
+            if (binding.var == pattern.var) {
+                return binding.operand == operand;
+            }
+        }
+        const char cls = pattern.var.size() > 1 ? pattern.var[1] : 'a';
+        const bool fits = cls == 'r' ? is_gpr(*m_target.machine, operand)
+                          : cls == 'm' ? operand.kind == MOperandKind::mem
+                          : cls == 'i' ? operand.kind == MOperandKind::imm
+                                       : true;
+        if (fits) {
+            bindings.push_back({.var = pattern.var, .operand = operand});
+        }
+        return fits;
+    }
+
+    [[nodiscard]] bool match(const Pattern &pattern, const MInst &inst, std::vector<Binding> &bindings) const {
+        if (inst.op != pattern.op || inst.cond != pattern.cond || inst.operand_count != pattern.operands.size()) {
+            return false;
+        }
+        for (size_t i = 0; i < pattern.operands.size(); i++) {
+            if (!bind(pattern.operands[i], inst.operands[i], bindings)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    static MInst substitute(const Pattern &pattern, const std::vector<Binding> &bindings) {
+        MInst inst{.op = pattern.op, .cond = pattern.cond};
+        for (const PatternOperand &operand: pattern.operands) {
+            MOperand &out = inst.operands[inst.operand_count++];
+            out = operand.literal;
+            for (const Binding &binding: bindings) {
+                if (binding.var == operand.var) {
+                    out = binding.operand;
+                    break;
+                }
+            }
+        }
+        return inst;
+    }
+
+    // Matches `rule` against the instructions and labels at the end of `out`.
+    bool apply(Rule &rule, std::vector<MInst> &out, std::vector<MInst> &pending) const {
+        std::vector<size_t> window;
+        for (size_t i = out.size(); i > 0 && window.size() < rule.match.size(); i--) {
+            if (out[i - 1].op == MOp::align) {
+                return false;
+            }
+            if (out[i - 1].op != MOp::comment) {
+                window.insert(window.begin(), i - 1);
+            }
+        }
+        if (window.size() < rule.match.size()) {
+            return false;
+        }
+        std::vector<Binding> bindings;
+        for (size_t i = 0; i < window.size(); i++) {
+            if (!match(rule.match[i], out[window[i]], bindings)) {
+                return false;
+            }
+        }
+        // An address computed from a register the rule reads or writes may
+        // not be the same address both times.
+        for (const Binding &mem: bindings) {
+            for (const Binding &reg: bindings) {
+                if (mem.operand.kind == MOperandKind::mem && reg.var.starts_with("$r") &&
+                    (mem.operand.reg == reg.operand.reg || mem.operand.index == reg.operand.reg)) {
+                    return false;
+                }
+            }
+        }
+        for (auto it = window.rbegin(); it != window.rend(); ++it) {
+            out.erase(out.begin() + static_cast<std::ptrdiff_t>(*it));
+        }
+        for (auto it = rule.replace.rbegin(); it != rule.replace.rend(); ++it) {
+            pending.push_back(substitute(*it, bindings));
+        }
+        rule.fired++;
+        return true;
+    }
+
+    const PeepholeTarget &m_target;
+    std::vector<Rule> m_rules;
+};
@@ -0,0 +1,134 @@
+#pragma once
+#include <spawn.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+extern char **environ;
+
+// Writes all of `text` to `fd`, retrying short and interrupted writes. False
+// with errno set if a write fails.
+inline bool write_all(const int fd, const std::string_view text) {
+    size_t written = 0;
+    while (written < text.size()) {
+        const ssize_t n = write(fd, text.data() + written, text.size() - written);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        written += static_cast<size_t>(n);
+    }
+    return true;
+}
+
+// Waits for `pid` and returns the exit code it ended with, or 128 plus the
+// signal number if a signal ended it, like a shell.
+inline int wait_exit_status(const pid_t pid) {
+    int status = 0;
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR) {
+            std::cerr << "Could not wait for process " << pid << ": " << strerror(errno) << std::endl;
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (WIFSIGNALED(status)) {
+        return 128 + WTERMSIG(status);
+    }
+    return WEXITSTATUS(status);
+}
+
+// A toolchain program (assembler, linker) started from an explicit argv,
+// looked up on PATH, without a shell in between.
+class Tool {
+public:
+    // With `pipe_input`, the tool's standard input is a pipe that feed()
+    // writes to, so it can start before its input is ready.
+    explicit Tool(std::vector<std::string> argv, const bool pipe_input = false)
+        : m_argv(std::move(argv)) {
+        int input[2] = {-1, -1};
+        if (pipe_input && pipe(input) != 0) {
+            std::cerr << "Could not create a pipe for " << m_argv[0] << ": " << strerror(errno) << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        posix_spawn_file_actions_t actions;
+        posix_spawn_file_actions_init(&actions);
+        if (pipe_input) {
+            posix_spawn_file_actions_adddup2(&actions, input[0], STDIN_FILENO);
+            posix_spawn_file_actions_addclose(&actions, input[0]);
+            posix_spawn_file_actions_addclose(&actions, input[1]);
+        }
+        std::vector<char *> args;
+        for (std::string &arg: m_argv) {
+            args.push_back(arg.data());
+        }
+        args.push_back(nullptr);
+        // Whatever is still buffered would reach the terminal after the
+        // tool's own output.
+        std::cout.flush();
+        const int error = posix_spawnp(&m_pid, m_argv[0].c_str(), &actions, nullptr, args.data(), environ);
+        posix_spawn_file_actions_destroy(&actions);
+        if (pipe_input) {
+            close(input[0]);
+            m_input = input[1];
+        }
+        if (error != 0) {
+            std::cerr << "Could not run " << m_argv[0] << ": " << strerror(error) << std::endl;
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    Tool(const Tool &) = delete;
+    Tool &operator=(const Tool &) = delete;
+
+    // Sends `text` to the tool's standard input. A tool that stops reading
+    // early has failed, which finish() reports.
+    void feed(const std::string_view text) {
+        // A closed pipe should show up as EPIPE rather than kill the driver.
+        signal(SIGPIPE, SIG_IGN);
+        if (m_input >= 0 && !write_all(m_input, text)) {
+            if (errno != EPIPE) {
+                std::cerr << "Could not write to " << m_argv[0] << ": " << strerror(errno) << std::endl;
+                exit(EXIT_FAILURE);
+            }
+            m_input_lost = true;
+        }
+    }
+
+    // Closes the tool's input and waits for it. If it failed, says so and
+    // exits with its exit code.
+    void finish() {
+        if (m_input >= 0) {
+            close(m_input);
+            m_input = -1;
+        }
+        const int status = wait_exit_status(m_pid);
+        if (status != 0) {
+            std::cerr << m_argv[0] << " failed with exit status " << status << std::endl;
+            exit(status);
+        }
+        if (m_input_lost) {
+            std::cerr << m_argv[0] << " stopped reading its input" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+    }
+
+private:
+    std::vector<std::string> m_argv;
+    pid_t m_pid = 0;
+    int m_input = -1;
+    bool m_input_lost = false;
+};
+
+// Runs a tool to completion, exiting the way finish() does if it fails.
+inline void run_tool(std::vector<std::string> argv) {
+    Tool(std::move(argv)).finish();
+}
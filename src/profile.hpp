@@ -0,0 +1,67 @@
+#pragma once
+#include <cstdint>
+#include <fstream>
+#include <map>
+#include <optional>
+#include <sstream>
+
+#include "./ast_utils.hpp"
+
+// How often each if/elif condition was true, keyed by the source line the
+// condition starts on. Stored as one `line true_count false_count` per line.
+class BranchProfile {
+public:
+    void record(const int line, const bool taken) {
+        Counts &counts = m_counts[line];
+        (taken ? counts.taken : counts.not_taken)++;
+    }
+
+    // Fraction of evaluations in which the condition was true.
+    [[nodiscard]] std::optional<double> taken_rate(const int line) const {
+        const auto it = m_counts.find(line);
+        if (it == m_counts.end() || it->second.taken + it->second.not_taken == 0) {
+            return {};
+        }
+        return static_cast<double>(it->second.taken) / static_cast<double>(it->second.taken + it->second.not_taken);
+    }
+
+    [[nodiscard]] size_t size() const {
+        return m_counts.size();
+    }
+
+    void save(std::ostream &out) const {
+        for (const auto &[line, counts]: m_counts) {
+            out << line << " " << counts.taken << " " << counts.not_taken << "\n";
+        }
+    }
+
+    static BranchProfile load(const std::string &path) {
+        std::ifstream in(path);
+        if (!in) {
+            std::cerr << "Could not read profile " << path << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        BranchProfile profile;
+        std::string text;
+        while (std::getline(in, text)) {
+            std::istringstream fields(text);
+            int line;
+            Counts counts;
+            std::string rest;
+            if (!(fields >> line >> counts.taken >> counts.not_taken) || fields >> rest) {
+                std::cerr << "Malformed profile " << path << std::endl;
+                exit(EXIT_FAILURE);
+            }
+            profile.m_counts[line] = counts;
+        }
+        return profile;
+    }
+
+private:
+    struct Counts {
+        uint64_t taken = 0;
+        uint64_t not_taken = 0;
+    };
+
+    std::map<int, Counts> m_counts;
+};
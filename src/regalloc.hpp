@@ -0,0 +1,591 @@
+#pragma once
+#include <cmath>
+#include <limits>
+#include <set>
+#include <unordered_set>
+
+#include "./ir.hpp"
+
+enum class RegAllocKind {
+    stack,
+    linear_scan,
+    graph_coloring,
+};
+
+// Where each virtual register lives: a physical register index, or a spill
+// slot in the frame.
+struct Allocation {
+    std::vector<int> reg;
+    std::vector<int> slot;
+    int slot_count = 0;
+};
+
+// Uses and definitions weighted by 10^loop depth, so values touched in inner
+// loops are the last to be spilled.
+inline std::vector<double> spill_weights(const IrFunction &fn) {
+    std::vector<double> weights(fn.vreg_count, 0);
+    for (const IrInst &inst: fn.insts) {
+        const double weight = std::pow(10.0, std::min(inst.loop_depth, 8));
+        if (ir_def(inst) >= 0) {
+            weights[ir_def(inst)] += weight;
+        }
+        for (const int use: ir_uses(inst)) {
+            weights[use] += weight;
+        }
+    }
+    return weights;
+}
+
+class LinearScan {
+public:
+    LinearScan(const IrFunction &fn, const int reg_count)
+        : m_fn(fn)
+        , m_reg_count(reg_count) {
+    }
+
+    Allocation run() {
+        build_intervals();
+        const std::vector<double> weights = spill_weights(m_fn);
+        Allocation alloc{.reg = std::vector(m_fn.vreg_count, -1), .slot = std::vector(m_fn.vreg_count, -1)};
+
+        std::vector<int> order;
+        for (int vreg = 0; vreg < m_fn.vreg_count; vreg++) {
+            if (m_intervals[vreg].start <= m_intervals[vreg].end) {
+                order.push_back(vreg);
+            }
+        }
+        std::ranges::sort(order, [&](const int a, const int b) {
+            return m_intervals[a].start < m_intervals[b].start;
+        });
+
+        std::vector<int> active;
+        std::vector<bool> free(m_reg_count, true);
+        for (const int vreg: order) {
+            const Interval &current = m_intervals[vreg];
+            std::erase_if(active, [&](const int other) {
+                if (m_intervals[other].end < current.start) {
+                    free[alloc.reg[other]] = true;
+                    return true;
+                }
+                return false;
+            });
+
+            int reg = -1;
+            const int hint = m_hints[vreg];
+            if (hint >= 0 && alloc.reg[hint] >= 0 && free[alloc.reg[hint]]) {
+                reg = alloc.reg[hint];
+            } else if (const auto it = std::ranges::find(free, true); it != free.end()) {
+                reg = static_cast<int>(it - free.begin());
+            }
+            if (reg >= 0) {
+                free[reg] = false;
+                alloc.reg[vreg] = reg;
+                active.push_back(vreg);
+                continue;
+            }
+
+            // Spill whichever interval is cheapest per instruction it keeps a
+            // register busy, which is usually a long-lived value outside hot loops.
+            const auto density = [&](const int other) {
+                return weights[other] / static_cast<double>(m_intervals[other].end - m_intervals[other].start + 1);
+            };
+            const auto victim = std::ranges::min_element(active, {}, density);
+            if (density(*victim) < density(vreg)) {
+                alloc.reg[vreg] = alloc.reg[*victim];
+                alloc.reg[*victim] = -1;
+                alloc.slot[*victim] = alloc.slot_count++;
+                *victim = vreg;
+            } else {
+                alloc.slot[vreg] = alloc.slot_count++;
+            }
+        }
+        return alloc;
+    }
+
+private:
+    // Positions are 2*i where instruction i reads its operands and 2*i+1
+    // where it writes its result, so a value that dies at an instruction can
+    // share a register with the value the instruction defines.
+    struct Interval {
+        size_t start = SIZE_MAX;
+        size_t end = 0;
+
+        void extend(const size_t pos) {
+            start = std::min(start, pos);
+            end = std::max(end, pos);
+        }
+    };
+
+    void build_intervals() {
+        m_intervals.assign(m_fn.vreg_count, {});
+        m_hints.assign(m_fn.vreg_count, -1);
+        const Liveness liveness(m_fn);
+        liveness.for_each_live_after([&](const size_t i, const VRegSet &live) {
+            const IrInst &inst = m_fn.insts[i];
+            live.for_each([&](const int vreg) { m_intervals[vreg].extend(2 * i + 1); });
+            if (ir_def(inst) >= 0) {
+                m_intervals[ir_def(inst)].extend(2 * i + 1);
+                if (inst.lhs >= 0 && inst.lhs != inst.dst) {
+                    m_hints[inst.dst] = inst.lhs;
+                }
+            }
+            for (const int use: ir_uses(inst)) {
+                m_intervals[use].extend(2 * i);
+            }
+        });
+        for (size_t b = 0; b < liveness.blocks().size(); b++) {
+            liveness.live_in(b).for_each([&](const int vreg) {
+                m_intervals[vreg].extend(2 * liveness.blocks()[b].begin);
+            });
+        }
+    }
+
+    const IrFunction &m_fn;
+    int m_reg_count;
+    std::vector<Interval> m_intervals;
+    std::vector<int> m_hints;
+};
+
+// Iterated register coalescing (George and Appel): simplify, coalesce moves
+// when the Briggs or George test says it is safe, freeze moves that cannot be
+// coalesced, and only then pick spill candidates by weight / degree. Actual
+// spills are rewritten into short-lived temporaries around explicit loads and
+// stores and the whole process is repeated.
+class GraphColoring {
+public:
+    GraphColoring(IrFunction &fn, const int reg_count)
+        : m_fn(fn)
+        , m_k(reg_count) {
+    }
+
+    Allocation run() {
+        int slot_count = 0;
+        for (int round = 0;; round++) {
+            reset();
+            build();
+            m_weights = spill_weights(m_fn);
+            // Spilling a value that is only live across one instruction frees no
+            // register anywhere, and neither does spilling a spill temporary.
+            for (int n = 0; n < m_fn.vreg_count; n++) {
+                if (m_live_span[n] <= 1 || m_unspillable.contains(n)) {
+                    m_weights[n] = std::numeric_limits<double>::infinity();
+                }
+            }
+            make_worklist();
+            while (!m_simplify.empty() || !m_worklist_moves.empty() || !m_freeze.empty() || !m_spill.empty()) {
+                if (!m_simplify.empty()) {
+                    simplify();
+                } else if (!m_worklist_moves.empty()) {
+                    coalesce();
+                } else if (!m_freeze.empty()) {
+                    freeze();
+                } else {
+                    select_spill();
+                }
+            }
+            Allocation alloc = assign_colors(slot_count);
+            // Values still spilled after a few rounds are addressed in place
+            // through the backend's scratch registers instead.
+            if (alloc.slot_count == slot_count || round == max_rewrite_rounds) {
+                return alloc;
+            }
+            std::vector<int> spill_slots(m_fn.vreg_count, -1);
+            for (int n = 0; n < m_fn.vreg_count; n++) {
+                if (m_state[n] != NodeState::coalesced && alloc.slot[n] >= 0) {
+                    spill_slots[n] = alloc.slot[n];
+                }
+            }
+            rewrite(spill_slots);
+            slot_count = alloc.slot_count;
+        }
+    }
+
+    [[nodiscard]] size_t coalesced_moves() const {
+        return m_coalesced_moves;
+    }
+
+private:
+    enum class NodeState { initial, simplify, freeze, spill, coalesced, select };
+    enum class MoveState { worklist, active, coalesced, constrained, frozen };
+
+    struct Move {
+        int dst;
+        int src;
+        MoveState state;
+    };
+
+    // A triangular bit matrix, or a hash set for functions too big for one.
+    class AdjacencySet {
+    public:
+        explicit AdjacencySet(const int size)
+            : m_bits(size <= max_matrix_size ? (static_cast<size_t>(size) * (size + 1) / 2 + 63) / 64 : 0, 0)
+            , m_use_matrix(size <= max_matrix_size) {
+        }
+
+        [[nodiscard]] bool contains(const int u, const int v) const {
+            if (!m_use_matrix) {
+                return m_set.contains(key(u, v));
+            }
+            const size_t bit = index(u, v);
+            return (m_bits[bit / 64] >> (bit % 64)) & 1;
+        }
+
+        // Returns false if the edge was already present.
+        bool insert(const int u, const int v) {
+            if (!m_use_matrix) {
+                return m_set.insert(key(u, v)).second;
+            }
+            const size_t bit = index(u, v);
+            const uint64_t mask = uint64_t{1} << (bit % 64);
+            const bool inserted = (m_bits[bit / 64] & mask) == 0;
+            m_bits[bit / 64] |= mask;
+            return inserted;
+        }
+
+    private:
+        static constexpr int max_matrix_size = 1 << 15;
+
+        static size_t index(const int u, const int v) {
+            const auto hi = static_cast<size_t>(std::max(u, v));
+            return hi * (hi + 1) / 2 + static_cast<size_t>(std::min(u, v));
+        }
+
+        static uint64_t key(const int u, const int v) {
+            return static_cast<uint64_t>(std::min(u, v)) << 32 | static_cast<uint32_t>(std::max(u, v));
+        }
+
+        std::vector<uint64_t> m_bits;
+        std::unordered_set<uint64_t> m_set;
+        bool m_use_matrix;
+    };
+
+    void add_edge(const int u, const int v) {
+        if (u == v || !m_adj_set.insert(u, v)) {
+            return;
+        }
+        m_adj_list[u].push_back(v);
+        m_adj_list[v].push_back(u);
+        m_degree[u]++;
+        m_degree[v]++;
+    }
+
+    void build() {
+        m_live_span.assign(m_fn.vreg_count, 0);
+        const Liveness liveness(m_fn);
+        liveness.for_each_live_after([&](const size_t i, const VRegSet &live) {
+            const IrInst &inst = m_fn.insts[i];
+            live.for_each([&](const int vreg) { m_live_span[vreg]++; });
+            const int def = ir_def(inst);
+            if (def < 0) {
+                return;
+            }
+            const bool is_move = inst.op == IrOp::copy && inst.lhs != inst.dst;
+            // x86 arithmetic overwrites its left operand, so giving the result the
+            // same register as `lhs` saves a mov just like coalescing a copy does.
+            const bool is_two_address = inst.op == IrOp::add || inst.op == IrOp::sub || inst.op == IrOp::mul;
+            if (inst.lhs >= 0 && inst.lhs != inst.dst && (is_move || is_two_address)) {
+                const int move = static_cast<int>(m_moves.size());
+                m_moves.push_back({.dst = inst.dst, .src = inst.lhs, .state = MoveState::worklist});
+                m_move_list[inst.dst].push_back(move);
+                m_move_list[inst.lhs].push_back(move);
+                m_worklist_moves.insert(move);
+            }
+            live.for_each([&](const int vreg) {
+                if (!is_move || vreg != inst.lhs) {
+                    add_edge(def, vreg);
+                }
+            });
+        });
+    }
+
+    void make_worklist() {
+        for (int n = 0; n < m_fn.vreg_count; n++) {
+            if (m_degree[n] >= m_k) {
+                set_state(n, NodeState::spill);
+            } else if (move_related(n)) {
+                set_state(n, NodeState::freeze);
+            } else {
+                set_state(n, NodeState::simplify);
+            }
+        }
+    }
+
+    void set_state(const int n, const NodeState state) {
+        const auto worklist = [&](const NodeState s) -> std::set<int> * {
+            switch (s) {
+                case NodeState::simplify:
+                    return &m_simplify;
+                case NodeState::freeze:
+                    return &m_freeze;
+                case NodeState::spill:
+                    return &m_spill;
+                default:
+                    return nullptr;
+            }
+        };
+        if (std::set<int> *from = worklist(m_state[n])) {
+            from->erase(n);
+        }
+        if (std::set<int> *to = worklist(state)) {
+            to->insert(n);
+        }
+        m_state[n] = state;
+    }
+
+    template<typename Fn>
+    void for_each_adjacent(const int n, Fn &&fn) const {
+        for (const int m: m_adj_list[n]) {
+            if (m_state[m] != NodeState::select && m_state[m] != NodeState::coalesced) {
+                fn(m);
+            }
+        }
+    }
+
+    // Coalesced, constrained and frozen moves never become live again, so they
+    // are dropped from the list as it is walked.
+    template<typename Fn>
+    void for_each_node_move(const int n, Fn &&fn) {
+        std::erase_if(m_move_list[n], [&](const int move) {
+            return m_moves[move].state != MoveState::active && m_moves[move].state != MoveState::worklist;
+        });
+        for (const int move: m_move_list[n]) {
+            fn(move);
+        }
+    }
+
+    bool move_related(const int n) {
+        bool related = false;
+        for_each_node_move(n, [&](int) { related = true; });
+        return related;
+    }
+
+    void simplify() {
+        const int n = *m_simplify.begin();
+        set_state(n, NodeState::select);
+        m_select_stack.push_back(n);
+        for_each_adjacent(n, [&](const int m) { decrement_degree(m); });
+    }
+
+    void enable_moves(const int n) {
+        for_each_node_move(n, [&](const int move) {
+            if (m_moves[move].state == MoveState::active) {
+                m_moves[move].state = MoveState::worklist;
+                m_worklist_moves.insert(move);
+            }
+        });
+    }
+
+    void decrement_degree(const int m) {
+        if (m_degree[m]-- != m_k) {
+            return;
+        }
+        enable_moves(m);
+        for_each_adjacent(m, [&](const int n) { enable_moves(n); });
+        set_state(m, move_related(m) ? NodeState::freeze : NodeState::simplify);
+    }
+
+    int get_alias(int n) const {
+        while (m_state[n] == NodeState::coalesced) {
+            n = m_alias[n];
+        }
+        return n;
+    }
+
+    void add_work_list(const int u) {
+        if (m_state[u] == NodeState::freeze && !move_related(u) && m_degree[u] < m_k) {
+            set_state(u, NodeState::simplify);
+        }
+    }
+
+    // George: every significant neighbour of v already interferes with u.
+    bool george(const int u, const int v) {
+        return std::ranges::all_of(m_adj_list[v], [&](const int t) {
+            return m_state[t] == NodeState::select || m_state[t] == NodeState::coalesced || m_degree[t] < m_k
+                   || m_adj_set.contains(t, u);
+        });
+    }
+
+    // Briggs: the merged node has fewer than K neighbours of significant degree.
+    bool briggs(const int u, const int v) {
+        m_mark_generation++;
+        int significant = 0;
+        for (const int n: {u, v}) {
+            for (const int m: m_adj_list[n]) {
+                if (m_state[m] == NodeState::select || m_state[m] == NodeState::coalesced || m_degree[m] < m_k
+                    || m_mark[m] == m_mark_generation) {
+                    continue;
+                }
+                m_mark[m] = m_mark_generation;
+                if (++significant >= m_k) {
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+
+    void coalesce() {
+        const int move = *m_worklist_moves.begin();
+        m_worklist_moves.erase(m_worklist_moves.begin());
+        const int u = get_alias(m_moves[move].dst);
+        const int v = get_alias(m_moves[move].src);
+        if (u == v) {
+            m_moves[move].state = MoveState::coalesced;
+            m_coalesced_moves++;
+            add_work_list(u);
+        } else if (m_adj_set.contains(u, v)) {
+            m_moves[move].state = MoveState::constrained;
+            add_work_list(u);
+            add_work_list(v);
+        } else if (george(u, v) || george(v, u) || briggs(u, v)) {
+            m_moves[move].state = MoveState::coalesced;
+            m_coalesced_moves++;
+            combine(u, v);
+            add_work_list(u);
+        } else {
+            m_moves[move].state = MoveState::active;
+        }
+    }
+
+    void combine(const int u, const int v) {
+        set_state(v, NodeState::coalesced);
+        m_alias[v] = u;
+        m_weights[u] += m_weights[v];
+        m_move_list[u].insert(m_move_list[u].end(), m_move_list[v].begin(), m_move_list[v].end());
+        enable_moves(v);
+        for_each_adjacent(v, [&](const int t) {
+            add_edge(t, u);
+            decrement_degree(t);
+        });
+        if (m_degree[u] >= m_k && m_state[u] == NodeState::freeze) {
+            set_state(u, NodeState::spill);
+        }
+    }
+
+    void freeze_moves(const int u) {
+        for_each_node_move(u, [&](const int move) {
+            const int x = get_alias(m_moves[move].dst);
+            const int y = get_alias(m_moves[move].src);
+            const int v = y == get_alias(u) ? x : y;
+            m_moves[move].state = MoveState::frozen;
+            m_worklist_moves.erase(move);
+            if (m_state[v] == NodeState::freeze && !move_related(v) && m_degree[v] < m_k) {
+                set_state(v, NodeState::simplify);
+            }
+        });
+    }
+
+    void freeze() {
+        const int u = *m_freeze.begin();
+        set_state(u, NodeState::simplify);
+        freeze_moves(u);
+    }
+
+    void select_spill() {
+        const int m = *std::ranges::min_element(m_spill, {}, [&](const int n) {
+            return m_weights[n] / std::max(m_degree[n], 1);
+        });
+        set_state(m, NodeState::simplify);
+        freeze_moves(m);
+    }
+
+    Allocation assign_colors(const int first_slot) {
+        Allocation alloc{.reg = std::vector(m_fn.vreg_count, -1), .slot = std::vector(m_fn.vreg_count, -1),
+                         .slot_count = first_slot};
+        while (!m_select_stack.empty()) {
+            const int n = m_select_stack.back();
+            m_select_stack.pop_back();
+            std::vector<bool> ok(m_k, true);
+            for (const int w: m_adj_list[n]) {
+                const int reg = alloc.reg[get_alias(w)];
+                if (reg >= 0) {
+                    ok[reg] = false;
+                }
+            }
+            if (const auto it = std::ranges::find(ok, true); it != ok.end()) {
+                alloc.reg[n] = static_cast<int>(it - ok.begin());
+            } else {
+                alloc.slot[n] = alloc.slot_count++;
+            }
+        }
+        for (int n = 0; n < m_fn.vreg_count; n++) {
+            if (m_state[n] == NodeState::coalesced) {
+                alloc.reg[n] = alloc.reg[get_alias(n)];
+                alloc.slot[n] = alloc.slot[get_alias(n)];
+            }
+        }
+        return alloc;
+    }
+
+    // Gives every instruction that touches a spilled value its own temporary,
+    // loaded before the instruction and stored after it.
+    void rewrite(const std::vector<int> &spill_slots) {
+        std::vector<IrInst> insts;
+        for (IrInst inst: m_fn.insts) {
+            std::vector<IrInst> stores;
+            const std::vector<int> uses = ir_uses(inst);
+            for (const int vreg: {inst.lhs, inst.rhs, inst.src, inst.dst}) {
+                const bool replaced = inst.lhs != vreg && inst.rhs != vreg && inst.src != vreg && inst.dst != vreg;
+                if (vreg < 0 || spill_slots[vreg] < 0 || replaced) {
+                    continue;
+                }
+                const int temp = m_fn.vreg_count++;
+                m_unspillable.insert(temp);
+                const int slot = spill_slots[vreg];
+                if (std::ranges::find(uses, vreg) != uses.end()) {
+                    insts.push_back({.op = IrOp::load, .dst = temp, .imm = slot, .loop_depth = inst.loop_depth});
+                }
+                if (inst.dst == vreg) {
+                    stores.push_back({.op = IrOp::store, .lhs = temp, .imm = slot, .loop_depth = inst.loop_depth});
+                }
+                inst.lhs = inst.lhs == vreg ? temp : inst.lhs;
+                inst.rhs = inst.rhs == vreg ? temp : inst.rhs;
+                inst.src = inst.src == vreg ? temp : inst.src;
+                inst.dst = inst.dst == vreg ? temp : inst.dst;
+            }
+            insts.push_back(inst);
+            insts.insert(insts.end(), stores.begin(), stores.end());
+        }
+        m_fn.insts = std::move(insts);
+    }
+
+    void reset() {
+        const int n = m_fn.vreg_count;
+        m_adj_list.assign(n, {});
+        m_degree.assign(n, 0);
+        m_adj_set = AdjacencySet(n);
+        m_moves.clear();
+        m_move_list.assign(n, {});
+        m_alias.assign(n, -1);
+        m_state.assign(n, NodeState::initial);
+        m_simplify.clear();
+        m_freeze.clear();
+        m_spill.clear();
+        m_worklist_moves.clear();
+        m_select_stack.clear();
+        m_mark.assign(n, 0);
+    }
+
+    static constexpr int max_rewrite_rounds = 4;
+
+    IrFunction &m_fn;
+    int m_k;
+    std::vector<std::vector<int>> m_adj_list;
+    std::vector<int> m_degree;
+    AdjacencySet m_adj_set{0};
+    std::vector<Move> m_moves;
+    std::vector<std::vector<int>> m_move_list;
+    std::vector<int> m_alias;
+    std::vector<NodeState> m_state;
+    std::vector<double> m_weights;
+    std::vector<int> m_live_span;
+    std::unordered_set<int> m_unspillable;
+    std::set<int> m_simplify;
+    std::set<int> m_freeze;
+    std::set<int> m_spill;
+    std::set<int> m_worklist_moves;
+    std::vector<int> m_select_stack;
+    std::vector<uint64_t> m_mark;
+    uint64_t m_mark_generation = 0;
+    size_t m_coalesced_moves = 0;
+};
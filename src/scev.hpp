@@ -0,0 +1,622 @@
+#pragma once
+#include <algorithm>
+#include <vector>
+
+#include "./ast_utils.hpp"
+
+enum class LoopCmp {
+    less,
+    less_eq,
+    greater,
+    greater_eq,
+    not_eq_,
+};
+
+// A `while (i <cmp> bound)` loop whose body bumps `i` by a constant step exactly
+// once per iteration and never writes `i` or `bound` anywhere else.
+struct CountedLoop {
+    std::string induction;
+    LoopCmp cmp;
+    int64_t start = 0;
+    // Unset when the bound is loop-invariant but not a compile-time constant.
+    std::optional<int64_t> bound = {};
+    const NodeExpr *bound_expr = nullptr;
+    int64_t step = 0;
+};
+
+inline std::optional<int64_t> induction_step(const NodeVarReassign *var_reassign, const ConstEnv &env) {
+    if (const auto unary = std::get_if<NodeUnary *>(&var_reassign->var)) {
+        return std::holds_alternative<NodeUnaryAdd *>((*unary)->var) ? 1 : -1;
+    }
+    const NodeCompound *compound = std::get<NodeCompound *>(var_reassign->var);
+    if (const auto plus = std::get_if<NodeCompoundPlus *>(&compound->var)) {
+        return eval_const((*plus)->term, env);
+    }
+    if (const auto sub = std::get_if<NodeCompoundSub *>(&compound->var)) {
+        if (const auto step = eval_const((*sub)->term, env)) {
+            return wrap_sub(0, step.value());
+        }
+    }
+    return {};
+}
+
+// `env` holds the constants known on loop entry.
+inline std::optional<CountedLoop> match_counted_loop(const NodeStmtWhile *stmt_while, const ConstEnv &env) {
+    const auto cond = std::get_if<NodeCondExpr *>(&stmt_while->expr->var);
+    if (cond == nullptr || std::holds_alternative<NodeCondExprEq *>((*cond)->var)) {
+        return {};
+    }
+    const auto [lhs, rhs, cmp] = std::visit([]<typename T>(const T *node) {
+        LoopCmp kind = LoopCmp::not_eq_;
+        if constexpr (std::is_same_v<T, NodeCondExprLess>) {
+            kind = LoopCmp::less;
+        } else if constexpr (std::is_same_v<T, NodeCondExprLessEq>) {
+            kind = LoopCmp::less_eq;
+        } else if constexpr (std::is_same_v<T, NodeCondExprGreater>) {
+            kind = LoopCmp::greater;
+        } else if constexpr (std::is_same_v<T, NodeCondExprGreaterEq>) {
+            kind = LoopCmp::greater_eq;
+        }
+        return std::tuple{node->lhs, node->rhs, kind};
+    }, (*cond)->var);
+
+    std::unordered_multiset<std::string> assigned;
+    collect_assigned(stmt_while->scope, assigned);
+    ConstEnv invariant = env;
+    for (const std::string &name: assigned) {
+        invariant.erase(name);
+    }
+
+    CountedLoop loop{.induction = {}, .cmp = cmp};
+    const NodeExpr *bound_expr = rhs;
+    if (const auto name = as_ident(lhs); name.has_value() && assigned.contains(name.value())) {
+        loop.induction = name.value();
+    } else if (const auto rhs_name = as_ident(rhs); rhs_name.has_value() && assigned.contains(rhs_name.value())) {
+        loop.induction = rhs_name.value();
+        bound_expr = lhs;
+        switch (cmp) {
+            case LoopCmp::less: loop.cmp = LoopCmp::greater; break;
+            case LoopCmp::less_eq: loop.cmp = LoopCmp::greater_eq; break;
+            case LoopCmp::greater: loop.cmp = LoopCmp::less; break;
+            case LoopCmp::greater_eq: loop.cmp = LoopCmp::less_eq; break;
+            case LoopCmp::not_eq_: break;
+        }
+    } else {
+        return {};
+    }
+
+    const auto start = env.find(loop.induction);
+    std::unordered_set<std::string> bound_reads;
+    collect_used(bound_expr, bound_reads);
+    if (start == env.end() || assigned.count(loop.induction) != 1
+        || std::ranges::any_of(bound_reads, [&](const std::string &name) { return assigned.contains(name); })) {
+        return {};
+    }
+    loop.start = start->second;
+    loop.bound = eval_const(bound_expr, invariant);
+    loop.bound_expr = bound_expr;
+
+    for (const NodeStmt *stmt: stmt_while->scope->stmts) {
+        const auto var_reassign = std::get_if<NodeVarReassign *>(&stmt->var);
+        if (var_reassign != nullptr && reassign_target(*var_reassign).value.value() == loop.induction) {
+            const auto step = induction_step(*var_reassign, invariant);
+            if (!step.has_value() || step.value() == 0) {
+                return {};
+            }
+            loop.step = step.value();
+            return loop;
+        }
+    }
+    return {};
+}
+
+// Exact iteration count, or nothing if the induction variable would wrap
+// around before the condition fails.
+inline std::optional<uint64_t> trip_count(const CountedLoop &loop) {
+    if (!loop.bound.has_value()) {
+        return {};
+    }
+    const __int128 start = loop.start;
+    const __int128 bound = loop.bound.value();
+    const __int128 step = loop.step;
+    __int128 count = 0;
+    switch (loop.cmp) {
+        case LoopCmp::less:
+        case LoopCmp::less_eq: {
+            const __int128 limit = loop.cmp == LoopCmp::less ? bound : bound + 1;
+            if (start >= limit) {
+                return 0;
+            }
+            if (step < 0) {
+                return {};
+            }
+            count = (limit - start + step - 1) / step;
+            break;
+        }
+        case LoopCmp::greater:
+        case LoopCmp::greater_eq: {
+            const __int128 limit = loop.cmp == LoopCmp::greater ? bound : bound - 1;
+            if (start <= limit) {
+                return 0;
+            }
+            if (step > 0) {
+                return {};
+            }
+            count = (start - limit + -step - 1) / -step;
+            break;
+        }
+        case LoopCmp::not_eq_: {
+            if ((bound - start) % step != 0 || (bound - start) / step < 0) {
+                return {};
+            }
+            count = (bound - start) / step;
+            break;
+        }
+    }
+    const __int128 last = start + count * step;
+    if (last > INT64_MAX || last < INT64_MIN) {
+        return {};
+    }
+    return static_cast<uint64_t>(count);
+}
+
+// Chain of recurrences {c0, +, c1, +, ..., +, cn}: the value in iteration k is
+// the sum of c_j * C(k, j), everything taken modulo 2^64 like the generated code.
+struct AddRec {
+    static constexpr size_t max_degree = 8;
+
+    std::vector<int64_t> coeffs;
+
+    [[nodiscard]] size_t degree() const {
+        return coeffs.size() - 1;
+    }
+
+    [[nodiscard]] int64_t at(uint64_t k) const;
+};
+
+inline uint64_t inverse_mod_2_64(const uint64_t odd) {
+    uint64_t inverse = odd;
+    for (int i = 0; i < 5; i++) {
+        inverse *= 2 - odd * inverse;
+    }
+    return inverse;
+}
+
+// C(n, k) mod 2^64. The product n (n-1) ... (n-k+1) is formed modulo
+// 2^(64+t), where 2^t is the power of two in k!, so the division by k! can be
+// done exactly as a shift followed by a multiply with the odd part's inverse.
+inline uint64_t binomial_mod(const uint64_t n, const size_t k) {
+    unsigned twos = 0;
+    uint64_t odd = 1;
+    for (uint64_t factor = 2; factor <= k; factor++) {
+        uint64_t rest = factor;
+        while (rest % 2 == 0) {
+            rest /= 2;
+            twos++;
+        }
+        odd *= rest;
+    }
+    using u128 = unsigned __int128;
+    const u128 mask = (static_cast<u128>(1) << (64 + twos)) - 1;
+    u128 product = 1;
+    for (uint64_t t = 0; t < k; t++) {
+        product = product * static_cast<u128>(n - t) & mask;
+        if (n == t) {
+            break;
+        }
+    }
+    return static_cast<uint64_t>(product >> twos) * inverse_mod_2_64(odd);
+}
+
+inline int64_t AddRec::at(const uint64_t k) const {
+    int64_t value = 0;
+    for (size_t j = 0; j < coeffs.size(); j++) {
+        value = wrap_add(value, wrap_mul(coeffs[j], static_cast<int64_t>(binomial_mod(k, j))));
+    }
+    return value;
+}
+
+inline AddRec add_rec_add(const AddRec &a, const AddRec &b, const bool subtract = false) {
+    AddRec result{.coeffs = std::vector<int64_t>(std::max(a.coeffs.size(), b.coeffs.size()), 0)};
+    for (size_t j = 0; j < result.coeffs.size(); j++) {
+        const int64_t lhs = j < a.coeffs.size() ? a.coeffs[j] : 0;
+        const int64_t rhs = j < b.coeffs.size() ? b.coeffs[j] : 0;
+        result.coeffs[j] = subtract ? wrap_sub(lhs, rhs) : wrap_add(lhs, rhs);
+    }
+    while (result.coeffs.size() > 1 && result.coeffs.back() == 0) {
+        result.coeffs.pop_back();
+    }
+    return result;
+}
+
+// The coefficients of a recurrence are its forward differences at k = 0, so a
+// product is built by sampling both factors and differencing the samples.
+inline std::optional<AddRec> add_rec_mul(const AddRec &a, const AddRec &b) {
+    const size_t degree = a.degree() + b.degree();
+    if (degree > AddRec::max_degree) {
+        return {};
+    }
+    std::vector<int64_t> samples(degree + 1);
+    for (size_t k = 0; k <= degree; k++) {
+        samples[k] = wrap_mul(a.at(k), b.at(k));
+    }
+    AddRec result;
+    for (size_t j = 0; j <= degree; j++) {
+        result.coeffs.push_back(samples[0]);
+        for (size_t k = 0; k + 1 < samples.size(); k++) {
+            samples[k] = wrap_sub(samples[k + 1], samples[k]);
+        }
+        samples.pop_back();
+    }
+    while (result.coeffs.size() > 1 && result.coeffs.back() == 0) {
+        result.coeffs.pop_back();
+    }
+    return result;
+}
+
+// Replaces counted loops whose body only accumulates into variables with
+// straight-line code computing each variable's value after the last iteration.
+class LoopClosedForm {
+public:
+    explicit LoopClosedForm(ArenaAllocator &allocator)
+        : m_allocator(allocator) {
+    }
+
+    void run(NodeProgram &prog) {
+        ConstEnv env;
+        replace_stmts(prog.stmts, env);
+    }
+
+    [[nodiscard]] size_t replaced_count() const {
+        return m_replaced_count;
+    }
+
+private:
+    // One `x += amount` (or `x -= amount`) in the loop body, in body order.
+    struct Update {
+        std::string var;
+        bool subtract = false;
+        bool unary = false;
+        const NodeTerm *term = nullptr;
+        // Signed summands for the `x = x + a - b ...` form.
+        std::vector<std::pair<bool, const NodeExpr *>> parts = {};
+    };
+
+    static void flatten_sum(const NodeExpr *expr, const bool negate,
+                            std::vector<std::pair<bool, const NodeExpr *>> &parts) {
+        if (const auto term = std::get_if<NodeTerm *>(&expr->var)) {
+            if (const auto paren = std::get_if<NodeTermParen *>(&(*term)->var)) {
+                flatten_sum((*paren)->expr, negate, parts);
+                return;
+            }
+        }
+        if (const auto bin_expr = std::get_if<NodeBinExpr *>(&expr->var)) {
+            if (const auto add = std::get_if<NodeBinExprAdd *>(&(*bin_expr)->var)) {
+                flatten_sum((*add)->lhs, negate, parts);
+                flatten_sum((*add)->rhs, negate, parts);
+                return;
+            }
+            if (const auto sub = std::get_if<NodeBinExprSub *>(&(*bin_expr)->var)) {
+                flatten_sum((*sub)->lhs, negate, parts);
+                flatten_sum((*sub)->rhs, !negate, parts);
+                return;
+            }
+        }
+        parts.emplace_back(negate, expr);
+    }
+
+    struct Recurrence {
+        AddRec rec;
+        bool start_known;
+    };
+
+    void replace_stmts(std::vector<NodeStmt *> &stmts, ConstEnv env) {
+        std::vector<NodeStmt *> result;
+        for (NodeStmt *stmt: stmts) {
+            for_each_nested_block(stmt, env, [&](std::vector<NodeStmt *> &nested, const ConstEnv &nested_env) {
+                replace_stmts(nested, nested_env);
+            });
+            const auto stmt_while = std::get_if<NodeStmtWhile *>(&stmt->var);
+            const auto replacement = stmt_while != nullptr ? closed_form(*stmt_while, env) : std::nullopt;
+            if (!replacement.has_value()) {
+                result.push_back(stmt);
+                update_const_env(stmt, env);
+                continue;
+            }
+            for (NodeStmt *replaced: replacement.value()) {
+                result.push_back(replaced);
+                update_const_env(replaced, env);
+            }
+            m_replaced_count++;
+        }
+        stmts = std::move(result);
+    }
+
+    static std::optional<std::vector<Update>> match_updates(const NodeScope *body) {
+        std::vector<Update> updates;
+        for (const NodeStmt *stmt: body->stmts) {
+            if (const auto var_reassign = std::get_if<NodeVarReassign *>(&stmt->var)) {
+                Update update{.var = reassign_target(*var_reassign).value.value()};
+                if (const auto unary = std::get_if<NodeUnary *>(&(*var_reassign)->var)) {
+                    update.unary = true;
+                    update.subtract = std::holds_alternative<NodeUnarySub *>((*unary)->var);
+                } else {
+                    const NodeCompound *compound = std::get<NodeCompound *>((*var_reassign)->var);
+                    if (const auto plus = std::get_if<NodeCompoundPlus *>(&compound->var)) {
+                        update.term = (*plus)->term;
+                    } else if (const auto sub = std::get_if<NodeCompoundSub *>(&compound->var)) {
+                        update.term = (*sub)->term;
+                        update.subtract = true;
+                    } else {
+                        return {};
+                    }
+                }
+                updates.push_back(update);
+                continue;
+            }
+            // x = <sum in which x appears exactly once, with a plus sign>
+            const auto stmt_assign = std::get_if<NodeStmtAssign *>(&stmt->var);
+            if (stmt_assign == nullptr) {
+                return {};
+            }
+            Update update{.var = (*stmt_assign)->ident.value.value()};
+            std::vector<std::pair<bool, const NodeExpr *>> parts;
+            flatten_sum((*stmt_assign)->expr, false, parts);
+            const auto self = std::ranges::find_if(parts, [&](const auto &part) {
+                return !part.first && as_ident(part.second) == update.var;
+            });
+            if (self == parts.end()) {
+                return {};
+            }
+            parts.erase(self);
+            update.parts = std::move(parts);
+            updates.push_back(update);
+        }
+        return updates;
+    }
+
+    struct RecEnv {
+        const std::unordered_map<std::string, AddRec> &current;
+        const std::unordered_set<std::string> &varying;
+        const ConstEnv &invariant;
+    };
+
+    static std::optional<AddRec> eval_rec(const NodeTerm *term, const RecEnv &env) {
+        if (const auto term_int_lit = std::get_if<NodeTermIntLit *>(&term->var)) {
+            return AddRec{.coeffs = {parse_int_lit((*term_int_lit)->int_lit)}};
+        }
+        if (const auto term_paren = std::get_if<NodeTermParen *>(&term->var)) {
+            return eval_rec((*term_paren)->expr, env);
+        }
+        const std::string &name = std::get<NodeTermIdent *>(term->var)->ident.value.value();
+        if (const auto it = env.current.find(name); it != env.current.end()) {
+            return it->second;
+        }
+        if (const auto it = env.invariant.find(name); it != env.invariant.end() && !env.varying.contains(name)) {
+            return AddRec{.coeffs = {it->second}};
+        }
+        return {};
+    }
+
+    static std::optional<AddRec> eval_rec(const NodeExpr *expr, const RecEnv &env) {
+        if (const auto term = std::get_if<NodeTerm *>(&expr->var)) {
+            return eval_rec(*term, env);
+        }
+        if (const auto cond_expr = std::get_if<NodeCondExpr *>(&expr->var)) {
+            if (const auto value = eval_const(expr, env.invariant); value.has_value()) {
+                std::unordered_set<std::string> reads;
+                collect_used(expr, reads);
+                if (std::ranges::none_of(reads, [&](const std::string &name) { return env.varying.contains(name); })) {
+                    return AddRec{.coeffs = {value.value()}};
+                }
+            }
+            return {};
+        }
+        return std::visit([&]<typename T>(const T *bin) -> std::optional<AddRec> {
+            const auto lhs = eval_rec(bin->lhs, env);
+            const auto rhs = eval_rec(bin->rhs, env);
+            if (!lhs.has_value() || !rhs.has_value()) {
+                return {};
+            }
+            if constexpr (std::is_same_v<T, NodeBinExprAdd>) {
+                return add_rec_add(lhs.value(), rhs.value());
+            } else if constexpr (std::is_same_v<T, NodeBinExprSub>) {
+                return add_rec_add(lhs.value(), rhs.value(), true);
+            } else if constexpr (std::is_same_v<T, NodeBinExprMult>) {
+                return add_rec_mul(lhs.value(), rhs.value());
+            } else {
+                if (lhs->degree() != 0 || rhs->degree() != 0) {
+                    return {};
+                }
+                const auto value = std::is_same_v<T, NodeBinExprDiv> ? checked_div(lhs->coeffs[0], rhs->coeffs[0])
+                                                                     : checked_mod(lhs->coeffs[0], rhs->coeffs[0]);
+                if (value.has_value()) {
+                    return AddRec{.coeffs = {value.value()}};
+                }
+                return {};
+            }
+        }, std::get<NodeBinExpr *>(expr->var)->var);
+    }
+
+    static std::optional<AddRec> eval_update(const Update &update, const RecEnv &env) {
+        if (update.term != nullptr) {
+            return eval_rec(update.term, env);
+        }
+        if (update.parts.empty()) {
+            return AddRec{.coeffs = {update.unary ? 1 : 0}};
+        }
+        AddRec sum{.coeffs = {0}};
+        for (const auto &[negate, part]: update.parts) {
+            const auto value = eval_rec(part, env);
+            if (!value.has_value()) {
+                return {};
+            }
+            sum = add_rec_add(sum, value.value(), negate);
+        }
+        return sum;
+    }
+
+    // Walks one iteration symbolically and returns how much `var` grows in
+    // iteration k, given the recurrences solved so far.
+    static std::optional<AddRec> iteration_delta(const std::string &var, const std::vector<Update> &updates,
+                                                 const std::unordered_map<std::string, Recurrence> &solved,
+                                                 const std::unordered_set<std::string> &varying,
+                                                 const ConstEnv &invariant) {
+        std::unordered_map<std::string, AddRec> current;
+        for (const auto &[name, recurrence]: solved) {
+            if (recurrence.start_known) {
+                current[name] = recurrence.rec;
+            }
+        }
+        const RecEnv env{.current = current, .varying = varying, .invariant = invariant};
+        AddRec delta{.coeffs = {0}};
+        for (const Update &update: updates) {
+            if (update.var != var && !current.contains(update.var)) {
+                continue;
+            }
+            const auto amount = eval_update(update, env);
+            if (!amount.has_value()) {
+                return {};
+            }
+            if (update.var == var) {
+                delta = add_rec_add(delta, amount.value(), update.subtract);
+            } else {
+                current[update.var] = add_rec_add(current[update.var], amount.value(), update.subtract);
+            }
+        }
+        return delta;
+    }
+
+    std::optional<std::vector<NodeStmt *>> closed_form(const NodeStmtWhile *stmt_while, const ConstEnv &env) {
+        const auto loop = match_counted_loop(stmt_while, env);
+        if (!loop.has_value()) {
+            return {};
+        }
+        const auto updates = match_updates(stmt_while->scope);
+        if (!updates.has_value()) {
+            return {};
+        }
+        std::unordered_set<std::string> varying;
+        std::vector<std::string> order;
+        for (const Update &update: updates.value()) {
+            if (varying.insert(update.var).second) {
+                order.push_back(update.var);
+            }
+        }
+
+        std::unordered_map<std::string, Recurrence> solved;
+        bool progress = true;
+        while (progress) {
+            progress = false;
+            for (const std::string &var: order) {
+                if (solved.contains(var)) {
+                    continue;
+                }
+                const auto delta = iteration_delta(var, updates.value(), solved, varying, env);
+                if (!delta.has_value() || delta->degree() + 1 > AddRec::max_degree) {
+                    continue;
+                }
+                const auto start = env.find(var);
+                AddRec rec{.coeffs = {start != env.end() ? start->second : 0}};
+                rec.coeffs.insert(rec.coeffs.end(), delta->coeffs.begin(), delta->coeffs.end());
+                solved[var] = {.rec = rec, .start_known = start != env.end()};
+                progress = true;
+            }
+        }
+        if (solved.size() != order.size()) {
+            return {};
+        }
+
+        if (const auto trips = trip_count(loop.value())) {
+            std::vector<NodeStmt *> stmts;
+            for (const std::string &var: order) {
+                const Recurrence &recurrence = solved.at(var);
+                const Token ident{.type = TokenType::ident, .line = 0, .value = var};
+                const int64_t value = recurrence.rec.at(trips.value());
+                if (recurrence.start_known) {
+                    stmts.push_back(make_assign_stmt(m_allocator, ident, make_int_lit_expr(m_allocator, value)));
+                } else {
+                    stmts.push_back(make_assign_stmt(m_allocator, ident,
+                                                     make_bin_expr<NodeBinExprAdd>(
+                                                         m_allocator, make_ident_expr(m_allocator, ident),
+                                                         make_int_lit_expr(m_allocator, value))));
+                }
+            }
+            return stmts;
+        }
+        return runtime_closed_form(loop.value(), order, solved);
+    }
+
+    // `while (i < n) { ...; i++; }` with n unknown at compile time: the trip
+    // count max(n - i0, 0) is computed at runtime and the closed form is
+    // emitted as code. Only recurrences up to degree 2 are handled, where
+    // C(N, 2) = (N / 2) * (N - 1 + N % 2) is exact under wraparound.
+    std::optional<std::vector<NodeStmt *>> runtime_closed_form(
+        const CountedLoop &loop, const std::vector<std::string> &order,
+        const std::unordered_map<std::string, Recurrence> &solved) {
+        if (loop.cmp != LoopCmp::less || loop.step != 1 || loop.start < 0) {
+            return {};
+        }
+        size_t degree = 0;
+        for (const auto &[name, recurrence]: solved) {
+            degree = std::max(degree, recurrence.rec.degree());
+        }
+        if (degree > 2) {
+            return {};
+        }
+        AstCloner cloner(m_allocator);
+        const size_t id = m_replaced_count;
+        const Token trips{.type = TokenType::ident, .line = 0, .value = "scev.n" + std::to_string(id)};
+        const Token half{.type = TokenType::ident, .line = 0, .value = "scev.h" + std::to_string(id)};
+        auto trips_expr = [&] { return make_ident_expr(m_allocator, trips); };
+        auto lit = [&](const int64_t value) { return make_int_lit_expr(m_allocator, value); };
+
+        auto scope = m_allocator.emplace<NodeScope>();
+        scope->stmts.push_back(make_let_stmt(m_allocator, trips, lit(0)));
+        auto guard = m_allocator.emplace<NodeStmtIf>();
+        guard->expr = make_bin_expr<NodeCondExprGreater>(m_allocator, cloner.clone(loop.bound_expr), lit(loop.start));
+        guard->scope = m_allocator.emplace<NodeScope>();
+        guard->scope->stmts.push_back(make_assign_stmt(
+            m_allocator, trips,
+            make_bin_expr<NodeBinExprSub>(m_allocator, cloner.clone(loop.bound_expr), lit(loop.start))));
+        auto guard_stmt = m_allocator.emplace<NodeStmt>();
+        guard_stmt->var = guard;
+        scope->stmts.push_back(guard_stmt);
+        if (degree == 2) {
+            NodeExpr *halved = make_bin_expr<NodeBinExprDiv>(m_allocator, trips_expr(), lit(2));
+            NodeExpr *parity = make_bin_expr<NodeBinExprSub>(
+                m_allocator, trips_expr(),
+                make_bin_expr<NodeBinExprMult>(m_allocator,
+                                               make_bin_expr<NodeBinExprDiv>(m_allocator, trips_expr(), lit(2)),
+                                               lit(2)));
+            NodeExpr *pred = make_bin_expr<NodeBinExprAdd>(
+                m_allocator, make_bin_expr<NodeBinExprSub>(m_allocator, trips_expr(), lit(1)), parity);
+            scope->stmts.push_back(make_let_stmt(m_allocator, half,
+                                                 make_bin_expr<NodeBinExprMult>(m_allocator, halved, pred)));
+        }
+        for (const std::string &var: order) {
+            const Recurrence &recurrence = solved.at(var);
+            const Token ident{.type = TokenType::ident, .line = 0, .value = var};
+            NodeExpr *value = recurrence.start_known ? lit(recurrence.rec.coeffs[0]) : make_ident_expr(m_allocator, ident);
+            const Token *basis[] = {&trips, &half};
+            for (size_t j = 1; j < recurrence.rec.coeffs.size(); j++) {
+                const int64_t coeff = recurrence.rec.coeffs[j];
+                if (coeff == 0) {
+                    continue;
+                }
+                NodeExpr *term = make_ident_expr(m_allocator, *basis[j - 1]);
+                if (coeff != 1) {
+                    term = make_bin_expr<NodeBinExprMult>(m_allocator, lit(coeff), term);
+                }
+                value = make_bin_expr<NodeBinExprAdd>(m_allocator, value, term);
+            }
+            scope->stmts.push_back(make_assign_stmt(m_allocator, ident, value));
+        }
+        auto stmt = m_allocator.emplace<NodeStmt>();
+        stmt->var = scope;
+        return std::vector{stmt};
+    }
+
+    ArenaAllocator &m_allocator;
+    size_t m_replaced_count = 0;
+};
@@ -0,0 +1,291 @@
+#pragma once
+#include <array>
+#include <optional>
+#include <string_view>
+
+#include "./regalloc.hpp"
+
+// Latencies and issue resources of the x86-64 instructions each IR operation
+// becomes, for one core.
+struct SchedModel {
+    std::string_view name;
+    // Instructions issued per cycle.
+    int width;
+    int alu_ports;
+    int mul_ports;
+    int alu;
+    int mul;
+    // A multiplication by a literal: shifts, leas and adds.
+    int mul_imm;
+    // idiv. The divider isn't pipelined and stays busy for `div_busy` cycles.
+    int div;
+    int div_busy;
+    // A division by a literal: a multiply-high and shifts.
+    int div_imm;
+};
+
+inline constexpr std::array<SchedModel, 4> s_x86_sched_models = {{
+    {.name = "generic", .width = 4, .alu_ports = 3, .mul_ports = 1, .alu = 1, .mul = 3, .mul_imm = 2, .div = 40,
+     .div_busy = 24, .div_imm = 7},
+    {.name = "skylake", .width = 4, .alu_ports = 4, .mul_ports = 1, .alu = 1, .mul = 3, .mul_imm = 2, .div = 42,
+     .div_busy = 24, .div_imm = 7},
+    {.name = "icelake", .width = 5, .alu_ports = 4, .mul_ports = 1, .alu = 1, .mul = 3, .mul_imm = 2, .div = 18,
+     .div_busy = 10, .div_imm = 7},
+    {.name = "silvermont", .width = 2, .alu_ports = 2, .mul_ports = 1, .alu = 1, .mul = 5, .mul_imm = 2, .div = 40,
+     .div_busy = 36, .div_imm = 10},
+}};
+
+inline const SchedModel *find_sched_model(const std::string_view name) {
+    for (const SchedModel &model: s_x86_sched_models) {
+        if (model.name == name) {
+            return &model;
+        }
+    }
+    return nullptr;
+}
+
+// Reorders the instructions inside each basic block before register
+// allocation, so independent computations (the two operands of a binary
+// expression, the iterations of an unrolled loop) interleave and work
+// fills the latency of multiplies and divides.
+//
+// Blocks are scheduled bottom-up: an instruction becomes ready once
+// everything that depends on it is placed, and the ready instruction with
+// the longest path from the top of the block goes last, as long as its
+// port is free in that cycle. Going upward, the values live at each point
+// are known, so when they reach the number of registers the instruction
+// that adds the fewest is picked instead. A block whose new order still
+// needs more registers than are free and than its old order did keeps the
+// old one, so the scheduler never causes a spill.
+class ListScheduler {
+public:
+    ListScheduler(IrFunction &fn, const SchedModel &model, const int reg_count)
+        : m_fn(fn)
+        , m_model(model)
+        , m_reg_count(reg_count) {
+    }
+
+    void run() {
+        const Liveness liveness(m_fn);
+        for (size_t b = 0; b < liveness.blocks().size(); b++) {
+            const Liveness::Block &block = liveness.blocks()[b];
+            size_t begin = block.begin;
+            size_t end = block.end;
+            if (begin < end && m_fn.insts[begin].op == IrOp::label) {
+                begin++;
+            }
+            if (begin < end && (ir_is_branch(m_fn.insts[end - 1].op) || m_fn.insts[end - 1].op == IrOp::exit)) {
+                end--;
+            }
+            if (end - begin > 1) {
+                schedule(begin, end, block.end, liveness.live_out(b));
+            }
+        }
+    }
+
+private:
+    enum class Unit { alu, mul, div };
+
+    struct Edge {
+        size_t to;
+        int latency;
+    };
+
+    struct Node {
+        IrInst inst;
+        std::vector<Edge> succs;
+        size_t unscheduled_succs = 0;
+        // Longest latency path from the top of the block.
+        int depth = 0;
+        // Earliest cycle, counted up from the bottom of the block, it can
+        // issue in for its results to reach everything placed below it.
+        int ready_cycle = 0;
+    };
+
+    [[nodiscard]] Unit unit(const IrInst &inst) const {
+        if (inst.op == IrOp::mul && inst.rhs >= 0) {
+            return Unit::mul;
+        }
+        if (inst.op == IrOp::div || inst.op == IrOp::mod) {
+            return inst.rhs >= 0 ? Unit::div : Unit::mul;
+        }
+        return Unit::alu;
+    }
+
+    [[nodiscard]] int latency(const IrInst &inst) const {
+        switch (inst.op) {
+            case IrOp::mul:
+                return inst.rhs >= 0 ? m_model.mul : m_model.mul_imm;
+            case IrOp::div:
+            case IrOp::mod:
+                return inst.rhs >= 0 ? m_model.div : m_model.div_imm;
+            default:
+                return m_model.alu;
+        }
+    }
+
+    static bool reads(const IrInst &inst, const int vreg) {
+        const std::vector<int> uses = ir_uses(inst);
+        return vreg >= 0 && std::ranges::find(uses, vreg) != uses.end();
+    }
+
+    // The most values live at once over `insts`, walking up from `live`.
+    static size_t peak_pressure(const std::vector<IrInst> &insts, VRegSet live) {
+        size_t peak = live.count();
+        for (auto it = insts.rbegin(); it != insts.rend(); ++it) {
+            if (ir_def(*it) >= 0) {
+                live.erase(ir_def(*it));
+            }
+            for (const int use: ir_uses(*it)) {
+                live.insert(use);
+            }
+            peak = std::max(peak, live.count() + (ir_def(*it) >= 0 ? 1 : 0));
+        }
+        return peak;
+    }
+
+    // Schedules insts[begin, end); the ones after it up to `block_end` stay put.
+    void schedule(const size_t begin, const size_t end, const size_t block_end, const VRegSet &live_out) {
+        const size_t n = end - begin;
+        std::vector<Node> nodes(n);
+        for (size_t i = 0; i < n; i++) {
+            nodes[i].inst = m_fn.insts[begin + i];
+        }
+        for (size_t i = 0; i < n; i++) {
+            const IrInst &a = nodes[i].inst;
+            for (size_t j = i + 1; j < n; j++) {
+                const IrInst &b = nodes[j].inst;
+                const bool raw = reads(b, ir_def(a));
+                const bool war = reads(a, ir_def(b));
+                const bool waw = ir_def(a) >= 0 && ir_def(a) == ir_def(b);
+                if (raw || war || waw) {
+                    nodes[i].succs.push_back({.to = j, .latency = raw ? latency(a) : 0});
+                    nodes[i].unscheduled_succs++;
+                }
+            }
+        }
+        for (size_t i = 0; i < n; i++) {
+            for (const Edge &edge: nodes[i].succs) {
+                nodes[edge.to].depth = std::max(nodes[edge.to].depth, nodes[i].depth + edge.latency);
+            }
+        }
+
+        // Values live right below the scheduled part: the block's live-out
+        // plus what the fixed instructions after it read.
+        std::vector<IrInst> tail(m_fn.insts.begin() + static_cast<std::ptrdiff_t>(end),
+                                 m_fn.insts.begin() + static_cast<std::ptrdiff_t>(block_end));
+        VRegSet live = live_out;
+        for (auto it = tail.rbegin(); it != tail.rend(); ++it) {
+            if (ir_def(*it) >= 0) {
+                live.erase(ir_def(*it));
+            }
+            for (const int use: ir_uses(*it)) {
+                live.insert(use);
+            }
+        }
+        const VRegSet live_below = live;
+
+        std::vector<IrInst> order;
+        std::vector<bool> placed(n, false);
+        std::vector<int> div_busy_until;
+        int cycle = 0;
+        while (order.size() < n) {
+            int issued = 0;
+            std::array<int, 3> ports{};
+            while (issued < m_model.width) {
+                const auto pressure_delta = [&](const size_t i) {
+                    const IrInst &inst = nodes[i].inst;
+                    int delta = ir_def(inst) >= 0 && live.contains(ir_def(inst)) ? -1 : 0;
+                    for (const int use: ir_uses(inst)) {
+                        delta += live.contains(use) ? 0 : 1;
+                    }
+                    return delta;
+                };
+                std::optional<size_t> best;
+                for (size_t i = n; i-- > 0;) {
+                    if (placed[i] || nodes[i].unscheduled_succs > 0 || nodes[i].ready_cycle > cycle ||
+                        !port_free(unit(nodes[i].inst), ports, div_busy_until, cycle)) {
+                        continue;
+                    }
+                    if (!best.has_value()) {
+                        best = i;
+                        continue;
+                    }
+                    if (live.count() >= static_cast<size_t>(m_reg_count) &&
+                        pressure_delta(i) != pressure_delta(best.value())) {
+                        if (pressure_delta(i) < pressure_delta(best.value())) {
+                            best = i;
+                        }
+                        continue;
+                    }
+                    if (nodes[i].depth > nodes[best.value()].depth) {
+                        best = i;
+                    }
+                }
+                if (!best.has_value()) {
+                    break;
+                }
+                const size_t i = best.value();
+                const IrInst &inst = nodes[i].inst;
+                placed[i] = true;
+                order.push_back(inst);
+                issued++;
+                take_port(unit(inst), ports, div_busy_until, cycle);
+                if (ir_def(inst) >= 0) {
+                    live.erase(ir_def(inst));
+                }
+                for (const int use: ir_uses(inst)) {
+                    live.insert(use);
+                }
+                for (size_t j = 0; j < i; j++) {
+                    for (const Edge &edge: nodes[j].succs) {
+                        if (edge.to == i) {
+                            nodes[j].unscheduled_succs--;
+                            nodes[j].ready_cycle = std::max(nodes[j].ready_cycle, cycle + edge.latency);
+                        }
+                    }
+                }
+            }
+            cycle++;
+        }
+        std::ranges::reverse(order);
+
+        std::vector<IrInst> original(m_fn.insts.begin() + static_cast<std::ptrdiff_t>(begin),
+                                     m_fn.insts.begin() + static_cast<std::ptrdiff_t>(end));
+        const size_t old_peak = peak_pressure(original, live_below);
+        const size_t new_peak = peak_pressure(order, live_below);
+        if (new_peak > std::max(old_peak, static_cast<size_t>(m_reg_count))) {
+            return;
+        }
+        std::ranges::copy(order, m_fn.insts.begin() + static_cast<std::ptrdiff_t>(begin));
+    }
+
+    // The divider is busy from an idiv's issue for `div_busy` cycles, which
+    // going upward is the cycles before the next one issues.
+    [[nodiscard]] bool port_free(const Unit unit, const std::array<int, 3> &ports,
+                                 const std::vector<int> &div_busy_until, const int cycle) const {
+        switch (unit) {
+            case Unit::alu:
+                return ports[0] < m_model.alu_ports;
+            case Unit::mul:
+                return ports[1] < m_model.mul_ports;
+            case Unit::div:
+                return ports[2] == 0 && std::ranges::none_of(div_busy_until, [&](const int until) {
+                    return cycle < until;
+                });
+        }
+        return true;
+    }
+
+    void take_port(const Unit unit, std::array<int, 3> &ports, std::vector<int> &div_busy_until,
+                   const int cycle) const {
+        ports[static_cast<size_t>(unit)]++;
+        if (unit == Unit::div) {
+            div_busy_until.push_back(cycle + m_model.div_busy);
+        }
+    }
+
+    IrFunction &m_fn;
+    const SchedModel &m_model;
+    int m_reg_count;
+};
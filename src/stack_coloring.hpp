@@ -0,0 +1,246 @@
+#pragma once
+#include <numeric>
+#include <unordered_map>
+#include <unordered_set>
+
+#include "./regalloc.hpp"
+
+// Frame slots for the variables of the stack backend, shared by variables
+// whose live ranges don't overlap. A variable lives from its `let` to its
+// last read or write, and one used inside a loop it was declared outside of
+// lives until the end of that loop, since the next iteration reads it again.
+// Live ranges are intervals over the statements in program order, so
+// assigning slots greedily by start uses as few as possible.
+class StackSlotColoring {
+public:
+    explicit StackSlotColoring(const NodeProgram &prog) {
+        for (const NodeStmt *stmt: prog.stmts) {
+            visit(stmt);
+        }
+        assign_slots();
+    }
+
+    [[nodiscard]] size_t slot(const NodeStmtLet *stmt_let) const {
+        return m_slots.at(stmt_let);
+    }
+
+    [[nodiscard]] size_t slot_count() const {
+        return m_slot_count;
+    }
+
+private:
+    struct Range {
+        const NodeStmtLet *let;
+        size_t start;
+        size_t end;
+    };
+
+    struct Loop {
+        size_t start;
+        // Ranges of variables declared before the loop and used inside it.
+        std::vector<size_t> carried;
+    };
+
+    void use(const std::string &name) {
+        const auto it = std::ranges::find_if(m_scope_vars.rbegin(), m_scope_vars.rend(), [&](const size_t range) {
+            return m_ranges[range].let->ident.value.value() == name;
+        });
+        if (it == m_scope_vars.rend()) {
+            return;
+        }
+        Range &range = m_ranges[*it];
+        range.end = std::max(range.end, m_pos);
+        const auto loop = std::ranges::find_if(m_loops, [&](const Loop &l) { return l.start > range.start; });
+        if (loop != m_loops.end()) {
+            loop->carried.push_back(*it);
+        }
+    }
+
+    void use(const NodeExpr *expr) {
+        std::unordered_set<std::string> names;
+        collect_used(expr, names);
+        for (const std::string &name: names) {
+            use(name);
+        }
+    }
+
+    void visit(const NodeScope *scope) {
+        const size_t mark = m_scope_vars.size();
+        for (const NodeStmt *stmt: scope->stmts) {
+            visit(stmt);
+        }
+        m_scope_vars.resize(mark);
+    }
+
+    void visit(const NodeIfPred *pred) {
+        m_pos++;
+        if (const auto elif = std::get_if<NodeIfPredElif *>(&pred->var)) {
+            use((*elif)->expr);
+            visit((*elif)->scope);
+            if ((*elif)->pred.has_value()) {
+                visit((*elif)->pred.value());
+            }
+            return;
+        }
+        visit(std::get<NodeIfPredElse *>(pred->var)->scope);
+    }
+
+    void visit(const NodeStmt *stmt) {
+        m_pos++;
+        struct StmtVisitor {
+            StackSlotColoring &coloring;
+
+            void operator()(const NodeStmtExit *stmt_exit) const {
+                coloring.use(stmt_exit->expr);
+            }
+
+            void operator()(const NodeStmtLet *stmt_let) const {
+                coloring.use(stmt_let->expr);
+                coloring.m_scope_vars.push_back(coloring.m_ranges.size());
+                coloring.m_ranges.push_back({.let = stmt_let, .start = coloring.m_pos, .end = coloring.m_pos});
+            }
+
+            void operator()(const NodeScope *scope) const {
+                coloring.visit(scope);
+            }
+
+            void operator()(const NodeStmtIf *stmt_if) const {
+                coloring.use(stmt_if->expr);
+                coloring.visit(stmt_if->scope);
+                if (stmt_if->pred.has_value()) {
+                    coloring.visit(stmt_if->pred.value());
+                }
+            }
+
+            void operator()(const NodeStmtAssign *stmt_assign) const {
+                coloring.use(stmt_assign->expr);
+                coloring.use(stmt_assign->ident.value.value());
+            }
+
+            // The condition is read again at the bottom of every iteration.
+            void operator()(const NodeStmtWhile *stmt_while) const {
+                coloring.m_loops.push_back({.start = coloring.m_pos, .carried = {}});
+                coloring.use(stmt_while->expr);
+                coloring.visit(stmt_while->scope);
+                coloring.m_pos++;
+                coloring.use(stmt_while->expr);
+                for (const size_t range: coloring.m_loops.back().carried) {
+                    coloring.m_ranges[range].end = std::max(coloring.m_ranges[range].end, coloring.m_pos);
+                }
+                coloring.m_loops.pop_back();
+            }
+
+            void operator()(const NodeVarReassign *var_reassign) const {
+                if (const auto compound = std::get_if<NodeCompound *>(&var_reassign->var)) {
+                    std::visit([&](const auto *stmt) {
+                        std::unordered_set<std::string> names;
+                        collect_used(stmt->term, names);
+                        for (const std::string &name: names) {
+                            coloring.use(name);
+                        }
+                    }, (*compound)->var);
+                }
+                coloring.use(reassign_target(var_reassign).value.value());
+            }
+        };
+        std::visit(StmtVisitor{.coloring = *this}, stmt->var);
+    }
+
+    // A variable last used by the `let` of another can hand it its slot: the
+    // value is read before the new one is stored.
+    void assign_slots() {
+        std::vector<size_t> order(m_ranges.size());
+        std::iota(order.begin(), order.end(), 0);
+        std::ranges::sort(order, {}, [&](const size_t range) { return m_ranges[range].start; });
+        std::vector<size_t> active;
+        std::vector<bool> free;
+        for (const size_t range: order) {
+            std::erase_if(active, [&](const size_t other) {
+                if (m_ranges[other].end <= m_ranges[range].start) {
+                    free[m_slots[m_ranges[other].let]] = true;
+                    return true;
+                }
+                return false;
+            });
+            auto it = std::ranges::find(free, true);
+            if (it == free.end()) {
+                free.push_back(true);
+                it = free.end() - 1;
+            }
+            *it = false;
+            m_slots[m_ranges[range].let] = static_cast<size_t>(it - free.begin());
+            active.push_back(range);
+        }
+        m_slot_count = free.size();
+    }
+
+    std::vector<Range> m_ranges;
+    // Indices into m_ranges of the variables in scope, innermost last.
+    std::vector<size_t> m_scope_vars;
+    std::vector<Loop> m_loops;
+    size_t m_pos = 0;
+    std::unordered_map<const NodeStmtLet *, size_t> m_slots;
+    size_t m_slot_count = 0;
+};
+
+// Shares the spill slots of the register allocator between values that are
+// never live at the same time: each slot is treated as a value of its own,
+// defined by the stores and writes to it and used by the loads and reads,
+// and the interference graph of the slots is colored greedily. Renumbers the
+// slots of `alloc` and of the loads and stores in `fn`.
+inline void color_spill_slots(IrFunction &fn, Allocation &alloc) {
+    const auto slot_of = [&](const int vreg) { return vreg >= 0 ? alloc.slot[vreg] : -1; };
+    IrFunction slots{.insts = {}, .vreg_count = alloc.slot_count, .label_count = fn.label_count};
+    for (IrInst inst: fn.insts) {
+        // A spill temporary can itself end up in a slot when the allocator
+        // gives up rewriting, so the other side of a load or store counts too.
+        if (inst.op == IrOp::load) {
+            inst = {.op = IrOp::copy, .dst = slot_of(inst.dst), .lhs = static_cast<int>(inst.imm)};
+        } else if (inst.op == IrOp::store) {
+            inst = {.op = IrOp::copy, .dst = static_cast<int>(inst.imm), .lhs = slot_of(inst.lhs)};
+        } else {
+            inst.dst = slot_of(inst.dst);
+            inst.lhs = slot_of(inst.lhs);
+            inst.rhs = slot_of(inst.rhs);
+            inst.src = slot_of(inst.src);
+        }
+        slots.insts.push_back(inst);
+    }
+
+    std::vector<VRegSet> interferes(alloc.slot_count, VRegSet(alloc.slot_count));
+    Liveness(slots).for_each_live_after([&](const size_t i, const VRegSet &live) {
+        const int def = ir_def(slots.insts[i]);
+        if (def < 0) {
+            return;
+        }
+        live.for_each([&](const int other) {
+            if (other != def) {
+                interferes[def].insert(other);
+                interferes[other].insert(def);
+            }
+        });
+    });
+
+    std::vector<int> color(alloc.slot_count, -1);
+    int color_count = 0;
+    for (int slot = 0; slot < alloc.slot_count; slot++) {
+        std::vector<bool> taken(color_count, false);
+        interferes[slot].for_each([&](const int other) {
+            if (color[other] >= 0) {
+                taken[color[other]] = true;
+            }
+        });
+        color[slot] = static_cast<int>(std::ranges::find(taken, false) - taken.begin());
+        color_count = std::max(color_count, color[slot] + 1);
+    }
+
+    for (IrInst &inst: fn.insts) {
+        if (inst.op == IrOp::load || inst.op == IrOp::store) {
+            inst.imm = color[inst.imm];
+        }
+    }
+    for (int &slot: alloc.slot) {
+        slot = slot >= 0 ? color[slot] : -1;
+    }
+    alloc.slot_count = color_count;
+}
@@ -0,0 +1,225 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <thread>
+
+#include "./ast_utils.hpp"
+#include "./bytecode.hpp"
+#include "./generation.hpp"
+#include "./jit.hpp"
+#include "./profile.hpp"
+#include "./x86_encoder.hpp"
+
+struct TierOptions {
+    // Back-edges a loop takes in the interpreter before it is compiled.
+    uint64_t hot_threshold = 1000;
+    bool trace = false;
+    CodegenOptions codegen{.regalloc = RegAllocKind::linear_scan};
+};
+
+// Starts a program in the bytecode VM and moves it to native code once a loop
+// gets hot. The loop is compiled on another thread while the VM keeps running
+// it. What gets compiled is the rest of the program from the loop's next
+// iteration on, as an AST of its own: a `let` for every variable in scope,
+// then the loop, then whatever follows it in each enclosing scope (running an
+// enclosing loop again after its body). The lets start from placeholder
+// literals, so the code does not depend on the values. At the loop's next
+// back-edge after the code is ready, the VM's current values are patched over
+// the placeholders and the code runs to the end of the program (on-stack
+// replacement).
+class TieredEngine {
+public:
+    TieredEngine(const NodeProgram &prog, const TierOptions &options)
+        : m_prog(prog)
+        , m_options(options) {
+    }
+
+    // The exit status of the program, as a shell would see it.
+    int run() {
+        m_start = std::chrono::steady_clock::now();
+        const BcProgram bytecode = BytecodeCompiler(true).compile(m_prog);
+        BytecodeVm vm(bytecode, m_options.hot_threshold);
+        while (true) {
+            const BcOutcome outcome = vm.run();
+            if (outcome.status != BcStatus::hot_loop) {
+                // The compiler still reads `bytecode`.
+                if (m_compiler.joinable()) {
+                    m_compiler.join();
+                }
+                trace() << "finished in the interpreter" << std::endl;
+                return exit_status(outcome);
+            }
+            const auto loop = static_cast<size_t>(outcome.value);
+            const BcLoopSite &site = bytecode.loops[loop];
+            finish_background(bytecode);
+            if (!m_compiler.joinable() && !m_tried[loop]) {
+                start_compile(site, loop, vm.back_edges(loop));
+            }
+            // Unless a compile is still running, the last job is finished.
+            if (!m_compiler.joinable() && m_job->loop == loop && m_job->code.has_value()) {
+                return enter_native(site, vm, loop);
+            }
+            // Check on the compiler again after another threshold's worth of
+            // back-edges, or never if this loop has had its chance.
+            const bool waiting = m_compiler.joinable() && m_job->loop == loop;
+            vm.defer_hot(loop, waiting || !m_tried[loop] ? m_options.hot_threshold : UINT64_MAX);
+        }
+    }
+
+private:
+    static constexpr int64_t s_placeholder = 0x6f73'7200'0000'0000;
+
+    struct NativeCode {
+        std::vector<uint8_t> bytes;
+        // For each variable of the loop site, the offsets of the imm64s that
+        // hold its placeholder.
+        std::vector<std::vector<size_t>> patches;
+    };
+
+    struct Job {
+        size_t loop;
+        std::atomic<bool> done = false;
+        std::optional<NativeCode> code;
+        double compile_ms = 0;
+    };
+
+    [[nodiscard]] double elapsed_ms() const {
+        return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - m_start).count();
+    }
+
+    // The stream for a tier trace line, or one that discards it.
+    std::ostream &trace() const {
+        static std::ostream s_null(nullptr);
+        if (!m_options.trace) {
+            return s_null;
+        }
+        return std::cerr << "[tier] " << std::fixed << std::setprecision(3) << std::setw(9) << elapsed_ms() << " ms  ";
+    }
+
+    static int loop_line(const BcLoopSite &site) {
+        return expr_line(std::get<NodeStmtWhile *>(site.loop->var)->expr);
+    }
+
+    // The rest of the program from `site`'s loop on, with placeholders as the
+    // values of the variables in scope.
+    static NodeProgram osr_program(ArenaAllocator &allocator, const BcLoopSite &site) {
+        std::vector<NodeStmt *> stmts;
+        size_t var_end = site.vars.size();
+        for (size_t i = site.frames.size(); i-- > 0;) {
+            const BcLoopSite::Frame &frame = site.frames[i];
+            std::vector<NodeStmt *> outer;
+            const size_t var_begin = var_end - frame.var_count;
+            for (size_t var = var_begin; var < var_end; var++) {
+                const Token ident{.type = TokenType::ident, .line = 0, .value = site.vars[var].name};
+                outer.push_back(make_let_stmt(allocator, ident,
+                                              make_int_lit_expr(allocator, s_placeholder + static_cast<int64_t>(var))));
+            }
+            if (i + 1 == site.frames.size()) {
+                outer.push_back(site.loop);
+            } else {
+                auto scope = allocator.emplace<NodeScope>();
+                scope->stmts = std::move(stmts);
+                outer.push_back(allocator.emplace<NodeStmt>(scope));
+                if (site.frames[i + 1].repeat != nullptr) {
+                    outer.push_back(site.frames[i + 1].repeat);
+                }
+            }
+            outer.insert(outer.end(), frame.rest.begin(), frame.rest.end());
+            stmts = std::move(outer);
+            var_end = var_begin;
+        }
+        return NodeProgram{.stmts = std::move(stmts)};
+    }
+
+    // Every placeholder has to turn up in the bytes exactly where the code
+    // has it as an immediate, or the code cannot be patched safely.
+    static std::optional<NativeCode> compile(const BcLoopSite &site, const CodegenOptions &options) {
+        ArenaAllocator allocator(1024 * 1024);
+        const NodeProgram prog = osr_program(allocator, site);
+        const MachineCode code = Generator(prog, options).gen_prog();
+        NativeCode native{.bytes = X86Encoder().encode(code), .patches = std::vector<std::vector<size_t>>(site.vars.size())};
+        for (size_t var = 0; var < site.vars.size(); var++) {
+            const int64_t placeholder = s_placeholder + static_cast<int64_t>(var);
+            const size_t uses = std::ranges::count_if(code.insts, [&](const MInst &inst) {
+                return std::ranges::any_of(inst.args(), [&](const MOperand &operand) {
+                    return operand.kind == MOperandKind::imm && operand.value == placeholder;
+                });
+            });
+            for (size_t at = 0; at + sizeof(placeholder) <= native.bytes.size(); at++) {
+                if (std::memcmp(native.bytes.data() + at, &placeholder, sizeof(placeholder)) == 0) {
+                    native.patches[var].push_back(at);
+                }
+            }
+            if (native.patches[var].size() != uses) {
+                return {};
+            }
+        }
+        return native;
+    }
+
+    // With a single core, a background compile would only take turns with the
+    // VM, so it is done right away instead.
+    void start_compile(const BcLoopSite &site, const size_t loop, const uint64_t back_edges) {
+        const bool background = std::thread::hardware_concurrency() > 1;
+        m_tried[loop] = true;
+        trace() << "loop at line " << loop_line(site) << " hot after " << back_edges << " back-edges, compiling"
+                << (background ? " in the background" : "") << std::endl;
+        m_job.emplace(loop);
+        const auto job = [this, &site] {
+            const auto start = std::chrono::steady_clock::now();
+            m_job->code = compile(site, m_options.codegen);
+            m_job->compile_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start)
+                                    .count();
+            m_job->done.store(true, std::memory_order_release);
+        };
+        if (background) {
+            m_compiler = std::thread(job);
+        } else {
+            job();
+            trace_compiled(site);
+        }
+    }
+
+    void finish_background(const BcProgram &bytecode) {
+        if (m_compiler.joinable() && m_job->done.load(std::memory_order_acquire)) {
+            m_compiler.join();
+            trace_compiled(bytecode.loops[m_job->loop]);
+        }
+    }
+
+    void trace_compiled(const BcLoopSite &site) const {
+        if (!m_job->code.has_value()) {
+            trace() << "loop at line " << loop_line(site)
+                    << " could not be compiled with patchable values, staying in the interpreter" << std::endl;
+            return;
+        }
+        trace() << "loop at line " << loop_line(site) << " compiled in " << std::setprecision(3) << m_job->compile_ms
+                << " ms, " << m_job->code->bytes.size() << " bytes" << std::endl;
+    }
+
+    int enter_native(const BcLoopSite &site, const BytecodeVm &vm, const size_t loop) {
+        NativeCode &native = m_job->code.value();
+        for (size_t var = 0; var < site.vars.size(); var++) {
+            const int64_t value = vm.reg(site.vars[var].reg);
+            for (const size_t at: native.patches[var]) {
+                std::memcpy(native.bytes.data() + at, &value, sizeof(value));
+            }
+        }
+        trace() << "entering native code after " << vm.back_edges(loop) << " back-edges with " << site.vars.size()
+                << " live variables" << std::endl;
+        const int status = run_machine_code(native.bytes);
+        trace() << "finished in native code" << std::endl;
+        return status;
+    }
+
+    const NodeProgram &m_prog;
+    TierOptions m_options;
+    std::chrono::steady_clock::time_point m_start;
+    std::optional<Job> m_job;
+    std::thread m_compiler;
+    std::unordered_map<size_t, bool> m_tried;
+};
@@ -21,6 +21,7 @@ enum class TokenType {
     star,
     minus,
     fslash,
+    percent,
     open_curly,
     closed_curly,
     greater,
@@ -33,6 +34,7 @@ enum class TokenType {
     compound_sub,
     compound_mul,
     compound_div,
+    compound_mod,
     unary_plus,
     unary_minus,
 
@@ -44,6 +46,7 @@ inline bool is_bin_op(const TokenType type) {
         case TokenType::star:
         case TokenType::minus:
         case TokenType::fslash:
+        case TokenType::percent:
             return true;
         default:
             return false;
@@ -82,6 +85,8 @@ inline std::string to_string(const TokenType type) {
             return "'-'";
         case TokenType::fslash:
             return "'/'";
+        case TokenType::percent:
+            return "'%'";
         case TokenType::greater:
             return "'>'";
         case TokenType::less:
@@ -112,6 +117,8 @@ inline std::string to_string(const TokenType type) {
             return "'*'";
         case TokenType::compound_div:
             return "'/'";
+        case TokenType::compound_mod:
+            return "'%'";
         default:
             return"";
     }
@@ -125,6 +132,7 @@ inline std::optional<int> bin_prec(const TokenType type) {
             return 1;
         case TokenType::star:
         case TokenType::fslash:
+        case TokenType::percent:
             return 2;
         case TokenType::greater:
         case TokenType::greaterequal:
@@ -262,6 +270,11 @@ public:
                 consume();
                 tokens.push_back({TokenType::compound_div, line_count});
             }
+            else if (peek().value() == '%' && peek(1).has_value() && peek(1).value() == '=') {
+                consume();
+                consume();
+                tokens.push_back({TokenType::compound_mod, line_count});
+            }
             else if (peek().value() == '(') {
                 consume();
                 tokens.push_back({TokenType::open_paren, line_count});
@@ -286,6 +299,9 @@ public:
             } else if (peek().value() == '/') {
                 consume();
                 tokens.push_back({TokenType::fslash, line_count});
+            } else if (peek().value() == '%') {
+                consume();
+                tokens.push_back({TokenType::percent, line_count});
             } else if (peek().value() == '{') {
                 consume();
                 tokens.push_back({TokenType::open_curly, line_count});
@@ -314,7 +330,7 @@ public:
 
 private:
     [[nodiscard]] std::optional<char> peek(const int offset = 0) const {
-        if (m_index + offset >= m_src.length()) {
+        if (static_cast<size_t>(m_index + offset) >= m_src.length()) {
             return {};
         }
         return m_src.at(m_index + offset);
@@ -0,0 +1,163 @@
+#pragma once
+#include <vector>
+
+#include "./scev.hpp"
+
+struct UnrollOptions {
+    // Loops with at most this many iterations are replaced by straight-line copies.
+    uint64_t max_full_trip_count = 0;
+    // Number of body copies per iteration of a partially unrolled loop; < 2 disables it.
+    uint64_t factor = 0;
+    // Upper bound on the AST nodes a single unrolled loop may grow to.
+    size_t size_budget = 0;
+
+    static UnrollOptions for_level(const std::string &level) {
+        if (level == "1") {
+            return {.max_full_trip_count = 8, .factor = 2, .size_budget = 96};
+        }
+        if (level == "2" || level == "3") {
+            return {.max_full_trip_count = 32, .factor = 4, .size_budget = 512};
+        }
+        if (level == "s") {
+            // Only unroll when the copies are no bigger than the loop they replace.
+            return {.max_full_trip_count = 2, .factor = 0, .size_budget = 0};
+        }
+        return {};
+    }
+};
+
+class LoopUnroller {
+public:
+    LoopUnroller(ArenaAllocator &allocator, const UnrollOptions &options)
+        : m_allocator(allocator)
+        , m_cloner(allocator)
+        , m_options(options) {
+    }
+
+    void run(NodeProgram &prog) {
+        ConstEnv env;
+        unroll_stmts(prog.stmts, env);
+    }
+
+    [[nodiscard]] size_t full_count() const {
+        return m_full_count;
+    }
+
+    [[nodiscard]] size_t partial_count() const {
+        return m_partial_count;
+    }
+
+private:
+    void unroll_stmts(std::vector<NodeStmt *> &stmts, ConstEnv env) {
+        std::vector<NodeStmt *> result;
+        for (NodeStmt *stmt: stmts) {
+            for_each_nested_block(stmt, env, [&](std::vector<NodeStmt *> &nested, const ConstEnv &nested_env) {
+                unroll_stmts(nested, nested_env);
+            });
+            const auto stmt_while = std::get_if<NodeStmtWhile *>(&stmt->var);
+            if (stmt_while == nullptr) {
+                result.push_back(stmt);
+                update_const_env(stmt, env);
+                continue;
+            }
+            const auto loop = match_counted_loop(*stmt_while, env);
+            std::optional<uint64_t> trips;
+            if (loop.has_value()) {
+                trips = trip_count(loop.value());
+            }
+            update_const_env(stmt, env);
+            if (!trips.has_value()) {
+                result.push_back(stmt);
+                continue;
+            }
+            env[loop->induction] = wrap_add(loop->start, wrap_mul(static_cast<int64_t>(trips.value()), loop->step));
+            if (!try_full_unroll(*stmt_while, trips.value(), result)
+                && !try_partial_unroll(*stmt_while, loop.value(), trips.value(), result)) {
+                result.push_back(stmt);
+            }
+        }
+        stmts = std::move(result);
+    }
+
+    bool try_full_unroll(const NodeStmtWhile *stmt_while, const uint64_t trips, std::vector<NodeStmt *> &out) {
+        const size_t body_size = count_nodes(stmt_while->scope);
+        const size_t loop_size = body_size + count_nodes(stmt_while->expr) + 1;
+        if (trips > m_options.max_full_trip_count) {
+            return false;
+        }
+        if (trips * body_size > std::max(m_options.size_budget, loop_size)) {
+            return false;
+        }
+        for (uint64_t i = 0; i < trips; i++) {
+            auto copy = m_allocator.emplace<NodeStmt>();
+            copy->var = m_cloner.clone(stmt_while->scope);
+            out.push_back(copy);
+        }
+        m_full_count++;
+        return true;
+    }
+
+    // Runs the body `factor` times per iteration until fewer than `factor`
+    // iterations remain, then hands the rest to the original loop.
+    bool try_partial_unroll(NodeStmtWhile *stmt_while, const CountedLoop &loop, const uint64_t trips,
+                            std::vector<NodeStmt *> &out) {
+        const uint64_t factor = m_options.factor;
+        if (factor < 2 || trips < factor || count_nodes(stmt_while->scope) * factor > m_options.size_budget) {
+            return false;
+        }
+        const uint64_t main_trips = trips / factor * factor;
+        const int64_t main_end = wrap_add(loop.start, wrap_mul(static_cast<int64_t>(main_trips), loop.step));
+
+        auto main_body = m_allocator.emplace<NodeScope>();
+        for (uint64_t i = 0; i < factor; i++) {
+            auto copy = m_allocator.emplace<NodeStmt>();
+            copy->var = m_cloner.clone(stmt_while->scope);
+            main_body->stmts.push_back(copy);
+        }
+        auto main_loop = m_allocator.emplace<NodeStmtWhile>();
+        main_loop->expr = make_exit_test(loop, main_end, expr_line(stmt_while->expr));
+        main_loop->scope = main_body;
+        auto main_stmt = m_allocator.emplace<NodeStmt>();
+        main_stmt->var = main_loop;
+        out.push_back(main_stmt);
+
+        if (main_trips != trips) {
+            auto remainder = m_allocator.emplace<NodeStmt>();
+            remainder->var = stmt_while;
+            out.push_back(remainder);
+        }
+        m_partial_count++;
+        return true;
+    }
+
+    // `line` is the line of the original loop condition, for diagnostics and
+    // traces.
+    NodeExpr *make_exit_test(const CountedLoop &loop, const int64_t end, const int line) {
+        const Token ident{.type = TokenType::ident, .line = line, .value = loop.induction};
+        NodeExpr *lhs = make_ident_expr(m_allocator, ident);
+        NodeExpr *rhs = make_int_lit_expr(m_allocator, end, line);
+        auto cond = m_allocator.emplace<NodeCondExpr>();
+        switch (loop.cmp) {
+            case LoopCmp::less:
+            case LoopCmp::less_eq:
+                cond->var = m_allocator.emplace<NodeCondExprLess>(lhs, rhs);
+                break;
+            case LoopCmp::greater:
+            case LoopCmp::greater_eq:
+                cond->var = m_allocator.emplace<NodeCondExprGreater>(lhs, rhs);
+                break;
+            case LoopCmp::not_eq_:
+                cond->var = m_allocator.emplace<NodeCondExprNotEq>(lhs, rhs);
+                break;
+        }
+        auto expr = m_allocator.emplace<NodeExpr>();
+        expr->var = cond;
+        return expr;
+    }
+
+    ArenaAllocator &m_allocator;
+    AstCloner m_cloner;
+    UnrollOptions m_options;
+    size_t m_full_count = 0;
+    size_t m_partial_count = 0;
+};
@@ -0,0 +1,398 @@
+#pragma once
+#include <array>
+#include <cstdint>
+#include <iostream>
+#include <unordered_map>
+#include <vector>
+
+#include "./machine.hpp"
+
+// Encodes the x86-64 instructions the backend emits straight into machine
+// code. Jumps start out in their two-byte rel8 form and are widened to rel32
+// when their target is out of reach; widening one can push another target out
+// of reach, so layout is repeated until no jump changes. Alignment is padded
+// with multi-byte nops.
+class X86Encoder {
+public:
+    [[nodiscard]] std::vector<uint8_t> encode(const MachineCode &code) {
+        m_pieces.clear();
+        m_bytes.clear();
+        m_bytes.reserve(code.insts.size() * 5);
+        std::unordered_map<int64_t, size_t> labels;
+        for (const MInst &inst: code.insts) {
+            switch (inst.op) {
+                case MOp::comment:
+                    break;
+                case MOp::label:
+                    labels[inst.operands[0].value] = m_pieces.size();
+                    m_pieces.push_back({.kind = PieceKind::label});
+                    break;
+                case MOp::align:
+                    m_pieces.push_back({.kind = PieceKind::align, .value = inst.operands[0].value});
+                    break;
+                case MOp::jcc:
+                case MOp::jmp:
+                    m_pieces.push_back({.kind = PieceKind::jump, .op = inst.op, .cond = inst.cond,
+                                        .value = inst.operands[0].value});
+                    break;
+                default: {
+                    const size_t begin = m_bytes.size();
+                    encode(inst);
+                    m_pieces.push_back({.kind = PieceKind::bytes, .begin = begin, .size = m_bytes.size() - begin});
+                    break;
+                }
+            }
+        }
+        for (Piece &piece: m_pieces) {
+            if (piece.kind == PieceKind::jump) {
+                const auto it = labels.find(piece.value);
+                if (it == labels.end()) {
+                    std::cerr << "Jump to undefined label " << piece.value << std::endl;
+                    exit(EXIT_FAILURE);
+                }
+                piece.target = it->second;
+            }
+        }
+
+        std::vector<int64_t> address(m_pieces.size() + 1);
+        for (bool changed = true; changed;) {
+            int64_t at = 0;
+            for (size_t i = 0; i < m_pieces.size(); i++) {
+                address[i] = at;
+                at += size(m_pieces[i], at);
+            }
+            address[m_pieces.size()] = at;
+            changed = false;
+            for (size_t i = 0; i < m_pieces.size(); i++) {
+                Piece &piece = m_pieces[i];
+                if (piece.kind == PieceKind::jump && !piece.wide &&
+                    !fits_int8(address[piece.target] - (address[i] + 2))) {
+                    piece.wide = true;
+                    changed = true;
+                }
+            }
+        }
+
+        std::vector<uint8_t> out;
+        out.reserve(static_cast<size_t>(address.back()));
+        for (size_t i = 0; i < m_pieces.size(); i++) {
+            const Piece &piece = m_pieces[i];
+            switch (piece.kind) {
+                case PieceKind::label:
+                    break;
+                case PieceKind::align:
+                    put_nops(out, size(piece, address[i]));
+                    break;
+                case PieceKind::bytes:
+                    out.insert(out.end(), m_bytes.begin() + static_cast<std::ptrdiff_t>(piece.begin),
+                               m_bytes.begin() + static_cast<std::ptrdiff_t>(piece.begin + piece.size));
+                    break;
+                case PieceKind::jump: {
+                    const int64_t next = address[i] + size(piece, address[i]);
+                    const int64_t disp = address[piece.target] - next;
+                    if (!piece.wide) {
+                        out.push_back(piece.op == MOp::jmp ? 0xeb : 0x70 | cond_code(piece.cond));
+                        out.push_back(static_cast<uint8_t>(disp));
+                    } else if (piece.op == MOp::jmp) {
+                        out.push_back(0xe9);
+                        put_le(out, disp, 4);
+                    } else {
+                        out.push_back(0x0f);
+                        out.push_back(0x80 | cond_code(piece.cond));
+                        put_le(out, disp, 4);
+                    }
+                    break;
+                }
+            }
+        }
+        return out;
+    }
+
+private:
+    enum class PieceKind { bytes, jump, label, align };
+
+    // An instruction already encoded into m_bytes, or one whose size depends
+    // on where it ends up.
+    struct Piece {
+        PieceKind kind;
+        size_t begin = 0;
+        size_t size = 0;
+        MOp op = MOp::jmp;
+        IrCond cond = IrCond::eq;
+        // The label a jump goes to or the boundary of an align.
+        int64_t value = 0;
+        // The piece a jump's label is.
+        size_t target = 0;
+        bool wide = false;
+    };
+
+    static size_t size(const Piece &piece, const int64_t address) {
+        switch (piece.kind) {
+            case PieceKind::bytes:
+                return piece.size;
+            case PieceKind::jump:
+                return !piece.wide ? 2 : piece.op == MOp::jmp ? 5 : 6;
+            case PieceKind::align:
+                return static_cast<size_t>((piece.value - address % piece.value) % piece.value);
+            case PieceKind::label:
+                break;
+        }
+        return 0;
+    }
+
+    static bool fits_int8(const int64_t value) {
+        return value >= INT8_MIN && value <= INT8_MAX;
+    }
+
+    static bool fits_int32(const int64_t value) {
+        return value >= INT32_MIN && value <= INT32_MAX;
+    }
+
+    // Indexed by IrCond: g, ge, l, le, e, ne.
+    static uint8_t cond_code(const IrCond cond) {
+        static constexpr std::array<uint8_t, 6> s_codes = {0xf, 0xd, 0xc, 0xe, 0x4, 0x5};
+        return s_codes[static_cast<size_t>(cond)];
+    }
+
+    static void put_le(std::vector<uint8_t> &out, const int64_t value, const int bytes) {
+        for (int i = 0; i < bytes; i++) {
+            out.push_back(static_cast<uint8_t>(static_cast<uint64_t>(value) >> (8 * i)));
+        }
+    }
+
+    static void put_nops(std::vector<uint8_t> &out, size_t count) {
+        static constexpr std::array<std::array<uint8_t, 9>, 9> s_nops = {{
+            {0x90},
+            {0x66, 0x90},
+            {0x0f, 0x1f, 0x00},
+            {0x0f, 0x1f, 0x40, 0x00},
+            {0x0f, 0x1f, 0x44, 0x00, 0x00},
+            {0x66, 0x0f, 0x1f, 0x44, 0x00, 0x00},
+            {0x0f, 0x1f, 0x80, 0x00, 0x00, 0x00, 0x00},
+            {0x0f, 0x1f, 0x84, 0x00, 0x00, 0x00, 0x00, 0x00},
+            {0x66, 0x0f, 0x1f, 0x84, 0x00, 0x00, 0x00, 0x00, 0x00},
+        }};
+        while (count > 0) {
+            const size_t n = std::min<size_t>(count, s_nops.size());
+            out.insert(out.end(), s_nops[n - 1].begin(), s_nops[n - 1].begin() + static_cast<std::ptrdiff_t>(n));
+            count -= n;
+        }
+    }
+
+    [[noreturn]] static void unsupported(const MInst &inst) {
+        std::cerr << "Cannot encode " << x86_mnemonic(inst.op) << " with these " << +inst.operand_count
+                  << " operands" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    // An optional REX prefix, `opcode`, and the ModRM byte for `reg` and
+    // `rm`, a register or memory operand, with its SIB byte and displacement.
+    // An 8-bit `rm` of spl, bpl, sil or dil needs an empty REX to be told
+    // apart from ah, ch, dh and bh.
+    void put_modrm(const bool wide, const std::initializer_list<uint8_t> opcode, const uint8_t reg,
+                   const MOperand &rm) {
+        const bool mem = rm.kind == MOperandKind::mem;
+        const bool has_index = mem && rm.index != s_no_index;
+        uint8_t rex = (wide ? 0x08 : 0) | (reg & 8) >> 1 | (has_index ? (rm.index & 8) >> 2 : 0) | (rm.reg & 8) >> 3;
+        const bool byte_reg = !mem && rm.bits == 8 && rm.reg >= 4 && rm.reg < 8;
+        if (rex != 0 || byte_reg) {
+            m_bytes.push_back(0x40 | rex);
+        }
+        m_bytes.insert(m_bytes.end(), opcode);
+        if (!mem) {
+            m_bytes.push_back(0xc0 | (reg & 7) << 3 | (rm.reg & 7));
+            return;
+        }
+        if (!fits_int32(rm.value) || rm.index == static_cast<uint8_t>(X86Reg::rsp)) {
+            std::cerr << "Cannot encode memory operand" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        // rbp and r13 as a base always take a displacement.
+        const uint8_t mod = rm.value == 0 && (rm.reg & 7) != 5 ? 0 : fits_int8(rm.value) ? 1 : 2;
+        // rsp and r12 as a base need a SIB byte.
+        if (has_index || (rm.reg & 7) == 4) {
+            const uint8_t scale = rm.scale == 8 ? 3 : rm.scale == 4 ? 2 : rm.scale == 2 ? 1 : 0;
+            m_bytes.push_back(mod << 6 | (reg & 7) << 3 | 4);
+            m_bytes.push_back(scale << 6 | (has_index ? rm.index & 7 : 4) << 3 | (rm.reg & 7));
+        } else {
+            m_bytes.push_back(mod << 6 | (reg & 7) << 3 | (rm.reg & 7));
+        }
+        if (mod != 0) {
+            put_le(m_bytes, rm.value, mod == 1 ? 1 : 4);
+        }
+    }
+
+    // add, and, sub and cmp share their encodings, told apart by `digit`.
+    void put_alu(const MInst &inst, const uint8_t digit) {
+        const MOperand &dst = inst.operands[0];
+        const MOperand &src = inst.operands[1];
+        if (src.kind == MOperandKind::reg) {
+            put_modrm(true, {static_cast<uint8_t>(digit << 3 | 0x01)}, src.reg, dst);
+        } else if (src.kind == MOperandKind::mem && dst.kind == MOperandKind::reg) {
+            put_modrm(true, {static_cast<uint8_t>(digit << 3 | 0x03)}, dst.reg, src);
+        } else if (src.kind == MOperandKind::imm && fits_int8(src.value)) {
+            put_modrm(true, {0x83}, digit, dst);
+            put_le(m_bytes, src.value, 1);
+        } else if (src.kind == MOperandKind::imm && fits_int32(src.value)) {
+            put_modrm(true, {0x81}, digit, dst);
+            put_le(m_bytes, src.value, 4);
+        } else {
+            unsupported(inst);
+        }
+    }
+
+    // `mov reg, imm` as the shortest form that gives the same 64 bits: the
+    // 32-bit move zero-extends, the sign-extended imm32 covers small
+    // negatives, and anything else takes a full imm64.
+    void put_mov_imm(const MOperand &dst, const int64_t value) {
+        const uint8_t rex_b = (dst.reg & 8) >> 3;
+        if (dst.bits == 32 || (value >= 0 && value <= UINT32_MAX)) {
+            if (rex_b != 0) {
+                m_bytes.push_back(0x41);
+            }
+            m_bytes.push_back(0xb8 | (dst.reg & 7));
+            put_le(m_bytes, value, 4);
+        } else if (fits_int32(value)) {
+            put_modrm(true, {0xc7}, 0, dst);
+            put_le(m_bytes, value, 4);
+        } else {
+            m_bytes.push_back(0x48 | rex_b);
+            m_bytes.push_back(0xb8 | (dst.reg & 7));
+            put_le(m_bytes, value, 8);
+        }
+    }
+
+    void put_short_reg(const uint8_t opcode, const MOperand &reg) {
+        if (reg.reg >= 8) {
+            m_bytes.push_back(0x41);
+        }
+        m_bytes.push_back(opcode | (reg.reg & 7));
+    }
+
+    void encode(const MInst &inst) {
+        const auto args = inst.args();
+        const auto kind = [&](const size_t i) {
+            return i < args.size() ? args[i].kind : MOperandKind::none;
+        };
+        const MOperandKind a = kind(0);
+        const MOperandKind b = kind(1);
+        switch (inst.op) {
+            case MOp::mov:
+                if (b == MOperandKind::imm && a == MOperandKind::reg) {
+                    put_mov_imm(args[0], args[1].value);
+                } else if (b == MOperandKind::imm && a == MOperandKind::mem && fits_int32(args[1].value)) {
+                    put_modrm(true, {0xc7}, 0, args[0]);
+                    put_le(m_bytes, args[1].value, 4);
+                } else if (b == MOperandKind::reg) {
+                    put_modrm(args[1].bits == 64, {0x89}, args[1].reg, args[0]);
+                } else if (b == MOperandKind::mem && a == MOperandKind::reg) {
+                    put_modrm(true, {0x8b}, args[0].reg, args[1]);
+                } else {
+                    unsupported(inst);
+                }
+                break;
+            case MOp::add:
+                put_alu(inst, 0);
+                break;
+            case MOp::and_:
+                put_alu(inst, 4);
+                break;
+            case MOp::sub:
+                put_alu(inst, 5);
+                break;
+            case MOp::cmp:
+                put_alu(inst, 7);
+                break;
+            case MOp::test:
+                if (b != MOperandKind::reg) {
+                    unsupported(inst);
+                }
+                put_modrm(true, {0x85}, args[1].reg, args[0]);
+                break;
+            case MOp::inc:
+            case MOp::dec:
+                put_modrm(true, {0xff}, inst.op == MOp::inc ? 0 : 1, args[0]);
+                break;
+            case MOp::neg:
+                put_modrm(true, {0xf7}, 3, args[0]);
+                break;
+            case MOp::idiv:
+                put_modrm(true, {0xf7}, 7, args[0]);
+                break;
+            case MOp::imul:
+                if (args.size() == 1) {
+                    put_modrm(true, {0xf7}, 5, args[0]);
+                } else if (args.size() == 2 && a == MOperandKind::reg && b != MOperandKind::imm) {
+                    put_modrm(true, {0x0f, 0xaf}, args[0].reg, args[1]);
+                } else if (args.size() == 3 && kind(2) == MOperandKind::imm && fits_int32(args[2].value)) {
+                    const bool short_imm = fits_int8(args[2].value);
+                    put_modrm(true, {static_cast<uint8_t>(short_imm ? 0x6b : 0x69)}, args[0].reg, args[1]);
+                    put_le(m_bytes, args[2].value, short_imm ? 1 : 4);
+                } else {
+                    unsupported(inst);
+                }
+                break;
+            case MOp::shl:
+            case MOp::shr:
+            case MOp::sar: {
+                if (b != MOperandKind::imm) {
+                    unsupported(inst);
+                }
+                const uint8_t digit = inst.op == MOp::shl ? 4 : inst.op == MOp::shr ? 5 : 7;
+                if (args[1].value == 1) {
+                    put_modrm(true, {0xd1}, digit, args[0]);
+                } else {
+                    put_modrm(true, {0xc1}, digit, args[0]);
+                    put_le(m_bytes, args[1].value, 1);
+                }
+                break;
+            }
+            case MOp::lea:
+                put_modrm(true, {0x8d}, args[0].reg, args[1]);
+                break;
+            case MOp::movzx:
+                put_modrm(args[0].bits == 64, {0x0f, 0xb6}, args[0].reg, args[1]);
+                break;
+            case MOp::setcc:
+                put_modrm(false, {0x0f, static_cast<uint8_t>(0x90 | cond_code(inst.cond))}, 0, args[0]);
+                break;
+            case MOp::cmovcc:
+                put_modrm(true, {0x0f, static_cast<uint8_t>(0x40 | cond_code(inst.cond))}, args[0].reg, args[1]);
+                break;
+            case MOp::push:
+                if (a == MOperandKind::reg) {
+                    put_short_reg(0x50, args[0]);
+                } else if (a == MOperandKind::imm && fits_int32(args[0].value)) {
+                    const bool short_imm = fits_int8(args[0].value);
+                    m_bytes.push_back(short_imm ? 0x6a : 0x68);
+                    put_le(m_bytes, args[0].value, short_imm ? 1 : 4);
+                } else if (a == MOperandKind::mem) {
+                    put_modrm(false, {0xff}, 6, args[0]);
+                } else {
+                    unsupported(inst);
+                }
+                break;
+            case MOp::pop:
+                if (a == MOperandKind::reg) {
+                    put_short_reg(0x58, args[0]);
+                } else if (a == MOperandKind::mem) {
+                    put_modrm(false, {0x8f}, 0, args[0]);
+                } else {
+                    unsupported(inst);
+                }
+                break;
+            case MOp::cqo:
+                m_bytes.insert(m_bytes.end(), {0x48, 0x99});
+                break;
+            case MOp::syscall:
+                m_bytes.insert(m_bytes.end(), {0x0f, 0x05});
+                break;
+            default:
+                unsupported(inst);
+        }
+    }
+
+    std::vector<Piece> m_pieces;
+    // The encodings of every piece that has a fixed one, back to back.
+    std::vector<uint8_t> m_bytes;
+};
@@ -0,0 +1,51 @@
+#!/usr/bin/env bash
+# Checks the built-in encoder against nasm and ld: every program in bench/
+# (and any extra .hy files given) is compiled both ways at each level, and
+# the two executables must exit with the same code. With objdump installed
+# their disassembly is compared too, ignoring padding nops.
+#
+#   tools/compare_external_as.sh [path/to/hydro] [extra.hy...]
+set -uo pipefail
+
+HYDRO=$(realpath "${1:-./build/hydro}")
+shift || true
+
+ROOT_DIR=$(cd "$(dirname "$0")/.." && pwd)
+WORK_DIR=$(mktemp -d)
+trap 'rm -rf "$WORK_DIR"' EXIT
+mkdir "$WORK_DIR/internal" "$WORK_DIR/external"
+
+disassemble() {
+    grep -E '^\s+[0-9a-f]+:' | sed -E 's/<[^>]*>//; s/0x//g; s/ +$//' | awk -F'\t' 'NF >= 3 { print $1 "\t" $3 }' |
+        grep -vE 'nop|xchg +ax,ax'
+}
+
+failures=0
+for program in "$ROOT_DIR"/bench/*.hy "$@"; do
+    program=$(realpath "$program")
+    for flags in -O0 -O1 -O2 "-O2 --loop-align=64"; do
+        # A build that fails must not leave the previous program's ./out behind.
+        rm -f "$WORK_DIR/internal/out" "$WORK_DIR/external/out"
+        (cd "$WORK_DIR/internal" && "$HYDRO" $flags "$program" > /dev/null) || { echo "FAIL $program $flags: compile"; failures=$((failures + 1)); continue; }
+        (cd "$WORK_DIR/external" && "$HYDRO" $flags --use-external-as "$program" > /dev/null) || { echo "FAIL $program $flags: compile with nasm and ld"; failures=$((failures + 1)); continue; }
+        internal=$(cd "$WORK_DIR/internal" && timeout 20 ./out > /dev/null; echo $?)
+        external=$(cd "$WORK_DIR/external" && timeout 20 ./out > /dev/null; echo $?)
+        if [ "$internal" != "$external" ]; then
+            echo "FAIL $program $flags: exit $internal, nasm exit $external"
+            failures=$((failures + 1))
+            continue
+        fi
+        if command -v objdump > /dev/null; then
+            objdump -D -b binary -m i386:x86-64 -M intel --adjust-vma=0x400000 --start-address=0x401000 \
+                "$WORK_DIR/internal/out" | disassemble > "$WORK_DIR/internal.txt"
+            objdump -d -M intel "$WORK_DIR/external/out" | disassemble > "$WORK_DIR/external.txt"
+            if ! diff -q "$WORK_DIR/internal.txt" "$WORK_DIR/external.txt" > /dev/null; then
+                echo "note $program $flags: same exit code, different instructions"
+                diff "$WORK_DIR/internal.txt" "$WORK_DIR/external.txt" | head -6
+            fi
+        fi
+    done
+done
+
+echo "$failures failures"
+[ "$failures" -eq 0 ]
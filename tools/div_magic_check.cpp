@@ -0,0 +1,123 @@
+// Checks the division-by-constant sequences against the hardware's idiv.
+//
+// For every divisor that lowers_to_multiply (all of -3000..3000, powers of two
+// and their neighbours, the extremes, and random ones) the sequences that
+// Generator::emit_div_const emits are replayed step by step on int64_t and
+// compared with `cqo; idiv` for boundary and random dividends. The AArch64
+// backend uses the same multiplier, shift and corrections with smulh and asr.
+//
+// usage: div_magic_check [--random-divisors=N] [--dividends=N]
+
+#include <cstdint>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "../src/div_magic.hpp"
+
+// n / d, or n % d with `mod`, the way emit_div_const computes it.
+static int64_t emitted(const int64_t n, const int64_t d, const bool mod) {
+    const auto u = [](const int64_t v) { return static_cast<uint64_t>(v); };
+    const auto s = [](const uint64_t v) { return static_cast<int64_t>(v); };
+    if (d == 1) {
+        return mod ? 0 : n;
+    }
+    if (const auto shift = pow2_shift(d)) {
+        const int k = shift.value();
+        int64_t rdx = n;
+        if (k > 1) {
+            rdx >>= 63;
+        }
+        rdx = s(u(rdx) >> (64 - k));
+        rdx = s(u(rdx) + u(n));
+        if (!mod) {
+            rdx >>= k;
+            return d < 0 ? s(0 - u(rdx)) : rdx;
+        }
+        rdx = s(u(rdx) & ~((uint64_t{1} << k) - 1));
+        return s(u(n) - u(rdx));
+    }
+    const auto [multiplier, shift] = div_magic(d);
+    int64_t rdx = static_cast<int64_t>((static_cast<__int128>(multiplier) * n) >> 64);
+    if (d > 0 && multiplier < 0) {
+        rdx = s(u(rdx) + u(n));
+    } else if (d < 0 && multiplier > 0) {
+        rdx = s(u(rdx) - u(n));
+    }
+    rdx >>= shift;
+    rdx = s(u(rdx) + (u(rdx) >> 63));
+    return mod ? s(u(n) - u(rdx) * u(d)) : rdx;
+}
+
+int main(int argc, char *argv[]) {
+    int random_divisors = 20000;
+    int dividends = 300;
+    for (int i = 1; i < argc; i++) {
+        const std::string arg = argv[i];
+        if (arg.starts_with("--random-divisors=")) {
+            random_divisors = std::stoi(arg.substr(18));
+        } else if (arg.starts_with("--dividends=")) {
+            dividends = std::stoi(arg.substr(12));
+        } else {
+            std::cerr << "usage: div_magic_check [--random-divisors=N] [--dividends=N]" << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+#if defined(__x86_64__)
+    std::mt19937_64 random(1);
+    std::vector<int64_t> divisors;
+    for (int64_t d = -3000; d <= 3000; d++) {
+        divisors.push_back(d);
+    }
+    for (int k = 1; k < 64; k++) {
+        const uint64_t power = uint64_t{1} << k;
+        for (const uint64_t d: {power, 0 - power, power + 1, power - 1, 0 - power + 1}) {
+            divisors.push_back(static_cast<int64_t>(d));
+        }
+    }
+    divisors.push_back(INT64_MAX);
+    divisors.push_back(INT64_MIN);
+    divisors.push_back(INT64_MIN + 1);
+    for (int i = 0; i < random_divisors; i++) {
+        divisors.push_back(static_cast<int64_t>(random()));
+        divisors.push_back(static_cast<int64_t>(random() >> (random() % 64)));
+    }
+
+    uint64_t checks = 0;
+    uint64_t failures = 0;
+    for (const int64_t d: divisors) {
+        if (!lowers_to_multiply(d)) {
+            continue;
+        }
+        std::vector<int64_t> ns = {0, 1, -1, 2, -2, INT64_MAX, INT64_MIN, INT64_MIN + 1, INT64_MAX - 1};
+        for (const int64_t near: {d, d - 1, d + 1}) {
+            ns.push_back(near);
+            ns.push_back(static_cast<int64_t>(0 - static_cast<uint64_t>(near)));
+        }
+        for (int i = 0; i < dividends; i++) {
+            ns.push_back(static_cast<int64_t>(random()));
+            ns.push_back(static_cast<int64_t>(random() >> (random() % 64)));
+        }
+        for (const int64_t n: ns) {
+            int64_t quotient;
+            int64_t remainder;
+            asm("cqo; idivq %[d]" : "=a"(quotient), "=d"(remainder) : "a"(n), [d] "r"(d));
+            for (const bool mod: {false, true}) {
+                checks++;
+                const int64_t want = mod ? remainder : quotient;
+                const int64_t got = emitted(n, d, mod);
+                if (got != want && failures++ < 10) {
+                    std::cerr << n << (mod ? " % " : " / ") << d << " = " << want << ", the sequence gives " << got
+                              << std::endl;
+                }
+            }
+        }
+    }
+    std::cout << checks << " checks, " << failures << " failures" << std::endl;
+    return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+#else
+    std::cerr << "div_magic_check compares against idiv and only runs on x86-64" << std::endl;
+    return EXIT_FAILURE;
+#endif
+}
@@ -0,0 +1,173 @@
+// Measures how fast generated code is turned into assembly text.
+//
+// Each input is compiled once per backend (the -O0 stack machine and the
+// register-allocating one) and the resulting MachineCode is rendered two
+// ways: by AsmPrinter into one preallocated buffer, and the way the
+// generators used to write it, an operand string at a time through
+// std::stringstream. Inputs are repeated `--repeat=N` times, each copy in
+// its own scope, so small programs still make enough code to time.
+//
+// usage: emit_bench [--repeat=N] [--iterations=N] input.hy...
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "../src/generation.hpp"
+
+// The operand as the generators used to build it, one std::string each.
+static std::string operand_text(const MachineTarget &target, const MInst &inst, const MOperand &operand) {
+    const auto reg_name = [&](const uint8_t reg, const uint8_t bits) {
+        return std::string((bits == 64 ? target.regs64 : bits == 32 ? target.regs32 : target.regs8)[reg]);
+    };
+    switch (operand.kind) {
+        case MOperandKind::reg:
+            return reg_name(operand.reg, operand.bits);
+        case MOperandKind::imm:
+            return std::string(target.imm_prefix) + std::to_string(operand.value);
+        case MOperandKind::mem: {
+            if (target.arch == MachineArch::aarch64) {
+                return "[" + reg_name(operand.reg, 64) + ", #" + std::to_string(operand.value) + "]";
+            }
+            std::string text = inst.op == MOp::lea ? "[" : "QWORD [";
+            text += reg_name(operand.reg, 64);
+            if (operand.index != s_no_index) {
+                text += " + " + reg_name(operand.index, 64);
+                if (operand.scale != 1) {
+                    text += "*" + std::to_string(operand.scale);
+                }
+            }
+            if (operand.value != 0) {
+                text += (operand.value < 0 ? " - " : " + ") + std::to_string(std::abs(operand.value));
+            }
+            return text + "]";
+        }
+        case MOperandKind::label:
+            return std::string(target.label_prefix) + std::to_string(operand.value);
+        case MOperandKind::shift: {
+            const char *name = operand.shift == MShift::lsl ? "lsl #" : operand.shift == MShift::lsr ? "lsr #" : "asr #";
+            return name + std::to_string(operand.value);
+        }
+        case MOperandKind::cond:
+            return std::string(target.conds[static_cast<size_t>(operand.value)]);
+        case MOperandKind::none:
+            break;
+    }
+    return {};
+}
+
+static std::string stream_print(const MachineTarget &target, const MachineCode &code) {
+    std::stringstream out;
+    if (std::ranges::any_of(code.insts, [](const MInst &inst) { return inst.op == MOp::align; })) {
+        out << target.align_header;
+    }
+    out << target.header;
+    for (const MInst &inst: code.insts) {
+        switch (inst.op) {
+            case MOp::label:
+                out << target.label_prefix << inst.operands[0].value << ":\n";
+                continue;
+            case MOp::comment:
+                out << "    ;; " << code.comments[inst.operands[0].value] << "\n";
+                continue;
+            case MOp::align:
+                out << target.align_directive << inst.operands[0].value << "\n";
+                continue;
+            default:
+                break;
+        }
+        out << "    " << target.mnemonic(inst.op);
+        if (mop_has_cond(inst.op)) {
+            out << target.conds[static_cast<size_t>(inst.cond)];
+        }
+        for (uint8_t i = 0; i < inst.operand_count; i++) {
+            out << (i == 0 ? " " : ", ") << operand_text(target, inst, inst.operands[i]);
+        }
+        out << "\n";
+    }
+    return out.str();
+}
+
+// The fastest of `iterations` runs of `fn`, in nanoseconds.
+template<typename Fn>
+static double best_ns(const int iterations, Fn &&fn) {
+    double best = 1e300;
+    for (int i = 0; i < iterations; i++) {
+        const auto start = std::chrono::steady_clock::now();
+        fn();
+        const auto end = std::chrono::steady_clock::now();
+        best = std::min(best, std::chrono::duration<double, std::nano>(end - start).count());
+    }
+    return best;
+}
+
+static void report(const std::string &name, const double ns, const size_t bytes, const size_t insts) {
+    std::cout << "  " << std::left << std::setw(14) << name << std::right << std::fixed << std::setprecision(1)
+              << std::setw(10) << ns / 1e6 << " ms" << std::setw(10) << bytes / (ns / 1e9) / 1e6 << " MB/s"
+              << std::setw(8) << ns / static_cast<double>(insts) << " ns/inst" << std::endl;
+}
+
+int main(int argc, char *argv[]) {
+    int repeat = 200;
+    int iterations = 10;
+    std::vector<std::string> inputs;
+    for (int i = 1; i < argc; i++) {
+        const std::string arg = argv[i];
+        if (arg.starts_with("--repeat=")) {
+            repeat = std::stoi(arg.substr(9));
+        } else if (arg.starts_with("--iterations=")) {
+            iterations = std::stoi(arg.substr(13));
+        } else {
+            inputs.push_back(arg);
+        }
+    }
+    if (inputs.empty() || repeat < 1 || iterations < 1) {
+        std::cerr << "usage: emit_bench [--repeat=N] [--iterations=N] input.hy..." << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    for (const std::string &input: inputs) {
+        std::stringstream contents;
+        contents << std::ifstream(input).rdbuf();
+        std::string source;
+        for (int i = 0; i < repeat; i++) {
+            source += "{\n" + contents.str() + "\n}\n";
+        }
+        Tokenizer tokenizer(std::move(source));
+        Parser parser(tokenizer.tokenize());
+        const std::optional<NodeProgram> prog = parser.parse_prog();
+        if (!prog.has_value()) {
+            std::cerr << "Invalid Program: " << input << std::endl;
+            return EXIT_FAILURE;
+        }
+        for (const RegAllocKind regalloc: {RegAllocKind::stack, RegAllocKind::graph_coloring}) {
+            MachineCode code;
+            const double generate_ns = best_ns(std::max(1, iterations / 5), [&] {
+                code = Generator(prog.value(), CodegenOptions{.regalloc = regalloc}).gen_prog();
+            });
+            std::string buffered;
+            std::string streamed;
+            const double buffer_ns = best_ns(iterations, [&] {
+                buffered = AsmPrinter(Generator::target()).print(code);
+            });
+            const double stream_ns = best_ns(iterations, [&] {
+                streamed = stream_print(Generator::target(), code);
+            });
+            if (buffered != streamed) {
+                std::cerr << "The two printers disagree on " << input << std::endl;
+                return EXIT_FAILURE;
+            }
+            std::cout << input << (regalloc == RegAllocKind::stack ? " (stack)" : " (graph)") << ": "
+                      << code.insts.size() << " instructions, " << buffered.size() << " bytes" << std::endl;
+            report("generate", generate_ns, buffered.size(), code.insts.size());
+            report("AsmPrinter", buffer_ns, buffered.size(), code.insts.size());
+            report("stringstream", stream_ns, streamed.size(), code.insts.size());
+        }
+    }
+    return EXIT_SUCCESS;
+}
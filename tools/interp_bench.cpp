@@ -0,0 +1,149 @@
+// Compares the ways hydro can run a program: walking the AST (the compile
+// time evaluator behind --eval), the bytecode VM behind --interpret with
+// switch and computed-goto dispatch, and, on x86-64 Linux, native code the
+// way --run makes it at -O0 and -O1 and the --tiered engine that starts in
+// the VM and moves hot loops to -O1 code. Every time includes getting from
+// the parsed program to its result, so the VM pays for its lowering and
+// native code for code generation, encoding and the fork. All engines must
+// agree on the exit code.
+//
+// usage: interp_bench [--iterations=N] [--ast-steps=N] input.hy...
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "../src/generation.hpp"
+#include "../src/evaluator.hpp"
+#include "../src/bytecode.hpp"
+#if defined(__linux__) && defined(__x86_64__)
+#include "../src/jit.hpp"
+#include "../src/tiered.hpp"
+#include "../src/x86_encoder.hpp"
+#endif
+
+// The fastest of `iterations` runs of `fn`, in nanoseconds.
+template<typename Fn>
+static double best_ns(const int iterations, Fn &&fn) {
+    double best = 1e300;
+    for (int i = 0; i < iterations; i++) {
+        const auto start = std::chrono::steady_clock::now();
+        fn();
+        const auto end = std::chrono::steady_clock::now();
+        best = std::min(best, std::chrono::duration<double, std::nano>(end - start).count());
+    }
+    return best;
+}
+
+// `baseline_ns` is the AST walker's time, or 0 if it gave up.
+static void report(const std::string &name, const double ns, const double baseline_ns, const int status) {
+    std::cout << "  " << std::left << std::setw(14) << name << std::right << std::fixed << std::setprecision(2)
+              << std::setw(12) << ns / 1e6 << " ms" << std::setw(9) << std::setprecision(1);
+    if (baseline_ns > 0) {
+        std::cout << baseline_ns / ns << "x";
+    } else {
+        std::cout << "-" << " ";
+    }
+    std::cout << "  exit " << status << std::endl;
+}
+
+int main(int argc, char *argv[]) {
+    int iterations = 3;
+    uint64_t ast_steps = 200'000'000;
+    std::vector<std::string> inputs;
+    for (int i = 1; i < argc; i++) {
+        const std::string arg = argv[i];
+        if (arg.starts_with("--iterations=")) {
+            iterations = std::stoi(arg.substr(13));
+        } else if (arg.starts_with("--ast-steps=")) {
+            ast_steps = std::stoull(arg.substr(12));
+        } else {
+            inputs.push_back(arg);
+        }
+    }
+    if (inputs.empty() || iterations < 1) {
+        std::cerr << "usage: interp_bench [--iterations=N] [--ast-steps=N] input.hy..." << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    bool agree = true;
+    for (const std::string &input: inputs) {
+        std::stringstream contents;
+        contents << std::ifstream(input).rdbuf();
+        Tokenizer tokenizer(contents.str());
+        Parser parser(tokenizer.tokenize());
+        const std::optional<NodeProgram> prog = parser.parse_prog();
+        if (!prog.has_value()) {
+            std::cerr << "Invalid Program: " << input << std::endl;
+            return EXIT_FAILURE;
+        }
+        std::cout << input << std::endl;
+
+        ArenaAllocator allocator(1024 * 1024 * 16);
+        std::optional<int> ast_status;
+        const double ast_ns = best_ns(iterations, [&] {
+            NodeProgram copy = prog.value();
+            PartialEvaluator evaluator(allocator, EvalOptions{.max_steps = ast_steps, .max_memory = SIZE_MAX});
+            evaluator.run(copy);
+            if (evaluator.outcome() == EvalOutcome::completed) {
+                ast_status = exit_status({.status = BcStatus::exited, .value = evaluator.exit_code()});
+            } else if (evaluator.outcome() == EvalOutcome::runtime_error) {
+                ast_status = exit_status({.status = BcStatus::trapped});
+            }
+        });
+        if (ast_status.has_value()) {
+            report("AST walker", ast_ns, ast_ns, ast_status.value());
+        } else {
+            std::cout << "  AST walker    over the --ast-steps budget" << std::endl;
+        }
+        const double baseline_ns = ast_status.has_value() ? ast_ns : 0;
+
+        std::vector<int> statuses;
+        int status = 0;
+        const double switch_ns = best_ns(iterations, [&] {
+            const BcProgram bytecode = BytecodeCompiler().compile(prog.value());
+            status = exit_status(BytecodeVm(bytecode).run<false>());
+        });
+        report("VM (switch)", switch_ns, baseline_ns, status);
+        statuses.push_back(status);
+        const double threaded_ns = best_ns(iterations, [&] {
+            const BcProgram bytecode = BytecodeCompiler().compile(prog.value());
+            status = exit_status(BytecodeVm(bytecode).run<true>());
+        });
+        report("VM (goto)", threaded_ns, baseline_ns, status);
+        statuses.push_back(status);
+#if defined(__linux__) && defined(__x86_64__)
+        const double native_ns = best_ns(iterations, [&] {
+            const MachineCode code = Generator(prog.value(), CodegenOptions{}).gen_prog();
+            status = run_machine_code(X86Encoder().encode(code));
+        });
+        report("native -O0", native_ns, baseline_ns, status);
+        statuses.push_back(status);
+        const CodegenOptions optimized{.regalloc = RegAllocKind::linear_scan};
+        const double optimized_ns = best_ns(iterations, [&] {
+            const MachineCode code = Generator(prog.value(), optimized).gen_prog();
+            status = run_machine_code(X86Encoder().encode(code));
+        });
+        report("native -O1", optimized_ns, baseline_ns, status);
+        statuses.push_back(status);
+        const double tiered_ns = best_ns(iterations, [&] {
+            status = TieredEngine(prog.value(), TierOptions{.codegen = optimized}).run();
+        });
+        report("tiered", tiered_ns, baseline_ns, status);
+        statuses.push_back(status);
+#endif
+        if (ast_status.has_value()) {
+            statuses.push_back(ast_status.value());
+        }
+        if (std::ranges::adjacent_find(statuses, std::not_equal_to()) != statuses.end()) {
+            std::cerr << "The engines disagree on the exit code of " << input << std::endl;
+            agree = false;
+        }
+    }
+    return agree ? EXIT_SUCCESS : EXIT_FAILURE;
+}
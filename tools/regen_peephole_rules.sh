@@ -0,0 +1,31 @@
+#!/usr/bin/env bash
+# Regenerates the superoptimizer-derived peephole rules for the host target
+# from the assembly hydro emits for bench/ without the peephole pass.
+#
+#   tools/regen_peephole_rules.sh [path/to/hydro] [path/to/superopt]
+set -euo pipefail
+
+HYDRO=$(realpath "${1:-./build/hydro}")
+SUPEROPT=$(realpath "${2:-./build/superopt}")
+
+ROOT_DIR=$(cd "$(dirname "$0")/.." && pwd)
+WORK_DIR=$(mktemp -d)
+trap 'rm -rf "$WORK_DIR"' EXIT
+
+case "$(uname -m)" in
+    x86_64) target=x86-64 table=x86 ;;
+    arm64 | aarch64) target=aarch64 table=aarch64 ;;
+    *) echo "unsupported host $(uname -m)" >&2; exit 1 ;;
+esac
+
+inputs=()
+for program in "$ROOT_DIR"/bench/*.hy; do
+    for level in -O0 -O1 -O2; do
+        (cd "$WORK_DIR" && "$HYDRO" $level --no-peephole "$program" > /dev/null)
+        name="$(basename "$program" .hy)$level.asm"
+        mv "$WORK_DIR/out.asm" "$WORK_DIR/$name"
+        inputs+=("$WORK_DIR/$name")
+    done
+done
+
+"$SUPEROPT" --target=$target -o "$ROOT_DIR/src/peephole_${table}_generated.inc" "${inputs[@]}"
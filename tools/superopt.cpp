@@ -0,0 +1,752 @@
+// Offline superoptimizer for the peephole pass.
+//
+// Reads assembly emitted by hydro with --no-peephole, runs the hand-written
+// peephole rules over it, and collects every window of two or three
+// consecutive instructions it can model. A window is abstracted over its
+// registers, stack slots and immediates and replaced by the cheapest shorter
+// sequence found by brute force over the instruction forms the window
+// itself uses, plus register moves. A candidate must leave every register
+// and slot the same as the window does on random inputs and then on every
+// combination of boundary values, for every way the abstract registers and
+// slots can alias, since a rule's variables may bind the same operand.
+//
+// Flags aren't compared: hydro only reads flags right after the cmp or test
+// that set them, with at most moves in between, so a replacement may only
+// clobber flags when the window already did.
+//
+// usage: superopt --target=x86-64|aarch64 -o FILE.inc input.asm...
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <optional>
+#include <random>
+#include <set>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "../src/peephole.hpp"
+
+static constexpr size_t s_max_vars = 4;
+
+enum class OperandKind { reg, mem, imm, text };
+
+struct Operand {
+    OperandKind kind;
+    size_t var = 0;
+    // The operand itself for `text`, e.g. `lsl #12`.
+    std::string text = {};
+
+    auto operator<=>(const Operand &) const = default;
+};
+
+struct Inst {
+    std::string mnemonic;
+    std::vector<Operand> operands;
+
+    auto operator<=>(const Inst &) const = default;
+};
+
+using Seq = std::vector<Inst>;
+
+struct Machine {
+    std::array<uint64_t, s_max_vars> regs{};
+    std::array<uint64_t, s_max_vars> mems{};
+    std::array<uint64_t, s_max_vars> imms{};
+
+    bool operator==(const Machine &) const = default;
+};
+
+static uint64_t read(const Machine &m, const Operand &op) {
+    switch (op.kind) {
+        case OperandKind::reg:
+            return m.regs[op.var];
+        case OperandKind::mem:
+            return m.mems[op.var];
+        case OperandKind::imm:
+            return m.imms[op.var];
+        default:
+            return 0;
+    }
+}
+
+static void write(Machine &m, const Operand &op, const uint64_t value) {
+    if (op.kind == OperandKind::reg) {
+        m.regs[op.var] = value;
+    } else if (op.kind == OperandKind::mem) {
+        m.mems[op.var] = value;
+    }
+}
+
+static uint64_t shift(const std::string &mnemonic, const uint64_t value, const uint64_t count) {
+    if (mnemonic == "shl" || mnemonic == "lsl") {
+        return value << (count & 63);
+    }
+    if (mnemonic == "shr" || mnemonic == "lsr") {
+        return value >> (count & 63);
+    }
+    return static_cast<uint64_t>(static_cast<int64_t>(value) >> (count & 63));
+}
+
+static bool is(const Operand &op, const std::initializer_list<OperandKind> kinds) {
+    return std::ranges::find(kinds, op.kind) != kinds.end();
+}
+
+// x86-64, two-operand Intel syntax. At most one operand is in memory.
+static bool x86_execute(const Inst &inst, Machine &m) {
+    const std::string &op = inst.mnemonic;
+    const std::vector<Operand> &ops = inst.operands;
+    if (ops.size() == 1 && op == "neg" && is(ops[0], {OperandKind::reg, OperandKind::mem})) {
+        write(m, ops[0], 0 - read(m, ops[0]));
+        return true;
+    }
+    if (ops.size() == 3) {
+        if (op != "imul" || !is(ops[0], {OperandKind::reg}) || !is(ops[1], {OperandKind::reg, OperandKind::mem}) ||
+            !is(ops[2], {OperandKind::imm})) {
+            return false;
+        }
+        write(m, ops[0], read(m, ops[1]) * read(m, ops[2]));
+        return true;
+    }
+    if (ops.size() != 2 || !is(ops[0], {OperandKind::reg, OperandKind::mem}) || ops[1].kind == OperandKind::text ||
+        (ops[0].kind == OperandKind::mem && ops[1].kind == OperandKind::mem)) {
+        return false;
+    }
+    const uint64_t a = read(m, ops[0]);
+    const uint64_t b = read(m, ops[1]);
+    if (op == "mov") {
+        write(m, ops[0], b);
+    } else if (op == "add") {
+        write(m, ops[0], a + b);
+    } else if (op == "sub") {
+        write(m, ops[0], a - b);
+    } else if (op == "and") {
+        write(m, ops[0], a & b);
+    } else if (op == "or") {
+        write(m, ops[0], a | b);
+    } else if (op == "xor") {
+        write(m, ops[0], a ^ b);
+    } else if (op == "imul" && ops[0].kind == OperandKind::reg) {
+        write(m, ops[0], a * b);
+    } else if ((op == "shl" || op == "shr" || op == "sar") && ops[1].kind == OperandKind::imm) {
+        write(m, ops[0], shift(op, a, b));
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// The register operand shifted by a trailing `lsl #k`, `lsr #k` or `asr #k`.
+static bool aarch64_shifted(const std::vector<Operand> &ops, const Machine &m, uint64_t &value) {
+    value = read(m, ops[ops.size() - 2]);
+    if (ops.back().kind != OperandKind::text) {
+        value = read(m, ops.back());
+        return ops.back().kind != OperandKind::mem;
+    }
+    const std::string &text = ops.back().text;
+    if (text.size() < 6 || text[3] != ' ' || text[4] != '#') {
+        return false;
+    }
+    const std::string kind = text.substr(0, 3);
+    if (kind != "lsl" && kind != "lsr" && kind != "asr") {
+        return false;
+    }
+    const int count = std::stoi(text.substr(5));
+    // An immediate can only be shifted left by 12.
+    if (ops[ops.size() - 2].kind == OperandKind::imm && (kind != "lsl" || count != 12)) {
+        return false;
+    }
+    value = shift(kind, value, count);
+    return ops[ops.size() - 2].kind != OperandKind::mem;
+}
+
+static bool aarch64_execute(const Inst &inst, Machine &m) {
+    const std::string &op = inst.mnemonic;
+    const std::vector<Operand> &ops = inst.operands;
+    if (ops.empty() || ops[0].kind != OperandKind::reg) {
+        return false;
+    }
+    if (op == "ldr" || op == "str") {
+        if (ops.size() != 2 || ops[1].kind != OperandKind::mem) {
+            return false;
+        }
+        if (op == "ldr") {
+            write(m, ops[0], read(m, ops[1]));
+        } else {
+            write(m, ops[1], read(m, ops[0]));
+        }
+        return true;
+    }
+    for (size_t i = 1; i < ops.size(); i++) {
+        if (ops[i].kind == OperandKind::mem || (ops[i].kind == OperandKind::imm && i + 2 < ops.size())) {
+            return false;
+        }
+    }
+    uint64_t rhs = 0;
+    if (op == "mov" && ops.size() == 2 && ops[1].kind != OperandKind::text) {
+        write(m, ops[0], read(m, ops[1]));
+    } else if (op == "neg" && (ops.size() == 2 || ops.size() == 3) && ops[1].kind == OperandKind::reg &&
+               aarch64_shifted(ops, m, rhs)) {
+        write(m, ops[0], 0 - rhs);
+    } else if ((op == "add" || op == "sub") && (ops.size() == 3 || ops.size() == 4) &&
+               ops[1].kind == OperandKind::reg && ops[2].kind != OperandKind::text && aarch64_shifted(ops, m, rhs)) {
+        write(m, ops[0], op == "add" ? read(m, ops[1]) + rhs : read(m, ops[1]) - rhs);
+    } else if ((op == "mul" || op == "and" || op == "orr" || op == "eor") && ops.size() == 3 &&
+               ops[1].kind == OperandKind::reg && ops[2].kind == OperandKind::reg) {
+        const uint64_t a = read(m, ops[1]);
+        const uint64_t b = read(m, ops[2]);
+        write(m, ops[0], op == "mul" ? a * b : op == "and" ? a & b : op == "orr" ? a | b : a ^ b);
+    } else if ((op == "lsl" || op == "lsr" || op == "asr") && ops.size() == 3 && ops[1].kind == OperandKind::reg &&
+               ops[2].kind == OperandKind::imm) {
+        write(m, ops[0], shift(op, read(m, ops[1]), read(m, ops[2])));
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// Approximate latencies: 1 for an ALU op, 3 for a multiply, 5 (x86) or 4
+// (AArch64) for a load, which also covers forwarding from a store just
+// before it.
+static int x86_latency(const Inst &inst) {
+    const bool load = std::ranges::any_of(inst.operands, [](const Operand &op) { return op.kind == OperandKind::mem; }) &&
+                      !(inst.mnemonic == "mov" && inst.operands[0].kind == OperandKind::mem);
+    const int alu = inst.mnemonic == "imul" ? 3 : inst.mnemonic == "mov" && load ? 0 : 1;
+    return alu + (load ? 5 : 0);
+}
+
+static int aarch64_latency(const Inst &inst) {
+    if (inst.mnemonic == "ldr") {
+        return 4;
+    }
+    if (inst.mnemonic == "mul") {
+        return 3;
+    }
+    const bool shifted_reg = inst.operands.size() == 4 && inst.operands[2].kind == OperandKind::reg;
+    return shifted_reg ? 2 : 1;
+}
+
+static bool x86_writes_flags(const Inst &inst) {
+    return inst.mnemonic != "mov";
+}
+
+struct TargetModel {
+    std::string_view name;
+    PeepholeTarget peephole;
+    bool (*execute)(const Inst &, Machine &);
+    int (*latency)(const Inst &);
+    bool (*writes_flags)(const Inst &);
+    // Forms tried in every window besides the window's own, with each
+    // register and slot filled in every possible way.
+    std::vector<Inst> extra_forms;
+};
+
+static const Operand s_any_reg{.kind = OperandKind::reg};
+static const Operand s_any_mem{.kind = OperandKind::mem};
+
+static TargetModel x86_model() {
+    return {
+        .name = "x86",
+        .peephole = {.rules = s_x86_peephole_rules, .generated = {}, .machine = &s_x86_machine},
+        .execute = x86_execute,
+        .latency = x86_latency,
+        .writes_flags = x86_writes_flags,
+        .extra_forms = {{"mov", {s_any_reg, s_any_reg}}, {"mov", {s_any_reg, s_any_mem}},
+                        {"mov", {s_any_mem, s_any_reg}}, {"neg", {s_any_reg}}},
+    };
+}
+
+static TargetModel aarch64_model() {
+    return {
+        .name = "aarch64",
+        .peephole = {.rules = s_aarch64_peephole_rules, .generated = {}, .machine = &s_aarch64_machine},
+        .execute = aarch64_execute,
+        .latency = aarch64_latency,
+        .writes_flags = [](const Inst &) { return false; },
+        .extra_forms = {{"mov", {s_any_reg, s_any_reg}}, {"neg", {s_any_reg, s_any_reg}},
+                        {"ldr", {s_any_reg, s_any_mem}}, {"str", {s_any_reg, s_any_mem}}},
+    };
+}
+
+// A window with its registers, slots and immediates numbered in order of
+// first use.
+struct Window {
+    Seq insts;
+    size_t regs = 0;
+    size_t mems = 0;
+    std::vector<int64_t> imm_values;
+};
+
+static std::optional<int64_t> parse_imm(const std::string &text) {
+    const std::string digits = text.starts_with('#') ? text.substr(1) : text;
+    try {
+        size_t used = 0;
+        const int64_t value = std::stoll(digits, &used, 0);
+        return used == digits.size() ? std::optional(value) : std::nullopt;
+    } catch (...) {
+        return {};
+    }
+}
+
+static std::optional<Window> abstract(const TargetModel &target, const std::vector<AsmLine> &lines) {
+    Window window;
+    std::vector<std::string> regs;
+    std::vector<std::string> mems;
+    std::vector<std::string> imms;
+    const auto var = [](std::vector<std::string> &names, const std::string &name) {
+        const auto it = std::ranges::find(names, name);
+        if (it != names.end()) {
+            return static_cast<size_t>(it - names.begin());
+        }
+        names.push_back(name);
+        return names.size() - 1;
+    };
+    for (const AsmLine &line: lines) {
+        Inst inst{.mnemonic = line.mnemonic, .operands = {}};
+        for (const std::string &text: line.operands) {
+            const auto reg = parse_asm_reg(*target.peephole.machine, text);
+            if (reg.has_value() && is_gpr(*target.peephole.machine, reg.value())) {
+                inst.operands.push_back({.kind = OperandKind::reg, .var = var(regs, text)});
+            } else if (asm_is_memory(text)) {
+                const std::string slot = text.starts_with("QWORD ") ? text.substr(6) : text;
+                inst.operands.push_back({.kind = OperandKind::mem, .var = var(mems, slot)});
+            } else if (asm_is_imm(text) && parse_imm(text).has_value()) {
+                inst.operands.push_back({.kind = OperandKind::imm, .var = var(imms, text)});
+            } else {
+                inst.operands.push_back({.kind = OperandKind::text, .text = text});
+            }
+        }
+        window.insts.push_back(std::move(inst));
+    }
+    if (regs.size() > s_max_vars || mems.size() > s_max_vars || imms.size() > s_max_vars) {
+        return {};
+    }
+    window.regs = regs.size();
+    window.mems = mems.size();
+    for (const std::string &imm: imms) {
+        window.imm_values.push_back(parse_imm(imm).value());
+    }
+    Machine m;
+    for (const Inst &inst: window.insts) {
+        if (!target.execute(inst, m)) {
+            return {};
+        }
+    }
+    return window;
+}
+
+static bool run(const TargetModel &target, const Seq &seq, Machine &m) {
+    return std::ranges::all_of(seq, [&](const Inst &inst) { return target.execute(inst, m); });
+}
+
+// Critical-path latency, then instruction count.
+static std::pair<int, size_t> cost(const TargetModel &target, const Seq &seq) {
+    std::map<std::pair<OperandKind, size_t>, int> ready;
+    int latency = 0;
+    for (const Inst &inst: seq) {
+        // The first operand is the destination, except for a store.
+        const bool store = inst.mnemonic == "str";
+        int start = 0;
+        for (size_t i = 0; i < inst.operands.size(); i++) {
+            const Operand &op = inst.operands[i];
+            const bool reads = i > 0 || store || (inst.mnemonic != "mov" && target.name == "x86" &&
+                                                   !(inst.mnemonic == "imul" && inst.operands.size() == 3));
+            if (reads && (op.kind == OperandKind::reg || op.kind == OperandKind::mem)) {
+                start = std::max(start, ready[{op.kind, op.var}]);
+            }
+        }
+        const int finish = start + target.latency(inst);
+        const Operand &dst = store ? inst.operands[1] : inst.operands[0];
+        ready[{dst.kind, dst.var}] = finish;
+        latency = std::max(latency, finish);
+    }
+    return {latency, seq.size()};
+}
+
+// Every way of splitting `n` variables into groups that share an operand,
+// as the group of each variable.
+static std::vector<std::vector<size_t>> partitions(const size_t n) {
+    std::vector<std::vector<size_t>> result;
+    std::vector<size_t> groups(n, 0);
+    const auto recurse = [&](auto &self, const size_t i, const size_t used) -> void {
+        if (i == n) {
+            result.push_back(groups);
+            return;
+        }
+        for (size_t g = 0; g <= used && g < n; g++) {
+            groups[i] = g;
+            self(self, i + 1, std::max(used, g + 1));
+        }
+    };
+    recurse(recurse, 0, 0);
+    return result;
+}
+
+static Seq alias(const Seq &seq, const std::vector<size_t> &reg_groups, const std::vector<size_t> &mem_groups) {
+    Seq result = seq;
+    for (Inst &inst: result) {
+        for (Operand &op: inst.operands) {
+            if (op.kind == OperandKind::reg) {
+                op.var = reg_groups[op.var];
+            } else if (op.kind == OperandKind::mem) {
+                op.var = mem_groups[op.var];
+            }
+        }
+    }
+    return result;
+}
+
+static constexpr std::array<uint64_t, 16> s_boundary_values = {
+    0, 1, 2, 3, 7, 63, 64, 0x7fffffff, 0x80000000, 0xffffffff,
+    0x7fffffffffffffff, 0x8000000000000000, 0xfffffffffffffffe, 0xffffffffffffffff, 0x123456789abcdef, 0xfedcba987654321};
+
+class Superoptimizer {
+public:
+    explicit Superoptimizer(const TargetModel &target)
+        : m_target(target) {
+    }
+
+    // The cheapest sequence shorter than `window` that computes the same
+    // registers and slots.
+    std::optional<Seq> search(const Window &window) {
+        const std::vector<Inst> vocabulary = candidates(window);
+        const bool may_clobber_flags = std::ranges::any_of(window.insts, m_target.writes_flags);
+        std::vector<Machine> inputs;
+        std::vector<Machine> outputs;
+        for (int i = 0; i < 8; i++) {
+            inputs.push_back(random_machine(window));
+            outputs.push_back(inputs.back());
+            run(m_target, window.insts, outputs.back());
+        }
+        const auto passes_quick_tests = [&](const Seq &seq) {
+            for (size_t i = 0; i < inputs.size(); i++) {
+                Machine m = inputs[i];
+                if (!run(m_target, seq, m) || m != outputs[i]) {
+                    return false;
+                }
+            }
+            return true;
+        };
+        std::optional<Seq> best;
+        std::pair<int, size_t> best_cost = cost(m_target, window.insts);
+        const auto consider = [&](const Seq &seq) {
+            if (!may_clobber_flags && std::ranges::any_of(seq, m_target.writes_flags)) {
+                return;
+            }
+            const auto seq_cost = cost(m_target, seq);
+            if (seq_cost < best_cost && passes_quick_tests(seq) && equivalent(window, seq)) {
+                best = seq;
+                best_cost = seq_cost;
+            }
+        };
+        consider({});
+        if (window.insts.size() > 1) {
+            for (const Inst &a: vocabulary) {
+                consider({a});
+            }
+        }
+        if (window.insts.size() > 2) {
+            for (const Inst &a: vocabulary) {
+                for (const Inst &b: vocabulary) {
+                    consider({a, b});
+                }
+            }
+        }
+        return best;
+    }
+
+private:
+    // The window's own instruction forms and the extra ones, with every
+    // register and slot operand filled in every possible way. Immediates stay
+    // where the window had them, so the replacement can always encode them.
+    std::vector<Inst> candidates(const Window &window) const {
+        std::set<Inst> result;
+        std::vector<Inst> forms = window.insts;
+        for (const Inst &form: m_target.extra_forms) {
+            const bool needs_mem = std::ranges::any_of(form.operands, [](const Operand &op) {
+                return op.kind == OperandKind::mem;
+            });
+            if (!needs_mem || window.mems > 0) {
+                forms.push_back(form);
+            }
+        }
+        for (const Inst &form: forms) {
+            Inst inst = form;
+            const auto fill = [&](auto &self, const size_t i) -> void {
+                if (i == inst.operands.size()) {
+                    Machine m;
+                    if (m_target.execute(inst, m)) {
+                        result.insert(inst);
+                    }
+                    return;
+                }
+                const OperandKind kind = inst.operands[i].kind;
+                const size_t count = kind == OperandKind::reg ? window.regs : kind == OperandKind::mem ? window.mems : 0;
+                if (count == 0) {
+                    self(self, i + 1);
+                    return;
+                }
+                for (size_t var = 0; var < count; var++) {
+                    inst.operands[i].var = var;
+                    self(self, i + 1);
+                }
+            };
+            fill(fill, 0);
+        }
+        return {result.begin(), result.end()};
+    }
+
+    Machine random_machine(const Window &window) {
+        Machine m;
+        const auto value = [&] {
+            return m_rng() % 4 == 0 ? s_boundary_values[m_rng() % s_boundary_values.size()] : m_rng();
+        };
+        for (size_t i = 0; i < s_max_vars; i++) {
+            m.regs[i] = value();
+            m.mems[i] = value();
+        }
+        for (size_t i = 0; i < window.imm_values.size(); i++) {
+            m.imms[i] = m_rng() % 2 == 0 ? static_cast<uint64_t>(window.imm_values[i]) : value();
+        }
+        return m;
+    }
+
+    bool equivalent(const Window &window, const Seq &seq) {
+        for (const std::vector<size_t> &reg_groups: partitions(window.regs)) {
+            for (const std::vector<size_t> &mem_groups: partitions(window.mems)) {
+                const Seq a = alias(window.insts, reg_groups, mem_groups);
+                const Seq b = alias(seq, reg_groups, mem_groups);
+                const size_t regs = reg_groups.empty() ? 0 : std::ranges::max(reg_groups) + 1;
+                const size_t mems = mem_groups.empty() ? 0 : std::ranges::max(mem_groups) + 1;
+                if (!equivalent_random(window, a, b) || !equivalent_boundary(window, a, b, regs, mems)) {
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+
+    bool equivalent_random(const Window &window, const Seq &a, const Seq &b) {
+        for (int i = 0; i < 1000; i++) {
+            Machine ma = random_machine(window);
+            Machine mb = ma;
+            if (!run(m_target, a, ma) || !run(m_target, b, mb) || ma != mb) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Every combination of boundary values over the inputs, fewer values per
+    // input the more inputs there are.
+    bool equivalent_boundary(const Window &window, const Seq &a, const Seq &b, const size_t regs,
+                             const size_t mems) const {
+        const size_t inputs = regs + mems + window.imm_values.size();
+        const size_t values = inputs <= 4 ? 16 : inputs <= 5 ? 10 : 6;
+        std::vector<size_t> digits(inputs, 0);
+        while (true) {
+            Machine ma;
+            size_t d = 0;
+            for (size_t i = 0; i < regs; i++) {
+                ma.regs[i] = s_boundary_values[digits[d++]];
+            }
+            for (size_t i = 0; i < mems; i++) {
+                ma.mems[i] = s_boundary_values[digits[d++]];
+            }
+            for (size_t i = 0; i < window.imm_values.size(); i++) {
+                ma.imms[i] = s_boundary_values[digits[d++]];
+            }
+            Machine mb = ma;
+            if (!run(m_target, a, ma) || !run(m_target, b, mb) || ma != mb) {
+                return false;
+            }
+            size_t i = 0;
+            while (i < inputs && ++digits[i] == values) {
+                digits[i++] = 0;
+            }
+            if (i == inputs) {
+                return true;
+            }
+        }
+    }
+
+    const TargetModel &m_target;
+    std::mt19937_64 m_rng{0x5eed};
+};
+
+static std::string format(const Seq &seq) {
+    std::string text;
+    for (const Inst &inst: seq) {
+        if (!text.empty()) {
+            text += "; ";
+        }
+        text += inst.mnemonic;
+        for (size_t i = 0; i < inst.operands.size(); i++) {
+            const Operand &op = inst.operands[i];
+            text += i == 0 ? " " : ", ";
+            switch (op.kind) {
+                case OperandKind::reg:
+                    text += "$r" + std::to_string(op.var + 1);
+                    break;
+                case OperandKind::mem:
+                    text += "$m" + std::to_string(op.var + 1);
+                    break;
+                case OperandKind::imm:
+                    text += "$i" + std::to_string(op.var + 1);
+                    break;
+                case OperandKind::text:
+                    text += op.text;
+                    break;
+            }
+        }
+    }
+    return text;
+}
+
+struct Harvest {
+    Window window;
+    size_t seen = 0;
+};
+
+struct Found {
+    std::string name;
+    Seq match;
+    Seq replace;
+    size_t seen;
+    std::pair<int, size_t> before;
+    std::pair<int, size_t> after;
+};
+
+static void harvest(const TargetModel &target, const std::string &assembly, std::map<Seq, Harvest> &windows) {
+    const MachineTarget &machine = *target.peephole.machine;
+    std::optional<MachineCode> code = parse_asm(machine, assembly);
+    if (!code.has_value()) {
+        std::cerr << "Could not parse the " << target.name << " assembly" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    Peephole hand_written(target.peephole);
+    hand_written.run(code.value());
+    std::stringstream stream(AsmPrinter(machine).print(code.value()));
+    std::vector<AsmLine> run_of_insts;
+    std::string text;
+    const auto flush = [&] {
+        for (size_t size = 2; size <= 3; size++) {
+            for (size_t start = 0; start + size <= run_of_insts.size(); start++) {
+                const std::vector<AsmLine> lines(run_of_insts.begin() + static_cast<std::ptrdiff_t>(start),
+                                                 run_of_insts.begin() + static_cast<std::ptrdiff_t>(start + size));
+                if (const auto window = abstract(target, lines)) {
+                    Harvest &entry = windows[window->insts];
+                    entry.window = window.value();
+                    entry.seen++;
+                }
+            }
+        }
+        run_of_insts.clear();
+    };
+    while (std::getline(stream, text)) {
+        const AsmLineKind kind = asm_line_kind(text);
+        if (kind == AsmLineKind::instruction) {
+            run_of_insts.push_back(parse_asm_line(text));
+        } else if (kind != AsmLineKind::comment) {
+            flush();
+        }
+    }
+    flush();
+}
+
+static void write_table(std::ostream &out, const TargetModel &target, const std::vector<Found> &rules,
+                        const size_t windows) {
+    out << "// Generated by tools/superopt from " << windows << " distinct instruction windows of the bench/\n"
+        << "// corpus. Do not edit; run tools/regen_peephole_rules.sh. Each rule was seen `seen` times and\n"
+        << "// saves `cycles` of critical-path latency per match; a rule that saves 0 is shorter at the same\n"
+        << "// latency.\n";
+    out << "inline constexpr std::array<PeepholeRule, " << rules.size() << "> s_" << target.name
+        << "_generated_peephole_rules = {{\n";
+    for (const Found &rule: rules) {
+        out << "    // seen " << rule.seen << ", " << rule.before.first << " -> " << rule.after.first << " cycles, "
+            << rule.before.second << " -> " << rule.after.second << " instructions\n";
+        out << "    {.name = \"" << rule.name << "\", .match = \"" << format(rule.match) << "\", .replace = \""
+            << format(rule.replace) << "\", .cycles = " << rule.before.first - rule.after.first << "},\n";
+    }
+    out << "}};\n";
+}
+
+static void print_stats(std::ostream &out, const std::vector<Found> &rules) {
+    out << std::left << std::setw(28) << "rule" << std::right << std::setw(8) << "seen" << std::setw(10)
+        << "cycles" << std::setw(8) << "insns" << std::setw(12) << "total" << "\n";
+    int64_t total = 0;
+    for (const Found &rule: rules) {
+        const int cycles = rule.before.first - rule.after.first;
+        const auto insns = static_cast<int64_t>(rule.before.second - rule.after.second);
+        out << std::left << std::setw(28) << rule.name << std::right << std::setw(8) << rule.seen << std::setw(10)
+            << cycles << std::setw(8) << insns << std::setw(12) << cycles * static_cast<int64_t>(rule.seen) << "\n"
+            << "    " << format(rule.match) << "  =>  " << format(rule.replace) << "\n";
+        total += cycles * static_cast<int64_t>(rule.seen);
+    }
+    out << rules.size() << " rules, " << total << " cycles saved over the corpus\n";
+}
+
+int main(int argc, char *argv[]) {
+    std::optional<TargetModel> target;
+    std::optional<std::string> output;
+    std::vector<std::string> inputs;
+    for (int i = 1; i < argc; i++) {
+        const std::string arg = argv[i];
+        if (arg == "--target=x86-64") {
+            target = x86_model();
+        } else if (arg == "--target=aarch64") {
+            target = aarch64_model();
+        } else if (arg == "-o" && i + 1 < argc) {
+            output = argv[++i];
+        } else {
+            inputs.push_back(arg);
+        }
+    }
+    if (!target.has_value() || !output.has_value() || inputs.empty()) {
+        std::cerr << "usage: superopt --target=x86-64|aarch64 -o FILE.inc input.asm..." << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    std::map<Seq, Harvest> windows;
+    for (const std::string &path: inputs) {
+        std::ifstream input(path);
+        if (!input) {
+            std::cerr << "Cannot read " << path << std::endl;
+            return EXIT_FAILURE;
+        }
+        std::stringstream contents;
+        contents << input.rdbuf();
+        harvest(target.value(), contents.str(), windows);
+    }
+
+    Superoptimizer superoptimizer(target.value());
+    std::vector<Found> rules;
+    std::map<std::string, int> names;
+    for (const auto &[insts, entry]: windows) {
+        const auto replacement = superoptimizer.search(entry.window);
+        if (!replacement.has_value()) {
+            continue;
+        }
+        std::string name = "so";
+        for (const Inst &inst: insts) {
+            name += "-" + inst.mnemonic;
+        }
+        if (const int n = ++names[name]; n > 1) {
+            name += "-" + std::to_string(n);
+        }
+        rules.push_back({.name = name, .match = insts, .replace = replacement.value(), .seen = entry.seen,
+                         .before = cost(target.value(), insts), .after = cost(target.value(), replacement.value())});
+    }
+    // Longer windows first, so they win over a rule for part of them.
+    std::ranges::stable_sort(rules, [](const Found &a, const Found &b) { return a.match.size() > b.match.size(); });
+
+    std::ofstream out(output.value());
+    write_table(out, target.value(), rules, windows.size());
+    print_stats(std::cout, rules);
+    return EXIT_SUCCESS;
+}